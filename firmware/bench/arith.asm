@@ -0,0 +1,37 @@
+; Register-only arithmetic: ALU operations, shifts, MUL/DIV and INC/DEC.
+ORG 0x0100
+
+section .text
+
+start:
+    MOV AX, 0x1234
+    MOV BX, 0x5678
+    MOV DX, 0x0000
+    MOV SI, 0x0003
+    MOV DI, 0x0007
+    MOV BP, 0x0000
+
+outer:
+    MOV CX, 1000
+
+inner:
+    ADD AX, BX
+    ADC BP, 0
+    XOR BX, AX
+    SUB BX, SI
+    SHL AX, 1
+    ROR BX, 1
+    INC SI
+    AND DI, 0x0FFF
+    OR DI, 0x0001
+    PUSH AX
+    MOV AX, SI
+    MUL DI
+    DIV DI
+    CMP AX, SI
+    POP AX
+    JNE start
+    NEG DX
+    DEC BP
+    LOOP inner
+    JMP outer
@@ -0,0 +1,69 @@
+; Timer interrupts at about 6 kHz of emulated time, keyboard handling and a
+; software interrupt service called from a loop that polls the keyboard
+; controller. run.sh types interrupts.input, bursts of 16 scancodes every
+; 8M clocks, so the keyboard ISR runs too.
+ORG 0x0100
+
+TICKS equ 0x0500
+LAST_KEY equ 0x0502
+
+section .text
+
+start:
+    CLI
+    XOR AX, AX
+    MOV DS, AX
+    MOV word [TICKS], 0
+    MOV word [0x08 * 4], timer
+    MOV word [0x08 * 4 + 2], 0
+    MOV word [0x09 * 4], keyboard
+    MOV word [0x09 * 4 + 2], 0
+    MOV word [0x21 * 4], service
+    MOV word [0x21 * 4 + 2], 0
+    MOV AL, 0x34
+    OUT 0x43, AL
+    MOV AL, 200
+    OUT 0x40, AL
+    MOV AL, 0
+    OUT 0x40, AL
+    MOV AL, 0xFC
+    OUT 0x21, AL
+    STI
+
+main:
+    IN AL, 0x64
+    TEST AL, 0x01
+    JZ no_key
+    IN AL, 0x60
+    MOV [LAST_KEY], AL
+
+no_key:
+    MOV AH, 0x01
+    INT 0x21
+    MOV BX, AX
+    JMP main
+
+timer:
+    PUSH AX
+    INC word [TICKS]
+    MOV AL, 0x20
+    OUT 0x20, AL
+    POP AX
+    IRET
+
+keyboard:
+    PUSH AX
+    IN AL, 0x60
+    MOV [LAST_KEY], AL
+    MOV AL, 0x20
+    OUT 0x20, AL
+    POP AX
+    IRET
+
+service:
+    CMP AH, 0x01
+    JNE service_done
+    MOV AX, [TICKS]
+
+service_done:
+    IRET
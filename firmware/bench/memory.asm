@@ -0,0 +1,44 @@
+; Word fill, copy and byte checksum over 8KB buffers with plain MOVs.
+ORG 0x0100
+
+section .text
+
+start:
+    MOV AX, 0x2000
+    MOV DS, AX
+    MOV AX, 0x3000
+    MOV ES, AX
+    MOV BP, 0x0000
+
+again:
+    XOR SI, SI
+    MOV CX, 4096
+    MOV AX, BP
+
+fill:
+    MOV [SI], AX
+    ADD SI, 2
+    INC AX
+    LOOP fill
+
+    XOR SI, SI
+    MOV CX, 4096
+
+copy:
+    MOV AX, [SI]
+    MOV [ES:SI], AX
+    ADD SI, 2
+    LOOP copy
+
+    XOR SI, SI
+    XOR DX, DX
+    MOV CX, 8192
+
+sum:
+    ADD DL, [ES:SI]
+    ADC DH, 0
+    INC SI
+    LOOP sum
+
+    INC BP
+    JMP again
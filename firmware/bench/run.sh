@@ -0,0 +1,98 @@
+#!/bin/sh
+# Runs each benchmark image for a fixed instruction budget, once translated
+# (jit) and once interpreted (interp), and writes one line per run to RESULTS:
+#
+#   name mode instructions cycles seconds mips ns_per_instruction
+#
+# With a BASELINE file in the same format, prints the change in MIPS and exits
+# with status 1 if any benchmark got slower than the tolerance allows. An
+# image NAME.bin whose NAME.input sits next to this script is fed that input
+# script, so benchmarks that handle keys get some.
+#
+# Usage: run.sh EMULATOR RESULTS BASELINE IMAGE...
+# Environment: BENCH_INSTRUCTIONS (default 50000000), BENCH_RUNS (best of,
+# default 3), BENCH_TOLERANCE (percent, default 10).
+
+set -u
+LC_ALL=C
+export LC_ALL
+
+if [ $# -lt 4 ]; then
+    echo "Usage: $0 EMULATOR RESULTS BASELINE IMAGE..." >&2
+    exit 2
+fi
+emulator=$1
+results=$2
+baseline=$3
+shift 3
+bench_dir=$(dirname "$0")
+instructions=${BENCH_INSTRUCTIONS:-50000000}
+runs=${BENCH_RUNS:-3}
+tolerance=${BENCH_TOLERANCE:-10}
+status=0
+
+tmp=$(mktemp) || exit 2
+trap 'rm -f "$tmp" "$tmp.out"' EXIT
+echo "# name mode instructions cycles seconds mips ns_per_instruction" > "$tmp"
+
+for image in "$@"; do
+    name=$(basename "$image" .bin)
+    for mode in jit interp; do
+        flags=
+        [ "$mode" = interp ] && flags=--no-jit
+        [ -f "$bench_dir/$name.input" ] && flags="$flags --input $bench_dir/$name.input"
+        best=
+        run=0
+        while [ $run -lt "$runs" ]; do
+            run=$((run + 1))
+            "$emulator" --headless -f "$image" -n "$instructions" $flags > "$tmp.out" 2>&1
+            line=$(awk -v name="$name" -v mode="$mode" '
+                /^Instructions:/ { n = $2 }
+                /^Wall time:/ { s = $3 }
+                /^Cycles:/ { c = $2 }
+                /^Stop reason:/ { sub(/^Stop reason: */, ""); stop = $0 }
+                END {
+                    if (stop != "instruction limit" || n == 0 || s == 0) { print "FAILED " stop; exit }
+                    printf "%s %s %d %d %.6f %.3f %.3f\n", name, mode, n, c, s, n / s / 1e6, s * 1e9 / n
+                }' "$tmp.out")
+            case $line in
+                FAILED*)
+                    echo "$name ($mode): stopped early: ${line#FAILED }" >&2
+                    best=
+                    status=1
+                    break
+                    ;;
+            esac
+            if [ -z "$best" ] || [ "$(echo "$line $best" | awk '{ print ($5 < $12) }')" = 1 ]; then
+                best=$line
+            fi
+        done
+        [ -n "$best" ] && echo "$best" >> "$tmp"
+    done
+done
+
+mv "$tmp" "$results"
+trap - EXIT
+rm -f "$tmp.out"
+
+if [ ! -f "$baseline" ]; then
+    column -t "$results" 2>/dev/null || cat "$results"
+    exit $status
+fi
+
+awk -v tolerance="$tolerance" '
+    /^#/ { next }
+    FNR == NR { base[$1 " " $2] = $6; next }
+    {
+        key = $1 " " $2
+        if (!(key in base)) {
+            printf "%-12s %-6s %10.3f MIPS  (no baseline)\n", $1, $2, $6
+            next
+        }
+        change = (base[key] > 0) ? ($6 / base[key] - 1) * 100 : 0
+        slower = change < -tolerance
+        printf "%-12s %-6s %10.3f MIPS  %+7.1f%%%s\n", $1, $2, $6, change, slower ? "  REGRESSION" : ""
+        if (slower) failed = 1
+    }
+    END { exit failed }' "$baseline" "$results" || status=1
+exit $status
@@ -0,0 +1,39 @@
+; Text output into VRAM: print a line on the bottom row, then scroll the
+; screen up by one row with word copies.
+ORG 0x0100
+
+section .text
+
+start:
+    MOV AX, 0xB800
+    MOV DS, AX
+    MOV BL, 'A'
+
+again:
+    MOV SI, 160
+    XOR DI, DI
+    MOV CX, 80 * 24
+
+scroll:
+    MOV AX, [SI]
+    MOV [DI], AX
+    ADD SI, 2
+    ADD DI, 2
+    LOOP scroll
+
+    MOV DI, 160 * 24
+    MOV CX, 80
+    MOV AH, 0x07
+    MOV AL, BL
+
+print:
+    MOV [DI], AX
+    ADD DI, 2
+    INC AL
+    LOOP print
+
+    INC BL
+    CMP BL, 'Z'
+    JBE again
+    MOV BL, 'A'
+    JMP again
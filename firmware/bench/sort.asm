@@ -0,0 +1,48 @@
+; Insertion sort of 256 pseudo-random words, regenerated after every pass.
+ORG 0x0100
+
+COUNT equ 256
+
+section .text
+
+start:
+    MOV AX, 0x2000
+    MOV DS, AX
+    MOV BP, 0x0001
+
+again:
+    XOR DI, DI
+    MOV CX, COUNT
+
+generate:
+    MOV AX, BP
+    MOV BX, 25173
+    MUL BX
+    ADD AX, 13849
+    MOV BP, AX
+    MOV [DI], AX
+    ADD DI, 2
+    LOOP generate
+
+    MOV SI, 2
+
+outer:
+    MOV AX, [SI]
+    MOV DI, SI
+
+inner:
+    TEST DI, DI
+    JZ place
+    MOV BX, [DI - 2]
+    CMP BX, AX
+    JBE place
+    MOV [DI], BX
+    SUB DI, 2
+    JMP inner
+
+place:
+    MOV [DI], AX
+    ADD SI, 2
+    CMP SI, COUNT * 2
+    JB outer
+    JMP again
@@ -0,0 +1,49 @@
+; String instructions over 8KB buffers: REP STOSW, REP MOVSW, REPE CMPSB,
+; REPNE SCASB and a LODSW loop.
+ORG 0x0100
+
+section .text
+
+start:
+    MOV AX, 0x2000
+    MOV DS, AX
+    MOV BP, 0x0000
+    CLD
+
+again:
+    MOV AX, 0x2000
+    MOV ES, AX
+    XOR DI, DI
+    MOV AX, BP
+    MOV CX, 4096
+    REP STOSW
+
+    MOV AX, 0x3000
+    MOV ES, AX
+    XOR SI, SI
+    XOR DI, DI
+    MOV CX, 4096
+    REP MOVSW
+
+    XOR SI, SI
+    XOR DI, DI
+    MOV CX, 8192
+    REPE CMPSB
+
+    XOR DI, DI
+    MOV AX, BP
+    NOT AL
+    MOV CX, 8192
+    REPNE SCASB
+
+    XOR SI, SI
+    XOR DX, DX
+    MOV CX, 1024
+
+sum:
+    LODSW
+    ADD DX, AX
+    LOOP sum
+
+    INC BP
+    JMP again
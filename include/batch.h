@@ -0,0 +1,21 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#define BATCH_LOG_LIMIT (64 * 1024)  // bytes of diagnostics kept per job
+
+// Runs every job of a manifest on workers threads (0 for one per available
+// CPU), each with its own CPU8086, and writes a JSON report with every job's
+// result and log to report_path ("-" for stdout).
+//
+// Manifest lines are "FIRMWARE [key=value ...]", with keys name,
+// max-instructions, max-cycles, max-seconds, restore (snapshot to start from
+// instead of FIRMWARE), input (input script typed during the run, see
+// input_script.h), trace (file to record the instruction trace to), profile
+// (file to write the execution profile to, see profile.h) and floppy, hdd
+// (disk images for drives A: and C:, see disk.h). Blank lines and text after
+// '#' are ignored.
+//
+// Returns the process exit status: 0 if every job ran without a fault.
+int run_batch(const char* manifest, int workers, const char* report_path);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <stdint.h>
+#include "cpu8086.h"
+#include "decode.h"
+
+// A block is a straight run of predecoded instructions that ends at the first
+// INSN_ENDS_BLOCK instruction, after BLOCK_MAX_INSNS, or where it would span
+// more than two code pages.
+#define BLOCK_MAX_INSNS 32
+#define BLOCK_CACHE_SIZE 4096  // direct-mapped, power of two
+#define BLOCK_EMPTY 0xFFFFFFFFu
+
+typedef struct {
+    uint32_t start;     // physical address of the first instruction
+    uint16_t page[2];   // first and last code page the bytes came from
+    uint32_t gen[2];    // code_gen of those pages when the block was decoded
+    uint16_t cs, ip;    // CS:IP the block was decoded at
+    uint32_t hits;      // entries, for the JIT threshold
+    void* native;       // translated code, or NULL (see jit.h)
+    uint8_t native_count;  // leading instructions covered by native
+    uint8_t loops;      // native code branches back to its own start
+    uint16_t loop_cycles;  // clocks of one pass round a looping native block
+    uint16_t lead_cycles;  // clocks of the native instructions before the last
+    uint8_t count;
+    DecodedInsn insns[BLOCK_MAX_INSNS];
+} Block;
+
+struct BlockCache {
+    Block blocks[BLOCK_CACHE_SIZE];
+    unsigned long built;   // blocks decoded
+    unsigned long stale;   // lookups that found a block invalidated by a write
+    unsigned long translated;  // blocks the JIT turned into native code
+};
+
+BlockCache* block_cache_create(void);
+void block_cache_destroy(BlockCache* cache);
+void block_cache_flush(CPU8086* cpu);
+
+// Decodes the block at phys (below MEMORY_SIZE). Returns NULL if its first
+// instruction cannot be decoded.
+Block* block_cache_build(CPU8086* cpu, uint32_t phys);
+
+static inline Block* block_cache_slot(BlockCache* cache, uint32_t phys) {
+    return &cache->blocks[(phys ^ (phys >> 12)) & (BLOCK_CACHE_SIZE - 1)];
+}
+
+// Returns the cached block at phys if it is still valid, else NULL.
+static inline Block* block_cache_lookup(CPU8086* cpu, uint32_t phys) {
+    BlockCache* cache = cpu->block_cache;
+    Block* b = block_cache_slot(cache, phys);
+    if (b->start != phys) return NULL;
+    if (cpu->code_gen[b->page[0]] != b->gen[0] || cpu->code_gen[b->page[1]] != b->gen[1]) {
+        cache->stale++;
+        return NULL;
+    }
+    return b;
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef CGA_H
+#define CGA_H
+
+#include <stdint.h>
+
+#define CGA_MODE_PORT 0x3D8
+#define CGA_COLOR_PORT 0x3D9
+#define CGA_STATUS_PORT 0x3DA
+
+// Mode control register (3D8h) bits.
+#define CGA_MODE_HIRES_TEXT 0x01  // 80 columns
+#define CGA_MODE_GRAPHICS 0x02
+#define CGA_MODE_BW 0x04          // 320x200: the cyan/red/white palette
+#define CGA_MODE_ENABLE 0x08      // video on
+#define CGA_MODE_HIRES 0x10       // 640x200x2 instead of 320x200x4
+#define CGA_MODE_BLINK 0x20       // attribute bit 7 blinks instead of brightening
+#define CGA_MODE_RESET (CGA_MODE_HIRES_TEXT | CGA_MODE_ENABLE | CGA_MODE_BLINK)
+
+// Colour select register (3D9h) bits.
+#define CGA_COLOR_MASK 0x0F       // 320x200 background, 640x200 foreground
+#define CGA_COLOR_BRIGHT 0x10     // 320x200: intense palette colours
+#define CGA_COLOR_PALETTE 0x20    // 320x200: cyan/magenta/white instead of green/red/brown
+
+// Status register (3DAh) bits, derived from the clock.
+#define CGA_STATUS_BLANK 0x01     // outside the visible area; safe to touch VRAM
+#define CGA_STATUS_VRETRACE 0x08
+
+#define CGA_VRAM_SIZE 0x4000
+#define CGA_BANK 0x2000           // odd scanlines start here
+#define CGA_LINE_BYTES 80
+#define CGA_WIDTH 640             // 320x200 pixels come out doubled
+#define CGA_HEIGHT 200
+
+// The 16 CGA colours as R8G8B8A8 pixels (bytes R, G, B, A in memory).
+extern const uint32_t cga_rgba[16];
+
+// Converts the interleaved graphics memory of the 320x200x4 or 640x200x2 mode
+// selected by mode and color into CGA_WIDTH x CGA_HEIGHT RGBA pixels. Every
+// VRAM byte becomes eight pixels in one palette-expansion step: AVX2 or SSE2
+// on x86-64 (picked at run time), plain C elsewhere or with CGA_NO_SIMD.
+void cga_convert(const uint8_t* vram, uint8_t mode, uint8_t color, uint32_t* pixels);
+// "avx2", "sse2" or "scalar": the kernel cga_convert uses on this host.
+const char* cga_kernel(void);
+
+#endif
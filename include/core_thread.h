@@ -0,0 +1,72 @@
+#ifndef CORE_THREAD_H
+#define CORE_THREAD_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "cpu8086.h"
+#include "throttle.h"
+
+#define CORE_SLICE 65536      // instructions between checks for UI requests, unthrottled
+#define KEY_QUEUE_SIZE 256    // power of two
+
+// What the UI shows of the CPU, copied out by the core thread.
+typedef struct {
+    union {
+        uint16_t regs[8];
+        struct { uint16_t ax, cx, dx, bx, sp, bp, si, di; };
+    };
+    union {
+        uint16_t sregs[4];
+        struct { uint16_t es, cs, ss, ds; };
+    };
+    uint16_t ip;
+    uint16_t flags;  // FLAGS register layout
+    uint8_t running;
+    unsigned long long instructions;  // retired since core_start
+    uint64_t cycles;                  // CPU8086.cycles
+    uint8_t vram[CGA_VRAM_SIZE];
+    uint8_t cga_mode, cga_color;
+} CoreSnapshot;
+
+// Single-producer (UI), single-consumer (core) ring of scancodes.
+typedef struct {
+    uint8_t codes[KEY_QUEUE_SIZE];
+    atomic_uint head;  // next slot to read, written by the consumer
+    atomic_uint tail;  // next slot to write, written by the producer
+} KeyQueue;
+
+typedef struct {
+    CPU8086* cpu;  // owned by the core thread between core_start and core_stop
+    pthread_t thread;
+    Throttle throttle;
+    atomic_int quit;
+    atomic_int auto_run;
+    atomic_int steps;          // single steps requested while not auto-running
+    atomic_int want_snapshot;
+    KeyQueue keys;
+    FILE* record;  // input script of the keys delivered, or NULL
+    // Seqlock: odd while the core thread is writing snapshot.
+    atomic_uint seq;
+    CoreSnapshot snapshot;
+} CoreThread;
+
+// Starts running cpu on a new thread at clock_hz (CLOCK_UNTHROTTLED for as
+// fast as possible). With record, every scancode is also written there at the
+// instruction count it reached the guest (see input_record_key). Returns 0 if
+// the thread cannot be created.
+int core_start(CoreThread* core, CPU8086* cpu, unsigned long clock_hz, FILE* record);
+// Stops the thread; the CPU can be used by the caller again afterwards.
+void core_stop(CoreThread* core);
+
+// Queues a scancode for the guest keyboard. Returns 0 if the queue is full.
+int core_send_key(CoreThread* core, uint8_t code);
+void core_set_auto_run(CoreThread* core, int enabled);
+void core_step(CoreThread* core);
+
+// Copies the latest published state into *out and asks for a fresh one, which
+// the core thread publishes after its current slice.
+void core_snapshot(CoreThread* core, CoreSnapshot* out);
+
+#endif
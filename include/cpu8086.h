@@ -2,23 +2,56 @@
 #define CPU8086_H
 
 #include <stdint.h>
-#include <raylib.h>
+#include <stdio.h>
+#include "guest_memory.h"
+#include "scheduler.h"
+#include "pit.h"
+#include "pic.h"
+#include "io_bus.h"
+#include "cga.h"
 
-#define MEMORY_SIZE (1024 * 1024)
 #define STACK_SIZE 0x1000
 #define STACK_BASE 0x7000
 #define VIDEO_MEMORY 0xB8000
+#define VIDEO_MEMORY_SIZE 0x8000
+#define BIOS_ROM 0xF0000
+#define BIOS_ROM_SIZE 0x10000
 #define SCREEN_WIDTH 80
 #define SCREEN_HEIGHT 25
 #define KEYBOARD_PORT 0x60
 #define KEYBOARD_STATUS 0x64
-#define PIC1_COMMAND 0x20
-#define PIC1_DATA 0x21
-#define PIC2_COMMAND 0xA0
-#define PIC2_DATA 0xA1
+#define IRQ_TIMER 0
 #define IRQ_KEYBOARD 1
 #define IVT_BASE 0x0000
 
+// Bits of CPU8086.pending: reasons for the run loop to leave its fast path.
+#define PENDING_STOP 0x01
+#define PENDING_IRQ 0x02
+#define PENDING_SMC 0x04  // a write hit predecoded code; leave the current block
+#define PENDING_HALT 0x08 // HLT is waiting for an interrupt
+
+// Granularity of self-modifying-code tracking for the block cache.
+#define CODE_PAGE_SHIFT 8
+#define CODE_PAGES (MEMORY_SIZE >> CODE_PAGE_SHIFT)
+// Bits of CPU8086.code_map. Native code leaves for the interpreter on any
+// store to a page with a bit set, and on loads from CODE_MAP_MMIO_READ pages.
+#define CODE_MAP_CODE 0x01       // holds predecoded code
+#define CODE_MAP_SLOW 0x02       // not direct RAM for stores (ROM, MMIO)
+#define CODE_MAP_MMIO_READ 0x04  // loads call an MMIO handler
+#define CODE_MAP_CLEAN 0x08      // unchanged since the last snapshot (see snapshot.h)
+#define CODE_MAP_WATCH 0x10      // stores are reported to the trace or profile
+
+#define RAM_PAGES (MEMORY_SIZE >> MAP_PAGE_SHIFT)
+
+typedef enum {
+    STOP_NONE = 0,
+    STOP_HLT,
+    STOP_UNKNOWN_OPCODE,
+    STOP_INSTRUCTION_LIMIT,
+    STOP_TIME_LIMIT,
+    STOP_CYCLE_LIMIT
+} StopReason;
+
 typedef struct {
     uint8_t carry : 1;
     uint8_t zero : 1;
@@ -26,35 +59,118 @@ typedef struct {
     uint8_t overflow : 1;
     uint8_t parity : 1;
     uint8_t auxiliary : 1;
+    uint8_t trap : 1;
     uint8_t interrupt : 1;
+    uint8_t direction : 1;
 } Flags;
 
+// LazyFlags.op: kind of the last flag-setting ALU operation
+enum {
+    LF_NONE = 0,  // Flags already hold the arithmetic flags
+    LF_ADD,       // ADD, ADC (carry_in = CF consumed)
+    LF_SUB,       // SUB, SBB, CMP, NEG
+    LF_LOGIC,     // AND, OR, XOR, TEST
+    LF_INC,       // INC (carry_in = preserved CF)
+    LF_DEC        // DEC (carry_in = preserved CF)
+};
+
+typedef struct {
+    uint8_t op;
+    uint8_t word;
+    uint8_t carry_in;
+    uint16_t dst, src, res;
+} LazyFlags;
+
+typedef struct BlockCache BlockCache;
+typedef struct Jit Jit;
+typedef struct Trace Trace;
+typedef struct Profile Profile;
+
 typedef struct {
-    uint16_t ax, bx, cx, dx;
-    uint16_t si, di;
-    uint16_t bp, sp;
-    uint16_t cs, ds, es, ss;
+    // General and segment registers in instruction-encoding order, so handlers
+    // can index them by the reg/rm/sreg fields.
+    union {
+        uint16_t regs[8];
+        struct { uint16_t ax, cx, dx, bx, sp, bp, si, di; };
+    };
+    union {
+        uint16_t sregs[4];
+        struct { uint16_t es, cs, ss, ds; };
+    };
     uint16_t ip;
     Flags flags;
-    uint8_t memory[MEMORY_SIZE];
+    LazyFlags lazy;
+    uint8_t* memory;  // backing store, see guest_memory.h for the mirrored layout
+    MemoryMap map;    // how each 4KB page of memory is accessed
+    uint64_t cycles;  // clocks retired, from the 8086 timing tables
     int running;
+    int halted;       // stopped by HLT until the next interrupt
+    StopReason stop_reason;
+    uint8_t pending;
     uint8_t last_instruction;
+    FILE* log;        // diagnostics, stderr unless the embedder redirects them
     uint8_t keyboard_buffer[256];
     uint8_t kb_head, kb_tail;
     uint8_t kb_status;
-    uint8_t pic_irr, pic_isr, pic_imr;
+    uint32_t kb_dropped;  // scancodes refused because the buffer was full
+    uint8_t cga_mode, cga_color;  // CGA mode control and colour select registers
+    Pic pic;
+    Scheduler events;  // device deadlines in cycles
+    // Called when HLT waits with no device event left to wake it; it may raise
+    // an interrupt instead of letting the CPU stop with STOP_HLT.
+    void (*idle_hook)(void* ctx);
+    void* idle_ctx;
+    Pit pit;
+    IoBus io;  // port handlers, see cpu_map_ports
+    IoHandler keyboard_io, pic_io, pit_io, cga_io;
+    // Predecoded blocks (NULL runs uncached). code_map marks pages that hold
+    // cached code; a write to one bumps its code_gen, which stales the blocks.
+    // It also mirrors the memory map's slow pages at the same granularity.
+    BlockCache* block_cache;
+    Jit* jit;  // native translation of hot blocks, NULL when disabled
+    Trace* trace;  // records every instruction when set; runs interpreted
+    Profile* profile;  // counts executions and accesses when set; runs interpreted
+    uint8_t code_map[CODE_PAGES];
+    uint32_t code_gen[CODE_PAGES];
+    // Incremental snapshots: the first store to a CODE_MAP_CLEAN page sets
+    // its entry in dirty and clears the bit for the rest of that page.
+    uint8_t dirty[RAM_PAGES];
+    uint64_t snapshot_chain;    // full snapshot the CPU was saved to or restored from, 0 if none
+    uint32_t snapshot_seq;      // checkpoints taken or restored since then
 } CPU8086;
 
-void init_cpu(CPU8086* cpu);
-int load_firmware(CPU8086* cpu, const char* filename);
-void update_flags(CPU8086* cpu, uint16_t result);
+// Sets up a powered-on CPU whose diagnostics go to log (CPU8086.log).
+// Returns 0 after logging on failure.
+int init_cpu(CPU8086* cpu, FILE* log);
+void free_cpu(CPU8086* cpu);
+void cpu_reset(CPU8086* cpu);
+int cpu_set_block_cache(CPU8086* cpu, int enabled);
+int cpu_set_jit(CPU8086* cpu, int enabled);
+void cpu_set_trace(CPU8086* cpu, Trace* trace);
+void cpu_set_profile(CPU8086* cpu, Profile* profile);
+void cpu_map_memory(CPU8086* cpu, uint32_t start, uint32_t size, MapKind kind, const MmioHandler* handler);
+void cpu_stop(CPU8086* cpu, StopReason reason);
+// Marks [addr, addr + size) as rewritten behind the CPU's back (loaders, DMA,
+// snapshot restore): drops predecoded code there and records the pages for
+// the next incremental snapshot.
+void cpu_mark_dirty(CPU8086* cpu, uint32_t addr, uint32_t size);
+// Sets the CPU clock that device timers are measured against (0 for 4.77 MHz).
+void cpu_set_clock(CPU8086* cpu, unsigned long hz);
+// Stops the CPU with STOP_CYCLE_LIMIT at the first instruction boundary at or
+// past cycles. It does not wake a CPU waiting in HLT with nothing else due.
+void cpu_set_cycle_limit(CPU8086* cpu, uint64_t cycles);
+const char* stop_reason_name(StopReason reason);
+void cpu_sync_flags(CPU8086* cpu);
+uint16_t cpu_get_flags(CPU8086* cpu);
+void cpu_set_flags(CPU8086* cpu, uint16_t value);
 void push(CPU8086* cpu, uint16_t value);
 uint16_t pop(CPU8086* cpu);
 void handle_interrupt(CPU8086* cpu, uint8_t int_num);
-void handle_keyboard(CPU8086* cpu);
-void read_port(CPU8086* cpu, uint16_t port, uint16_t* value);
-void write_port(CPU8086* cpu, uint16_t port, uint16_t value);
+void keyboard_push(CPU8086* cpu, uint8_t code);
+int cpu_map_ports(CPU8086* cpu, uint16_t first, uint32_t count, const IoHandler* handler);
+uint16_t read_port(CPU8086* cpu, uint16_t port, int word);
+void write_port(CPU8086* cpu, uint16_t port, uint16_t value, int word);
 void execute_instruction(CPU8086* cpu);
-void draw_screen(CPU8086* cpu, int screen_x, int screen_y, int char_width, int char_height, Font font);
+unsigned long cpu_run(CPU8086* cpu, unsigned long max_instructions);
 
 #endif
@@ -0,0 +1,84 @@
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <stdint.h>
+
+// Bytes the decoder may look at for one instruction: up to DECODE_MAX_PREFIXES
+// prefixes plus opcode, ModR/M, disp16 and imm16/ptr16:16.
+#define DECODE_MAX_PREFIXES 4
+#define DECODE_WINDOW 16
+
+// Segment register indices, in the order of CPU8086.sregs and the sreg field.
+#define SREG_ES 0
+#define SREG_CS 1
+#define SREG_SS 2
+#define SREG_DS 3
+
+// Effective-address forms. 0-7 follow the rm field for mod 0-2.
+#define EA_BX_SI 0
+#define EA_BX_DI 1
+#define EA_BP_SI 2
+#define EA_BP_DI 3
+#define EA_SI 4
+#define EA_DI 5
+#define EA_BP 6
+#define EA_BX 7
+#define EA_DIRECT 8  // mod 0, rm 6: [disp16]
+#define EA_REG 9     // mod 3: register operand
+#define EA_NONE 10   // no ModR/M byte
+
+// DecodedInsn.prefixes bits
+#define PREFIX_SEG 0x01
+#define PREFIX_REP 0x02    // F3 (REP/REPE)
+#define PREFIX_REPNE 0x04  // F2
+#define PREFIX_LOCK 0x08
+
+// DecodedInsn.flags bits
+#define INSN_ENDS_BLOCK 0x01  // may change CS:IP non-sequentially or the interrupt state
+
+typedef struct {
+    uint8_t opcode;
+    uint8_t length;    // total length including prefixes
+    uint8_t prefixes;  // PREFIX_* bits
+    uint8_t modrm;
+    uint8_t ea;        // EA_* form of the r/m operand
+    uint8_t seg;       // SREG_* used for the memory operand (default or override)
+    uint8_t reg;       // ModR/M reg field: register or group sub-opcode
+    uint8_t rm;        // ModR/M rm field
+    uint8_t flags;     // INSN_* bits
+    uint8_t cycles;    // 8086 clocks including EA and prefixes; branches not taken
+    uint16_t disp;     // displacement, sign-extended from disp8
+    uint16_t imm;      // immediate, rel8/rel16, moffs16 or far offset
+    uint16_t imm2;     // far segment (9A, EA)
+} DecodedInsn;
+
+// Clocks a conditional branch (Jcc, LOOP/LOOPE/LOOPNE, JCXZ) adds when taken.
+static inline int branch_taken_cycles(uint8_t opcode) {
+    return opcode == 0xE0 ? 14 : 12;
+}
+
+// Clocks a REP string instruction (A4-A7, AA-AF) adds per repetition on top
+// of the 9 it is decoded with.
+static inline int rep_string_cycles(uint8_t opcode) {
+    switch (opcode & 0xFE) {
+        case 0xA4: return 17;  // MOVS
+        case 0xA6: return 22;  // CMPS
+        case 0xAA: return 10;  // STOS
+        case 0xAC: return 13;  // LODS
+        default: return 15;    // SCAS
+    }
+}
+
+typedef struct {
+    uint8_t ea;
+    uint8_t disp_size;
+    uint8_t seg;
+} ModRMInfo;
+
+extern const ModRMInfo modrm_info[256];
+
+// Decodes one instruction from code[0..DECODE_WINDOW). Returns its length, or 0
+// if the prefix run is longer than DECODE_MAX_PREFIXES.
+int decode_instruction(const uint8_t* code, DecodedInsn* d);
+
+#endif
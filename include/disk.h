@@ -0,0 +1,77 @@
+#ifndef DISK_H
+#define DISK_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "cpu8086.h"
+
+#define DISK_SECTOR_SIZE 512
+#define DISK_DRIVES 4  // floppies 00h, 01h and hard disks 80h, 81h
+#define DISK_DRIVE_NUMBER(slot) ((slot) < 2 ? (slot) : 0x80 + (slot) - 2)
+#define DISK_PORT_BASE 0x00E0
+#define DISK_BIOS_ENTRY 0xFE3FE  // F000:E3FE, where the PC BIOS keeps INT 13h
+#define DISK_PARAM_TABLE 0xFEFC7  // F000:EFC7, diskette parameters for INT 13h AH=08
+
+// Controller registers at DISK_PORT_BASE + DISK_REG_*. Multi-byte registers
+// are little-endian and take word accesses.
+enum {
+    DISK_REG_COMMAND = 0,  // W: DISK_CMD_*; R: DISK_STATUS_*
+    DISK_REG_ERROR = 1,    // R: INT 13h status code of the last command, 0 for success
+    DISK_REG_DRIVE = 2,    // BIOS drive number
+    DISK_REG_SERVICE = 3,  // W: run INT 13h on the CPU's current registers
+    DISK_REG_COUNT = 4,    // sectors to transfer
+    DISK_REG_LBA = 6,      // first sector, 32 bits
+    DISK_REG_OFFSET = 10,  // buffer offset
+    DISK_REG_SEGMENT = 12, // buffer segment
+    DISK_REGS = 14
+};
+
+#define DISK_CMD_READ 0x20
+#define DISK_CMD_WRITE 0x30
+#define DISK_CMD_VERIFY 0x40
+#define DISK_STATUS_ERROR 0x01
+#define DISK_STATUS_READY 0x40  // the selected drive has an image
+
+typedef struct {
+    uint8_t* data;         // the image mapped copy-on-write, NULL if no drive
+    uint64_t size;
+    uint32_t sectors;
+    uint16_t cylinders;
+    uint8_t heads;
+    uint8_t sectors_per_track;
+    uint8_t floppy_type;   // INT 13h AH=08 drive type, 0 for hard disks
+    const char* path;
+    uint64_t reads, writes;  // sectors transferred
+} DiskDrive;
+
+// Disk images behind INT 13h and a DMA-style controller. Each image is mapped
+// MAP_PRIVATE, so reads are served straight from the page cache (shared by
+// every instance using the image) and writes land in a private copy of the
+// pages they touch; the file itself never changes. A transfer of any number
+// of sectors is one memcpy per side of the 1MB wrap. Transfers complete
+// before the OUT that starts them returns, so the controller schedules no
+// events. Image contents are not part of snapshots, so a snapshot taken after
+// the guest wrote to a disk would restore its RAM (FAT, buffers) against the
+// original image: callers check disk_written before saving one.
+typedef struct {
+    DiskDrive drives[DISK_DRIVES];
+    uint8_t regs[DISK_REGS];
+    CPU8086* cpu;   // set by disk_attach
+    IoHandler io;
+} DiskController;
+
+void disk_init(DiskController* dc);
+// Opens path as BIOS drive 00h, 01h, 80h or 81h. Floppy images must have a
+// standard size (160KB to 2.88MB); hard disks get 16 heads and 63 sectors
+// per track. Returns 0 after logging on failure.
+int disk_open(DiskController* dc, uint8_t drive, const char* path, FILE* log);
+// Maps the controller ports and, unless a ROM image or a restored stub already
+// occupies DISK_BIOS_ENTRY, installs an INT 13h handler there that calls
+// DISK_REG_SERVICE and points vector 13h at it. Call after the CPU is loaded
+// or restored.
+void disk_attach(DiskController* dc, CPU8086* cpu);
+// True once the guest has written a sector to any drive.
+int disk_written(const DiskController* dc);
+void disk_close(DiskController* dc);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef GUEST_MEMORY_H
+#define GUEST_MEMORY_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define MEMORY_SIZE (1024 * 1024)
+#define ADDR_MASK (MEMORY_SIZE - 1)  // 20 address lines
+// Bytes mapped past MEMORY_SIZE that alias the start of memory: covers FFFF:FFFF
+// (0x10FFEF) plus a decode window, rounded to a multiple of any host page size.
+#define MEMORY_MIRROR 0x20000
+
+// Page table granularity. Entries past 1MB repeat the first 64KB, so any
+// segment:offset sum indexes the table without masking.
+#define MAP_PAGE_SHIFT 12
+#define MAP_PAGE_SIZE (1 << MAP_PAGE_SHIFT)
+#define MAP_PAGE_MASK (MAP_PAGE_SIZE - 1)
+#define MAP_PAGES ((MEMORY_SIZE + 0x10000) >> MAP_PAGE_SHIFT)
+
+typedef enum {
+    MAP_RAM,   // direct loads and stores
+    MAP_ROM,   // direct loads, stores ignored
+    MAP_MMIO   // goes through an MmioHandler
+} MapKind;
+
+// Addresses passed to handlers are 20-bit physical addresses. A handler
+// without read keeps the page backed by RAM: loads stay direct and stores
+// update the RAM before write is called, which is how VRAM hooks work.
+typedef struct {
+    uint8_t (*read)(void* ctx, uint32_t addr);
+    void (*write)(void* ctx, uint32_t addr, uint8_t value);
+    void* ctx;
+} MmioHandler;
+
+typedef struct {
+    // Host address of each page for direct access, NULL to take the slow path.
+    // Direct pages always point at the same address in the backing store.
+    uint8_t* read[MAP_PAGES];
+    uint8_t* write[MAP_PAGES];
+    const MmioHandler* mmio[MAP_PAGES];
+    int read_handlers;  // pages whose loads call a handler
+    int watch_reads;    // every load takes the slow path, see memory_map_watch_reads
+} MemoryMap;
+
+// Maps MEMORY_SIZE bytes of zeroed guest RAM followed by MEMORY_MIRROR bytes
+// that alias its start, so any segment:offset sum can be dereferenced without
+// masking and reads the 20-bit wrapped address. Returns NULL after logging on
+// failure.
+uint8_t* guest_memory_create(FILE* log);
+void guest_memory_destroy(uint8_t* memory);
+
+// Maps size bytes of the open file fd over guest memory at addr, copy-on-write,
+// so instances that map the same image share its page cache pages until they
+// write to them. addr must be page aligned and above the mirrored start of
+// memory. Returns 0 if the range cannot be mapped this way.
+int guest_memory_map_file(uint8_t* memory, uint32_t addr, int fd, uint32_t size);
+
+// Makes every page direct RAM in the backing store memory.
+void memory_map_init(MemoryMap* map, uint8_t* memory);
+
+// Changes the kind of the pages covering [start, start + size). handler is
+// only used for MAP_MMIO and must outlive the mapping.
+void memory_map_set(MemoryMap* map, uint8_t* memory, uint32_t start, uint32_t size,
+                    MapKind kind, const MmioHandler* handler);
+
+// Sends every load through the slow path while enabled, so each one can be
+// observed; handler pages keep calling their handler.
+void memory_map_watch_reads(MemoryMap* map, uint8_t* memory, int enabled);
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+int run_headless(int argc, char** argv);
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef INPUT_SCRIPT_H
+#define INPUT_SCRIPT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "cpu8086.h"
+
+// InputEvent.clock: what an event's time counts.
+enum {
+    INPUT_AT_INSTRUCTION,  // instructions retired since the run started
+    INPUT_AT_CYCLE         // CPU8086.cycles
+};
+
+typedef struct {
+    uint64_t when;
+    uint8_t clock;  // INPUT_AT_*
+    uint8_t code;   // scancode pushed into the keyboard controller
+} InputEvent;
+
+// Scancodes to feed the keyboard at fixed points of a run, so an interactive
+// workload replays identically without a window. A script is text, one event
+// per line:
+//
+//   # clock  when       scancodes (hex, make and break codes)
+//   insn     1500000    1E 9E
+//   cycle    20000000   1C
+//   insn     +250000    9C
+//   clock    4772727
+//
+// insn counts instructions retired and cycle counts CPU clocks; "+N" is
+// relative to the previous event. "clock HZ" gives the CPU clock the input
+// was recorded at; device timers follow it, so replaying at another --clock
+// would change the run. Events are delivered in file order, each
+// once its counter reaches when, so times must not go backwards. Cycle events
+// are due through the device scheduler (EVENT_INPUT), at the first instruction
+// boundary at or past their clock, and instruction events at the end of a
+// cpu_run slice bounded by input_script_slice(). Neither point depends on the
+// block cache or the JIT. A CPU waiting in HLT with no device event left to
+// wake it retires no more instructions, so the next instruction event (all
+// scancodes of its line) is delivered then instead (CPU8086.idle_hook).
+typedef struct {
+    InputEvent* events;
+    size_t count;
+    size_t next;    // first event not delivered yet
+    unsigned long clock_hz;  // from a "clock" line, 0 if none or the run's own
+    CPU8086* cpu;   // set by input_script_attach
+} InputScript;
+
+// Reads a script, reporting problems on log, including a "clock" line that
+// differs from clock_hz (the run's --clock). Returns NULL on failure.
+InputScript* input_script_load(const char* path, unsigned long clock_hz, FILE* log);
+void input_script_free(InputScript* s);
+
+// Starts feeding s into cpu from instruction count 0 and, if the script has a
+// clock, times the CPU's devices by it. Call after the CPU is loaded or
+// restored, since cpu_reset clears the scheduler.
+void input_script_attach(InputScript* s, CPU8086* cpu);
+// Caps a cpu_run slice so it ends at the next instruction-keyed event.
+unsigned long input_script_slice(const InputScript* s, unsigned long long instructions, unsigned long slice);
+// Delivers the events due after instructions have been retired in total and
+// schedules the next cycle-keyed one. Call after every cpu_run.
+void input_script_poll(InputScript* s, unsigned long long instructions);
+
+// Recording: input_record_key writes one insn line per scancode as it is
+// pushed into the guest, after a clock line for clock_hz (the session's
+// --clock), so the file replays the session's input exactly.
+FILE* input_record_open(const char* path, unsigned long clock_hz);
+void input_record_key(FILE* out, unsigned long long instructions, uint8_t code);
+int input_record_close(FILE* out);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef IO_BUS_H
+#define IO_BUS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define IO_PORTS 0x10000
+#define IO_MAX_HANDLERS 64  // distinct handlers; IoBus.slot is a byte
+#define IO_COUNT_SHIFT 8     // ports per block of unmapped-access counters: 1 << shift
+
+// IoHandler.widths: access sizes the device decodes itself.
+#define IO_BYTE 0x01
+#define IO_WORD 0x02
+
+// A device on the port bus. word is 1 for IN/OUT AX and 0 for AL. A word
+// access to a handler without IO_WORD is split into byte accesses to port and
+// port + 1, as the 8088's 8-bit bus does, and each byte goes to whichever
+// handler owns its port.
+typedef struct {
+    uint16_t (*read)(void* ctx, uint16_t port, int word);
+    void (*write)(void* ctx, uint16_t port, uint16_t value, int word);
+    void* ctx;
+    uint8_t widths;
+} IoHandler;
+
+// Port decoding as one flat table: every port holds the index of its handler,
+// 0 for none, so an access costs two loads whatever the device.
+typedef struct {
+    uint8_t slot[IO_PORTS];
+    const IoHandler* handlers[IO_MAX_HANDLERS];  // [0] is always NULL
+    int count;
+    // Unmapped ports accessed so far, one bit each: the first access to a port
+    // is logged, the rest only counted. Counts are per port, in blocks
+    // allocated when one of their ports is first hit, so a bus that only sees
+    // mapped ports carries no counters at all.
+    uint8_t unmapped_logged[IO_PORTS / 8];
+    uint64_t* unmapped[IO_PORTS >> IO_COUNT_SHIFT];
+    uint32_t unmapped_ports;       // bits set in unmapped_logged
+    uint64_t unmapped_accesses;
+} IoBus;
+
+void io_bus_init(IoBus* bus);
+// Frees the unmapped-access counters.
+void io_bus_free(IoBus* bus);
+// Accesses to an unmapped port so far.
+uint64_t io_bus_unmapped_count(const IoBus* bus, uint16_t port);
+
+// Routes ports [first, first + count) to handler, or unmaps them with NULL.
+// handler must outlive the mapping. Returns 0 if IO_MAX_HANDLERS distinct
+// handlers are already mapped.
+int io_bus_map(IoBus* bus, uint16_t first, uint32_t count, const IoHandler* handler);
+
+// Unmapped ports read as 0 and ignore writes; log receives one warning per port.
+uint16_t io_bus_read(IoBus* bus, uint16_t port, int word, FILE* log);
+void io_bus_write(IoBus* bus, uint16_t port, uint16_t value, int word, FILE* log);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "cpu8086.h"
+#include "block_cache.h"
+
+// Block entries before a block is translated to native code.
+#define JIT_THRESHOLD 64
+#define JIT_ARENA_SIZE (4 * 1024 * 1024)
+
+// Returns NULL when the host cannot run translated code (not x86-64, no
+// executable memory, or built with -DCPU_NO_JIT).
+Jit* jit_create(void);
+void jit_destroy(Jit* jit);
+
+// Translates the longest supported prefix of b. Leaves b->native NULL if
+// nothing worth running natively was found.
+void jit_compile(CPU8086* cpu, Block* b);
+
+// Runs b's native code for at most budget instructions, and never beyond the
+// first instruction boundary at or past the next device deadline, where the
+// interpreter would stop too. Stores in *resume the index of the first
+// instruction of b the interpreter still has to execute (b->count if none)
+// and returns the number of instructions retired.
+unsigned long jit_run(CPU8086* cpu, Block* b, unsigned long budget, unsigned* resume);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <stdint.h>
+#include "cpu8086.h"
+
+#define LOADER_PSP_SEGMENT 0x1000  // program segment prefix of .COM and MZ programs
+#define LOADER_MEMORY_TOP 0xA000   // paragraph where conventional memory ends
+
+// Loads a program image into a freshly reset CPU and points CS:IP, SS:SP and
+// the data segments at it. The format comes from the file:
+// - "MZ" header: DOS executable at LOADER_PSP_SEGMENT + 10h, relocations
+//   applied, CS:IP and SS:SP from the header, DS = ES = PSP
+// - .com: at PSP:0100 with CS = DS = ES = SS = PSP and SP = FFFE, above a
+//   minimal PSP (INT 20h at offset 0, empty command tail)
+// - .rom: a BIOS image, see load_rom(); execution starts at FFFF:0000
+// - anything else: a flat image at 0000:0100, the emulator's own firmware
+// The file is mapped rather than read. Returns 0 after logging on failure.
+int load_firmware(CPU8086* cpu, const char* filename);
+
+// Maps a ROM image read-only at physical base, or ending at the top of memory
+// when base is 0. Images at a host-page-aligned address, clear of the
+// low-memory mirror, are mapped straight from the file (see
+// guest_memory_map_file), so every CPU loading the same ROM shares one copy;
+// the size may be any length, and the rest of a partial last page reads as
+// zeros. Others are copied. Returns 0 after logging on failure.
+int load_rom(CPU8086* cpu, const char* filename, uint32_t base);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef PIC_H
+#define PIC_H
+
+#include <stdint.h>
+
+#define PIC1_COMMAND 0x20
+#define PIC1_DATA 0x21
+#define PIC2_COMMAND 0xA0
+#define PIC2_DATA 0xA1
+#define PIC_CASCADE_IRQ 2   // master input the slave is wired to
+
+// One Intel 8259A.
+typedef struct {
+    uint8_t irr, isr, imr;
+    uint8_t vector_base;     // ICW2, low three bits clear
+    uint8_t cascade;         // ICW3: master's slave inputs, or the slave's id
+    uint8_t init_step;       // next ICW expected on the data port (2-4), 0 when operational
+    uint8_t single;          // ICW1 SNGL: no ICW3
+    uint8_t need_icw4;       // ICW1 IC4
+    uint8_t auto_eoi;        // ICW4 AEOI
+    uint8_t rotate_on_aeoi;
+    uint8_t nested;          // ICW4 SFNM: special fully nested mode
+    uint8_t special_mask;    // OCW3 SMM
+    uint8_t read_isr;        // OCW3 RIS: command port reads ISR, not IRR
+    uint8_t poll;            // OCW3 P: next command port read is a poll
+    uint8_t lowest;          // lowest-priority level; lowest + 1 is served first
+} Pic8259;
+
+// Master at 0x20 and slave at 0xA0 on master input 2, as in the PC/AT.
+// intr is the master's INTR line, recomputed whenever IRR, ISR or IMR change,
+// so the CPU only has to look at it (and IF) to know an interrupt is due.
+typedef struct {
+    Pic8259 master, slave;
+    int intr;
+} Pic;
+
+// Leaves both chips as a PC BIOS programs them: vectors 08h and 70h, edge
+// triggered, normal EOI, only the keyboard unmasked.
+void pic_init(Pic* pic);
+// Requests IRQ 0-7 on the master or 8-15 on the slave.
+void pic_raise(Pic* pic, int irq);
+// Interrupt acknowledge: moves the winning request into service and returns
+// its vector. Only call while pic->intr is set.
+uint8_t pic_acknowledge(Pic* pic);
+uint8_t pic_read(Pic* pic, uint16_t port);
+void pic_write(Pic* pic, uint16_t port, uint8_t value);
+
+#endif
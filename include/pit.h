@@ -0,0 +1,53 @@
+#ifndef PIT_H
+#define PIT_H
+
+#include <stdint.h>
+#include "scheduler.h"
+
+#define PIT_COUNTER0 0x40  // counters 0-2 at 0x40-0x42
+#define PIT_CONTROL 0x43
+#define PIT_CLOCK 1193182UL  // 14.31818 MHz / 12
+
+typedef struct {
+    uint16_t reload;     // count in use; 0 counts 65536 (10000 in BCD)
+    uint16_t written;    // LSB of a count being written as LSB then MSB
+    uint16_t next_reload;  // count written in mode 2/3, used from reload_at on
+    uint16_t latch;      // count latched by a latch or read-back command
+    uint8_t mode;        // 0-5
+    uint8_t access;      // 1 LSB only, 2 MSB only, 3 LSB then MSB
+    uint8_t bcd;
+    uint8_t write_msb;   // the next count byte written is the MSB
+    uint8_t read_msb;    // the next byte read is the MSB
+    uint8_t latched;     // reads come from latch until both bytes are read
+    uint8_t status_latched;
+    uint8_t status;
+    uint8_t counting;    // a count has been loaded since the control word
+    uint8_t reload_pending;
+    uint64_t start;      // tick the count was loaded at
+    uint64_t reload_at;  // end of the period during which next_reload was written
+    uint64_t edge;       // tick of the next IRQ for counter 0
+} PitChannel;
+
+// Intel 8253/8254 programmable interval timer. Counters are not stepped; their
+// state is derived from CPU clocks when read, and counter 0 schedules
+// EVENT_PIT for each rising edge of its output, which raises IRQ 0.
+typedef struct {
+    PitChannel ch[3];
+    uint64_t num, den;   // CPU clocks per PIT tick as a fraction
+    uint64_t base;       // CPU clock of PIT tick 0
+    Scheduler* events;
+    void (*irq0)(void* ctx);
+    void* ctx;
+} Pit;
+
+void pit_init(Pit* pit, Scheduler* events, void (*irq0)(void* ctx), void* ctx);
+// Sets the CPU clock the PIT is measured against; 0 means the PC's 4.77 MHz.
+// A running count carries on from the tick it has reached at CPU clock now;
+// the same clock again changes nothing.
+void pit_set_cpu_clock(Pit* pit, unsigned long cpu_hz, uint64_t now);
+// PIT ticks elapsed at CPU clock now, for devices timed off the same crystal.
+uint64_t pit_ticks(const Pit* pit, uint64_t now);
+uint8_t pit_read(Pit* pit, uint16_t port, uint64_t now);
+void pit_write(Pit* pit, uint16_t port, uint8_t value, uint64_t now);
+
+#endif
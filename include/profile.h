@@ -0,0 +1,101 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <time.h>
+#include "cpu8086.h"
+#include "decode.h"
+
+#define PROFILE_MODRM_FORMS 32  // mod * 8 + rm
+#define PROFILE_PREFIXES 7      // ES: CS: SS: DS: REP REPNE LOCK
+
+// Guest memory regions that reads and writes are counted by.
+enum {
+    REGION_IVT,   // 00000-003FF
+    REGION_RAM,   // the rest of conventional memory
+    REGION_VRAM,  // A0000-BFFFF
+    REGION_ROM,   // C0000-FFFFF: option and BIOS ROMs, MMIO
+    PROFILE_REGIONS
+};
+
+typedef struct {
+    uint64_t count;
+    uint64_t clocks;   // 8086 clocks, including taken branches
+    uint64_t samples;  // executions timed on the host
+    uint64_t ticks;    // host ticks those took
+} ProfileOp;
+
+// Counts for one CPU. Counting happens only while the profile is attached
+// with cpu_set_profile, and then the CPU runs interpreted.
+struct Profile {
+    ProfileOp opcode[256];
+    uint64_t modrm[PROFILE_MODRM_FORMS];
+    uint64_t prefix[PROFILE_PREFIXES];
+    uint64_t reads[PROFILE_REGIONS], writes[PROFILE_REGIONS];  // bytes
+    uint64_t port_reads[65536], port_writes[65536];
+    uint64_t interrupts[256];     // delivered, by vector
+    uint64_t irq_interrupts[256]; // of those, hardware interrupts
+    // Host timing of every sample_every-th instruction; 0 turns it off.
+    unsigned sample_every;
+    unsigned countdown;
+    int timing;                   // the current instruction is being timed
+    uint64_t start_ticks;
+    uint64_t start_cycles;
+    uint64_t calibrate_ticks;     // profile_ticks() and CLOCK_MONOTONIC at creation
+    uint64_t calibrate_ns;
+};
+
+// Returns a zeroed profile that times every sample_every-th instruction
+// (0 for none), or NULL if it cannot be allocated. Free with free().
+Profile* profile_create(unsigned sample_every);
+// Writes the counts to path as CSV if it ends in ".csv", JSON otherwise.
+// instructions and cycles are the run totals. Returns 0 on failure.
+int profile_dump(const Profile* p, const char* path, uint64_t instructions, uint64_t cycles);
+
+// Host timestamp: the TSC on x86, nanoseconds elsewhere.
+static inline uint64_t profile_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline int profile_region(uint32_t addr) {
+    if (addr < 0x400) return REGION_IVT;
+    if (addr < 0xA0000) return REGION_RAM;
+    if (addr < 0xC0000) return REGION_VRAM;
+    return REGION_ROM;
+}
+
+// Called with IP and cycles not yet advanced past d.
+static inline void profile_begin(Profile* p, const CPU8086* cpu, const DecodedInsn* d) {
+    p->opcode[d->opcode].count++;
+    if (d->ea != EA_NONE) p->modrm[(d->modrm >> 6) << 3 | (d->modrm & 7)]++;
+    if (d->prefixes) {
+        if (d->prefixes & PREFIX_SEG) p->prefix[d->seg]++;
+        if (d->prefixes & PREFIX_REP) p->prefix[4]++;
+        if (d->prefixes & PREFIX_REPNE) p->prefix[5]++;
+        if (d->prefixes & PREFIX_LOCK) p->prefix[6]++;
+    }
+    p->start_cycles = cpu->cycles;
+    if (p->sample_every && --p->countdown == 0) {
+        p->countdown = p->sample_every;
+        p->timing = 1;
+        p->start_ticks = profile_ticks();
+    }
+}
+
+static inline void profile_end(Profile* p, const CPU8086* cpu, uint8_t opcode) {
+    ProfileOp* op = &p->opcode[opcode];
+    if (p->timing) {
+        op->ticks += profile_ticks() - p->start_ticks;
+        op->samples++;
+        p->timing = 0;
+    }
+    op->clocks += cpu->cycles - p->start_cycles;
+}
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+
+#define SCHED_NEVER UINT64_MAX
+#define SCHED_MAX_EVENTS 8
+
+// Device events. Each id is either scheduled once or not at all. Ids below
+// EVENT_COUNT are machine state and saved in snapshots; the ones after it
+// belong to whoever drives the run.
+enum {
+    EVENT_PIT,  // next rising edge of PIT channel 0
+    EVENT_COUNT,
+    EVENT_INPUT = EVENT_COUNT,  // next cycle-keyed input script event
+    EVENT_CYCLE_LIMIT,          // see cpu_set_cycle_limit
+    EVENT_IDS
+};
+_Static_assert(EVENT_IDS <= SCHED_MAX_EVENTS, "too many event ids");
+
+// Called with the deadline the event was scheduled for, so periodic events
+// can schedule their next occurrence without drifting.
+typedef void (*EventHandler)(void* ctx, uint64_t when);
+
+// Pending device deadlines in CPU clocks, kept as a binary min-heap so the
+// run loop only has to compare CPU8086.cycles against next.
+typedef struct {
+    uint64_t next;               // earliest deadline, SCHED_NEVER if none
+    int count;
+    uint8_t heap[SCHED_MAX_EVENTS];   // event ids, heap-ordered on when
+    int8_t slot[SCHED_MAX_EVENTS];    // position of each id in heap, -1 when idle
+    uint64_t when[SCHED_MAX_EVENTS];
+    EventHandler handler[SCHED_MAX_EVENTS];
+    void* ctx[SCHED_MAX_EVENTS];
+} Scheduler;
+
+void scheduler_init(Scheduler* s);
+void scheduler_register(Scheduler* s, int id, EventHandler handler, void* ctx);
+// Schedules id at when, replacing its previous deadline.
+void scheduler_set(Scheduler* s, int id, uint64_t when);
+void scheduler_cancel(Scheduler* s, int id);
+// Calls the handlers of every event due by now, earliest first. A handler
+// may reschedule its own or any other event.
+void scheduler_run(Scheduler* s, uint64_t now);
+
+#endif
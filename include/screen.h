@@ -0,0 +1,43 @@
+#ifndef SCREEN_H
+#define SCREEN_H
+
+#include <raylib.h>
+#include "cpu8086.h"
+
+#define SCREEN_CELLS (SCREEN_WIDTH * SCREEN_HEIGHT)
+#define SCREEN_BLINK_FRAMES 16  // frames per blink phase, as on the CGA
+
+// CGA display. In text mode, cells are drawn into a persistent render texture
+// and only redrawn when their character/attribute pair changed since the last
+// frame. The graphics modes are converted to RGBA by cga_convert and uploaded
+// with one UpdateTexture per frame in which VRAM or the registers changed.
+typedef struct {
+    RenderTexture2D target;          // the 80x25 screen as last drawn
+    Texture2D atlas;                 // code page 437 glyphs, 16x16, white on transparent
+    int char_width, char_height;
+    uint16_t shadow[SCREEN_CELLS];   // VRAM cells as last drawn
+    int valid;                       // target and shadow hold a full frame
+    unsigned long frame;
+    int blink_visible;               // blinking characters currently shown
+    uint8_t mode, color;             // CGA registers of the last frame
+    Texture2D graphics;              // CGA_WIDTH x CGA_HEIGHT, the last graphics frame
+    uint32_t* pixels;                // RGBA staging for graphics
+    uint8_t graphics_shadow[CGA_VRAM_SIZE];  // VRAM as last converted
+    int graphics_valid;              // graphics, graphics_shadow, mode and color agree
+    int showing_graphics;
+} Screen;
+
+int screen_init(Screen* screen, const char* font_path, int char_width, int char_height);
+void screen_unload(Screen* screen);
+
+// Brings the screen up to date with vram (CGA_VRAM_SIZE bytes from 0xB8000)
+// and the CGA mode and colour registers: in text mode the cells that changed,
+// plus blinking ones when the blink phase flips; in a graphics mode the whole
+// frame if anything changed. Call once per frame outside
+// BeginDrawing/EndDrawing.
+void screen_update(Screen* screen, const uint8_t* vram, uint8_t mode, uint8_t color);
+
+// Draws the screen at x, y; graphics are scaled to the size of the text screen.
+void screen_draw(const Screen* screen, int x, int y);
+
+#endif
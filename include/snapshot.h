@@ -0,0 +1,61 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include "cpu8086.h"
+
+#define SNAPSHOT_MAGIC "86SNAP\r\n"
+#define SNAPSHOT_VERSION 2
+// Page data starts here, so the pages of a mapped file are host-page aligned.
+#define SNAPSHOT_DATA_OFFSET 4096
+
+// Everything but RAM that a restore puts back. The memory map, block cache
+// and JIT are configuration, not state: restore into a CPU set up the same way.
+typedef struct {
+    uint16_t regs[8];
+    uint16_t sregs[4];
+    uint16_t ip;
+    uint16_t flags;      // FLAGS register layout
+    uint8_t halted;
+    uint8_t kb_head, kb_tail, kb_status;
+    uint8_t cga_mode, cga_color;
+    uint8_t keyboard_buffer[256];
+    uint64_t cycles;
+    uint64_t events[SCHED_MAX_EVENTS];  // deadline of each event id, SCHED_NEVER if idle
+    Pic pic;
+    PitChannel pit[3];
+    uint64_t pit_num, pit_den, pit_base;
+} SnapshotMachine;
+
+// A snapshot file is this header, padded to SNAPSHOT_DATA_OFFSET, followed by
+// page_count pages of MAP_PAGE_SIZE bytes in index order. A full snapshot
+// holds every page; a checkpoint holds the pages written since the previous
+// snapshot or checkpoint of the same chain, and applies on top of it.
+typedef struct {
+    char magic[8];          // SNAPSHOT_MAGIC
+    uint32_t version;       // SNAPSHOT_VERSION
+    uint32_t header_size;   // sizeof(SnapshotHeader), catches layout changes
+    uint32_t page_size;     // MAP_PAGE_SIZE
+    uint32_t page_count;
+    uint64_t chain;         // random id given to a full snapshot, inherited by its checkpoints
+    uint32_t sequence;      // 0 for the full snapshot, n for its nth checkpoint
+    uint32_t reserved;
+    SnapshotMachine machine;
+    uint16_t index[RAM_PAGES];  // guest page number of each stored page
+} SnapshotHeader;
+_Static_assert(sizeof(SnapshotHeader) <= SNAPSHOT_DATA_OFFSET, "snapshot header too large");
+
+// Writes the whole machine to path and starts tracking dirty pages for
+// snapshot_checkpoint. Returns 0 on failure.
+int snapshot_save(CPU8086* cpu, const char* path);
+// Writes the machine state and the pages dirtied since the last save,
+// checkpoint or restore. Returns 0 on failure or if there is nothing to
+// build on.
+int snapshot_checkpoint(CPU8086* cpu, const char* path);
+// Maps path and loads it: a full snapshot, or the next checkpoint of the
+// chain the CPU was last saved to or restored from. Only pages that differ
+// from guest memory are copied, so code in unchanged pages stays translated.
+// Returns 0 on failure, leaving the CPU untouched.
+int snapshot_restore(CPU8086* cpu, const char* path);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <stdint.h>
+
+#define CLOCK_PC 4772727UL   // 14.31818 MHz / 3, the IBM PC and XT
+#define CLOCK_8MHZ 8000000UL
+#define CLOCK_UNTHROTTLED 0UL
+
+// Most instructions to run between syncs with host time when throttled; a few
+// milliseconds of guest time at PC clock rates. A halted CPU retires none, so
+// cpu_run also returns after each skip to the next device event.
+#define THROTTLE_SLICE 4096
+// How far the guest may fall behind host time (a slow host, a paused UI)
+// before the throttle gives up catching up and starts counting afresh.
+#define THROTTLE_MAX_LAG_NS 50000000ULL
+
+// Paces CPU8086.cycles to a target clock by sleeping between slices.
+typedef struct {
+    unsigned long hz;      // CLOCK_UNTHROTTLED never sleeps
+    uint64_t base_cycles;
+    uint64_t base_ns;
+} Throttle;
+
+// Parses "4.77", "8", any other MHz value, or "max" for unthrottled.
+// Returns 0 if text is not a clock, including zero, negative and clocks
+// below 0.5 Hz.
+int throttle_parse_clock(const char* text, unsigned long* hz);
+
+void throttle_init(Throttle* throttle, unsigned long hz, uint64_t cycles);
+
+// Sleeps until host time has caught up with cycles at the target clock.
+void throttle_sync(Throttle* throttle, uint64_t cycles);
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "cpu8086.h"
+#include "decode.h"
+
+#define TRACE_MAGIC "86TRACE\n"
+#define TRACE_VERSION 1
+#define TRACE_CHUNK_RECORDS 16384  // records per write, 1MB
+#define TRACE_CHUNKS 4             // ring of chunks the writer thread drains
+#define TRACE_WRITE_BYTES 8        // bytes of each instruction's stores kept
+// TraceRecord.write_addr bit: the instruction stored outside the TRACE_WRITE_BYTES
+// bytes from write_addr, so write_data is incomplete.
+#define TRACE_WRITES_TRUNCATED 0x80000000u
+
+// One executed instruction, or a hardware interrupt when length is 0.
+// Registers are the state after it; what changed is found by comparing with
+// the previous record.
+typedef struct {
+    uint64_t cycles;      // CPU8086.cycles before the instruction
+    uint16_t cs, ip;      // where it was fetched
+    uint16_t regs[8];
+    uint16_t sregs[4];
+    uint32_t write_addr;  // physical address of write_data[0], plus TRACE_WRITES_TRUNCATED
+    uint32_t write_count; // bytes stored
+    uint16_t flags;       // FLAGS register layout
+    uint8_t length;       // instruction length, 0 for an interrupt
+    uint8_t write_len;    // valid bytes in write_data
+    uint8_t bytes[6];     // first instruction bytes; for an interrupt, the vector
+    uint8_t write_data[TRACE_WRITE_BYTES];  // memory from write_addr after the instruction
+    uint16_t reserved;
+} TraceRecord;
+_Static_assert(sizeof(TraceRecord) == 64, "trace records are 64 bytes");
+
+typedef struct {
+    char magic[8];         // TRACE_MAGIC
+    uint32_t version;      // TRACE_VERSION
+    uint32_t record_size;  // sizeof(TraceRecord)
+    uint64_t clock_hz;     // CPU clock the run was timed against, 0 for 4.77 MHz
+} TraceHeader;
+
+// Records go into a ring of TRACE_CHUNKS chunks. A full chunk is handed to a
+// writer thread and recording moves on to the next one, only waiting if the
+// writer is a whole ring behind.
+struct Trace {
+    TraceRecord* ring;
+    TraceRecord* cur;        // record being filled
+    TraceRecord* chunk_end;
+    unsigned fill;           // chunk being filled
+    uint32_t write_lo, write_hi, write_count;  // stores of the current record
+    uint64_t records;
+    int fd;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned submitted, done;  // chunks handed to and finished by the writer
+    size_t counts[TRACE_CHUNKS];
+    int closing;
+    int error;
+};
+
+// Creates path and starts its writer thread. Returns NULL after logging on
+// failure.
+Trace* trace_open(const char* path, unsigned long clock_hz, FILE* log);
+// Writes out the remaining records and frees the trace. Returns 0 if any
+// write failed.
+int trace_close(Trace* trace);
+
+// Slow path of trace_end: hands the full chunk to the writer.
+void trace_next_chunk(Trace* trace);
+
+// Called for every byte a traced instruction stores to RAM.
+static inline void trace_note_write(Trace* t, uint32_t addr) {
+    if (t->write_count++ == 0) {
+        t->write_lo = t->write_hi = addr;
+    } else if (addr < t->write_lo) {
+        t->write_lo = addr;
+    } else if (addr > t->write_hi) {
+        t->write_hi = addr;
+    }
+}
+
+// Starts the record of the instruction at CS:IP, or of interrupt vector
+// length == 0.
+static inline void trace_begin(Trace* t, const CPU8086* cpu, uint8_t length, uint8_t vector) {
+    TraceRecord* r = t->cur;
+    r->cycles = cpu->cycles;
+    r->cs = cpu->cs;
+    r->ip = cpu->ip;
+    r->length = length;
+    if (length) {
+        memcpy(r->bytes, cpu->memory + ((uint32_t)cpu->cs << 4) + cpu->ip, sizeof(r->bytes));
+    } else {
+        memset(r->bytes, 0, sizeof(r->bytes));
+        r->bytes[0] = vector;
+    }
+    t->write_count = 0;
+}
+
+static inline void trace_end(Trace* t, CPU8086* cpu) {
+    TraceRecord* r = t->cur;
+    memcpy(r->regs, cpu->regs, sizeof(r->regs));
+    memcpy(r->sregs, cpu->sregs, sizeof(r->sregs));
+    r->flags = cpu_get_flags(cpu);
+    r->write_count = t->write_count;
+    memset(r->write_data, 0, sizeof(r->write_data));
+    if (t->write_count) {
+        uint32_t span = t->write_hi - t->write_lo + 1;
+        r->write_addr = t->write_lo | (span > TRACE_WRITE_BYTES ? TRACE_WRITES_TRUNCATED : 0);
+        r->write_len = span > TRACE_WRITE_BYTES ? TRACE_WRITE_BYTES : span;
+        memcpy(r->write_data, cpu->memory + t->write_lo, r->write_len);
+    } else {
+        r->write_addr = 0;
+        r->write_len = 0;
+    }
+    r->reserved = 0;
+    t->records++;
+    if (++t->cur == t->chunk_end) trace_next_chunk(t);
+}
+
+#endif
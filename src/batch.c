@@ -0,0 +1,468 @@
+#define _GNU_SOURCE  // pthread_setaffinity_np, sched_getaffinity
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include "cpu8086.h"
+#include "snapshot.h"
+#include "batch.h"
+#include "throttle.h"
+#include "trace.h"
+#include "profile.h"
+#include "input_script.h"
+#include "loader.h"
+#include "disk.h"
+
+#define BATCH_SLICE 65536  // instructions between limit checks
+
+typedef struct {
+    // From the manifest
+    char* name;
+    char* firmware;
+    char* restore;   // snapshot to start from, or NULL
+    char* input;     // input script fed during the run, or NULL
+    char* trace;     // instruction trace to record, or NULL
+    char* profile;   // execution profile to write, or NULL
+    char* floppy;    // disk image for drive A:, or NULL
+    char* hdd;       // disk image for drive C:, or NULL
+    unsigned long long max_instructions;
+    unsigned long long max_cycles;
+    double max_seconds;
+    int line;
+    // Results
+    int loaded;
+    int worker;
+    StopReason stop_reason;
+    unsigned long long instructions;
+    uint64_t cycles;
+    uint16_t cs, ip;
+    double seconds;
+    char* log;
+    size_t log_size;
+} BatchJob;
+
+// Job indices of one worker. The owner takes from the tail and idle workers
+// steal from the head. Jobs run for milliseconds to minutes, so a mutex per
+// deque costs nothing next to them.
+typedef struct {
+    pthread_mutex_t lock;
+    int* jobs;
+    int head, tail;
+} JobDeque;
+
+typedef struct {
+    BatchJob* jobs;
+    int job_count;
+    JobDeque* deques;
+    int workers;
+} Batch;
+
+typedef struct {
+    Batch* batch;
+    int id;
+    int host_cpu;    // CPU to pin to, -1 to let the scheduler move the thread
+    pthread_t thread;
+} Worker;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int deque_pop(JobDeque* q) {
+    pthread_mutex_lock(&q->lock);
+    int job = q->head < q->tail ? q->jobs[--q->tail] : -1;
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+static int deque_steal(JobDeque* q) {
+    pthread_mutex_lock(&q->lock);
+    int job = q->head < q->tail ? q->jobs[q->head++] : -1;
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+// No jobs are added once the pool starts, so all deques empty means done.
+static int next_job(Batch* b, int self) {
+    int job = deque_pop(&b->deques[self]);
+    for (int i = 1; job < 0 && i < b->workers; i++) {
+        job = deque_steal(&b->deques[(self + i) % b->workers]);
+    }
+    return job;
+}
+
+static void close_log(BatchJob* job, FILE* log) {
+    if (!log) return;
+    fflush(log);
+    long size = ftell(log);
+    job->log_size = size < 0 ? 0 : size >= BATCH_LOG_LIMIT ? BATCH_LOG_LIMIT - 1 : (size_t)size;
+    fclose(log);
+}
+
+static void run_job(CPU8086* cpu, BatchJob* job) {
+    job->log = malloc(BATCH_LOG_LIMIT);
+    FILE* log = job->log ? fmemopen(job->log, BATCH_LOG_LIMIT, "w") : NULL;
+    if (!init_cpu(cpu, log ? log : stderr)) {
+        fprintf(log ? log : stderr, "Cannot set up the emulated CPU\n");
+        close_log(job, log);
+        return;
+    }
+
+    if (job->restore) {
+        job->loaded = snapshot_restore(cpu, job->restore);
+    } else {
+        job->loaded = load_firmware(cpu, job->firmware);
+    }
+    DiskController disks;
+    disk_init(&disks);
+    if (job->loaded && job->floppy) job->loaded = disk_open(&disks, 0x00, job->floppy, cpu->log);
+    if (job->loaded && job->hdd) job->loaded = disk_open(&disks, 0x80, job->hdd, cpu->log);
+    if (job->loaded && (job->floppy || job->hdd)) disk_attach(&disks, cpu);
+    InputScript* input = NULL;
+    if (job->loaded && job->input) {
+        input = input_script_load(job->input, CLOCK_UNTHROTTLED, cpu->log);
+        job->loaded = input != NULL;
+        if (input) input_script_attach(input, cpu);
+    }
+    Trace* trace = NULL;
+    if (job->loaded && job->trace) {
+        trace = trace_open(job->trace, CLOCK_UNTHROTTLED, cpu->log);
+        job->loaded = trace != NULL;
+        cpu_set_trace(cpu, trace);
+    }
+    Profile* profile = NULL;
+    if (job->loaded && job->profile) {
+        profile = profile_create(0);
+        job->loaded = profile != NULL;
+        if (profile) cpu_set_profile(cpu, profile);
+    }
+    if (job->loaded) {
+        double start = now_seconds();
+        double deadline = job->max_seconds > 0.0 ? start + job->max_seconds : 0.0;
+        if (job->max_cycles) cpu_set_cycle_limit(cpu, cpu->cycles + job->max_cycles);
+        while (cpu->running) {
+            unsigned long slice = BATCH_SLICE;
+            if (job->max_instructions) {
+                if (job->instructions >= job->max_instructions) {
+                    cpu_stop(cpu, STOP_INSTRUCTION_LIMIT);
+                    break;
+                }
+                if (job->max_instructions - job->instructions < slice) {
+                    slice = job->max_instructions - job->instructions;
+                }
+            }
+            if (input) slice = input_script_slice(input, job->instructions, slice);
+            job->instructions += cpu_run(cpu, slice);
+            if (input) input_script_poll(input, job->instructions);
+            if (deadline > 0.0 && now_seconds() >= deadline) {
+                cpu_stop(cpu, STOP_TIME_LIMIT);
+            }
+        }
+        job->seconds = now_seconds() - start;
+        job->stop_reason = cpu->stop_reason;
+        job->cycles = cpu->cycles;
+        job->cs = cpu->cs;
+        job->ip = cpu->ip;
+    }
+    input_script_free(input);
+    disk_close(&disks);
+    if (trace) {
+        cpu_set_trace(cpu, NULL);
+        if (!trace_close(trace)) fprintf(cpu->log, "Cannot write trace: %s\n", job->trace);
+    }
+    if (profile) {
+        cpu_set_profile(cpu, NULL);
+        if (!profile_dump(profile, job->profile, job->instructions, cpu->cycles)) {
+            fprintf(cpu->log, "Cannot write profile: %s\n", job->profile);
+        }
+        free(profile);
+    }
+
+    close_log(job, log);
+    free_cpu(cpu);
+}
+
+static void pin_thread(int host_cpu) {
+#ifdef __linux__
+    if (host_cpu < 0) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(host_cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)host_cpu;
+#endif
+}
+
+// The worker pins itself before allocating its CPU, so under the kernel's
+// first-touch policy the CPU state and every job's guest memory and JIT arena
+// come from the NUMA node it runs on. Guest memory is recreated per job by
+// init_cpu, which also keeps jobs from seeing each other's state.
+static void* worker_main(void* arg) {
+    Worker* w = arg;
+    pin_thread(w->host_cpu);
+    CPU8086* cpu = malloc(sizeof(CPU8086));
+    if (!cpu) return NULL;
+    int index;
+    while ((index = next_job(w->batch, w->id)) >= 0) {
+        w->batch->jobs[index].worker = w->id;
+        run_job(cpu, &w->batch->jobs[index]);
+    }
+    free(cpu);
+    return NULL;
+}
+
+static char* copy_string(const char* s) {
+    char* copy = malloc(strlen(s) + 1);
+    if (copy) strcpy(copy, s);
+    return copy;
+}
+
+static int parse_job(BatchJob* job, char* line, const char* manifest, int line_number) {
+    memset(job, 0, sizeof(*job));
+    job->line = line_number;
+    char* save = NULL;
+    for (char* word = strtok_r(line, " \t\r\n", &save); word; word = strtok_r(NULL, " \t\r\n", &save)) {
+        char* value = strchr(word, '=');
+        if (!value) {
+            if (job->firmware) {
+                fprintf(stderr, "%s:%d: more than one firmware: %s\n", manifest, line_number, word);
+                return 0;
+            }
+            job->firmware = copy_string(word);
+            continue;
+        }
+        *value++ = '\0';
+        if (strcmp(word, "name") == 0) {
+            job->name = copy_string(value);
+        } else if (strcmp(word, "max-instructions") == 0) {
+            job->max_instructions = strtoull(value, NULL, 0);
+        } else if (strcmp(word, "max-cycles") == 0) {
+            job->max_cycles = strtoull(value, NULL, 0);
+        } else if (strcmp(word, "max-seconds") == 0) {
+            job->max_seconds = strtod(value, NULL);
+        } else if (strcmp(word, "restore") == 0) {
+            job->restore = copy_string(value);
+        } else if (strcmp(word, "input") == 0) {
+            job->input = copy_string(value);
+        } else if (strcmp(word, "trace") == 0) {
+            job->trace = copy_string(value);
+        } else if (strcmp(word, "profile") == 0) {
+            job->profile = copy_string(value);
+        } else if (strcmp(word, "floppy") == 0) {
+            job->floppy = copy_string(value);
+        } else if (strcmp(word, "hdd") == 0) {
+            job->hdd = copy_string(value);
+        } else {
+            fprintf(stderr, "%s:%d: unknown job option: %s\n", manifest, line_number, word);
+            return 0;
+        }
+    }
+    if (!job->firmware && !job->restore) {
+        fprintf(stderr, "%s:%d: no firmware or snapshot\n", manifest, line_number);
+        return 0;
+    }
+    if (!job->name) job->name = copy_string(job->restore ? job->restore : job->firmware);
+    return 1;
+}
+
+static void free_jobs(BatchJob* jobs, int count) {
+    for (int i = 0; i < count; i++) {
+        free(jobs[i].name);
+        free(jobs[i].firmware);
+        free(jobs[i].restore);
+        free(jobs[i].input);
+        free(jobs[i].trace);
+        free(jobs[i].profile);
+        free(jobs[i].floppy);
+        free(jobs[i].hdd);
+        free(jobs[i].log);
+    }
+    free(jobs);
+}
+
+// Returns the number of jobs read, or -1 on error.
+static int read_manifest(const char* path, BatchJob** jobs) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Cannot open manifest: %s\n", path);
+        return -1;
+    }
+    int count = 0, capacity = 0, line_number = 0;
+    int error = 0;
+    char* line = NULL;
+    size_t line_size = 0;
+    *jobs = NULL;
+    while (!error && getline(&line, &line_size, file) != -1) {
+        line_number++;
+        char* comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+        if (strspn(line, " \t\r\n") == strlen(line)) continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            BatchJob* grown = realloc(*jobs, capacity * sizeof(BatchJob));
+            if (!grown) {
+                fprintf(stderr, "Out of memory\n");
+                error = 1;
+                break;
+            }
+            *jobs = grown;
+        }
+        // A rejected line may have copied some of its fields already.
+        error = !parse_job(&(*jobs)[count], line, path, line_number);
+        count++;
+    }
+    free(line);
+    fclose(file);
+    if (error) {
+        free_jobs(*jobs, count);
+        *jobs = NULL;
+        return -1;
+    }
+    return count;
+}
+
+static void write_json_string(FILE* out, const char* s, size_t size) {
+    fputc('"', out);
+    for (size_t i = 0; i < size; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c == '\n') {
+            fputs("\\n", out);
+        } else if (c < 0x20 || c == 0x7F) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static const char* job_status(const BatchJob* job) {
+    if (!job->loaded) return "error";
+    return job->stop_reason == STOP_UNKNOWN_OPCODE ? "fault" : "ok";
+}
+
+static void write_report(FILE* out, const Batch* b, double wall) {
+    fprintf(out, "{\n  \"workers\": %d,\n  \"wall_seconds\": %.6f,\n  \"jobs\": [", b->workers, wall);
+    for (int i = 0; i < b->job_count; i++) {
+        const BatchJob* job = &b->jobs[i];
+        fprintf(out, "%s\n    {\"name\": ", i ? "," : "");
+        write_json_string(out, job->name, strlen(job->name));
+        fprintf(out, ", \"line\": %d, \"worker\": %d, \"status\": \"%s\"", job->line, job->worker, job_status(job));
+        if (job->loaded) {
+            fprintf(out, ", \"stop_reason\": \"%s\", \"instructions\": %llu, \"cycles\": %llu, "
+                         "\"seconds\": %.6f, \"cs\": %u, \"ip\": %u",
+                    stop_reason_name(job->stop_reason), job->instructions,
+                    (unsigned long long)job->cycles, job->seconds, job->cs, job->ip);
+        } else {
+            fputs(", \"stop_reason\": \"not started\"", out);
+        }
+        fputs(", \"log\": ", out);
+        write_json_string(out, job->log ? job->log : "", job->log_size);
+        fputc('}', out);
+    }
+    fputs("\n  ]\n}\n", out);
+}
+
+// CPUs this process may run on, in order; the count is returned.
+static int host_cpus(int* cpus, int max) {
+#ifdef __linux__
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        int count = 0;
+        for (int i = 0; i < CPU_SETSIZE && count < max; i++) {
+            if (CPU_ISSET(i, &set)) cpus[count++] = i;
+        }
+        if (count) return count;
+    }
+#endif
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = online > 0 ? (online < max ? (int)online : max) : 1;
+    for (int i = 0; i < count; i++) {
+        cpus[i] = -1;
+    }
+    return count;
+}
+
+int run_batch(const char* manifest, int workers, const char* report_path) {
+    Batch b = { 0 };
+    b.job_count = read_manifest(manifest, &b.jobs);
+    if (b.job_count < 0) return 2;
+
+    int cpus[1024];
+    int cpu_count = host_cpus(cpus, 1024);
+    b.workers = workers > 0 ? workers : cpu_count;
+    if (b.workers > b.job_count) b.workers = b.job_count > 0 ? b.job_count : 1;
+
+    b.deques = calloc(b.workers, sizeof(JobDeque));
+    Worker* pool = calloc(b.workers, sizeof(Worker));
+    int* order = malloc((b.job_count + 1) * sizeof(int));
+    if (!b.deques || !pool || !order) {
+        fprintf(stderr, "Out of memory\n");
+        free(b.deques);
+        free(pool);
+        free(order);
+        free_jobs(b.jobs, b.job_count);
+        return 1;
+    }
+    // Deal jobs round-robin so each worker starts with a mix of the manifest;
+    // each deque is a slice of order.
+    int next = 0;
+    for (int w = 0; w < b.workers; w++) {
+        JobDeque* q = &b.deques[w];
+        pthread_mutex_init(&q->lock, NULL);
+        q->jobs = order + next;
+        for (int i = w; i < b.job_count; i += b.workers) {
+            order[next++] = i;
+        }
+        q->tail = (int)(order + next - q->jobs);
+    }
+
+    double start = now_seconds();
+    int started = 0;
+    for (int w = 0; w < b.workers; w++) {
+        pool[w] = (Worker){ &b, w, cpus[w % cpu_count], 0 };
+        if (pthread_create(&pool[w].thread, NULL, worker_main, &pool[w]) != 0) break;
+        started++;
+    }
+    // Workers that failed to start leave their deques to the others to steal;
+    // with none at all, this thread does the work.
+    if (started == 0) {
+        worker_main(&pool[0]);
+    }
+    for (int w = 0; w < started; w++) {
+        pthread_join(pool[w].thread, NULL);
+    }
+    double wall = now_seconds() - start;
+
+    int failed = 0;
+    for (int i = 0; i < b.job_count; i++) {
+        if (strcmp(job_status(&b.jobs[i]), "ok") != 0) failed++;
+    }
+    fprintf(stderr, "Batch: %d jobs on %d workers in %.3f s, %d failed\n",
+            b.job_count, b.workers, wall, failed);
+    FILE* out = strcmp(report_path, "-") == 0 ? stdout : fopen(report_path, "w");
+    if (!out) {
+        fprintf(stderr, "Cannot create report: %s\n", report_path);
+        failed++;
+    } else {
+        write_report(out, &b, wall);
+        if (out != stdout) fclose(out);
+    }
+
+    for (int w = 0; w < b.workers; w++) {
+        pthread_mutex_destroy(&b.deques[w].lock);
+    }
+    free(b.deques);
+    free(pool);
+    free(order);
+    free_jobs(b.jobs, b.job_count);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,76 @@
+#include <stdlib.h>
+#include "block_cache.h"
+
+BlockCache* block_cache_create(void) {
+    BlockCache* cache = malloc(sizeof(BlockCache));
+    if (!cache) return NULL;
+    for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
+        cache->blocks[i].start = BLOCK_EMPTY;
+    }
+    cache->built = 0;
+    cache->stale = 0;
+    cache->translated = 0;
+    return cache;
+}
+
+void block_cache_destroy(BlockCache* cache) {
+    free(cache);
+}
+
+// Drops every block, e.g. after memory was rewritten behind the CPU's back
+// or remapped, and rebuilds code_map from the memory map.
+void block_cache_flush(CPU8086* cpu) {
+    if (cpu->block_cache) {
+        for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
+            cpu->block_cache->blocks[i].start = BLOCK_EMPTY;
+        }
+    }
+    for (int i = 0; i < CODE_PAGES; i++) {
+        int page = i >> (MAP_PAGE_SHIFT - CODE_PAGE_SHIFT);
+        cpu->code_map[i] = (cpu->code_map[i] & (CODE_MAP_CLEAN | CODE_MAP_WATCH)) |
+                           (cpu->map.write[page] ? 0 : CODE_MAP_SLOW) |
+                           (cpu->map.read[page] ? 0 : CODE_MAP_MMIO_READ);
+    }
+}
+
+Block* block_cache_build(CPU8086* cpu, uint32_t phys) {
+    Block* b = block_cache_slot(cpu->block_cache, phys);
+    uint32_t first_page = phys >> CODE_PAGE_SHIFT;
+    uint32_t last_page = first_page;
+    uint32_t addr = phys;
+    uint32_t ip = cpu->ip;
+
+    b->count = 0;
+    while (b->count < BLOCK_MAX_INSNS) {
+        DecodedInsn* d = &b->insns[b->count];
+        if (!decode_instruction(&cpu->memory[addr], d)) break;
+        uint32_t end = addr + d->length - 1;
+        if (b->count > 0 && ((end >> CODE_PAGE_SHIFT) > first_page + 1 || ip + d->length > 0x10000)) break;
+        b->count++;
+        last_page = (end & ADDR_MASK) >> CODE_PAGE_SHIFT;  // past 1MB the bytes came from page 0
+        addr += d->length;
+        ip += d->length;
+        if (d->flags & INSN_ENDS_BLOCK) break;
+    }
+    if (b->count == 0) {
+        b->start = BLOCK_EMPTY;
+        return NULL;
+    }
+
+    b->start = phys;
+    b->cs = cpu->cs;
+    b->ip = cpu->ip;
+    b->hits = 0;
+    b->native = NULL;
+    b->native_count = 0;
+    b->loops = 0;
+    b->loop_cycles = 0;
+    b->page[0] = first_page;
+    b->page[1] = last_page;
+    b->gen[0] = cpu->code_gen[first_page];
+    b->gen[1] = cpu->code_gen[last_page];
+    cpu->code_map[first_page] |= CODE_MAP_CODE;
+    cpu->code_map[last_page] |= CODE_MAP_CODE;
+    cpu->block_cache->built++;
+    return b;
+}
@@ -0,0 +1,139 @@
+#include <string.h>
+#include "cga.h"
+
+#if defined(__x86_64__) && !defined(CGA_NO_SIMD)
+#include <immintrin.h>
+#define CGA_SIMD 1
+#endif
+
+#define RGBA(r, g, b) ((uint32_t)(r) | (uint32_t)(g) << 8 | (uint32_t)(b) << 16 | 0xFF000000u)
+
+const uint32_t cga_rgba[16] = {
+    RGBA(0x00, 0x00, 0x00), RGBA(0x00, 0x00, 0xAA), RGBA(0x00, 0xAA, 0x00), RGBA(0x00, 0xAA, 0xAA),
+    RGBA(0xAA, 0x00, 0x00), RGBA(0xAA, 0x00, 0xAA), RGBA(0xAA, 0x55, 0x00), RGBA(0xAA, 0xAA, 0xAA),
+    RGBA(0x55, 0x55, 0x55), RGBA(0x55, 0x55, 0xFF), RGBA(0x55, 0xFF, 0x55), RGBA(0x55, 0xFF, 0xFF),
+    RGBA(0xFF, 0x55, 0x55), RGBA(0xFF, 0x55, 0xFF), RGBA(0xFF, 0xFF, 0x55), RGBA(0xFF, 0xFF, 0xFF),
+};
+
+// How a VRAM byte becomes eight pixels: pixel i is
+// palette[(byte >> shift[i]) & mask].
+typedef struct {
+    uint32_t shift[8];
+    uint32_t mask;
+    uint32_t palette[8];  // entries past mask are unused
+} Expand;
+
+typedef void (*ExpandRow)(const Expand* e, const uint8_t* src, uint32_t* dst);
+
+static void setup(Expand* e, uint8_t mode, uint8_t color) {
+    static const uint32_t hires_shift[8] = { 7, 6, 5, 4, 3, 2, 1, 0 };
+    static const uint32_t lores_shift[8] = { 6, 6, 4, 4, 2, 2, 0, 0 };
+    memset(e, 0, sizeof(*e));
+    if (mode & CGA_MODE_HIRES) {
+        memcpy(e->shift, hires_shift, sizeof(e->shift));
+        e->mask = 1;
+        e->palette[1] = cga_rgba[color & CGA_COLOR_MASK];
+        e->palette[0] = cga_rgba[0];
+        return;
+    }
+    static const uint8_t palettes[3][3] = { { 2, 4, 6 }, { 3, 5, 7 }, { 3, 4, 7 } };
+    const uint8_t* p = palettes[mode & CGA_MODE_BW ? 2 : (color & CGA_COLOR_PALETTE) ? 1 : 0];
+    int bright = color & CGA_COLOR_BRIGHT ? 8 : 0;
+    memcpy(e->shift, lores_shift, sizeof(e->shift));
+    e->mask = 3;
+    e->palette[0] = cga_rgba[color & CGA_COLOR_MASK];
+    for (int i = 0; i < 3; i++) {
+        e->palette[i + 1] = cga_rgba[p[i] + bright];
+    }
+}
+
+#ifndef CGA_SIMD
+static void expand_scalar(const Expand* e, const uint8_t* src, uint32_t* dst) {
+    for (int x = 0; x < CGA_LINE_BYTES; x++, dst += 8) {
+        for (int i = 0; i < 8; i++) {
+            dst[i] = e->palette[(src[x] >> e->shift[i]) & e->mask];
+        }
+    }
+}
+#else
+// Each lane keeps its field of the byte in place and compares it against the
+// field values of colours 1-3, blending the matching colour in.
+static void expand_sse2(const Expand* e, const uint8_t* src, uint32_t* dst) {
+    __m128i field[2], value[3][2], colour[4];
+    for (int h = 0; h < 2; h++) {
+        const uint32_t* s = e->shift + 4 * h;
+        field[h] = _mm_setr_epi32(e->mask << s[0], e->mask << s[1], e->mask << s[2], e->mask << s[3]);
+        for (uint32_t k = 1; k <= 3; k++) {
+            value[k - 1][h] = _mm_setr_epi32(k << s[0], k << s[1], k << s[2], k << s[3]);
+        }
+    }
+    for (uint32_t k = 0; k <= e->mask; k++) {
+        colour[k] = _mm_set1_epi32((int)e->palette[k]);
+    }
+    for (int x = 0; x < CGA_LINE_BYTES; x++, dst += 8) {
+        __m128i byte = _mm_set1_epi32(src[x]);
+        for (int h = 0; h < 2; h++) {
+            __m128i f = _mm_and_si128(byte, field[h]);
+            __m128i px = colour[0];
+            for (uint32_t k = 1; k <= e->mask; k++) {
+                __m128i hit = _mm_cmpeq_epi32(f, value[k - 1][h]);
+                px = _mm_or_si128(_mm_and_si128(hit, colour[k]), _mm_andnot_si128(hit, px));
+            }
+            _mm_storeu_si128((__m128i*)dst + h, px);
+        }
+    }
+}
+
+// One variable shift and one cross-lane permute per byte: the palette sits
+// in a register and the field is the permute index.
+__attribute__((target("avx2")))
+static void expand_avx2(const Expand* e, const uint8_t* src, uint32_t* dst) {
+    __m256i shift = _mm256_loadu_si256((const __m256i*)e->shift);
+    __m256i mask = _mm256_set1_epi32((int)e->mask);
+    __m256i palette = _mm256_loadu_si256((const __m256i*)e->palette);
+    for (int x = 0; x < CGA_LINE_BYTES; x++, dst += 8) {
+        __m256i index = _mm256_and_si256(_mm256_srlv_epi32(_mm256_set1_epi32(src[x]), shift), mask);
+        _mm256_storeu_si256((__m256i*)dst, _mm256_permutevar8x32_epi32(palette, index));
+    }
+}
+#endif
+
+static ExpandRow kernel;
+static const char* kernel_name;
+
+static void pick_kernel(void) {
+    if (kernel) return;
+#ifdef CGA_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernel_name = "avx2";
+        kernel = expand_avx2;
+    } else {
+        kernel_name = "sse2";
+        kernel = expand_sse2;
+    }
+#else
+    kernel_name = "scalar";
+    kernel = expand_scalar;
+#endif
+}
+
+const char* cga_kernel(void) {
+    pick_kernel();
+    return kernel_name;
+}
+
+void cga_convert(const uint8_t* vram, uint8_t mode, uint8_t color, uint32_t* pixels) {
+    if (!(mode & CGA_MODE_ENABLE)) {
+        for (int i = 0; i < CGA_WIDTH * CGA_HEIGHT; i++) {
+            pixels[i] = cga_rgba[0];
+        }
+        return;
+    }
+    pick_kernel();
+    Expand e;
+    setup(&e, mode, color);
+    for (int y = 0; y < CGA_HEIGHT; y++) {
+        kernel(&e, vram + (y & 1) * CGA_BANK + (y >> 1) * CGA_LINE_BYTES, pixels + y * CGA_WIDTH);
+    }
+}
@@ -0,0 +1,553 @@
+#define _GNU_SOURCE  // pipe2, getc_unlocked
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "cpu8086.h"
+
+// Runs single-instruction test vectors (the JSON format of the published
+// 8086/8088 SingleStepTests corpora): every case gives the registers and the
+// RAM bytes before one instruction and the registers that changed and RAM
+// after it. Files are streamed, never loaded whole, and ".gz" files are read
+// through gzip. Each worker thread takes whole files and keeps one CPU8086
+// for all its cases, resetting only the memory the previous case touched.
+
+#define NAME_SIZE 128
+#define DEFAULT_MAX_FAILURES 5
+
+enum {
+    R_AX, R_BX, R_CX, R_DX, R_CS, R_SS, R_DS, R_ES,
+    R_SP, R_BP, R_SI, R_DI, R_IP, R_FLAGS, REG_COUNT
+};
+
+static const char* const reg_keys[REG_COUNT] = {
+    "ax", "bx", "cx", "dx", "cs", "ss", "ds", "es", "sp", "bp", "si", "di", "ip", "flags"
+};
+
+typedef struct {
+    uint32_t addr;
+    uint8_t value;
+} RamByte;
+
+typedef struct {
+    uint16_t value[REG_COUNT];
+    unsigned present;  // bit per register given in the file
+    RamByte* ram;
+    size_t ram_count, ram_capacity;
+} TestState;
+
+typedef struct {
+    char name[NAME_SIZE];
+    TestState initial, final;
+} TestCase;
+
+typedef struct {
+    FILE* in;
+    pid_t child;  // gzip feeding in, or 0
+    const char* error;
+} JsonReader;
+
+typedef enum { CASE_PASSED, CASE_FAILED, CASE_UNSUPPORTED } CaseResult;
+
+typedef struct {
+    char** files;
+    int file_count;
+    int next_file;        // taken with __atomic_fetch_add
+    uint16_t flags_mask;  // FLAGS bits not compared
+    unsigned max_failures;
+    pthread_mutex_t lock; // stdout and the totals
+    unsigned long passed, failed, unsupported;
+    int errors;
+} Run;
+
+// --- Streaming JSON -------------------------------------------------------
+
+static FILE* open_input(const char* path, pid_t* child) {
+    size_t len = strlen(path);
+    *child = 0;
+    if (len < 3 || strcmp(path + len - 3, ".gz") != 0) return fopen(path, "r");
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) return NULL;
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return NULL;
+    }
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        execlp("gzip", "gzip", "-dc", "--", path, (char*)NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+    *child = pid;
+    FILE* in = fdopen(fds[0], "r");
+    if (!in) close(fds[0]);
+    return in;
+}
+
+// Returns 0 if the input could not be read to the end.
+static int close_input(JsonReader* r) {
+    int ok = !ferror(r->in);
+    fclose(r->in);
+    if (r->child) {
+        int status;
+        ok = waitpid(r->child, &status, 0) == r->child && WIFEXITED(status) &&
+             WEXITSTATUS(status) == 0 && ok;
+    }
+    return ok;
+}
+
+static int fail(JsonReader* r, const char* error) {
+    if (!r->error) r->error = error;
+    return 0;
+}
+
+static int next_token(JsonReader* r) {
+    int c;
+    do {
+        c = getc_unlocked(r->in);
+    } while (c == ' ' || c == '\n' || c == '\r' || c == '\t');
+    return c;
+}
+
+static int expect(JsonReader* r, int want) {
+    return next_token(r) == want || fail(r, "malformed JSON");
+}
+
+// Reads the rest of a string whose opening quote was consumed. Escapes are
+// kept as the escaped character; out may be NULL to skip it.
+static int read_string(JsonReader* r, char* out, size_t size) {
+    size_t n = 0;
+    for (;;) {
+        int c = getc_unlocked(r->in);
+        if (c == EOF) return fail(r, "unterminated string");
+        if (c == '"') break;
+        if (c == '\\') {
+            c = getc_unlocked(r->in);
+            if (c == EOF) return fail(r, "unterminated string");
+        }
+        if (out && n + 1 < size) out[n++] = c;
+    }
+    if (out && size) out[n] = '\0';
+    return 1;
+}
+
+static int read_number(JsonReader* r, int first, long* value) {
+    int negative = first == '-';
+    int c = negative ? getc_unlocked(r->in) : first;
+    if (!isdigit(c)) return fail(r, "expected a number");
+    long v = 0;
+    while (isdigit(c)) {
+        v = v * 10 + (c - '0');
+        c = getc_unlocked(r->in);
+    }
+    if (c == '.' || c == 'e' || c == 'E') return fail(r, "expected an integer");
+    ungetc(c, r->in);
+    *value = negative ? -v : v;
+    return 1;
+}
+
+static int skip_value(JsonReader* r, int c) {
+    long number;
+    switch (c) {
+        case '"':
+            return read_string(r, NULL, 0);
+        case '{':
+        case '[': {
+            int close = c == '{' ? '}' : ']';
+            c = next_token(r);
+            if (c == close) return 1;
+            for (;;) {
+                if (close == '}') {
+                    if (c != '"' || !read_string(r, NULL, 0) || !expect(r, ':')) return fail(r, "malformed object");
+                    c = next_token(r);
+                }
+                if (!skip_value(r, c)) return 0;
+                c = next_token(r);
+                if (c == close) return 1;
+                if (c != ',') return fail(r, "malformed JSON");
+                c = next_token(r);
+            }
+        }
+        case 't':
+        case 'f':
+        case 'n':
+            while (isalpha(c = getc_unlocked(r->in))) {}
+            ungetc(c, r->in);
+            return 1;
+        default:
+            return read_number(r, c, &number);
+    }
+}
+
+// Calls member(r, key, ctx) with the first character of each value of the
+// object whose '{' was consumed.
+static int read_object(JsonReader* r, int (*member)(JsonReader*, const char*, int, void*), void* ctx) {
+    char key[32];
+    int c = next_token(r);
+    if (c == '}') return 1;
+    for (;;) {
+        if (c != '"' || !read_string(r, key, sizeof(key)) || !expect(r, ':')) return fail(r, "malformed object");
+        if (!member(r, key, next_token(r), ctx)) return 0;
+        c = next_token(r);
+        if (c == '}') return 1;
+        if (c != ',') return fail(r, "malformed object");
+        c = next_token(r);
+    }
+}
+
+static int reg_member(JsonReader* r, const char* key, int c, void* ctx) {
+    TestState* s = ctx;
+    for (int i = 0; i < REG_COUNT; i++) {
+        if (strcmp(key, reg_keys[i]) == 0) {
+            long value;
+            if (!read_number(r, c, &value)) return 0;
+            s->value[i] = value;
+            s->present |= 1u << i;
+            return 1;
+        }
+    }
+    return skip_value(r, c);
+}
+
+// "ram": [[address, value], ...]
+static int read_ram(JsonReader* r, int c, TestState* s) {
+    if (c != '[') return fail(r, "ram is not an array");
+    c = next_token(r);
+    while (c != ']') {
+        long addr, value;
+        if (c != '[' || !read_number(r, next_token(r), &addr) || !expect(r, ',') ||
+            !read_number(r, next_token(r), &value) || !expect(r, ']')) {
+            return fail(r, "malformed ram entry");
+        }
+        if (s->ram_count == s->ram_capacity) {
+            size_t capacity = s->ram_capacity ? s->ram_capacity * 2 : 64;
+            RamByte* ram = realloc(s->ram, capacity * sizeof(*ram));
+            if (!ram) return fail(r, "out of memory");
+            s->ram = ram;
+            s->ram_capacity = capacity;
+        }
+        s->ram[s->ram_count++] = (RamByte){ (uint32_t)addr & ADDR_MASK, (uint8_t)value };
+        c = next_token(r);
+        if (c == ',') c = next_token(r);
+    }
+    return 1;
+}
+
+static int state_member(JsonReader* r, const char* key, int c, void* ctx) {
+    TestState* s = ctx;
+    if (strcmp(key, "regs") == 0) {
+        return c == '{' ? read_object(r, reg_member, s) : fail(r, "regs is not an object");
+    }
+    if (strcmp(key, "ram") == 0) return read_ram(r, c, s);
+    return skip_value(r, c);
+}
+
+static int case_member(JsonReader* r, const char* key, int c, void* ctx) {
+    TestCase* t = ctx;
+    if (strcmp(key, "name") == 0) {
+        return c == '"' ? read_string(r, t->name, sizeof(t->name)) : fail(r, "name is not a string");
+    }
+    int initial = strcmp(key, "initial") == 0;
+    if (initial || strcmp(key, "final") == 0) {
+        TestState* s = initial ? &t->initial : &t->final;
+        return c == '{' ? read_object(r, state_member, s) : fail(r, "state is not an object");
+    }
+    return skip_value(r, c);
+}
+
+// Reads the next case of the top-level array. Returns 1 with a case, 0 at
+// its end or on an error (r->error set).
+static int read_case(JsonReader* r, TestCase* t, int first) {
+    int c = next_token(r);
+    if (first) {
+        if (c != '[') return fail(r, "not a JSON array of test cases");
+        c = next_token(r);
+    } else if (c == ',') {
+        c = next_token(r);
+    }
+    if (c == ']') return 0;
+    if (c != '{') return fail(r, c == EOF ? "unexpected end of file" : "malformed test case");
+    t->name[0] = '\0';
+    t->initial.present = t->final.present = 0;
+    t->initial.ram_count = t->final.ram_count = 0;
+    return read_object(r, case_member, t);
+}
+
+// --- Execution ------------------------------------------------------------
+
+// Marks every page clean so the pages a case stores to show up in cpu->dirty.
+static void track_writes(CPU8086* cpu) {
+    memset(cpu->dirty, 0, sizeof(cpu->dirty));
+    for (int i = 0; i < CODE_PAGES; i++) {
+        cpu->code_map[i] |= CODE_MAP_CLEAN;
+    }
+}
+
+// Zeroes the bytes the case loaded and every page the instruction stored to.
+static void clear_case(CPU8086* cpu, const TestCase* t) {
+    for (size_t i = 0; i < t->initial.ram_count; i++) {
+        cpu->memory[t->initial.ram[i].addr] = 0;
+    }
+    const int entries = 1 << (MAP_PAGE_SHIFT - CODE_PAGE_SHIFT);
+    for (int page = 0; page < RAM_PAGES; page++) {
+        if (!cpu->dirty[page]) continue;
+        memset(cpu->memory + page * MAP_PAGE_SIZE, 0, MAP_PAGE_SIZE);
+        cpu->dirty[page] = 0;
+        for (int i = 0; i < entries; i++) {
+            cpu->code_map[page * entries + i] |= CODE_MAP_CLEAN;
+        }
+    }
+}
+
+static void load_state(CPU8086* cpu, const TestState* s) {
+    const uint16_t* v = s->value;
+    cpu->ax = v[R_AX];
+    cpu->bx = v[R_BX];
+    cpu->cx = v[R_CX];
+    cpu->dx = v[R_DX];
+    cpu->cs = v[R_CS];
+    cpu->ss = v[R_SS];
+    cpu->ds = v[R_DS];
+    cpu->es = v[R_ES];
+    cpu->sp = v[R_SP];
+    cpu->bp = v[R_BP];
+    cpu->si = v[R_SI];
+    cpu->di = v[R_DI];
+    cpu->ip = v[R_IP];
+    cpu_set_flags(cpu, v[R_FLAGS]);
+    for (size_t i = 0; i < s->ram_count; i++) {
+        cpu->memory[s->ram[i].addr] = s->ram[i].value;
+    }
+}
+
+static void read_state(CPU8086* cpu, uint16_t* v) {
+    v[R_AX] = cpu->ax;
+    v[R_BX] = cpu->bx;
+    v[R_CX] = cpu->cx;
+    v[R_DX] = cpu->dx;
+    v[R_CS] = cpu->cs;
+    v[R_SS] = cpu->ss;
+    v[R_DS] = cpu->ds;
+    v[R_ES] = cpu->es;
+    v[R_SP] = cpu->sp;
+    v[R_BP] = cpu->bp;
+    v[R_SI] = cpu->si;
+    v[R_DI] = cpu->di;
+    v[R_IP] = cpu->ip;
+    v[R_FLAGS] = cpu_get_flags(cpu);
+}
+
+// Registers missing from the final state are expected unchanged. Describes
+// the differences on report when it is not NULL.
+static CaseResult run_case(CPU8086* cpu, const TestCase* t, uint16_t flags_mask, FILE* report) {
+    cpu_reset(cpu);
+    load_state(cpu, &t->initial);
+    execute_instruction(cpu);
+    CaseResult result = CASE_PASSED;
+    if (cpu->stop_reason == STOP_UNKNOWN_OPCODE) {
+        result = CASE_UNSUPPORTED;
+    } else {
+        uint16_t got[REG_COUNT];
+        read_state(cpu, got);
+        for (int i = 0; i < REG_COUNT; i++) {
+            uint16_t want = (t->final.present >> i & 1) ? t->final.value[i] : t->initial.value[i];
+            uint16_t diff = got[i] ^ want;
+            if (i == R_FLAGS) diff &= ~flags_mask;
+            if (!diff) continue;
+            if (report) fprintf(report, "%s%s %04X, expected %04X", result ? "; " : "  ", reg_keys[i], got[i], want);
+            result = CASE_FAILED;
+        }
+        for (size_t i = 0; i < t->final.ram_count; i++) {
+            const RamByte* b = &t->final.ram[i];
+            if (cpu->memory[b->addr] == b->value) continue;
+            if (report) {
+                fprintf(report, "%s[%05X] %02X, expected %02X", result ? "; " : "  ", b->addr,
+                        cpu->memory[b->addr], b->value);
+            }
+            result = CASE_FAILED;
+        }
+    }
+    clear_case(cpu, t);
+    return result;
+}
+
+// Runs every case of path, appending a summary and the first failures to
+// report. Returns 0 if the file could not be read.
+static int run_file(Run* run, CPU8086* cpu, TestCase* t, const char* path, FILE* report,
+                    unsigned long* counts) {
+    JsonReader r = { 0 };
+    r.in = open_input(path, &r.child);
+    if (!r.in) {
+        fprintf(report, "%s: cannot open\n", path);
+        return 0;
+    }
+    unsigned long index = 0;
+    unsigned failures = 0;
+    for (int first = 1; read_case(&r, t, first); first = 0, index++) {
+        CaseResult result = run_case(cpu, t, run->flags_mask, NULL);
+        counts[result]++;
+        if (result == CASE_FAILED && failures++ < run->max_failures) {
+            fprintf(report, "%s #%lu %s:\n", path, index, t->name);
+            run_case(cpu, t, run->flags_mask, report);
+            fputc('\n', report);
+        }
+    }
+    int ok = close_input(&r) && !r.error;
+    fprintf(report, "%s: %lu passed, %lu failed, %lu unsupported", path, counts[CASE_PASSED],
+            counts[CASE_FAILED], counts[CASE_UNSUPPORTED]);
+    if (r.error) {
+        fprintf(report, ", stopped at case %lu: %s", index, r.error);
+    } else if (!ok) {
+        fprintf(report, ", read error");
+    }
+    fputc('\n', report);
+    return ok;
+}
+
+static void* worker_main(void* arg) {
+    Run* run = arg;
+    CPU8086* cpu = malloc(sizeof(CPU8086));
+    TestCase* t = calloc(1, sizeof(TestCase));
+    FILE* quiet = fopen("/dev/null", "w");
+    if (!cpu || !t || !quiet || !init_cpu(cpu, stderr)) {
+        fprintf(stderr, "Cannot set up a test CPU\n");
+        pthread_mutex_lock(&run->lock);
+        run->errors++;
+        pthread_mutex_unlock(&run->lock);
+        if (quiet) fclose(quiet);
+        free(cpu);
+        free(t);
+        return NULL;
+    }
+    // Cases may use any address: all RAM, decoded one instruction at a time,
+    // cleared once here and then only where a case touched it.
+    cpu->log = quiet;
+    cpu_set_block_cache(cpu, 0);
+    cpu_map_memory(cpu, 0, MEMORY_SIZE, MAP_RAM, NULL);
+    memset(cpu->memory, 0, MEMORY_SIZE);
+    track_writes(cpu);
+
+    int index;
+    while ((index = __atomic_fetch_add(&run->next_file, 1, __ATOMIC_RELAXED)) < run->file_count) {
+        char* text = NULL;
+        size_t size = 0;
+        FILE* report = open_memstream(&text, &size);
+        if (!report) break;
+        unsigned long counts[3] = { 0 };
+        int ok = run_file(run, cpu, t, run->files[index], report, counts);
+        fclose(report);
+        pthread_mutex_lock(&run->lock);
+        fputs(text, stdout);
+        fflush(stdout);
+        run->passed += counts[CASE_PASSED];
+        run->failed += counts[CASE_FAILED];
+        run->unsupported += counts[CASE_UNSUPPORTED];
+        if (!ok) run->errors++;
+        pthread_mutex_unlock(&run->lock);
+        free(text);
+    }
+
+    free(t->initial.ram);
+    free(t->final.ram);
+    free(t);
+    free_cpu(cpu);
+    free(cpu);
+    fclose(quiet);
+    return NULL;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void print_usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s [options] FILE...\n"
+            "Runs single-instruction test vectors (JSON, or gzipped JSON ending in .gz).\n"
+            "  -j, --jobs N           worker threads (default: one per CPU)\n"
+            "  -m, --flags-mask HEX   FLAGS bits to ignore, e.g. undefined ones\n"
+            "  -f, --max-failures N   failures to describe per file (default %d)\n"
+            "  -h, --help             show this help\n",
+            prog, DEFAULT_MAX_FAILURES);
+}
+
+int main(int argc, char** argv) {
+    Run run = { 0 };
+    int workers = 0;
+    run.max_failures = DEFAULT_MAX_FAILURES;
+
+    static const struct option options[] = {
+        {"jobs", required_argument, NULL, 'j'},
+        {"flags-mask", required_argument, NULL, 'm'},
+        {"max-failures", required_argument, NULL, 'f'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "j:m:f:h", options, NULL)) != -1) {
+        switch (opt) {
+            case 'j':
+                workers = atoi(optarg);
+                break;
+            case 'm':
+                run.flags_mask = strtoul(optarg, NULL, 16);
+                break;
+            case 'f':
+                run.max_failures = strtoul(optarg, NULL, 0);
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                return 2;
+        }
+    }
+    if (optind >= argc) {
+        print_usage(argv[0]);
+        return 2;
+    }
+    run.files = argv + optind;
+    run.file_count = argc - optind;
+    if (workers <= 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = online > 0 ? (int)online : 1;
+    }
+    if (workers > run.file_count) workers = run.file_count;
+    pthread_mutex_init(&run.lock, NULL);
+
+    double start = now_seconds();
+    pthread_t* threads = calloc(workers, sizeof(*threads));
+    int started = 0;
+    for (int i = 0; threads && i < workers; i++) {
+        if (pthread_create(&threads[i], NULL, worker_main, &run) != 0) break;
+        started++;
+    }
+    if (started == 0) {
+        fprintf(stderr, "Cannot start worker threads\n");
+        free(threads);
+        return 2;
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    double elapsed = now_seconds() - start;
+
+    unsigned long total = run.passed + run.failed + run.unsupported;
+    printf("Total: %lu cases in %.3f s (%.0f cases/s): %lu passed, %lu failed, %lu unsupported\n",
+           total, elapsed, elapsed > 0.0 ? total / elapsed : 0.0, run.passed, run.failed, run.unsupported);
+    if (run.errors) printf("%d files could not be read completely\n", run.errors);
+    pthread_mutex_destroy(&run.lock);
+    return run.failed || run.errors ? 1 : 0;
+}
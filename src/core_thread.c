@@ -0,0 +1,127 @@
+#include <string.h>
+#include <time.h>
+#include "core_thread.h"
+#include "input_script.h"
+
+static int key_queue_push(KeyQueue* q, uint8_t code) {
+    unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (tail - head == KEY_QUEUE_SIZE) return 0;
+    q->codes[tail % KEY_QUEUE_SIZE] = code;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+static int key_queue_pop(KeyQueue* q, uint8_t* code) {
+    unsigned head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (head == tail) return 0;
+    *code = q->codes[head % KEY_QUEUE_SIZE];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return 1;
+}
+
+static void publish(CoreThread* core, unsigned long long instructions) {
+    CPU8086* cpu = core->cpu;
+    CoreSnapshot* s = &core->snapshot;
+    unsigned seq = atomic_load_explicit(&core->seq, memory_order_relaxed);
+    atomic_store_explicit(&core->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(s->regs, cpu->regs, sizeof(s->regs));
+    memcpy(s->sregs, cpu->sregs, sizeof(s->sregs));
+    s->ip = cpu->ip;
+    s->flags = cpu_get_flags(cpu);
+    s->running = cpu->running;
+    s->instructions = instructions;
+    s->cycles = cpu->cycles;
+    memcpy(s->vram, cpu->memory + VIDEO_MEMORY, sizeof(s->vram));
+    s->cga_mode = cpu->cga_mode;
+    s->cga_color = cpu->cga_color;
+    atomic_store_explicit(&core->seq, seq + 2, memory_order_release);
+}
+
+static void idle(void) {
+    struct timespec ts = { 0, 1000000 };  // 1 ms
+    nanosleep(&ts, NULL);
+}
+
+static void* core_main(void* arg) {
+    CoreThread* core = arg;
+    CPU8086* cpu = core->cpu;
+    unsigned long long instructions = 0;
+    unsigned long slice = core->throttle.hz ? THROTTLE_SLICE : CORE_SLICE;
+
+    while (!atomic_load_explicit(&core->quit, memory_order_relaxed)) {
+        uint8_t code;
+        while (key_queue_pop(&core->keys, &code)) {
+            if (!cpu->running) continue;
+            keyboard_push(cpu, code);
+            if (core->record) input_record_key(core->record, instructions, code);
+        }
+
+        int busy = 0;
+        if (cpu->running) {
+            if (atomic_load_explicit(&core->auto_run, memory_order_relaxed)) {
+                instructions += cpu_run(cpu, slice);
+                throttle_sync(&core->throttle, cpu->cycles);
+                busy = 1;
+            } else if (atomic_load_explicit(&core->steps, memory_order_relaxed) > 0) {
+                atomic_fetch_sub_explicit(&core->steps, 1, memory_order_relaxed);
+                execute_instruction(cpu);
+                instructions++;
+                busy = 1;
+            }
+        }
+        if (atomic_exchange_explicit(&core->want_snapshot, 0, memory_order_acquire)) {
+            publish(core, instructions);
+        }
+        if (!busy) idle();
+    }
+    publish(core, instructions);
+    return NULL;
+}
+
+int core_start(CoreThread* core, CPU8086* cpu, unsigned long clock_hz, FILE* record) {
+    memset(core, 0, sizeof(*core));
+    core->cpu = cpu;
+    core->record = record;
+    throttle_init(&core->throttle, clock_hz, cpu->cycles);
+    cpu_set_clock(cpu, clock_hz);
+    atomic_init(&core->quit, 0);
+    atomic_init(&core->auto_run, 1);
+    atomic_init(&core->steps, 0);
+    atomic_init(&core->want_snapshot, 0);
+    atomic_init(&core->keys.head, 0);
+    atomic_init(&core->keys.tail, 0);
+    atomic_init(&core->seq, 0);
+    publish(core, 0);
+    return pthread_create(&core->thread, NULL, core_main, core) == 0;
+}
+
+void core_stop(CoreThread* core) {
+    atomic_store(&core->quit, 1);
+    pthread_join(core->thread, NULL);
+}
+
+int core_send_key(CoreThread* core, uint8_t code) {
+    return key_queue_push(&core->keys, code);
+}
+
+void core_set_auto_run(CoreThread* core, int enabled) {
+    atomic_store(&core->auto_run, enabled);
+}
+
+void core_step(CoreThread* core) {
+    atomic_fetch_add(&core->steps, 1);
+}
+
+void core_snapshot(CoreThread* core, CoreSnapshot* out) {
+    unsigned before, after;
+    do {
+        before = atomic_load_explicit(&core->seq, memory_order_acquire);
+        memcpy(out, &core->snapshot, sizeof(*out));
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&core->seq, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    atomic_store_explicit(&core->want_snapshot, 1, memory_order_release);
+}
@@ -2,683 +2,1781 @@
 #include <stdlib.h>
 #include <string.h>
 #include "cpu8086.h"
+#include "decode.h"
+#include "block_cache.h"
+#include "jit.h"
+#include "trace.h"
+#include "profile.h"
+#include "guest_memory.h"
 
+// Up to 0x10FFEF. Guest memory is mirrored past MEMORY_SIZE, so the result can
+// index cpu->memory directly and reads the wrapped 20-bit address.
 static inline uint32_t get_physical_addr(uint16_t segment, uint16_t offset) {
     return ((uint32_t)segment << 4) + offset;
 }
 
-static inline int check_memory_bounds(uint32_t addr, uint32_t size, uint32_t max) {
-    return addr <= max - size;
+// Keeps PENDING_IRQ equal to "the PIC asserts INTR and IF is set", so the run
+// loop only looks at pending. Call after anything that changes either.
+static inline void update_irq(CPU8086* cpu) {
+    if (cpu->pic.intr && cpu->flags.interrupt) {
+        cpu->pending |= PENDING_IRQ;
+    } else {
+        cpu->pending &= ~PENDING_IRQ;
+    }
+}
+
+static void raise_irq(CPU8086* cpu, int irq) {
+    pic_raise(&cpu->pic, irq);
+    update_irq(cpu);
+}
+
+static void map_builtin_ports(CPU8086* cpu);
+
+static void raise_timer_irq(void* ctx) {
+    raise_irq(ctx, IRQ_TIMER);
 }
 
-void init_cpu(CPU8086* cpu) {
+int init_cpu(CPU8086* cpu, FILE* log) {
     memset(cpu, 0, sizeof(CPU8086));
+    cpu->log = log;
+    cpu->memory = guest_memory_create(log);
+    if (!cpu->memory) return 0;
+    memory_map_init(&cpu->map, cpu->memory);
+    cpu_map_memory(cpu, BIOS_ROM, BIOS_ROM_SIZE, MAP_ROM, NULL);
+    io_bus_init(&cpu->io);
+    map_builtin_ports(cpu);
+    cpu_reset(cpu);
+    for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT * 2; i += 2) {
+        cpu->memory[VIDEO_MEMORY + i] = ' ';
+        cpu->memory[VIDEO_MEMORY + i + 1] = 0x07;
+    }
+    for (int i = 0; i < 256 * 4; i += 4) {
+        cpu->memory[IVT_BASE + i] = 0x00;
+        cpu->memory[IVT_BASE + i + 1] = 0x01;
+        cpu->memory[IVT_BASE + i + 2] = 0x00;
+        cpu->memory[IVT_BASE + i + 3] = 0x00;
+    }
+    cpu_set_block_cache(cpu, 1);
+    cpu_set_jit(cpu, 1);
+    return 1;
+}
+
+// Registers, flags, keyboard, PIC, PIT and the clock go back to their
+// power-on state (PIT at 4.77 MHz). Memory, the memory map, the block cache
+// and any attached trace or profile are left alone.
+void cpu_reset(CPU8086* cpu) {
+    memset(cpu->regs, 0, sizeof(cpu->regs));
+    memset(cpu->sregs, 0, sizeof(cpu->sregs));
     cpu->sp = STACK_BASE;
     cpu->ip = 0x0100;
-    cpu->running = 1;
+    cpu_set_flags(cpu, 0);
     cpu->flags.interrupt = 1;
+    cpu->cycles = 0;
+    cpu->running = 1;
+    cpu->halted = 0;
+    cpu->stop_reason = STOP_NONE;
+    cpu->pending = 0;
+    cpu->last_instruction = 0;
+    cpu->kb_head = cpu->kb_tail = 0;
     cpu->kb_status = 0;
-    cpu->pic_irr = 0;
-    cpu->pic_isr = 0;
-    cpu->pic_imr = 0xFD;
-    for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT * 2; i += 2) {
-        cpu->memory[VIDEO_MEMORY + i] = ' ';
-        cpu->memory[VIDEO_MEMORY + i + 1] = 0x07;
+    cpu->kb_dropped = 0;
+    cpu->cga_mode = CGA_MODE_RESET;
+    cpu->cga_color = 0;
+    pic_init(&cpu->pic);
+    scheduler_init(&cpu->events);
+    cpu->idle_hook = NULL;
+    pit_init(&cpu->pit, &cpu->events, raise_timer_irq, cpu);
+}
+
+void free_cpu(CPU8086* cpu) {
+    io_bus_free(&cpu->io);
+    cpu_set_block_cache(cpu, 0);
+    guest_memory_destroy(cpu->memory);
+    cpu->memory = NULL;
+}
+
+// Switches between block-cached and per-instruction decoding. Returns 0 if
+// the cache could not be allocated; the CPU then keeps running uncached.
+int cpu_set_block_cache(CPU8086* cpu, int enabled) {
+    if (!enabled) {
+        cpu_set_jit(cpu, 0);
+        block_cache_destroy(cpu->block_cache);
+        cpu->block_cache = NULL;
+        return 1;
+    }
+    if (!cpu->block_cache) {
+        cpu->block_cache = block_cache_create();
+        if (!cpu->block_cache) {
+            fprintf(cpu->log, "Cannot allocate block cache, running uncached\n");
+            return 0;
+        }
+        block_cache_flush(cpu);
+    }
+    return 1;
+}
+
+// Changes how guest accesses to [start, start + size) are served, see
+// guest_memory.h. Drops all predecoded and translated code.
+void cpu_map_memory(CPU8086* cpu, uint32_t start, uint32_t size, MapKind kind, const MmioHandler* handler) {
+    memory_map_set(&cpu->map, cpu->memory, start, size, kind, handler);
+    block_cache_flush(cpu);
+}
+
+// Switches translation of hot blocks to native code. Needs the block cache;
+// returns 0 if the host cannot run translated code.
+int cpu_set_jit(CPU8086* cpu, int enabled) {
+    if (!enabled) {
+        jit_destroy(cpu->jit);
+        cpu->jit = NULL;
+        if (cpu->block_cache) block_cache_flush(cpu);
+        return 1;
+    }
+    if (!cpu->jit && cpu->block_cache) {
+        cpu->jit = jit_create();
+    }
+    return cpu->jit != NULL;
+}
+
+// Sends every store through note_write_slow while a trace or profile is
+// attached.
+static void update_watch(CPU8086* cpu) {
+    int watch = cpu->trace || cpu->profile;
+    for (int i = 0; i < CODE_PAGES; i++) {
+        if (watch) {
+            cpu->code_map[i] |= CODE_MAP_WATCH;
+        } else {
+            cpu->code_map[i] &= ~CODE_MAP_WATCH;
+        }
+    }
+}
+
+// Starts recording into trace, or stops with NULL; the caller owns the trace.
+void cpu_set_trace(CPU8086* cpu, Trace* trace) {
+    cpu->trace = trace;
+    update_watch(cpu);
+}
+
+// Starts counting into profile, or stops with NULL; the caller owns the
+// profile. Loads are counted by taking every page off the direct read path.
+void cpu_set_profile(CPU8086* cpu, Profile* profile) {
+    cpu->profile = profile;
+    memory_map_watch_reads(&cpu->map, cpu->memory, profile != NULL);
+    block_cache_flush(cpu);
+    update_watch(cpu);
+}
+
+void cpu_stop(CPU8086* cpu, StopReason reason) {
+    cpu->running = 0;
+    cpu->pending |= PENDING_STOP;
+    if (cpu->stop_reason == STOP_NONE) {
+        cpu->stop_reason = reason;
+    }
+}
+
+void cpu_set_clock(CPU8086* cpu, unsigned long hz) {
+    pit_set_cpu_clock(&cpu->pit, hz, cpu->cycles);
+}
+
+static void cycle_limit_event(void* ctx, uint64_t when) {
+    (void)when;
+    cpu_stop(ctx, STOP_CYCLE_LIMIT);
+}
+
+void cpu_set_cycle_limit(CPU8086* cpu, uint64_t cycles) {
+    scheduler_register(&cpu->events, EVENT_CYCLE_LIMIT, cycle_limit_event, cpu);
+    scheduler_set(&cpu->events, EVENT_CYCLE_LIMIT, cycles);
+}
+
+const char* stop_reason_name(StopReason reason) {
+    switch (reason) {
+        case STOP_NONE: return "running";
+        case STOP_HLT: return "HLT";
+        case STOP_UNKNOWN_OPCODE: return "unknown opcode";
+        case STOP_INSTRUCTION_LIMIT: return "instruction limit";
+        case STOP_TIME_LIMIT: return "time limit";
+        case STOP_CYCLE_LIMIT: return "cycle limit";
+    }
+    return "unknown";
+}
+
+#define P2(n) n, n ^ 1, n ^ 1, n
+#define P4(n) P2(n), P2(n ^ 1), P2(n ^ 1), P2(n)
+#define P6(n) P4(n), P4(n ^ 1), P4(n ^ 1), P4(n)
+// 1 for bytes with an even number of set bits (PF).
+static const uint8_t parity_table[256] = { P6(1), P6(0), P6(0), P6(1) };
+#undef P2
+#undef P4
+#undef P6
+
+/* Lazy flags. ALU instructions only record their operation, operands and
+   result in cpu->lazy; the arithmetic flags are derived from that record when
+   something reads them. cpu->flags holds them whenever lazy.op == LF_NONE. */
+
+static inline void lazy_set(CPU8086* cpu, uint8_t op, uint16_t dst, uint16_t src, uint16_t res,
+                            uint8_t carry_in, uint8_t word) {
+    cpu->lazy.op = op;
+    cpu->lazy.word = word;
+    cpu->lazy.carry_in = carry_in;
+    cpu->lazy.dst = dst;
+    cpu->lazy.src = src;
+    cpu->lazy.res = res;
+}
+
+static inline int lazy_cf(const LazyFlags* lf) {
+    switch (lf->op) {
+        case LF_ADD: return lf->res < lf->dst || (lf->carry_in && lf->res == lf->dst);
+        case LF_SUB: return (uint32_t)lf->dst < (uint32_t)lf->src + lf->carry_in;
+        case LF_INC:
+        case LF_DEC: return lf->carry_in;
+        default: return 0;
+    }
+}
+
+static inline int lazy_of(const LazyFlags* lf) {
+    uint16_t sign = lf->word ? 0x8000 : 0x80;
+    switch (lf->op) {
+        case LF_ADD:
+        case LF_INC: return ((lf->dst ^ lf->res) & (lf->src ^ lf->res) & sign) != 0;
+        case LF_SUB:
+        case LF_DEC: return ((lf->dst ^ lf->src) & (lf->dst ^ lf->res) & sign) != 0;
+        default: return 0;
+    }
+}
+
+static inline int lazy_af(const LazyFlags* lf) {
+    return lf->op != LF_LOGIC && ((lf->dst ^ lf->src ^ lf->res) & 0x10) != 0;
+}
+
+static inline int lazy_sf(const LazyFlags* lf) {
+    return (lf->res >> (lf->word ? 15 : 7)) & 1;
+}
+
+static inline int get_cf(const CPU8086* cpu) {
+    return cpu->lazy.op == LF_NONE ? cpu->flags.carry : lazy_cf(&cpu->lazy);
+}
+
+static inline int get_zf(const CPU8086* cpu) {
+    return cpu->lazy.op == LF_NONE ? cpu->flags.zero : cpu->lazy.res == 0;
+}
+
+static inline int get_sf(const CPU8086* cpu) {
+    return cpu->lazy.op == LF_NONE ? cpu->flags.sign : lazy_sf(&cpu->lazy);
+}
+
+static inline int get_of(const CPU8086* cpu) {
+    return cpu->lazy.op == LF_NONE ? cpu->flags.overflow : lazy_of(&cpu->lazy);
+}
+
+static inline int get_pf(const CPU8086* cpu) {
+    return cpu->lazy.op == LF_NONE ? cpu->flags.parity : parity_table[cpu->lazy.res & 0xFF];
+}
+
+void cpu_sync_flags(CPU8086* cpu) {
+    const LazyFlags* lf = &cpu->lazy;
+    if (lf->op == LF_NONE) return;
+    cpu->flags.carry = lazy_cf(lf);
+    cpu->flags.parity = parity_table[lf->res & 0xFF];
+    cpu->flags.auxiliary = lazy_af(lf);
+    cpu->flags.zero = lf->res == 0;
+    cpu->flags.sign = lazy_sf(lf);
+    cpu->flags.overflow = lazy_of(lf);
+    cpu->lazy.op = LF_NONE;
+}
+
+uint16_t cpu_get_flags(CPU8086* cpu) {
+    cpu_sync_flags(cpu);
+    return 0xF002 | cpu->flags.carry | (cpu->flags.parity << 2) | (cpu->flags.auxiliary << 4) |
+           (cpu->flags.zero << 6) | (cpu->flags.sign << 7) | (cpu->flags.trap << 8) |
+           (cpu->flags.interrupt << 9) | (cpu->flags.direction << 10) | (cpu->flags.overflow << 11);
+}
+
+void cpu_set_flags(CPU8086* cpu, uint16_t value) {
+    cpu->lazy.op = LF_NONE;
+    cpu->flags.carry = value & 0x01;
+    cpu->flags.parity = (value >> 2) & 0x01;
+    cpu->flags.auxiliary = (value >> 4) & 0x01;
+    cpu->flags.zero = (value >> 6) & 0x01;
+    cpu->flags.sign = (value >> 7) & 0x01;
+    cpu->flags.trap = (value >> 8) & 0x01;
+    cpu->flags.interrupt = (value >> 9) & 0x01;
+    cpu->flags.direction = (value >> 10) & 0x01;
+    cpu->flags.overflow = (value >> 11) & 0x01;
+    update_irq(cpu);
+}
+
+
+static void invalidate_page(CPU8086* cpu, uint32_t page) {
+    if (cpu->code_map[page] & CODE_MAP_CODE) {
+        cpu->code_gen[page]++;
+        cpu->code_map[page] &= ~CODE_MAP_CODE;
+        cpu->pending |= PENDING_SMC;
+    }
+    if (cpu->code_map[page] & CODE_MAP_CLEAN) {
+        uint32_t ram_page = page >> (MAP_PAGE_SHIFT - CODE_PAGE_SHIFT);
+        uint8_t* bits = &cpu->code_map[ram_page << (MAP_PAGE_SHIFT - CODE_PAGE_SHIFT)];
+        for (int i = 0; i < 1 << (MAP_PAGE_SHIFT - CODE_PAGE_SHIFT); i++) {
+            bits[i] &= ~CODE_MAP_CLEAN;
+        }
+        cpu->dirty[ram_page] = 1;
+    }
+}
+
+static void note_write_slow(CPU8086* cpu, uint32_t addr) {
+    invalidate_page(cpu, addr >> CODE_PAGE_SHIFT);
+    if (cpu->trace) trace_note_write(cpu->trace, addr);
+    if (cpu->profile) cpu->profile->writes[profile_region(addr)]++;
+}
+
+// Called for every guest store byte that reaches RAM: a write into a page
+// holding predecoded code invalidates its blocks and makes the run loop leave
+// the current one, and the first write to a clean page marks it dirty.
+// While tracing or profiling every page has CODE_MAP_WATCH, so all stores
+// take the slow path.
+static inline void note_write(CPU8086* cpu, uint32_t addr) {
+    addr &= ADDR_MASK;
+    if (__builtin_expect(cpu->code_map[addr >> CODE_PAGE_SHIFT] &
+                         (CODE_MAP_CODE | CODE_MAP_CLEAN | CODE_MAP_WATCH), 0)) {
+        note_write_slow(cpu, addr);
+    }
+}
+
+void cpu_mark_dirty(CPU8086* cpu, uint32_t addr, uint32_t size) {
+    if (size == 0) return;
+    uint32_t last = (addr + size - 1) >> CODE_PAGE_SHIFT;
+    for (uint32_t page = addr >> CODE_PAGE_SHIFT; page <= last; page++) {
+        invalidate_page(cpu, page & (CODE_PAGES - 1));
+    }
+}
+
+// Handler pages, and every page while profiling.
+static uint8_t read_slow(CPU8086* cpu, uint32_t addr) {
+    const MmioHandler* h = cpu->map.mmio[addr >> MAP_PAGE_SHIFT];
+    addr &= ADDR_MASK;
+    if (cpu->profile) cpu->profile->reads[profile_region(addr)]++;
+    if (!h || !h->read) return cpu->memory[addr];
+    return h->read(h->ctx, addr);
+}
+
+static void write_slow(CPU8086* cpu, uint32_t addr, uint8_t value) {
+    const MmioHandler* h = cpu->map.mmio[addr >> MAP_PAGE_SHIFT];
+    addr &= ADDR_MASK;
+    if (!h || h->read) {
+        // Not RAM-backed, so note_write does not see it.
+        if (cpu->profile) cpu->profile->writes[profile_region(addr)]++;
+        if (!h) return;  // ROM
+    } else {
+        note_write(cpu, addr);
+        cpu->memory[addr] = value;
+    }
+    if (h->write) h->write(h->ctx, addr, value);
+}
+
+static inline uint8_t read_phys8(CPU8086* cpu, uint32_t addr) {
+    const uint8_t* page = cpu->map.read[addr >> MAP_PAGE_SHIFT];
+    if (page) return page[addr & MAP_PAGE_MASK];
+    return read_slow(cpu, addr);
+}
+
+static inline void write_phys8(CPU8086* cpu, uint32_t addr, uint8_t value) {
+    uint8_t* page = cpu->map.write[addr >> MAP_PAGE_SHIFT];
+    if (page) {
+        note_write(cpu, addr);
+        page[addr & MAP_PAGE_MASK] = value;
+    } else {
+        write_slow(cpu, addr, value);
+    }
+}
+
+static inline uint8_t read_mem8(CPU8086* cpu, uint16_t segment, uint16_t offset) {
+    return read_phys8(cpu, get_physical_addr(segment, offset));
+}
+
+// A word at offset FFFF takes its high byte from offset 0 of the same segment.
+static inline uint16_t read_mem16(CPU8086* cpu, uint16_t segment, uint16_t offset) {
+    return read_mem8(cpu, segment, offset) | (read_mem8(cpu, segment, offset + 1) << 8);
+}
+
+static inline void write_mem8(CPU8086* cpu, uint16_t segment, uint16_t offset, uint8_t value) {
+    write_phys8(cpu, get_physical_addr(segment, offset), value);
+}
+
+static inline void write_mem16(CPU8086* cpu, uint16_t segment, uint16_t offset, uint16_t value) {
+    write_mem8(cpu, segment, offset, value & 0xFF);
+    write_mem8(cpu, segment, offset + 1, value >> 8);
+}
+
+void push(CPU8086* cpu, uint16_t value) {
+    cpu->sp -= 2;
+    write_mem16(cpu, cpu->ss, cpu->sp, value);
+}
+
+uint16_t pop(CPU8086* cpu) {
+    uint16_t value = read_mem16(cpu, cpu->ss, cpu->sp);
+    cpu->sp += 2;
+    return value;
+}
+
+// Pushes FLAGS, CS and IP and vectors through the IVT; shared by INT n and IRQs.
+static void interrupt_entry(CPU8086* cpu, uint8_t int_num) {
+    if (cpu->profile) cpu->profile->interrupts[int_num]++;
+    push(cpu, cpu_get_flags(cpu));
+    push(cpu, cpu->cs);
+    push(cpu, cpu->ip);
+    uint32_t ivt_addr = IVT_BASE + int_num * 4;
+    cpu->ip = read_mem16(cpu, 0, ivt_addr);
+    cpu->cs = read_mem16(cpu, 0, ivt_addr + 2);
+    cpu->flags.interrupt = 0;
+    cpu->flags.trap = 0;
+    update_irq(cpu);
+}
+
+void handle_interrupt(CPU8086* cpu, uint8_t int_num) {
+    if (!cpu->flags.interrupt) return;
+    cpu->cycles += 61;  // INTA bus cycles plus the entry itself
+    cpu->halted = 0;
+    interrupt_entry(cpu, int_num);
+}
+
+// A scancode arriving in an empty buffer raises IRQ 1; the rest follow one
+// per read of port 60h. A full buffer drops the code rather than wrapping
+// onto kb_head, which would make every queued code look consumed.
+void keyboard_push(CPU8086* cpu, uint8_t code) {
+    if ((uint8_t)(cpu->kb_tail + 1) == cpu->kb_head) {
+        cpu->kb_dropped++;
+        fprintf(cpu->log, "Keyboard buffer full, scancode %02X dropped\n", code);
+        return;
+    }
+    int was_empty = cpu->kb_head == cpu->kb_tail;
+    cpu->keyboard_buffer[cpu->kb_tail] = code;
+    cpu->kb_tail = (cpu->kb_tail + 1) % 256;
+    cpu->kb_status |= 0x01;
+    if (was_empty) raise_irq(cpu, IRQ_KEYBOARD);
+}
+
+static uint8_t keyboard_pop(CPU8086* cpu) {
+    if (cpu->kb_head == cpu->kb_tail) return 0;
+    uint8_t code = cpu->keyboard_buffer[cpu->kb_head];
+    cpu->kb_head = (cpu->kb_head + 1) % 256;
+    if (cpu->kb_head != cpu->kb_tail) {
+        raise_irq(cpu, IRQ_KEYBOARD);
+    } else {
+        cpu->kb_status &= ~0x01;
+    }
+    return code;
+}
+
+static uint16_t keyboard_port_read(void* ctx, uint16_t port, int word) {
+    CPU8086* cpu = ctx;
+    (void)word;
+    return port == KEYBOARD_PORT ? keyboard_pop(cpu) : cpu->kb_status;
+}
+
+static uint16_t pic_port_read(void* ctx, uint16_t port, int word) {
+    CPU8086* cpu = ctx;
+    (void)word;
+    uint8_t value = pic_read(&cpu->pic, port);  // a poll acknowledges an IRQ
+    update_irq(cpu);
+    return value;
+}
+
+static void pic_port_write(void* ctx, uint16_t port, uint16_t value, int word) {
+    CPU8086* cpu = ctx;
+    (void)word;
+    pic_write(&cpu->pic, port, value);
+    update_irq(cpu);
+}
+
+static uint16_t pit_port_read(void* ctx, uint16_t port, int word) {
+    CPU8086* cpu = ctx;
+    (void)word;
+    return pit_read(&cpu->pit, port, cpu->cycles);
+}
+
+static void pit_port_write(void* ctx, uint16_t port, uint16_t value, int word) {
+    CPU8086* cpu = ctx;
+    (void)word;
+    pit_write(&cpu->pit, port, value, cpu->cycles);
+}
+
+// The status register follows the 14.31818 MHz crystal the PIT also runs
+// from: 912 dots (76 PIT ticks) per scanline, 262 lines per frame, of which
+// 640 dots of the first 200 lines are visible.
+static uint16_t cga_port_read(void* ctx, uint16_t port, int word) {
+    CPU8086* cpu = ctx;
+    (void)word;
+    if (port == CGA_MODE_PORT) return cpu->cga_mode;
+    if (port == CGA_COLOR_PORT) return cpu->cga_color;
+    uint64_t tick = pit_ticks(&cpu->pit, cpu->cycles) % (76 * 262);
+    uint64_t line = tick / 76;
+    if (line >= 200) return CGA_STATUS_BLANK | CGA_STATUS_VRETRACE;
+    return tick % 76 >= 640 / 12 ? CGA_STATUS_BLANK : 0;
+}
+
+static void cga_port_write(void* ctx, uint16_t port, uint16_t value, int word) {
+    CPU8086* cpu = ctx;
+    (void)word;
+    if (port == CGA_MODE_PORT) {
+        cpu->cga_mode = value & 0x3F;
+    } else if (port == CGA_COLOR_PORT) {
+        cpu->cga_color = value & 0x3F;
+    }
+}
+
+// The built-in devices, registered on the bus by init_cpu.
+static void map_builtin_ports(CPU8086* cpu) {
+    cpu->keyboard_io = (IoHandler){ keyboard_port_read, NULL, cpu, IO_BYTE };
+    cpu->pic_io = (IoHandler){ pic_port_read, pic_port_write, cpu, IO_BYTE };
+    cpu->pit_io = (IoHandler){ pit_port_read, pit_port_write, cpu, IO_BYTE };
+    cpu->cga_io = (IoHandler){ cga_port_read, cga_port_write, cpu, IO_BYTE };
+    cpu_map_ports(cpu, KEYBOARD_PORT, 1, &cpu->keyboard_io);
+    cpu_map_ports(cpu, KEYBOARD_STATUS, 1, &cpu->keyboard_io);
+    cpu_map_ports(cpu, PIC1_COMMAND, 2, &cpu->pic_io);
+    cpu_map_ports(cpu, PIC2_COMMAND, 2, &cpu->pic_io);
+    cpu_map_ports(cpu, PIT_COUNTER0, PIT_CONTROL - PIT_COUNTER0 + 1, &cpu->pit_io);
+    cpu_map_ports(cpu, CGA_MODE_PORT, CGA_STATUS_PORT - CGA_MODE_PORT + 1, &cpu->cga_io);
+}
+
+// Routes ports [first, first + count) to handler (NULL unmaps them); see
+// io_bus.h. Returns 0 if the bus has no room for another handler.
+int cpu_map_ports(CPU8086* cpu, uint16_t first, uint32_t count, const IoHandler* handler) {
+    return io_bus_map(&cpu->io, first, count, handler);
+}
+
+uint16_t read_port(CPU8086* cpu, uint16_t port, int word) {
+    if (cpu->profile) cpu->profile->port_reads[port]++;
+    return io_bus_read(&cpu->io, port, word, cpu->log);
+}
+
+void write_port(CPU8086* cpu, uint16_t port, uint16_t value, int word) {
+    if (cpu->profile) cpu->profile->port_writes[port]++;
+    io_bus_write(&cpu->io, port, value, word, cpu->log);
+}
+
+
+// AL..BH alias the low and high bytes of AX..BX (little-endian host).
+static inline uint8_t* reg8(CPU8086* cpu, int n) {
+    return (uint8_t*)&cpu->regs[n & 3] + (n >> 2);
+}
+
+static inline uint16_t ea_offset(const CPU8086* cpu, const DecodedInsn* d) {
+    uint16_t base;
+    switch (d->ea) {
+        case EA_BX_SI: base = cpu->bx + cpu->si; break;
+        case EA_BX_DI: base = cpu->bx + cpu->di; break;
+        case EA_BP_SI: base = cpu->bp + cpu->si; break;
+        case EA_BP_DI: base = cpu->bp + cpu->di; break;
+        case EA_SI: base = cpu->si; break;
+        case EA_DI: base = cpu->di; break;
+        case EA_BP: base = cpu->bp; break;
+        case EA_BX: base = cpu->bx; break;
+        default: base = 0; break;
+    }
+    return base + d->disp;
+}
+
+/* r/m operand access. offset is ea_offset() and is ignored for register operands. */
+
+static inline uint8_t rm_read8(CPU8086* cpu, const DecodedInsn* d, uint16_t offset) {
+    if (d->ea == EA_REG) return *reg8(cpu, d->rm);
+    return read_mem8(cpu, cpu->sregs[d->seg], offset);
+}
+
+static inline uint16_t rm_read16(CPU8086* cpu, const DecodedInsn* d, uint16_t offset) {
+    if (d->ea == EA_REG) return cpu->regs[d->rm];
+    return read_mem16(cpu, cpu->sregs[d->seg], offset);
+}
+
+static inline void rm_write8(CPU8086* cpu, const DecodedInsn* d, uint16_t offset, uint8_t value) {
+    if (d->ea == EA_REG) {
+        *reg8(cpu, d->rm) = value;
+    } else {
+        write_mem8(cpu, cpu->sregs[d->seg], offset, value);
+    }
+}
+
+static inline void rm_write16(CPU8086* cpu, const DecodedInsn* d, uint16_t offset, uint16_t value) {
+    if (d->ea == EA_REG) {
+        cpu->regs[d->rm] = value;
+    } else {
+        write_mem16(cpu, cpu->sregs[d->seg], offset, value);
+    }
+}
+
+enum { ALU_ADD, ALU_OR, ALU_ADC, ALU_SBB, ALU_AND, ALU_SUB, ALU_XOR, ALU_CMP };
+
+// The eight ALU operations of opcodes 00-3F and group 80-83, in encoding order.
+static inline uint16_t alu(CPU8086* cpu, int op, uint16_t a, uint16_t b, int word) {
+    uint16_t mask = word ? 0xFFFF : 0xFF;
+    uint8_t carry_in = 0;
+    uint8_t kind;
+    uint16_t r;
+    switch (op) {
+        case ALU_ADC:
+            carry_in = get_cf(cpu);
+            /* fall through */
+        case ALU_ADD:
+            r = a + b + carry_in;
+            kind = LF_ADD;
+            break;
+        case ALU_SBB:
+            carry_in = get_cf(cpu);
+            /* fall through */
+        case ALU_SUB:
+        case ALU_CMP:
+            r = a - b - carry_in;
+            kind = LF_SUB;
+            break;
+        case ALU_OR:
+            r = a | b;
+            kind = LF_LOGIC;
+            break;
+        case ALU_AND:
+            r = a & b;
+            kind = LF_LOGIC;
+            break;
+        default:
+            r = a ^ b;
+            kind = LF_LOGIC;
+            break;
+    }
+    r &= mask;
+    lazy_set(cpu, kind, a, b, r, carry_in, word);
+    return r;
+}
+
+static inline uint16_t inc_dec(CPU8086* cpu, uint16_t value, int dec, int word) {
+    uint16_t r = (dec ? value - 1 : value + 1) & (word ? 0xFFFF : 0xFF);
+    lazy_set(cpu, dec ? LF_DEC : LF_INC, value, 1, r, get_cf(cpu), word);
+    return r;
+}
+
+// Rotates and shifts of group D0-D3 (/0 ROL ... /7 SAR); /6 is the SAL alias.
+// Rare enough that their flags are computed eagerly.
+static uint16_t shift(CPU8086* cpu, int op, uint16_t value, uint8_t count, int word) {
+    uint32_t mask = word ? 0xFFFF : 0xFF;
+    uint32_t sign = word ? 0x8000 : 0x80;
+    uint32_t r = value;
+    if (count == 0) return value;
+    cpu_sync_flags(cpu);
+    uint32_t cf = cpu->flags.carry;
+    for (int i = 0; i < count; i++) {
+        switch (op) {
+            case 0: cf = (r & sign) != 0; r = ((r << 1) | cf) & mask; break;
+            case 1: cf = r & 1; r = (r >> 1) | (cf ? sign : 0); break;
+            case 2: { uint32_t out = (r & sign) != 0; r = ((r << 1) | cf) & mask; cf = out; break; }
+            case 3: { uint32_t out = r & 1; r = (r >> 1) | (cf ? sign : 0); cf = out; break; }
+            case 4: case 6: cf = (r & sign) != 0; r = (r << 1) & mask; break;
+            case 5: cf = r & 1; r >>= 1; break;
+            default: cf = r & 1; r = (r >> 1) | (r & sign); break;
+        }
+    }
+    cpu->flags.carry = cf;
+    switch (op) {
+        case 0: case 2: case 4: case 6:
+            cpu->flags.overflow = ((r & sign) != 0) ^ cf;
+            break;
+        case 1: case 3:
+            cpu->flags.overflow = ((r ^ (r << 1)) & sign) != 0;
+            break;
+        case 5:
+            cpu->flags.overflow = (value & sign) != 0;
+            break;
+        default:
+            cpu->flags.overflow = 0;
+            break;
+    }
+    if (op >= 4) {
+        cpu->flags.zero = r == 0;
+        cpu->flags.sign = (r & sign) != 0;
+        cpu->flags.parity = parity_table[r & 0xFF];
+        cpu->flags.auxiliary = 0;
+    }
+    return r;
+}
+
+static inline int condition(const CPU8086* cpu, int cc) {
+    int r;
+    switch (cc >> 1) {
+        case 0: r = get_of(cpu); break;
+        case 1: r = get_cf(cpu); break;
+        case 2: r = get_zf(cpu); break;
+        case 3: r = get_cf(cpu) | get_zf(cpu); break;
+        case 4: r = get_sf(cpu); break;
+        case 5: r = get_pf(cpu); break;
+        case 6: r = get_sf(cpu) != get_of(cpu); break;
+        default: r = (get_sf(cpu) != get_of(cpu)) | get_zf(cpu); break;
+    }
+    return r ^ (cc & 1);
+}
+
+/* Opcode handlers. Each is entered with cpu->ip already past the whole
+   instruction; relative branches add their displacement to it. */
+
+static inline void op_unknown(CPU8086* cpu, const DecodedInsn* d) {
+    fprintf(cpu->log, "Unknown instruction: 0x%02X (ModR/M 0x%02X) at %04X:%04X\n",
+            d->opcode, d->modrm, cpu->cs, (uint16_t)(cpu->ip - d->length));
+    cpu_stop(cpu, STOP_UNKNOWN_OPCODE);
+}
+
+static inline void op_alu_rm(CPU8086* cpu, const DecodedInsn* d) { // 00-3B: op r/m, reg / reg, r/m
+    int op = (d->opcode >> 3) & 7;
+    uint16_t offset = ea_offset(cpu, d);
+    if (d->opcode & 1) {
+        uint16_t* reg = &cpu->regs[d->reg];
+        if (d->opcode & 2) {
+            uint16_t r = alu(cpu, op, *reg, rm_read16(cpu, d, offset), 1);
+            if (op != ALU_CMP) *reg = r;
+        } else {
+            uint16_t r = alu(cpu, op, rm_read16(cpu, d, offset), *reg, 1);
+            if (op != ALU_CMP) rm_write16(cpu, d, offset, r);
+        }
+    } else {
+        uint8_t* reg = reg8(cpu, d->reg);
+        if (d->opcode & 2) {
+            uint8_t r = alu(cpu, op, *reg, rm_read8(cpu, d, offset), 0);
+            if (op != ALU_CMP) *reg = r;
+        } else {
+            uint8_t r = alu(cpu, op, rm_read8(cpu, d, offset), *reg, 0);
+            if (op != ALU_CMP) rm_write8(cpu, d, offset, r);
+        }
+    }
+}
+
+static inline void op_alu_acc_imm(CPU8086* cpu, const DecodedInsn* d) { // 04-3D: op AL/AX, imm
+    int op = (d->opcode >> 3) & 7;
+    if (d->opcode & 1) {
+        uint16_t r = alu(cpu, op, cpu->ax, d->imm, 1);
+        if (op != ALU_CMP) cpu->ax = r;
+    } else {
+        uint8_t r = alu(cpu, op, cpu->ax & 0xFF, d->imm, 0);
+        if (op != ALU_CMP) cpu->ax = (cpu->ax & 0xFF00) | r;
+    }
+}
+
+static inline void op_grp1(CPU8086* cpu, const DecodedInsn* d) { // 80-83: op r/m, imm
+    uint16_t offset = ea_offset(cpu, d);
+    if (d->opcode & 1) {
+        uint16_t imm = (d->opcode == 0x83) ? (uint16_t)(int8_t)d->imm : d->imm;
+        uint16_t r = alu(cpu, d->reg, rm_read16(cpu, d, offset), imm, 1);
+        if (d->reg != ALU_CMP) rm_write16(cpu, d, offset, r);
+    } else {
+        uint8_t r = alu(cpu, d->reg, rm_read8(cpu, d, offset), d->imm, 0);
+        if (d->reg != ALU_CMP) rm_write8(cpu, d, offset, r);
+    }
+}
+
+static inline void op_test_rm(CPU8086* cpu, const DecodedInsn* d) { // 84, 85
+    uint16_t offset = ea_offset(cpu, d);
+    if (d->opcode & 1) {
+        alu(cpu, ALU_AND, rm_read16(cpu, d, offset), cpu->regs[d->reg], 1);
+    } else {
+        alu(cpu, ALU_AND, rm_read8(cpu, d, offset), *reg8(cpu, d->reg), 0);
+    }
+}
+
+static inline void op_test_acc_imm(CPU8086* cpu, const DecodedInsn* d) { // A8, A9
+    if (d->opcode & 1) {
+        alu(cpu, ALU_AND, cpu->ax, d->imm, 1);
+    } else {
+        alu(cpu, ALU_AND, cpu->ax & 0xFF, d->imm, 0);
+    }
+}
+
+static inline void op_inc_r16(CPU8086* cpu, const DecodedInsn* d) { // 40+r
+    cpu->regs[d->opcode & 7] = inc_dec(cpu, cpu->regs[d->opcode & 7], 0, 1);
+}
+
+static inline void op_dec_r16(CPU8086* cpu, const DecodedInsn* d) { // 48+r
+    cpu->regs[d->opcode & 7] = inc_dec(cpu, cpu->regs[d->opcode & 7], 1, 1);
+}
+
+static inline void op_push_r16(CPU8086* cpu, const DecodedInsn* d) { // 50+r
+    // The 8086 pushes SP after the decrement.
+    push(cpu, (d->opcode & 7) == 4 ? cpu->sp - 2 : cpu->regs[d->opcode & 7]);
+}
+
+static inline void op_pop_r16(CPU8086* cpu, const DecodedInsn* d) { // 58+r
+    uint16_t value = pop(cpu);
+    cpu->regs[d->opcode & 7] = value;
+}
+
+static inline void op_push_sreg(CPU8086* cpu, const DecodedInsn* d) { // 06, 0E, 16, 1E
+    push(cpu, cpu->sregs[(d->opcode >> 3) & 3]);
+}
+
+static inline void op_pop_sreg(CPU8086* cpu, const DecodedInsn* d) { // 07, 17, 1F
+    cpu->sregs[(d->opcode >> 3) & 3] = pop(cpu);
+}
+
+static inline void op_pop_rm(CPU8086* cpu, const DecodedInsn* d) { // 8F /0
+    if (d->reg != 0) {
+        op_unknown(cpu, d);
+        return;
+    }
+    uint16_t value = pop(cpu);
+    rm_write16(cpu, d, ea_offset(cpu, d), value);
+}
+
+static inline void op_jcc(CPU8086* cpu, const DecodedInsn* d) { // 70-7F (60-6F on the 8086)
+    if (condition(cpu, d->opcode & 0x0F)) {
+        cpu->ip += (int8_t)d->imm;
+        cpu->cycles += branch_taken_cycles(d->opcode);
+    }
+}
+
+static inline void op_xchg_rm(CPU8086* cpu, const DecodedInsn* d) { // 86, 87
+    uint16_t offset = ea_offset(cpu, d);
+    if (d->opcode & 1) {
+        uint16_t value = rm_read16(cpu, d, offset);
+        rm_write16(cpu, d, offset, cpu->regs[d->reg]);
+        cpu->regs[d->reg] = value;
+    } else {
+        uint8_t value = rm_read8(cpu, d, offset);
+        rm_write8(cpu, d, offset, *reg8(cpu, d->reg));
+        *reg8(cpu, d->reg) = value;
+    }
+}
+
+static inline void op_xchg_ax(CPU8086* cpu, const DecodedInsn* d) { // 90+r (90 is NOP)
+    uint16_t value = cpu->regs[d->opcode & 7];
+    cpu->regs[d->opcode & 7] = cpu->ax;
+    cpu->ax = value;
+}
+
+static inline void op_mov_rm_reg(CPU8086* cpu, const DecodedInsn* d) { // 88, 89
+    if (d->opcode & 1) {
+        rm_write16(cpu, d, ea_offset(cpu, d), cpu->regs[d->reg]);
+    } else {
+        rm_write8(cpu, d, ea_offset(cpu, d), *reg8(cpu, d->reg));
+    }
+}
+
+static inline void op_mov_reg_rm(CPU8086* cpu, const DecodedInsn* d) { // 8A, 8B
+    if (d->opcode & 1) {
+        cpu->regs[d->reg] = rm_read16(cpu, d, ea_offset(cpu, d));
+    } else {
+        *reg8(cpu, d->reg) = rm_read8(cpu, d, ea_offset(cpu, d));
+    }
+}
+
+static inline void op_mov_rm_sreg(CPU8086* cpu, const DecodedInsn* d) { // 8C
+    rm_write16(cpu, d, ea_offset(cpu, d), cpu->sregs[d->reg & 3]);
+}
+
+static inline void op_mov_sreg_rm(CPU8086* cpu, const DecodedInsn* d) { // 8E
+    cpu->sregs[d->reg & 3] = rm_read16(cpu, d, ea_offset(cpu, d));
+}
+
+static inline void op_lea(CPU8086* cpu, const DecodedInsn* d) { // 8D
+    if (d->ea == EA_REG) {
+        op_unknown(cpu, d);
+        return;
+    }
+    cpu->regs[d->reg] = ea_offset(cpu, d);
+}
+
+static inline void op_load_far_ptr(CPU8086* cpu, const DecodedInsn* d) { // C4 LES, C5 LDS
+    if (d->ea == EA_REG) {
+        op_unknown(cpu, d);
+        return;
+    }
+    uint16_t offset = ea_offset(cpu, d);
+    uint16_t segment = cpu->sregs[d->seg];
+    cpu->regs[d->reg] = read_mem16(cpu, segment, offset);
+    cpu->sregs[d->opcode == 0xC4 ? SREG_ES : SREG_DS] = read_mem16(cpu, segment, offset + 2);
+}
+
+static inline void op_mov_acc_moffs(CPU8086* cpu, const DecodedInsn* d) { // A0, A1
+    if (d->opcode & 1) {
+        cpu->ax = read_mem16(cpu, cpu->sregs[d->seg], d->imm);
+    } else {
+        cpu->ax = (cpu->ax & 0xFF00) | read_mem8(cpu, cpu->sregs[d->seg], d->imm);
+    }
+}
+
+static inline void op_mov_moffs_acc(CPU8086* cpu, const DecodedInsn* d) { // A2, A3
+    if (d->opcode & 1) {
+        write_mem16(cpu, cpu->sregs[d->seg], d->imm, cpu->ax);
+    } else {
+        write_mem8(cpu, cpu->sregs[d->seg], d->imm, cpu->ax & 0xFF);
+    }
+}
+
+static inline void op_mov_r8_imm8(CPU8086* cpu, const DecodedInsn* d) { // B0+r
+    *reg8(cpu, d->opcode & 7) = d->imm;
+}
+
+static inline void op_mov_r16_imm16(CPU8086* cpu, const DecodedInsn* d) { // B8+r
+    cpu->regs[d->opcode & 7] = d->imm;
+}
+
+static inline void op_mov_rm_imm(CPU8086* cpu, const DecodedInsn* d) { // C6, C7
+    if (d->reg != 0) {
+        op_unknown(cpu, d);
+        return;
     }
-    for (int i = 0; i < 256 * 4; i += 4) {
-        cpu->memory[IVT_BASE + i] = 0x00;
-        cpu->memory[IVT_BASE + i + 1] = 0x01;
-        cpu->memory[IVT_BASE + i + 2] = 0x00;
-        cpu->memory[IVT_BASE + i + 3] = 0x00;
+    if (d->opcode & 1) {
+        rm_write16(cpu, d, ea_offset(cpu, d), d->imm);
+    } else {
+        rm_write8(cpu, d, ea_offset(cpu, d), d->imm);
     }
 }
 
-int load_firmware(CPU8086* cpu, const char* filename) {
-    FILE* file = fopen(filename, "rb");
-    if (!file) {
-        fprintf(stderr, "Cannot open firmware file: %s\n", filename);
-        return 0;
+static inline void op_cbw(CPU8086* cpu, const DecodedInsn* d) { // 98
+    (void)d;
+    cpu->ax = (uint16_t)(int8_t)(cpu->ax & 0xFF);
+}
+
+static inline void op_cwd(CPU8086* cpu, const DecodedInsn* d) { // 99
+    (void)d;
+    cpu->dx = (cpu->ax & 0x8000) ? 0xFFFF : 0x0000;
+}
+
+static inline void op_pushf(CPU8086* cpu, const DecodedInsn* d) { // 9C
+    (void)d;
+    push(cpu, cpu_get_flags(cpu));
+}
+
+static inline void op_popf(CPU8086* cpu, const DecodedInsn* d) { // 9D
+    (void)d;
+    cpu_set_flags(cpu, pop(cpu));
+}
+
+static inline void op_sahf(CPU8086* cpu, const DecodedInsn* d) { // 9E
+    (void)d;
+    cpu_set_flags(cpu, (cpu_get_flags(cpu) & 0xFF00) | (cpu->ax >> 8));
+}
+
+static inline void op_lahf(CPU8086* cpu, const DecodedInsn* d) { // 9F
+    (void)d;
+    cpu->ax = (cpu->ax & 0x00FF) | ((cpu_get_flags(cpu) & 0xFF) << 8);
+}
+
+static inline void op_call_near(CPU8086* cpu, const DecodedInsn* d) { // E8
+    push(cpu, cpu->ip);
+    cpu->ip += d->imm;
+}
+
+static inline void op_call_far(CPU8086* cpu, const DecodedInsn* d) { // 9A
+    push(cpu, cpu->cs);
+    push(cpu, cpu->ip);
+    cpu->cs = d->imm2;
+    cpu->ip = d->imm;
+}
+
+static inline void op_jmp_near(CPU8086* cpu, const DecodedInsn* d) { // E9
+    cpu->ip += d->imm;
+}
+
+static inline void op_jmp_far(CPU8086* cpu, const DecodedInsn* d) { // EA
+    cpu->cs = d->imm2;
+    cpu->ip = d->imm;
+}
+
+static inline void op_jmp_short(CPU8086* cpu, const DecodedInsn* d) { // EB
+    cpu->ip += (int8_t)d->imm;
+}
+
+static inline void op_ret_near(CPU8086* cpu, const DecodedInsn* d) { // C2 imm16, C3 (C0, C1)
+    cpu->ip = pop(cpu);
+    if (!(d->opcode & 1)) cpu->sp += d->imm;
+}
+
+static inline void op_ret_far(CPU8086* cpu, const DecodedInsn* d) { // CA imm16, CB (C8, C9)
+    cpu->ip = pop(cpu);
+    cpu->cs = pop(cpu);
+    if (!(d->opcode & 1)) cpu->sp += d->imm;
+}
+
+static inline void op_int3(CPU8086* cpu, const DecodedInsn* d) { // CC
+    (void)d;
+    interrupt_entry(cpu, 3);
+}
+
+static inline void op_int(CPU8086* cpu, const DecodedInsn* d) { // CD
+    interrupt_entry(cpu, d->imm);
+}
+
+static inline void op_into(CPU8086* cpu, const DecodedInsn* d) { // CE
+    (void)d;
+    if (get_of(cpu)) {
+        cpu->cycles += 49;
+        interrupt_entry(cpu, 4);
     }
-    fseek(file, 0, SEEK_END);
-    size_t size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    if (size > MEMORY_SIZE - 0x0100) {
-        fprintf(stderr, "Firmware too large: %zu bytes\n", size);
-        fclose(file);
-        return 0;
+}
+
+static inline void op_iret(CPU8086* cpu, const DecodedInsn* d) { // CF
+    (void)d;
+    cpu->ip = pop(cpu);
+    cpu->cs = pop(cpu);
+    cpu_set_flags(cpu, pop(cpu));
+}
+
+static inline void op_shift(CPU8086* cpu, const DecodedInsn* d) { // D0-D3
+    uint8_t count = 1;
+    if (d->opcode & 2) {
+        count = cpu->cx & 0xFF;
+        cpu->cycles += 4 * count;
     }
-    size_t read = fread(cpu->memory + 0x0100, 1, size, file);
-    fclose(file);
-    if (read != size) {
-        fprintf(stderr, "Incomplete read: %zu bytes of %zu\n", read, size);
-        return 0;
+    uint16_t offset = ea_offset(cpu, d);
+    if (d->opcode & 1) {
+        rm_write16(cpu, d, offset, shift(cpu, d->reg, rm_read16(cpu, d, offset), count, 1));
+    } else {
+        rm_write8(cpu, d, offset, shift(cpu, d->reg, rm_read8(cpu, d, offset), count, 0));
     }
-    return 1;
 }
 
-void update_flags(CPU8086* cpu, uint16_t result) {
-    cpu->flags.zero = (result == 0);
-    cpu->flags.sign = (result & 0x8000) != 0;
-    cpu->flags.parity = 0;
-    uint8_t low_byte = (uint8_t)result;
-    int parity_count = 0;
-    for (int i = 0; i < 8; i++) {
-        parity_count += (low_byte >> i) & 1;
+static inline void op_xlat(CPU8086* cpu, const DecodedInsn* d) { // D7
+    uint8_t value = read_mem8(cpu, cpu->sregs[d->seg], cpu->bx + (cpu->ax & 0xFF));
+    cpu->ax = (cpu->ax & 0xFF00) | value;
+}
+
+/* String instructions. The source is seg:SI (DS unless overridden), the
+   destination always ES:DI, and both step by the operand size, downwards when
+   DF is set. With REP they run CX times; REPE/REPNE CMPS and SCAS also stop
+   when ZF no longer matches the prefix. */
+
+#define IS_REP(d) ((d)->prefixes & (PREFIX_REP | PREFIX_REPNE))
+
+// Repetitions to run now: CX, but no further than the next device event (and
+// at least one), so an interrupt it raises is taken between repetitions.
+static inline uint32_t rep_count(const CPU8086* cpu, const DecodedInsn* d) {
+    int per_rep = rep_string_cycles(d->opcode);
+    uint64_t room = cpu->cycles < cpu->events.next ? (cpu->events.next - cpu->cycles) / per_rep + 1 : 1;
+    return room < cpu->cx ? (uint32_t)room : cpu->cx;
+}
+
+// Charges n repetitions and, unless they finished the instruction, moves IP
+// back to its first prefix so the run loop can take an interrupt and then
+// restart it with the remaining count. REP string instructions end their
+// block, so nothing after them has been dispatched yet.
+static inline void rep_finish(CPU8086* cpu, const DecodedInsn* d, uint32_t n, int stopped) {
+    cpu->cx -= n;
+    cpu->cycles += (uint64_t)n * rep_string_cycles(d->opcode);
+    if (cpu->cx != 0 && !stopped) cpu->ip -= d->length;
+}
+
+// Host pointer to len bytes at seg:off for a bulk REP, or NULL when they must
+// go through the memory helpers one element at a time: the offset wraps inside
+// the segment, the range crosses the top of memory, a page is not plain RAM
+// (or ROM, when only reading), or a trace or profile is watching accesses.
+// Bulk stores must be reported with cpu_mark_dirty().
+static uint8_t* ram_span(CPU8086* cpu, uint16_t seg, uint16_t off, uint32_t len, int write) {
+    if (off + len > 0x10000 || cpu->trace || cpu->profile) return NULL;
+    uint32_t addr = get_physical_addr(seg, off) & ADDR_MASK;
+    if (addr + len > MEMORY_SIZE) return NULL;
+    uint32_t last = (addr + len - 1) >> MAP_PAGE_SHIFT;
+    for (uint32_t page = addr >> MAP_PAGE_SHIFT; page <= last; page++) {
+        if (!(write ? cpu->map.write[page] : cpu->map.read[page])) return NULL;
     }
-    cpu->flags.parity = (parity_count % 2) == 0;
-    cpu->flags.auxiliary = 0; 
+    return &cpu->memory[addr];
 }
 
+static inline uint16_t load_elem(const uint8_t* p, uint32_t i, int word) {
+    return word ? p[2 * i] | (p[2 * i + 1] << 8) : p[i];
+}
 
-void push(CPU8086* cpu, uint16_t value) {
-    cpu->sp -= 2;
-    uint32_t addr = get_physical_addr(cpu->ss, cpu->sp);
-    if (check_memory_bounds(addr, 2, MEMORY_SIZE)) {
-        cpu->memory[addr] = value & 0xFF;
-        cpu->memory[addr + 1] = (value >> 8) & 0xFF;
+static inline uint16_t string_read(CPU8086* cpu, uint16_t seg, uint16_t off, int word) {
+    return word ? read_mem16(cpu, seg, off) : read_mem8(cpu, seg, off);
+}
+
+static inline void string_write(CPU8086* cpu, uint16_t off, uint16_t value, int word) {
+    if (word) {
+        write_mem16(cpu, cpu->es, off, value);
     } else {
-        fprintf(stderr, "Stack push out of bounds at address 0x%05X\n", addr);
-        cpu->running = 0;
+        write_mem8(cpu, cpu->es, off, value);
     }
 }
 
-uint16_t pop(CPU8086* cpu) {
-    uint32_t addr = get_physical_addr(cpu->ss, cpu->sp);
-    if (!check_memory_bounds(addr, 2, MEMORY_SIZE)) {
-        fprintf(stderr, "Stack pop out of bounds at address 0x%05X\n", addr);
-        cpu->running = 0;
-        return 0;
-    }
-    uint16_t value = cpu->memory[addr] | (cpu->memory[addr + 1] << 8);
-    cpu->sp += 2;
-    return value;
+static inline int string_step(const CPU8086* cpu, int word) {
+    int size = word ? 2 : 1;
+    return cpu->flags.direction ? -size : size;
 }
 
-void handle_interrupt(CPU8086* cpu, uint8_t int_num) {
-    if (!cpu->flags.interrupt) return;
-    push(cpu, cpu->flags.carry | (cpu->flags.zero << 1) | (cpu->flags.sign << 2) |
-               (cpu->flags.overflow << 3) | (cpu->flags.parity << 4) |
-               (cpu->flags.auxiliary << 5) | (cpu->flags.interrupt << 6));
-    push(cpu, cpu->cs);
-    push(cpu, cpu->ip);
-    uint32_t ivt_addr = IVT_BASE + int_num * 4;
-    if (!check_memory_bounds(ivt_addr, 4, MEMORY_SIZE)) {
-        fprintf(stderr, "IVT access out of bounds at address 0x%05X\n", ivt_addr);
-        cpu->running = 0;
-        return;
+static inline void op_movs(CPU8086* cpu, const DecodedInsn* d) { // A4, A5
+    int word = d->opcode & 1;
+    int step = string_step(cpu, word);
+    uint16_t seg = cpu->sregs[d->seg];
+    uint32_t n = 1;
+    if (IS_REP(d)) {
+        if (cpu->cx == 0) return;
+        n = rep_count(cpu, d);
+        uint32_t len = n << word;
+        uint8_t* src = step > 0 ? ram_span(cpu, seg, cpu->si, len, 0) : NULL;
+        uint8_t* dst = src ? ram_span(cpu, cpu->es, cpu->di, len, 1) : NULL;
+        // An element-wise forward copy onto a destination just above its source
+        // repeats the leading bytes, which memmove would not.
+        if (dst && (dst <= src || dst >= src + len)) {
+            memmove(dst, src, len);
+            cpu_mark_dirty(cpu, dst - cpu->memory, len);
+            cpu->si += len;
+            cpu->di += len;
+            rep_finish(cpu, d, n, 0);
+            return;
+        }
     }
-    cpu->ip = cpu->memory[ivt_addr] | (cpu->memory[ivt_addr + 1] << 8);
-    cpu->cs = cpu->memory[ivt_addr + 2] | (cpu->memory[ivt_addr + 3] << 8);
-    cpu->flags.interrupt = 0;
-    cpu->pic_isr |= (1 << IRQ_KEYBOARD);
+    for (uint32_t i = 0; i < n; i++) {
+        string_write(cpu, cpu->di, string_read(cpu, seg, cpu->si, word), word);
+        cpu->si += step;
+        cpu->di += step;
+    }
+    if (IS_REP(d)) rep_finish(cpu, d, n, 0);
 }
 
-void handle_keyboard(CPU8086* cpu) {
-    if (cpu->kb_head != cpu->kb_tail) {
-        cpu->pic_irr |= (1 << IRQ_KEYBOARD);
-        cpu->kb_status |= 0x01;
+static inline void op_stos(CPU8086* cpu, const DecodedInsn* d) { // AA, AB
+    int word = d->opcode & 1;
+    int step = string_step(cpu, word);
+    uint32_t n = 1;
+    if (IS_REP(d)) {
+        if (cpu->cx == 0) return;
+        n = rep_count(cpu, d);
+        uint32_t len = n << word;
+        uint8_t* dst = step > 0 ? ram_span(cpu, cpu->es, cpu->di, len, 1) : NULL;
+        if (dst) {
+            uint8_t lo = cpu->ax & 0xFF, hi = cpu->ax >> 8;
+            if (!word || lo == hi) {
+                memset(dst, lo, len);
+            } else {
+                for (uint32_t i = 0; i < len; i += 2) {
+                    dst[i] = lo;
+                    dst[i + 1] = hi;
+                }
+            }
+            cpu_mark_dirty(cpu, dst - cpu->memory, len);
+            cpu->di += len;
+            rep_finish(cpu, d, n, 0);
+            return;
+        }
     }
-    if (cpu->flags.interrupt && (cpu->pic_irr & ~cpu->pic_imr) & (1 << IRQ_KEYBOARD)) {
-        handle_interrupt(cpu, 9);
-        cpu->pic_irr &= ~(1 << IRQ_KEYBOARD);
+    for (uint32_t i = 0; i < n; i++) {
+        string_write(cpu, cpu->di, cpu->ax, word);
+        cpu->di += step;
     }
+    if (IS_REP(d)) rep_finish(cpu, d, n, 0);
 }
 
-void read_port(CPU8086* cpu, uint16_t port, uint16_t* value) {
-    *value = 0;
-    if (port == KEYBOARD_PORT) {
-        if (cpu->kb_head != cpu->kb_tail) {
-            *value = cpu->keyboard_buffer[cpu->kb_head];
-            cpu->kb_head = (cpu->kb_head + 1) % 256;
-            cpu->kb_status &= ~0x01;
-        } else {
-            cpu->kb_status &= ~0x01;
+static inline void op_lods(CPU8086* cpu, const DecodedInsn* d) { // AC, AD
+    int word = d->opcode & 1;
+    int step = string_step(cpu, word);
+    uint16_t seg = cpu->sregs[d->seg];
+    uint32_t n = 1, loads = 1;
+    uint16_t value = 0;
+    if (IS_REP(d)) {
+        if (cpu->cx == 0) return;
+        n = loads = rep_count(cpu, d);
+        // Only the last element survives in the accumulator.
+        if (step > 0 && ram_span(cpu, seg, cpu->si, n << word, 0)) {
+            cpu->si += (n - 1) << word;
+            loads = 1;
         }
-    } else if (port == KEYBOARD_STATUS) {
-        *value = cpu->kb_status;
-    } else if (port == PIC1_DATA) {
-        *value = cpu->pic_imr;
+    }
+    for (uint32_t i = 0; i < loads; i++) {
+        value = string_read(cpu, seg, cpu->si, word);
+        cpu->si += step;
+    }
+    if (word) {
+        cpu->ax = value;
     } else {
-        fprintf(stderr, "Warning: Attempted to read from unsupported port 0x%04X\n", port);
+        cpu->ax = (cpu->ax & 0xFF00) | value;
     }
+    if (IS_REP(d)) rep_finish(cpu, d, n, 0);
 }
 
-void write_port(CPU8086* cpu, uint16_t port, uint16_t value) {
-    if (port == PIC1_DATA) {
-        cpu->pic_imr = value & 0xFF;
-    } else if (port == PIC1_COMMAND) {
-        if (value == 0x20) {
-            cpu->pic_isr = 0;
-        }
+static inline void op_cmps(CPU8086* cpu, const DecodedInsn* d) { // A6, A7
+    int word = d->opcode & 1;
+    int step = string_step(cpu, word);
+    uint16_t seg = cpu->sregs[d->seg];
+    int repe = !(d->prefixes & PREFIX_REPNE);
+    if (!IS_REP(d)) {
+        alu(cpu, ALU_CMP, string_read(cpu, seg, cpu->si, word), string_read(cpu, cpu->es, cpu->di, word), word);
+        cpu->si += step;
+        cpu->di += step;
+        return;
+    }
+    if (cpu->cx == 0) return;
+    uint32_t n = rep_count(cpu, d);
+    uint32_t len = n << word;
+    const uint8_t* src = step > 0 ? ram_span(cpu, seg, cpu->si, len, 0) : NULL;
+    const uint8_t* dst = src ? ram_span(cpu, cpu->es, cpu->di, len, 0) : NULL;
+    uint32_t i = 0;
+    uint16_t a, b;
+    if (dst) {
+        // Find the first element that ends the repeat, then compare it once
+        // through the ALU for the flags.
+        do {
+            a = load_elem(src, i, word);
+            b = load_elem(dst, i, word);
+            i++;
+        } while (i < n && (a == b) == repe);
+        alu(cpu, ALU_CMP, a, b, word);
+        cpu->si += i << word;
+        cpu->di += i << word;
     } else {
-        fprintf(stderr, "Warning: Attempted to write to unsupported port 0x%04X\n", port);
+        do {
+            a = string_read(cpu, seg, cpu->si, word);
+            b = string_read(cpu, cpu->es, cpu->di, word);
+            alu(cpu, ALU_CMP, a, b, word);
+            cpu->si += step;
+            cpu->di += step;
+            i++;
+        } while (i < n && (a == b) == repe);
     }
+    rep_finish(cpu, d, i, (a == b) != repe);
 }
 
-void execute_instruction(CPU8086* cpu) {
-    if (!cpu->running) return;
+static inline void op_scas(CPU8086* cpu, const DecodedInsn* d) { // AE, AF
+    int word = d->opcode & 1;
+    int step = string_step(cpu, word);
+    int repe = !(d->prefixes & PREFIX_REPNE);
+    uint16_t acc = word ? cpu->ax : cpu->ax & 0xFF;
+    if (!IS_REP(d)) {
+        alu(cpu, ALU_CMP, acc, string_read(cpu, cpu->es, cpu->di, word), word);
+        cpu->di += step;
+        return;
+    }
+    if (cpu->cx == 0) return;
+    uint32_t n = rep_count(cpu, d);
+    uint32_t len = n << word;
+    const uint8_t* dst = step > 0 ? ram_span(cpu, cpu->es, cpu->di, len, 0) : NULL;
+    uint32_t i = 0;
+    uint16_t b;
+    if (dst && !word && !repe) {
+        const uint8_t* hit = memchr(dst, acc, n);
+        i = hit ? (uint32_t)(hit - dst) + 1 : n;
+        b = dst[i - 1];
+        alu(cpu, ALU_CMP, acc, b, word);
+        cpu->di += i;
+    } else if (dst) {
+        do {
+            b = load_elem(dst, i, word);
+            i++;
+        } while (i < n && (acc == b) == repe);
+        alu(cpu, ALU_CMP, acc, b, word);
+        cpu->di += i << word;
+    } else {
+        do {
+            b = string_read(cpu, cpu->es, cpu->di, word);
+            alu(cpu, ALU_CMP, acc, b, word);
+            cpu->di += step;
+            i++;
+        } while (i < n && (acc == b) == repe);
+    }
+    rep_finish(cpu, d, i, (acc == b) != repe);
+}
+
+static inline void op_loop(CPU8086* cpu, const DecodedInsn* d) { // E0 LOOPNE, E1 LOOPE, E2 LOOP
+    cpu->cx--;
+    int taken = cpu->cx != 0;
+    if (d->opcode == 0xE0) taken &= !get_zf(cpu);
+    if (d->opcode == 0xE1) taken &= get_zf(cpu);
+    if (taken) {
+        cpu->ip += (int8_t)d->imm;
+        cpu->cycles += branch_taken_cycles(d->opcode);
+    }
+}
 
-    handle_keyboard(cpu);
+static inline void op_jcxz(CPU8086* cpu, const DecodedInsn* d) { // E3
+    if (cpu->cx == 0) {
+        cpu->ip += (int8_t)d->imm;
+        cpu->cycles += branch_taken_cycles(d->opcode);
+    }
+}
 
-    uint32_t addr = get_physical_addr(cpu->cs, cpu->ip);
-    if (!check_memory_bounds(addr, 1, MEMORY_SIZE)) {
-        fprintf(stderr, "IP out of memory bounds: 0x%05X\n", addr);
-        cpu->running = 0;
-        return;
+static inline void op_in(CPU8086* cpu, const DecodedInsn* d) { // E4, E5 imm8; EC, ED DX
+    uint16_t port = (d->opcode & 0x08) ? cpu->dx : d->imm;
+    uint16_t value = read_port(cpu, port, d->opcode & 1);
+    if (d->opcode & 1) {
+        cpu->ax = value;
+    } else {
+        cpu->ax = (cpu->ax & 0xFF00) | (value & 0xFF);
     }
+}
 
-    uint8_t opcode = cpu->memory[addr];
-    cpu->last_instruction = opcode;
-    cpu->ip++;
+static inline void op_out(CPU8086* cpu, const DecodedInsn* d) { // E6, E7 imm8; EE, EF DX
+    uint16_t port = (d->opcode & 0x08) ? cpu->dx : d->imm;
+    write_port(cpu, port, cpu->ax, d->opcode & 1);
+}
 
-    uint8_t modrm; // Declare modrm once for all instructions
+static inline void op_hlt(CPU8086* cpu, const DecodedInsn* d) { // F4
+    (void)d;
+    // Wait for an interrupt; service_pending stops the CPU if nothing can
+    // raise one. With interrupts off nothing could ever resume it.
+    if (cpu->flags.interrupt) {
+        cpu->halted = 1;
+        cpu->pending |= PENDING_HALT;
+    } else {
+        cpu_stop(cpu, STOP_HLT);
+    }
+}
 
-    switch (opcode) {
-        case 0xB8: // MOV AX, imm16
-            if (!check_memory_bounds(addr, 3, MEMORY_SIZE)) {
-                fprintf(stderr, "Insufficient memory for MOV AX, imm16 at 0x%05X\n", addr);
-                cpu->running = 0;
-                return;
-            }
-            cpu->ax = cpu->memory[addr + 1] | (cpu->memory[addr + 2] << 8);
-            cpu->ip += 2;
-            update_flags(cpu, cpu->ax);
-            break;
-        case 0xB9: // MOV CX, imm16
-            if (!check_memory_bounds(addr, 3, MEMORY_SIZE)) {
-                fprintf(stderr, "Insufficient memory for MOV CX, imm16 at 0x%05X\n", addr);
-                cpu->running = 0;
-                return;
-            }
-            cpu->cx = cpu->memory[addr + 1] | (cpu->memory[addr + 2] << 8);
-            cpu->ip += 2;
-            update_flags(cpu, cpu->cx);
-            break;
-        case 0xBA: // MOV DX, imm16
-            if (!check_memory_bounds(addr, 3, MEMORY_SIZE)) {
-                fprintf(stderr, "Insufficient memory for MOV DX, imm16 at 0x%05X\n", addr);
-                cpu->running = 0;
-                return;
-            }
-            cpu->dx = cpu->memory[addr + 1] | (cpu->memory[addr + 2] << 8);
-            cpu->ip += 2;
-            update_flags(cpu, cpu->dx);
-            break;
-        case 0xBB: // MOV BX, imm16
-            if (!check_memory_bounds(addr, 3, MEMORY_SIZE)) {
-                fprintf(stderr, "Insufficient memory for MOV BX, imm16 at 0x%05X\n", addr);
-                cpu->running = 0;
-                return;
-            }
-            cpu->bx = cpu->memory[addr + 1] | (cpu->memory[addr + 2] << 8);
-            cpu->ip += 2;
-            update_flags(cpu, cpu->bx);
-            break;
-        case 0xBE: // MOV SI, imm16
-            if (!check_memory_bounds(addr, 3, MEMORY_SIZE)) {
-                fprintf(stderr, "Insufficient memory for MOV SI, imm16 at 0x%05X\n", addr);
-                cpu->running = 0;
-                return;
-            }
-            cpu->si = cpu->memory[addr + 1] | (cpu->memory[addr + 2] << 8);
-            cpu->ip += 2;
-            update_flags(cpu, cpu->si);
-            break;
-        case 0xBF: // MOV DI, imm16
-            if (!check_memory_bounds(addr, 3, MEMORY_SIZE)) {
-                fprintf(stderr, "Insufficient memory for MOV DI, imm16 at 0x%05X\n", addr);
-                cpu->running = 0;
-                return;
-            }
-            cpu->di = cpu->memory[addr + 1] | (cpu->memory[addr + 2] << 8);
-            cpu->ip += 2;
-            update_flags(cpu, cpu->di);
+static inline void op_cmc(CPU8086* cpu, const DecodedInsn* d) { // F5
+    (void)d;
+    cpu_sync_flags(cpu);
+    cpu->flags.carry = !cpu->flags.carry;
+}
+
+static inline void op_grp3(CPU8086* cpu, const DecodedInsn* d) { // F6, F7
+    uint16_t offset = ea_offset(cpu, d);
+    int word = d->opcode & 1;
+    uint16_t value = word ? rm_read16(cpu, d, offset) : rm_read8(cpu, d, offset);
+    switch (d->reg) {
+        case 0:
+        case 1: // TEST r/m, imm
+            alu(cpu, ALU_AND, value, d->imm, word);
+            return;
+        case 2: // NOT
+            value = ~value;
             break;
-        case 0x8E: // MOV segment_reg, AX
-            if (!check_memory_bounds(addr, 2, MEMORY_SIZE)) {
-                fprintf(stderr, "Insufficient memory for MOV segment_reg, AX at 0x%05X\n", addr);
-                cpu->running = 0;
-                return;
-            }
-            modrm = cpu->memory[addr + 1];
-            switch (modrm) {
-                case 0xD8:
-                    cpu->ds = cpu->ax;
-                    cpu->ip++;
-                    break;
-                case 0xC0:
-                    cpu->es = cpu->ax;
-                    cpu->ip++;
-                    break;
-                case 0xD0:
-                    cpu->ss = cpu->ax;
-                    cpu->ip++;
-                    break;
-                default:
-                    fprintf(stderr, "Unknown operand for MOV: 0x%02X at 0x%05X\n", modrm, addr);
-                    cpu->running = 0;
-            }
+        case 3: // NEG
+            value = alu(cpu, ALU_SUB, 0, value, word);
             break;
-        case 0xC7: // MOV [mem], imm16
-            if (!check_memory_bounds(addr, 6, MEMORY_SIZE)) {
-                fprintf(stderr, "Insufficient memory for MOV [mem], imm16 at 0x%05X\n", addr);
-                cpu->running = 0;
-                return;
-            }
-            modrm = cpu->memory[addr + 1];
-            if (modrm == 0x06) { // Direct address
-                uint16_t mem_addr = cpu->memory[addr + 2] | (cpu->memory[addr + 3] << 8);
-                uint16_t val = cpu->memory[addr + 4] | (cpu->memory[addr + 5] << 8);
-                uint32_t phys_addr = get_physical_addr(cpu->ds, mem_addr);
-                if (check_memory_bounds(phys_addr, 2, MEMORY_SIZE)) {
-                    cpu->memory[phys_addr] = val & 0xFF;
-                    cpu->memory[phys_addr + 1] = (val >> 8) & 0xFF;
-                    cpu->ip += 5;
-                } else {
-                    fprintf(stderr, "Address out of memory: 0x%05X\n", phys_addr);
-                    cpu->running = 0;
-                }
-            } else if (modrm == 0x04) { // Addressing via SI
-                uint16_t val = cpu->memory[addr + 2] | (cpu->memory[addr + 3] << 8);
-                uint32_t phys_addr = get_physical_addr(cpu->ds, cpu->si);
-                if (check_memory_bounds(phys_addr, 2, MEMORY_SIZE)) {
-                    cpu->memory[phys_addr] = val & 0xFF;
-                    cpu->memory[phys_addr + 1] = (val >> 8) & 0xFF;
-                    cpu->ip += 3;
-                } else {
-                    fprintf(stderr, "Address out of memory: 0x%05X\n", phys_addr);
-                    cpu->running = 0;
-                }
+        case 4: // MUL
+            cpu_sync_flags(cpu);
+            if (word) {
+                uint32_t r = (uint32_t)cpu->ax * value;
+                cpu->ax = r & 0xFFFF;
+                cpu->dx = r >> 16;
+                cpu->flags.carry = cpu->flags.overflow = cpu->dx != 0;
             } else {
-                fprintf(stderr, "Unknown operand for MOV: 0x%02X at 0x%05X\n", modrm, addr);
-                cpu->running = 0;
+                cpu->ax = (cpu->ax & 0xFF) * value;
+                cpu->flags.carry = cpu->flags.overflow = (cpu->ax >> 8) != 0;
             }
-            break;
-        case 0x89: // MOV [mem], reg
-            if (!check_memory_bounds(addr, 4, MEMORY_SIZE)) {
-                fprintf(stderr, "Insufficient memory for MOV [mem], reg at 0x%05X\n", addr);
-                cpu->running = 0;
-                return;
-            }
-            modrm = cpu->memory[addr + 1];
-            if (modrm == 0x06) {
-                uint16_t mem_addr = cpu->memory[addr + 2] | (cpu->memory[addr + 3] << 8);
-                uint32_t phys_addr = get_physical_addr(cpu->ds, mem_addr);
-                if (check_memory_bounds(phys_addr, 2, MEMORY_SIZE)) {
-                    uint16_t val = cpu->ax; // Assuming AX for simplicity
-                    cpu->memory[phys_addr] = val & 0xFF;
-                    cpu->memory[phys_addr + 1] = (val >> 8) & 0xFF;
-                    cpu->ip += 3;
-                } else {
-                    fprintf(stderr, "Address out of memory: 0x%05X\n", phys_addr);
-                    cpu->running = 0;
-                }
+            return;
+        case 5: // IMUL
+            cpu_sync_flags(cpu);
+            if (word) {
+                int32_t r = (int32_t)(int16_t)cpu->ax * (int16_t)value;
+                cpu->ax = r & 0xFFFF;
+                cpu->dx = (uint32_t)r >> 16;
+                cpu->flags.carry = cpu->flags.overflow = r != (int16_t)r;
             } else {
-                fprintf(stderr, "Unknown operand for MOV: 0x%02X at 0x%05X\n", modrm, addr);
-                cpu->running = 0;
-            }
-            break;
-        case 0x8B: // MOV reg, [mem]
-            if (!check_memory_bounds(addr, 4, MEMORY_SIZE)) {
-                fprintf(stderr, "Insufficient memory for MOV reg, [mem] at 0x%05X\n", addr);
-                cpu->running = 0;
-                return;
+                int16_t r = (int16_t)(int8_t)(cpu->ax & 0xFF) * (int8_t)value;
+                cpu->ax = r;
+                cpu->flags.carry = cpu->flags.overflow = r != (int8_t)r;
             }
-            modrm = cpu->memory[addr + 1];
-            if (modrm == 0x06) {
-                uint16_t mem_addr = cpu->memory[addr + 2] | (cpu->memory[addr + 3] << 8);
-                uint32_t phys_addr = get_physical_addr(cpu->ds, mem_addr);
-                if (check_memory_bounds(phys_addr, 2, MEMORY_SIZE)) {
-                    cpu->ax = cpu->memory[phys_addr] | (cpu->memory[phys_addr + 1] << 8);
-                    cpu->ip += 3;
-                    update_flags(cpu, cpu->ax);
-                } else {
-                    fprintf(stderr, "Address out of memory: 0x%05X\n", phys_addr);
-                    cpu->running = 0;
+            return;
+        case 6: // DIV
+            if (word) {
+                uint32_t dividend = ((uint32_t)cpu->dx << 16) | cpu->ax;
+                if (value == 0 || dividend / value > 0xFFFF) {
+                    interrupt_entry(cpu, 0);
+                    return;
                 }
+                cpu->ax = dividend / value;
+                cpu->dx = dividend % value;
             } else {
-                fprintf(stderr, "Unknown operand for MOV: 0x%02X at 0x%05X\n", modrm, addr);
-                cpu->running = 0;
-            }
-            break;
-        case 0x03: // ADD AX, [mem]
-            if (!check_memory_bounds(addr, 4, MEMORY_SIZE)) {
-                fprintf(stderr, "Insufficient memory for ADD AX, [mem] at 0x%05X\n", addr);
-                cpu->running = 0;
-                return;
-            }
-            modrm = cpu->memory[addr + 1];
-            if (modrm == 0x06) { // Direct address
-                uint16_t mem_addr = cpu->memory[addr + 2] | (cpu->memory[addr + 3] << 8);
-                uint32_t phys_addr = get_physical_addr(cpu->ds, mem_addr);
-                if (check_memory_bounds(phys_addr, 2, MEMORY_SIZE)) {
-                    uint16_t val = cpu->memory[phys_addr] | (cpu->memory[phys_addr + 1] << 8);
-                    uint32_t result = cpu->ax + val;
-                    cpu->flags.carry = (result > 0xFFFF) ? 1 : 0;
-                    cpu->ax = result & 0xFFFF;
-                    cpu->ip += 3;
-                    update_flags(cpu, cpu->ax);
-                } else {
-                    fprintf(stderr, "Address out of memory: 0x%05X\n", phys_addr);
-                    cpu->running = 0;
-                }
-            } else if (modrm == 0x04) { // Addressing via SI
-                uint32_t phys_addr = get_physical_addr(cpu->ds, cpu->si);
-                if (check_memory_bounds(phys_addr, 2, MEMORY_SIZE)) {
-                    uint16_t val = cpu->memory[phys_addr] | (cpu->memory[phys_addr + 1] << 8);
-                    uint32_t result = cpu->ax + val;
-                    cpu->flags.carry = (result > 0xFFFF) ? 1 : 0;
-                    cpu->ax = result & 0xFFFF;
-                    cpu->ip += 1; // Only 2 bytes: opcode + ModR/M
-                    update_flags(cpu, cpu->ax);
-                } else {
-                    fprintf(stderr, "Address out of memory: 0x%05X\n", phys_addr);
-                    cpu->running = 0;
+                if (value == 0 || cpu->ax / value > 0xFF) {
+                    interrupt_entry(cpu, 0);
+                    return;
                 }
-            } else {
-                fprintf(stderr, "Unknown operand for ADD: 0x%02X at 0x%05X\n", modrm, addr);
-                cpu->running = 0;
+                cpu->ax = ((cpu->ax % value) << 8) | (cpu->ax / value);
             }
-            break;
-        case 0x2B: // SUB AX, [mem]
-            if (!check_memory_bounds(addr, 4, MEMORY_SIZE)) {
-                fprintf(stderr, "Insufficient memory for SUB AX, [mem] at 0x%05X\n", addr);
-                cpu->running = 0;
-                return;
-            }
-            modrm = cpu->memory[addr + 1];
-            if (modrm == 0x06) {
-                uint16_t mem_addr = cpu->memory[addr + 2] | (cpu->memory[addr + 3] << 8);
-                uint32_t phys_addr = get_physical_addr(cpu->ds, mem_addr);
-                if (check_memory_bounds(phys_addr, 2, MEMORY_SIZE)) {
-                    uint16_t val = cpu->memory[phys_addr] | (cpu->memory[phys_addr + 1] << 8);
-                    int32_t result = cpu->ax - val;
-                    cpu->flags.carry = (result < 0) ? 1 : 0;
-                    cpu->ax = result & 0xFFFF;
-                    cpu->ip += 3;
-                    update_flags(cpu, cpu->ax);
-                } else {
-                    fprintf(stderr, "Address out of memory: 0x%05X\n", phys_addr);
-                    cpu->running = 0;
+            return;
+        default: // IDIV
+            if (word) {
+                int32_t dividend = (int32_t)(((uint32_t)cpu->dx << 16) | cpu->ax);
+                int32_t divisor = (int16_t)value;
+                if (divisor == 0 || (dividend == INT32_MIN && divisor == -1)) {
+                    interrupt_entry(cpu, 0);
+                    return;
                 }
-            } else {
-                fprintf(stderr, "Unknown operand for SUB: 0x%02X at 0x%05X\n", modrm, addr);
-                cpu->running = 0;
-            }
-            break;
-        case 0x05: // ADD AX, imm16
-            if (!check_memory_bounds(addr, 3, MEMORY_SIZE)) {
-                fprintf(stderr, "Insufficient memory for ADD AX, imm16 at 0x%05X\n", addr);
-                cpu->running = 0;
-                return;
-            }
-            uint16_t imm16 = cpu->memory[addr + 1] | (cpu->memory[addr + 2] << 8);
-            uint32_t result = cpu->ax + imm16;
-            cpu->flags.carry = (result > 0xFFFF) ? 1 : 0;
-            cpu->ax = result & 0xFFFF;
-            cpu->ip += 2;
-            update_flags(cpu, cpu->ax);
-            break;
-        case 0x2D: // SUB AX, imm16
-            if (!check_memory_bounds(addr, 3, MEMORY_SIZE)) {
-                fprintf(stderr, "Insufficient memory for SUB AX, imm16 at 0x%05X\n", addr);
-                cpu->running = 0;
-                return;
-            }
-            imm16 = cpu->memory[addr + 1] | (cpu->memory[addr + 2] << 8);
-            int32_t result_sub = cpu->ax - imm16;
-            cpu->flags.carry = (result_sub < 0) ? 1 : 0;
-            cpu->ax = result_sub & 0xFFFF;
-            cpu->ip += 2;
-            update_flags(cpu, cpu->ax);
-            break;
-        case 0xEB: // JMP short imm8
-            if (!check_memory_bounds(addr, 2, MEMORY_SIZE)) {
-                fprintf(stderr, "Insufficient memory for JMP short imm8 at 0x%05X\n", addr);
-                cpu->running = 0;
-                return;
-            }
-            int8_t offset = (int8_t)cpu->memory[addr + 1];
-            cpu->ip += offset + 1;
-            break;
-        case 0x74: // JE imm8
-            if (!check_memory_bounds(addr, 2, MEMORY_SIZE)) {
-                fprintf(stderr, "Insufficient memory for JE imm8 at 0x%05X\n", addr);
-                cpu->running = 0;
-                return;
-            }
-            int8_t je_offset = (int8_t)cpu->memory[addr + 1];
-            if (cpu->flags.zero) {
-                cpu->ip += je_offset + 1;
-            } else {
-                cpu->ip++;
-            }
-            break;
-        case 0x75: // JNE imm8
-            if (!check_memory_bounds(addr, 2, MEMORY_SIZE)) {
-                fprintf(stderr, "Insufficient memory for JNE imm8 at 0x%05X\n", addr);
-                cpu->running = 0;
-                return;
-            }
-            int8_t jne_offset = (int8_t)cpu->memory[addr + 1];
-            if (!cpu->flags.zero) {
-                cpu->ip += jne_offset + 1;
-            } else {
-                cpu->ip++;
-            }
-            break;
-        case 0x72: // JC imm8
-            if (!check_memory_bounds(addr, 2, MEMORY_SIZE)) {
-                fprintf(stderr, "Insufficient memory for JC imm8 at 0x%05X\n", addr);
-                cpu->running = 0;
-                return;
-            }
-            int8_t jc_offset = (int8_t)cpu->memory[addr + 1];
-            if (cpu->flags.carry) {
-                cpu->ip += jc_offset + 1;
-            } else {
-                cpu->ip++;
-            }
-            break;
-        case 0x73: // JNC imm8
-            if (!check_memory_bounds(addr, 2, MEMORY_SIZE)) {
-                fprintf(stderr, "Insufficient memory for JNC imm8 at 0x%05X\n", addr);
-                cpu->running = 0;
-                return;
-            }
-            int8_t jnc_offset = (int8_t)cpu->memory[addr + 1];
-            if (!cpu->flags.carry) {
-                cpu->ip += jnc_offset + 1;
-            } else {
-                cpu->ip++;
-            }
-            break;
-        case 0xF4: // HLT
-            cpu->running = 0;
-            break;
-        case 0x83: // CMP reg, imm8
-            if (!check_memory_bounds(addr, 3, MEMORY_SIZE)) {
-                fprintf(stderr, "Insufficient memory for CMP reg, imm8 at 0x%05X\n", addr);
-                cpu->running = 0;
-                return;
-            }
-            modrm = cpu->memory[addr + 1];
-            int8_t imm8 = (int8_t)cpu->memory[addr + 2];
-            if ((modrm & 0xF8) == 0xF8) {
-                int32_t result = cpu->ax - imm8;
-                cpu->flags.zero = (result == 0);
-                cpu->flags.sign = (result & 0x8000) != 0;
-                cpu->flags.carry = (result < 0) ? 1 : 0;
-                cpu->flags.parity = 0;
-                uint8_t low_byte = result & 0xFF;
-                for (int i = 0; i < 8; i++) {
-                    cpu->flags.parity ^= (low_byte >> i) & 1;
+                int32_t q = dividend / divisor;
+                if (q > 32767 || q < -32767) {
+                    interrupt_entry(cpu, 0);
+                    return;
                 }
-                cpu->ip += 2;
+                cpu->ax = q;
+                cpu->dx = dividend % divisor;
             } else {
-                fprintf(stderr, "Unsupported ModR/M for 0x83: 0x%02X at 0x%05X\n", modrm, addr);
-                cpu->running = 0;
-            }
-            break;
-        case 0x3B: // CMP AX, [mem]
-            if (!check_memory_bounds(addr, 4, MEMORY_SIZE)) {
-                fprintf(stderr, "Insufficient memory for CMP AX, [mem] at 0x%05X\n", addr);
-                cpu->running = 0;
-                return;
-            }
-            modrm = cpu->memory[addr + 1];
-            if (modrm == 0x06) {
-                uint16_t mem_addr = cpu->memory[addr + 2] | (cpu->memory[addr + 3] << 8);
-                uint32_t phys_addr = get_physical_addr(cpu->ds, mem_addr);
-                if (check_memory_bounds(phys_addr, 2, MEMORY_SIZE)) {
-                    uint16_t val = cpu->memory[phys_addr] | (cpu->memory[phys_addr + 1] << 8);
-                    int32_t result = cpu->ax - val;
-                    cpu->flags.zero = (result == 0);
-                    cpu->flags.sign = (result & 0x8000) != 0;
-                    cpu->flags.carry = (result < 0) ? 1 : 0;
-                    cpu->flags.parity = 0;
-                    uint8_t low_byte = result & 0xFF;
-                    for (int i = 0; i < 8; i++) {
-                        cpu->flags.parity ^= (low_byte >> i) & 1;
-                    }
-                    cpu->ip += 3;
-                } else {
-                    fprintf(stderr, "Address out of memory: 0x%05X\n", phys_addr);
-                    cpu->running = 0;
+                int16_t dividend = (int16_t)cpu->ax;
+                int16_t divisor = (int8_t)value;
+                if (divisor == 0) {
+                    interrupt_entry(cpu, 0);
+                    return;
                 }
-            } else {
-                fprintf(stderr, "Unknown operand for CMP: 0x%02X at 0x%05X\n", modrm, addr);
-                cpu->running = 0;
-            }
-            break;
-        case 0xE4: // IN AL, imm8
-            if (!check_memory_bounds(addr, 2, MEMORY_SIZE)) {
-                fprintf(stderr, "Insufficient memory for IN AL, imm8 at 0x%05X\n", addr);
-                cpu->running = 0;
-                return;
-            }
-            uint16_t port = cpu->memory[addr + 1];
-            uint16_t value;
-            read_port(cpu, port, &value);
-            cpu->ax = (cpu->ax & 0xFF00) | (value & 0xFF);
-            cpu->ip++;
-            update_flags(cpu, cpu->ax);
-            break;
-        case 0xE5: // IN AX, imm8
-            if (!check_memory_bounds(addr, 2, MEMORY_SIZE)) {
-                fprintf(stderr, "Insufficient memory for IN AX, imm8 at 0x%05X\n", addr);
-                cpu->running = 0;
-                return;
-            }
-            port = cpu->memory[addr + 1];
-            read_port(cpu, port, &value);
-            cpu->ax = value;
-            cpu->ip++;
-            update_flags(cpu, cpu->ax);
-            break;
-        case 0xE6: // OUT imm8, AL
-            if (!check_memory_bounds(addr, 2, MEMORY_SIZE)) {
-                fprintf(stderr, "Insufficient memory for OUT imm8, AL at 0x%05X\n", addr);
-                cpu->running = 0;
-                return;
+                int16_t q = dividend / divisor;
+                if (q > 127 || q < -127) {
+                    interrupt_entry(cpu, 0);
+                    return;
+                }
+                cpu->ax = ((uint8_t)(dividend % divisor) << 8) | (uint8_t)q;
             }
-            port = cpu->memory[addr + 1];
-            write_port(cpu, port, cpu->ax & 0xFF);
-            cpu->ip++;
+            return;
+    }
+    if (word) {
+        rm_write16(cpu, d, offset, value);
+    } else {
+        rm_write8(cpu, d, offset, value);
+    }
+}
+
+static inline void op_clc(CPU8086* cpu, const DecodedInsn* d) { // F8
+    (void)d;
+    cpu_sync_flags(cpu);
+    cpu->flags.carry = 0;
+}
+
+static inline void op_stc(CPU8086* cpu, const DecodedInsn* d) { // F9
+    (void)d;
+    cpu_sync_flags(cpu);
+    cpu->flags.carry = 1;
+}
+
+static inline void op_cli(CPU8086* cpu, const DecodedInsn* d) { // FA
+    (void)d;
+    cpu->flags.interrupt = 0;
+    update_irq(cpu);
+}
+
+static inline void op_sti(CPU8086* cpu, const DecodedInsn* d) { // FB
+    (void)d;
+    cpu->flags.interrupt = 1;
+    update_irq(cpu);
+}
+
+static inline void op_cld(CPU8086* cpu, const DecodedInsn* d) { // FC
+    (void)d;
+    cpu->flags.direction = 0;
+}
+
+static inline void op_std(CPU8086* cpu, const DecodedInsn* d) { // FD
+    (void)d;
+    cpu->flags.direction = 1;
+}
+
+static inline void op_grp4(CPU8086* cpu, const DecodedInsn* d) { // FE: INC/DEC r/m8
+    if (d->reg > 1) {
+        op_unknown(cpu, d);
+        return;
+    }
+    uint16_t offset = ea_offset(cpu, d);
+    rm_write8(cpu, d, offset, inc_dec(cpu, rm_read8(cpu, d, offset), d->reg, 0));
+}
+
+static inline void op_grp5(CPU8086* cpu, const DecodedInsn* d) { // FF
+    uint16_t offset = ea_offset(cpu, d);
+    uint16_t value = rm_read16(cpu, d, offset);
+    switch (d->reg) {
+        case 0: // INC r/m16
+        case 1: // DEC r/m16
+            rm_write16(cpu, d, offset, inc_dec(cpu, value, d->reg, 1));
             break;
-        case 0xE7: // OUT imm8, AX
-            if (!check_memory_bounds(addr, 2, MEMORY_SIZE)) {
-                fprintf(stderr, "Insufficient memory for OUT imm8, AX at 0x%05X\n", addr);
-                cpu->running = 0;
-                return;
-            }
-            port = cpu->memory[addr + 1];
-            write_port(cpu, port, cpu->ax);
-            cpu->ip++;
+        case 2: // CALL r/m16
+            push(cpu, cpu->ip);
+            cpu->ip = value;
             break;
-        case 0xFA: // CLI
-            cpu->flags.interrupt = 0;
+        case 3: // CALL m16:16
+            push(cpu, cpu->cs);
+            push(cpu, cpu->ip);
+            cpu->ip = value;
+            cpu->cs = read_mem16(cpu, cpu->sregs[d->seg], offset + 2);
             break;
-        case 0xFB: // STI
-            cpu->flags.interrupt = 1;
+        case 4: // JMP r/m16
+            cpu->ip = value;
             break;
-        case 0xCF: // IRET
-            cpu->ip = pop(cpu);
-            cpu->cs = pop(cpu);
-            uint16_t flags_val = pop(cpu);
-            cpu->flags.carry = flags_val & 0x01;
-            cpu->flags.zero = (flags_val >> 1) & 0x01;
-            cpu->flags.sign = (flags_val >> 2) & 0x01;
-            cpu->flags.overflow = (flags_val >> 3) & 0x01;
-            cpu->flags.parity = (flags_val >> 4) & 0x01;
-            cpu->flags.auxiliary = (flags_val >> 5) & 0x01;
-            cpu->flags.interrupt = (flags_val >> 6) & 0x01;
-            cpu->pic_isr = 0;
+        case 5: // JMP m16:16
+            cpu->ip = value;
+            cpu->cs = read_mem16(cpu, cpu->sregs[d->seg], offset + 2);
             break;
-		case 0xBC: // MOV SP, imm16
-		    if (!check_memory_bounds(addr, 3, MEMORY_SIZE)) {
-		        fprintf(stderr, "Insufficient memory for MOV SP, imm16 at 0x%05X\n", addr);
-		        cpu->running = 0;
-		        return;
-		    }
-		    cpu->sp = cpu->memory[addr + 1] | (cpu->memory[addr + 2] << 8);
-		    cpu->ip += 2;
-		    update_flags(cpu, cpu->sp);
-		    break;
-        case 0x01: // ADD r/m16, r16
-            if (!check_memory_bounds(addr, 2, MEMORY_SIZE)) {
-                fprintf(stderr, "Insufficient memory for ADD r/m16, r16 at 0x%05X\n", addr);
-                cpu->running = 0;
-                return;
-            }
-            modrm = cpu->memory[addr + 1];
-            if (modrm == 0x06) { // Direct address: ADD [mem], AX
-                if (!check_memory_bounds(addr, 4, MEMORY_SIZE)) {
-                    fprintf(stderr, "Insufficient memory for ADD [mem], AX at 0x%05X\n", addr);
-                    cpu->running = 0;
-                    return;
-                }
-                uint16_t mem_addr = cpu->memory[addr + 2] | (cpu->memory[addr + 3] << 8);
-                uint32_t phys_addr = get_physical_addr(cpu->ds, mem_addr);
-                if (check_memory_bounds(phys_addr, 2, MEMORY_SIZE)) {
-                    uint16_t val = cpu->memory[phys_addr] | (cpu->memory[phys_addr + 1] << 8);
-                    uint32_t result = val + cpu->ax;
-                    cpu->flags.carry = (result > 0xFFFF) ? 1 : 0;
-                    cpu->memory[phys_addr] = result & 0xFF;
-                    cpu->memory[phys_addr + 1] = (result >> 8) & 0xFF;
-                    cpu->ip += 3;
-                    update_flags(cpu, result & 0xFFFF);
-                } else {
-                    fprintf(stderr, "Address out of memory: 0x%05X\n", phys_addr);
-                    cpu->running = 0;
-                }
-            } else {
-                fprintf(stderr, "Unknown operand for ADD: 0x%02X at 0x%05X\n", modrm, addr);
-                cpu->running = 0;
-            }
+        case 6: // PUSH r/m16
+            push(cpu, value);
             break;
         default:
-            fprintf(stderr, "Unknown instruction: 0x%02X at 0x%05X\n", opcode, addr);
-            cpu->running = 0;
+            op_unknown(cpu, d);
             break;
     }
 }
 
-void draw_screen(CPU8086* cpu, int screen_x, int screen_y, int char_width, int char_height, Font font) {
-    for (int y = 0; y < SCREEN_HEIGHT; y++) {
-        for (int x = 0; x < SCREEN_WIDTH; x++) {
-            int mem_offset = VIDEO_MEMORY + (y * SCREEN_WIDTH + x) * 2;
-            uint8_t ch = cpu->memory[mem_offset];
-            uint8_t attr = cpu->memory[mem_offset + 1];
-            Color fg_color = (attr == 0x07) ? WHITE : (attr == 0x70) ? BLACK : WHITE;
-            Color bg_color = (attr == 0x07) ? BLACK : (attr == 0x70) ? WHITE : BLACK;
-            DrawRectangle(screen_x + x * char_width, screen_y + y * char_height, 
-                          char_width, char_height, bg_color);
-            if (ch >= 32 && ch <= 126) {
-                DrawTextEx(font, TextFormat("%c", ch), 
-                           (Vector2){screen_x + x * char_width, screen_y + y * char_height}, 
-                           char_height, 1, fg_color);
+/* Distinct handlers; the threaded dispatcher emits one label per entry. */
+#define HANDLER_LIST(X) \
+    X(unknown) X(alu_rm) X(alu_acc_imm) X(push_sreg) X(pop_sreg) X(inc_r16) X(dec_r16) \
+    X(push_r16) X(pop_r16) X(jcc) X(grp1) X(test_rm) X(xchg_rm) X(mov_rm_reg) \
+    X(mov_reg_rm) X(mov_rm_sreg) X(lea) X(mov_sreg_rm) X(pop_rm) X(xchg_ax) X(cbw) X(cwd) \
+    X(call_far) X(pushf) X(popf) X(sahf) X(lahf) X(mov_acc_moffs) X(mov_moffs_acc) X(test_acc_imm) X(mov_r8_imm8) \
+    X(mov_r16_imm16) X(ret_near) X(load_far_ptr) X(mov_rm_imm) X(ret_far) X(int3) X(int) \
+    X(into) X(iret) X(shift) X(xlat) X(loop) X(jcxz) X(in) X(out) X(call_near) X(jmp_near) \
+    X(jmp_far) X(jmp_short) X(hlt) X(cmc) X(grp3) X(clc) X(stc) X(cli) X(sti) X(cld) \
+    X(std) X(grp4) X(grp5) X(movs) X(cmps) X(stos) X(lods) X(scas)
+
+#define U unknown
+/* Handler for each opcode, in opcode order. Prefix bytes are consumed by the
+   decoder and never dispatched. */
+#define OPCODE_MAP(X) \
+    /* 0x00 */ X(alu_rm) X(alu_rm) X(alu_rm) X(alu_rm) \
+    /* 0x04 */ X(alu_acc_imm) X(alu_acc_imm) X(push_sreg) X(pop_sreg) \
+    /* 0x08 */ X(alu_rm) X(alu_rm) X(alu_rm) X(alu_rm) \
+    /* 0x0C */ X(alu_acc_imm) X(alu_acc_imm) X(push_sreg) X(U) \
+    /* 0x10 */ X(alu_rm) X(alu_rm) X(alu_rm) X(alu_rm) \
+    /* 0x14 */ X(alu_acc_imm) X(alu_acc_imm) X(push_sreg) X(pop_sreg) \
+    /* 0x18 */ X(alu_rm) X(alu_rm) X(alu_rm) X(alu_rm) \
+    /* 0x1C */ X(alu_acc_imm) X(alu_acc_imm) X(push_sreg) X(pop_sreg) \
+    /* 0x20 */ X(alu_rm) X(alu_rm) X(alu_rm) X(alu_rm) X(alu_acc_imm) X(alu_acc_imm) X(U) X(U) \
+    /* 0x28 */ X(alu_rm) X(alu_rm) X(alu_rm) X(alu_rm) X(alu_acc_imm) X(alu_acc_imm) X(U) X(U) \
+    /* 0x30 */ X(alu_rm) X(alu_rm) X(alu_rm) X(alu_rm) X(alu_acc_imm) X(alu_acc_imm) X(U) X(U) \
+    /* 0x38 */ X(alu_rm) X(alu_rm) X(alu_rm) X(alu_rm) X(alu_acc_imm) X(alu_acc_imm) X(U) X(U) \
+    /* 0x40 */ X(inc_r16) X(inc_r16) X(inc_r16) X(inc_r16) \
+    /* 0x44 */ X(inc_r16) X(inc_r16) X(inc_r16) X(inc_r16) \
+    /* 0x48 */ X(dec_r16) X(dec_r16) X(dec_r16) X(dec_r16) \
+    /* 0x4C */ X(dec_r16) X(dec_r16) X(dec_r16) X(dec_r16) \
+    /* 0x50 */ X(push_r16) X(push_r16) X(push_r16) X(push_r16) \
+    /* 0x54 */ X(push_r16) X(push_r16) X(push_r16) X(push_r16) \
+    /* 0x58 */ X(pop_r16) X(pop_r16) X(pop_r16) X(pop_r16) \
+    /* 0x5C */ X(pop_r16) X(pop_r16) X(pop_r16) X(pop_r16) \
+    /* 0x60 */ X(jcc) X(jcc) X(jcc) X(jcc) X(jcc) X(jcc) X(jcc) X(jcc) \
+    /* 0x68 */ X(jcc) X(jcc) X(jcc) X(jcc) X(jcc) X(jcc) X(jcc) X(jcc) \
+    /* 0x70 */ X(jcc) X(jcc) X(jcc) X(jcc) X(jcc) X(jcc) X(jcc) X(jcc) \
+    /* 0x78 */ X(jcc) X(jcc) X(jcc) X(jcc) X(jcc) X(jcc) X(jcc) X(jcc) \
+    /* 0x80 */ X(grp1) X(grp1) X(grp1) X(grp1) X(test_rm) X(test_rm) X(xchg_rm) X(xchg_rm) \
+    /* 0x88 */ X(mov_rm_reg) X(mov_rm_reg) X(mov_reg_rm) X(mov_reg_rm) \
+    /* 0x8C */ X(mov_rm_sreg) X(lea) X(mov_sreg_rm) X(pop_rm) \
+    /* 0x90 */ X(xchg_ax) X(xchg_ax) X(xchg_ax) X(xchg_ax) \
+    /* 0x94 */ X(xchg_ax) X(xchg_ax) X(xchg_ax) X(xchg_ax) \
+    /* 0x98 */ X(cbw) X(cwd) X(call_far) X(U) X(pushf) X(popf) X(sahf) X(lahf) \
+    /* 0xA0 */ X(mov_acc_moffs) X(mov_acc_moffs) X(mov_moffs_acc) X(mov_moffs_acc) \
+    /* 0xA4 */ X(movs) X(movs) X(cmps) X(cmps) \
+    /* 0xA8 */ X(test_acc_imm) X(test_acc_imm) X(stos) X(stos) X(lods) X(lods) X(scas) X(scas) \
+    /* 0xB0 */ X(mov_r8_imm8) X(mov_r8_imm8) X(mov_r8_imm8) X(mov_r8_imm8) \
+    /* 0xB4 */ X(mov_r8_imm8) X(mov_r8_imm8) X(mov_r8_imm8) X(mov_r8_imm8) \
+    /* 0xB8 */ X(mov_r16_imm16) X(mov_r16_imm16) X(mov_r16_imm16) X(mov_r16_imm16) \
+    /* 0xBC */ X(mov_r16_imm16) X(mov_r16_imm16) X(mov_r16_imm16) X(mov_r16_imm16) \
+    /* 0xC0 */ X(ret_near) X(ret_near) X(ret_near) X(ret_near) \
+    /* 0xC4 */ X(load_far_ptr) X(load_far_ptr) X(mov_rm_imm) X(mov_rm_imm) \
+    /* 0xC8 */ X(ret_far) X(ret_far) X(ret_far) X(ret_far) X(int3) X(int) X(into) X(iret) \
+    /* 0xD0 */ X(shift) X(shift) X(shift) X(shift) X(U) X(U) X(U) X(xlat) \
+    /* 0xD8 */ X(U) X(U) X(U) X(U) X(U) X(U) X(U) X(U) \
+    /* 0xE0 */ X(loop) X(loop) X(loop) X(jcxz) X(in) X(in) X(out) X(out) \
+    /* 0xE8 */ X(call_near) X(jmp_near) X(jmp_far) X(jmp_short) X(in) X(in) X(out) X(out) \
+    /* 0xF0 */ X(U) X(U) X(U) X(U) X(hlt) X(cmc) X(grp3) X(grp3) \
+    /* 0xF8 */ X(clc) X(stc) X(cli) X(sti) X(cld) X(std) X(grp4) X(grp5)
+
+typedef void (*OpHandler)(CPU8086* cpu, const DecodedInsn* d);
+
+#define HANDLER_ENTRY_(h) op_##h,
+#define HANDLER_ENTRY(h) HANDLER_ENTRY_(h)
+static const OpHandler op_table[] = { OPCODE_MAP(HANDLER_ENTRY) };
+_Static_assert(sizeof(op_table) / sizeof(op_table[0]) == 256, "OPCODE_MAP must cover all 256 opcodes");
+
+#if defined(__GNUC__) && !defined(CPU_NO_COMPUTED_GOTO)
+#define USE_COMPUTED_GOTO 1
+#else
+#define USE_COMPUTED_GOTO 0
+#endif
+
+// Physical address of CS:IP, wrapped so blocks are cached under one address.
+// The mirror behind memory always leaves a full decode window after it.
+static inline uint32_t code_address(CPU8086* cpu) {
+    return get_physical_addr(cpu->cs, cpu->ip) & ADDR_MASK;
+}
+
+static void fault_prefixes(CPU8086* cpu) {
+    fprintf(cpu->log, "Too many prefixes at %04X:%04X\n", cpu->cs, cpu->ip);
+    cpu_stop(cpu, STOP_UNKNOWN_OPCODE);
+}
+
+// Decodes the instruction at CS:IP into *d without advancing IP. Returns 0
+// after stopping the CPU if it cannot be decoded.
+static inline int fetch_instruction(CPU8086* cpu, DecodedInsn* d) {
+    if (!decode_instruction(&cpu->memory[code_address(cpu)], d)) {
+        fault_prefixes(cpu);
+        return 0;
+    }
+    return 1;
+}
+
+// Finds the instructions to run from CS:IP: a cached block when the block
+// cache is enabled, otherwise the single instruction decoded into *scratch.
+// Returns NULL if the CPU stopped.
+static inline Block* fetch_block(CPU8086* cpu, Block* scratch) {
+    if (!cpu->block_cache) {
+        scratch->count = 1;
+        scratch->native = NULL;
+        return fetch_instruction(cpu, &scratch->insns[0]) ? scratch : NULL;
+    }
+    uint32_t addr = code_address(cpu);
+    Block* b = block_cache_lookup(cpu, addr);
+    if (!b) {
+        b = block_cache_build(cpu, addr);
+        if (!b) fault_prefixes(cpu);
+    }
+    return b;
+}
+
+// Handles everything flagged in cpu->pending. Returns 0 if the CPU stopped, is
+// still halted or has just skipped ahead: a halted CPU jumps to the next device
+// event without retiring anything, so the run loop hands back after each skip
+// and callers pacing by host time never see more than one idle gap per call.
+static inline int service_pending(CPU8086* cpu) {
+    if (!cpu->running) return 0;
+    cpu->pending = 0;
+    int skipped = 0;
+    if (cpu->halted && !cpu->pic.intr) {
+        // Only the cycle limit ahead: no device can wake the CPU any more, so
+        // the idle hook is the last chance to raise an interrupt.
+        int idle = cpu->events.count == 1 && cpu->events.heap[0] == EVENT_CYCLE_LIMIT;
+        if (cpu->events.next == SCHED_NEVER || idle) {
+            if (cpu->idle_hook) cpu->idle_hook(cpu->idle_ctx);
+            if (!cpu->pic.intr) {
+                cpu_stop(cpu, STOP_HLT);
+                return 0;
             }
+        } else {
+            if (cpu->cycles < cpu->events.next) cpu->cycles = cpu->events.next;
+            scheduler_run(&cpu->events, cpu->cycles);
+            skipped = 1;
+        }
+    }
+    if (cpu->pic.intr && cpu->flags.interrupt) {
+        uint8_t vector = pic_acknowledge(&cpu->pic);
+        if (cpu->trace) trace_begin(cpu->trace, cpu, 0, vector);
+        if (cpu->profile) cpu->profile->irq_interrupts[vector]++;
+        handle_interrupt(cpu, vector);
+        if (cpu->trace) trace_end(cpu->trace, cpu);
+    }
+    update_irq(cpu);
+    if (cpu->halted) {
+        cpu->pending |= PENDING_HALT;
+        return 0;
+    }
+    return cpu->running && !skipped;
+}
+
+// True once the clock has reached the next device deadline. The run loops
+// check it after every instruction, like pending, so events fire at the
+// first instruction boundary at or past their deadline in every mode.
+static inline int events_due(const CPU8086* cpu) {
+    return cpu->cycles >= cpu->events.next;
+}
+
+// Runs the device events that are due; they may raise IRQs through the PIC.
+static inline void run_events(CPU8086* cpu) {
+    if (__builtin_expect(events_due(cpu), 0)) {
+        scheduler_run(&cpu->events, cpu->cycles);
+    }
+}
+
+void execute_instruction(CPU8086* cpu) {
+    DecodedInsn d;
+    if (!cpu->running) return;
+    run_events(cpu);
+    if (cpu->pending && !service_pending(cpu)) return;
+    if (fetch_instruction(cpu, &d)) {
+        cpu->last_instruction = d.opcode;
+        if (cpu->trace) trace_begin(cpu->trace, cpu, d.length, 0);
+        if (cpu->profile) profile_begin(cpu->profile, cpu, &d);
+        cpu->ip += d.length;
+        cpu->cycles += d.cycles;
+        op_table[d.opcode](cpu, &d);
+        if (cpu->profile) profile_end(cpu->profile, cpu, d.opcode);
+        if (cpu->trace) trace_end(cpu->trace, cpu);
+    }
+}
+
+// cpu_run while tracing or profiling: the same block walk, but every
+// instruction is interpreted between the recorders' begin and end calls.
+// Kept apart so the normal loop carries no such checks at all.
+static unsigned long run_instrumented(CPU8086* cpu, unsigned long max_instructions) {
+    unsigned long executed = 0;
+    Block scratch;
+    Trace* t = cpu->trace;
+    Profile* p = cpu->profile;
+
+    for (;;) {
+        run_events(cpu);
+        if (cpu->pending && !service_pending(cpu)) break;
+        if (executed >= max_instructions) break;
+        Block* b = fetch_block(cpu, &scratch);
+        if (!b) break;
+        unsigned count = b->count;
+        if (count > max_instructions - executed) count = max_instructions - executed;
+        const DecodedInsn* insn = b->insns;
+        const DecodedInsn* end = insn + count;
+        while (insn != end) {
+            if (t) trace_begin(t, cpu, insn->length, 0);
+            if (p) profile_begin(p, cpu, insn);
+            cpu->ip += insn->length;
+            cpu->cycles += insn->cycles;
+            op_table[insn->opcode](cpu, insn);
+            if (p) profile_end(p, cpu, insn->opcode);
+            if (t) trace_end(t, cpu);
+            insn++;
+            if (cpu->pending || events_due(cpu)) break;
+        }
+        executed += insn - b->insns;
+        cpu->last_instruction = insn[-1].opcode;
+    }
+    return executed;
+}
+
+// Runs whole blocks, checking cpu->pending and the next device deadline after
+// every instruction so that stops, interrupts, writes into the running block
+// and device events take effect at once. Blocks that have been translated run
+// natively as far as their native code goes, or up to the deadline; the
+// interpreter picks up from wherever it left off.
+unsigned long cpu_run(CPU8086* cpu, unsigned long max_instructions) {
+    unsigned long executed = 0;
+    Block scratch;
+    const DecodedInsn* start;
+    const DecodedInsn* insn;
+    const DecodedInsn* end;
+
+    if (!cpu->running) return 0;
+    if (__builtin_expect(cpu->trace || cpu->profile, 0)) return run_instrumented(cpu, max_instructions);
+
+#if USE_COMPUTED_GOTO
+#define HANDLER_LABEL_ADDR_(h) &&L_##h,
+#define HANDLER_LABEL_ADDR(h) HANDLER_LABEL_ADDR_(h)
+    static const void* const labels[] = { OPCODE_MAP(HANDLER_LABEL_ADDR) };
+
+#define DISPATCH() \
+    do { \
+        if (__builtin_expect(cpu->pending != 0 || events_due(cpu), 0) || ++insn == end) goto block_done; \
+        cpu->ip += insn->length; \
+        cpu->cycles += insn->cycles; \
+        goto *labels[insn->opcode]; \
+    } while (0)
+#endif
+
+    for (;;) {
+        run_events(cpu);
+        if (cpu->pending && !service_pending(cpu)) break;
+        if (executed >= max_instructions) break;
+        Block* b = fetch_block(cpu, &scratch);
+        if (!b) break;
+        start = b->insns;
+        unsigned count = b->count;
+        if (b->native) {
+            unsigned resume;
+            executed += jit_run(cpu, b, max_instructions - executed, &resume);
+            if (resume == count || cpu->pending || events_due(cpu) || executed >= max_instructions) continue;
+            start += resume;
+            count -= resume;
+        } else if (cpu->jit && ++b->hits == JIT_THRESHOLD) {
+            jit_compile(cpu, b);
+        }
+        if (count > max_instructions - executed) count = max_instructions - executed;
+        insn = start;
+        end = start + count;
+#if USE_COMPUTED_GOTO
+        cpu->ip += insn->length;
+        cpu->cycles += insn->cycles;
+        goto *labels[insn->opcode];
+#define HANDLER_LABEL(h) L_##h: op_##h(cpu, insn); DISPATCH();
+        HANDLER_LIST(HANDLER_LABEL)
+#undef HANDLER_LABEL
+#undef DISPATCH
+block_done:
+        if (insn != end) insn++;
+#else
+        for (; insn != end; ) {
+            cpu->ip += insn->length;
+            cpu->cycles += insn->cycles;
+            op_table[insn->opcode](cpu, insn);
+            insn++;
+            if (cpu->pending || events_due(cpu)) break;
         }
+#endif
+        executed += insn - start;
+        cpu->last_instruction = insn[-1].opcode;
     }
+    return executed;
 }
@@ -0,0 +1,261 @@
+#include "decode.h"
+
+#define OPF_MODRM 0x01
+#define OPF_IMM8 0x02
+#define OPF_IMM16 0x04
+#define OPF_FAR 0x08    // ptr16:16 immediate
+#define OPF_PREFIX 0x10
+#define OPF_GRP3 0x20   // F6/F7: immediate only for TEST (/0, /1)
+
+#define M OPF_MODRM
+#define I8 OPF_IMM8
+#define I16 OPF_IMM16
+#define MI8 (OPF_MODRM | OPF_IMM8)
+#define MI16 (OPF_MODRM | OPF_IMM16)
+#define F OPF_FAR
+#define P OPF_PREFIX
+#define G3 (OPF_MODRM | OPF_GRP3)
+
+// Operand layout of every 8086 opcode. 60-6F, C0/C1 and C8/C9 are the
+// undocumented aliases of 70-7F, C2/C3 and CA/CB on the 8086.
+static const uint8_t opcode_info[256] = {
+    /* 0x00 */ M, M, M, M, I8, I16, 0, 0, M, M, M, M, I8, I16, 0, 0,
+    /* 0x10 */ M, M, M, M, I8, I16, 0, 0, M, M, M, M, I8, I16, 0, 0,
+    /* 0x20 */ M, M, M, M, I8, I16, P, 0, M, M, M, M, I8, I16, P, 0,
+    /* 0x30 */ M, M, M, M, I8, I16, P, 0, M, M, M, M, I8, I16, P, 0,
+    /* 0x40 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 0x50 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    /* 0x60 */ I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8,
+    /* 0x70 */ I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8, I8,
+    /* 0x80 */ MI8, MI16, MI8, MI8, M, M, M, M, M, M, M, M, M, M, M, M,
+    /* 0x90 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, F, 0, 0, 0, 0, 0,
+    /* 0xA0 */ I16, I16, I16, I16, 0, 0, 0, 0, I8, I16, 0, 0, 0, 0, 0, 0,
+    /* 0xB0 */ I8, I8, I8, I8, I8, I8, I8, I8, I16, I16, I16, I16, I16, I16, I16, I16,
+    /* 0xC0 */ I16, 0, I16, 0, M, M, MI8, MI16, I16, 0, I16, 0, 0, I8, 0, 0,
+    /* 0xD0 */ M, M, M, M, I8, I8, 0, 0, M, M, M, M, M, M, M, M,
+    /* 0xE0 */ I8, I8, I8, I8, I8, I8, I8, I8, I16, I16, F, I8, 0, 0, 0, 0,
+    /* 0xF0 */ P, P, P, P, 0, 0, G3, G3, 0, 0, 0, 0, 0, 0, M, M,
+};
+
+#undef M
+#undef I8
+#undef I16
+#undef MI8
+#undef MI16
+#undef F
+#undef P
+#undef G3
+
+// Execution clocks of every opcode from the 8086 timing tables, with a
+// register operand (or no ModR/M) and with a memory operand, the latter
+// without the EA time. Data-dependent times (MUL, DIV) use the middle of
+// their range; the +4 for word accesses at odd addresses is not modelled.
+// Groups 80-83, D0-D3 and F6-FF depend on the reg field; see insn_cycles().
+static const uint8_t cycles_reg[256] = {
+    /* 0x00 */  3,  3,  3,  3,  4,  4, 10,  8,  3,  3,  3,  3,  4,  4, 10,  8,
+    /* 0x10 */  3,  3,  3,  3,  4,  4, 10,  8,  3,  3,  3,  3,  4,  4, 10,  8,
+    /* 0x20 */  3,  3,  3,  3,  4,  4,  0,  4,  3,  3,  3,  3,  4,  4,  0,  4,
+    /* 0x30 */  3,  3,  3,  3,  4,  4,  0,  8,  3,  3,  3,  3,  4,  4,  0,  8,
+    /* 0x40 */  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,
+    /* 0x50 */ 11, 11, 11, 11, 11, 11, 11, 11,  8,  8,  8,  8,  8,  8,  8,  8,
+    /* 0x60 */  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,
+    /* 0x70 */  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,
+    /* 0x80 */  4,  4,  4,  4,  3,  3,  4,  4,  2,  2,  2,  2,  2,  2,  2,  8,
+    /* 0x90 */  3,  3,  3,  3,  3,  3,  3,  3,  2,  5, 28,  4, 10,  8,  4,  4,
+    /* 0xA0 */ 10, 10, 10, 10, 18, 18, 22, 22,  4,  4, 11, 11, 12, 12, 15, 15,
+    /* 0xB0 */  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,
+    /* 0xC0 */ 12,  8, 12,  8, 16, 16,  4,  4, 17, 18, 17, 18, 52, 51,  4, 24,
+    /* 0xD0 */  2,  2,  8,  8, 83, 60,  3, 11,  2,  2,  2,  2,  2,  2,  2,  2,
+    /* 0xE0 */  5,  6,  5,  6, 10, 10, 10, 10, 19, 15, 15, 15,  8,  8,  8,  8,
+    /* 0xF0 */  0,  0,  0,  0,  2,  2,  0,  0,  2,  2,  2,  2,  2,  2,  3,  3,
+};
+
+static const uint8_t cycles_mem[256] = {
+    /* 0x00 */ 16, 16,  9,  9,  0,  0,  0,  0, 16, 16,  9,  9,  0,  0,  0,  0,
+    /* 0x10 */ 16, 16,  9,  9,  0,  0,  0,  0, 16, 16,  9,  9,  0,  0,  0,  0,
+    /* 0x20 */ 16, 16,  9,  9,  0,  0,  0,  0, 16, 16,  9,  9,  0,  0,  0,  0,
+    /* 0x30 */ 16, 16,  9,  9,  0,  0,  0,  0,  9,  9,  9,  9,  0,  0,  0,  0,
+    /* 0x40 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+    /* 0x50 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+    /* 0x60 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+    /* 0x70 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+    /* 0x80 */ 17, 17, 17, 17,  9,  9, 17, 17,  9,  9,  8,  8,  9,  2,  8, 17,
+    /* 0x90 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+    /* 0xA0 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+    /* 0xB0 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+    /* 0xC0 */  0,  0,  0,  0, 16, 16, 10, 10,  0,  0,  0,  0,  0,  0,  0,  0,
+    /* 0xD0 */ 15, 15, 20, 20,  0,  0,  0,  0,  8,  8,  8,  8,  8,  8,  8,  8,
+    /* 0xE0 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+    /* 0xF0 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 15, 15,
+};
+
+// F6/F7 by reg field: TEST, TEST, NOT, NEG, MUL, IMUL, DIV, IDIV.
+static const uint8_t grp3_reg[2][8] = {
+    { 5, 5, 3, 3,  73,  89,  85, 106 },
+    { 5, 5, 3, 3, 125, 141, 153, 174 },
+};
+static const uint8_t grp3_mem[2][8] = {
+    { 11, 11, 16, 16,  79,  95,  91, 112 },
+    { 11, 11, 16, 16, 131, 147, 159, 180 },
+};
+// FF by reg field: INC, DEC, CALL, CALL far, JMP, JMP far, PUSH, (PUSH).
+static const uint8_t grp5_reg[8] = { 3, 3, 16, 37, 11, 24, 11, 11 };
+static const uint8_t grp5_mem[8] = { 15, 15, 21, 37, 18, 24, 16, 16 };
+
+// Effective-address clocks by EA_* form; see modrm_info for the forms.
+static const uint8_t ea_cycles[EA_NONE + 1] = { 7, 8, 8, 7, 5, 5, 5, 5, 6, 0, 0 };
+
+static int is_string_op(uint8_t op) {
+    return (op >= 0xA4 && op <= 0xA7) || (op >= 0xAA && op <= 0xAF);
+}
+
+static int insn_cycles(const DecodedInsn* d, int prefix_count) {
+    uint8_t op = d->opcode;
+    int mem = d->ea != EA_REG && d->ea != EA_NONE;
+    int word = op & 1;
+    int n;
+    if (is_string_op(op) && (d->prefixes & (PREFIX_REP | PREFIX_REPNE))) {
+        // The REP prefix is part of the setup clocks; the handler adds
+        // rep_string_cycles() per repetition.
+        return 9 + 2 * (prefix_count - 1);
+    }
+    if (op == 0xF6 || op == 0xF7) {
+        n = mem ? grp3_mem[word][d->reg] : grp3_reg[word][d->reg];
+    } else if (op == 0xFF) {
+        n = mem ? grp5_mem[d->reg] : grp5_reg[d->reg];
+    } else if (op >= 0x80 && op <= 0x83 && d->reg == 7 && mem) {
+        n = 10;  // CMP r/m, imm does not write back
+    } else {
+        n = mem ? cycles_mem[op] : cycles_reg[op];
+    }
+    if (mem) {
+        n += ea_cycles[d->ea];
+        // [base + index + disp] and [reg + disp] cost 4 more than without disp.
+        if (d->ea < EA_DIRECT && (d->modrm >> 6) != 0) n += 4;
+    }
+    return n + 2 * prefix_count;
+}
+
+#define MRM_MOD(m) ((m) >> 6)
+#define MRM_RM(m) ((m) & 7)
+#define MRM_DIRECT(m) (MRM_MOD(m) == 0 && MRM_RM(m) == 6)
+#define MRM_EA(m) (MRM_MOD(m) == 3 ? EA_REG : MRM_DIRECT(m) ? EA_DIRECT : MRM_RM(m))
+#define MRM_DISP(m) (MRM_MOD(m) == 1 ? 1 : MRM_MOD(m) == 2 ? 2 : MRM_DIRECT(m) ? 2 : 0)
+#define MRM_SEG(m) (MRM_MOD(m) != 3 && (MRM_RM(m) == 2 || MRM_RM(m) == 3 || \
+                    (MRM_RM(m) == 6 && MRM_MOD(m) != 0)) ? SREG_SS : SREG_DS)
+
+#define MRM1(m) { MRM_EA(m), MRM_DISP(m), MRM_SEG(m) },
+#define MRM4(m) MRM1(m) MRM1((m) + 1) MRM1((m) + 2) MRM1((m) + 3)
+#define MRM16(m) MRM4(m) MRM4((m) + 4) MRM4((m) + 8) MRM4((m) + 12)
+#define MRM64(m) MRM16(m) MRM16((m) + 16) MRM16((m) + 32) MRM16((m) + 48)
+
+// Addressing form, displacement size and default segment of every ModR/M byte.
+const ModRMInfo modrm_info[256] = { MRM64(0) MRM64(64) MRM64(128) MRM64(192) };
+
+// Branches, interrupts, port I/O and anything that can change IF end a
+// predecoded block so interrupts are checked at block boundaries. So do REP
+// string instructions, which may stop between repetitions for an interrupt.
+static int ends_block(const DecodedInsn* d) {
+    uint8_t op = d->opcode;
+    if (is_string_op(op) && (d->prefixes & (PREFIX_REP | PREFIX_REPNE))) {
+        return 1;
+    }
+    if ((op >= 0x60 && op <= 0x7F) || (op >= 0xC0 && op <= 0xC3) || (op >= 0xC8 && op <= 0xCF) ||
+        (op >= 0xE0 && op <= 0xEF)) {
+        return 1;
+    }
+    switch (op) {
+        case 0x9A: case 0x9D: case 0xF4: case 0xFB:
+            return 1;
+        case 0x8E:
+            return d->reg == SREG_CS;
+        case 0xF6: case 0xF7:
+            return d->reg >= 6;  // DIV/IDIV may raise INT 0
+        case 0xFF:
+            return d->reg >= 2 && d->reg <= 5;
+    }
+    return 0;
+}
+
+static inline uint16_t read16(const uint8_t* p) {
+    return p[0] | (p[1] << 8);
+}
+
+int decode_instruction(const uint8_t* code, DecodedInsn* d) {
+    const uint8_t* p = code;
+    uint8_t prefixes = 0;
+    uint8_t seg_override = 0;
+
+    while (opcode_info[*p] & OPF_PREFIX) {
+        if (p - code == DECODE_MAX_PREFIXES) return 0;
+        switch (*p) {
+            case 0x26: case 0x2E: case 0x36: case 0x3E:
+                prefixes |= PREFIX_SEG;
+                seg_override = (*p >> 3) & 3;
+                break;
+            case 0xF0: case 0xF1:
+                prefixes |= PREFIX_LOCK;
+                break;
+            case 0xF2:
+                prefixes = (prefixes & ~PREFIX_REP) | PREFIX_REPNE;
+                break;
+            case 0xF3:
+                prefixes = (prefixes & ~PREFIX_REPNE) | PREFIX_REP;
+                break;
+        }
+        p++;
+    }
+
+    int prefix_count = (int)(p - code);
+    uint8_t opcode = *p++;
+    uint8_t info = opcode_info[opcode];
+    d->opcode = opcode;
+    d->prefixes = prefixes;
+    d->disp = 0;
+    d->imm = 0;
+    d->imm2 = 0;
+
+    if (info & OPF_MODRM) {
+        uint8_t modrm = *p++;
+        const ModRMInfo* mi = &modrm_info[modrm];
+        d->modrm = modrm;
+        d->ea = mi->ea;
+        d->seg = mi->seg;
+        d->reg = (modrm >> 3) & 7;
+        d->rm = modrm & 7;
+        if (mi->disp_size == 1) {
+            d->disp = (uint16_t)(int8_t)*p++;
+        } else if (mi->disp_size == 2) {
+            d->disp = read16(p);
+            p += 2;
+        }
+        if ((info & OPF_GRP3) && d->reg < 2) {
+            info |= (opcode & 1) ? OPF_IMM16 : OPF_IMM8;
+        }
+    } else {
+        d->modrm = 0;
+        d->ea = EA_NONE;
+        d->seg = SREG_DS;
+        d->reg = 0;
+        d->rm = 0;
+    }
+    if (prefixes & PREFIX_SEG) {
+        d->seg = seg_override;
+    }
+
+    if (info & OPF_IMM8) {
+        d->imm = *p++;
+    } else if (info & OPF_IMM16) {
+        d->imm = read16(p);
+        p += 2;
+    } else if (info & OPF_FAR) {
+        d->imm = read16(p);
+        d->imm2 = read16(p + 2);
+        p += 4;
+    }
+
+    d->length = (uint8_t)(p - code);
+    d->flags = ends_block(d) ? INSN_ENDS_BLOCK : 0;
+    d->cycles = (uint8_t)insn_cycles(d, prefix_count);
+    return d->length;
+}
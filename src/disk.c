@@ -0,0 +1,359 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "disk.h"
+
+// INT 13h status codes, also kept in DISK_REG_ERROR.
+#define DISK_OK 0x00
+#define DISK_BAD_COMMAND 0x01
+#define DISK_NOT_FOUND 0x04  // sector out of range
+#define DISK_TIMEOUT 0x80    // no such drive
+
+#define MAX_TRANSFER (MEMORY_SIZE / DISK_SECTOR_SIZE)
+
+typedef struct {
+    uint32_t size;
+    uint16_t cylinders;
+    uint8_t heads, sectors_per_track, type;
+} FloppyFormat;
+
+static const FloppyFormat floppy_formats[] = {
+    { 163840, 40, 1, 8, 1 },
+    { 184320, 40, 1, 9, 1 },
+    { 327680, 40, 2, 8, 1 },
+    { 368640, 40, 2, 9, 1 },
+    { 737280, 80, 2, 9, 3 },
+    { 1228800, 80, 2, 15, 2 },
+    { 1474560, 80, 2, 18, 4 },
+    { 2949120, 80, 2, 36, 6 },
+};
+
+// sti; out 0E3h, al; retf 2 -- the flags set by the service survive the return.
+static const uint8_t bios_stub[] = { 0xFB, 0xE6, DISK_PORT_BASE + DISK_REG_SERVICE, 0xCA, 0x02, 0x00 };
+
+// 1.44MB diskette parameters, as the PC BIOS has them at F000:EFC7.
+static const uint8_t param_table[] = { 0xDF, 0x02, 0x25, 0x02, 0x12, 0x1B, 0xFF, 0x6C, 0xF6, 0x0F, 0x08 };
+
+static int drive_slot(uint8_t drive) {
+    if (drive < 2) return drive;
+    if (drive >= 0x80 && drive < 0x82) return 2 + drive - 0x80;
+    return -1;
+}
+
+static DiskDrive* find_drive(DiskController* dc, uint8_t drive) {
+    int slot = drive_slot(drive);
+    return slot >= 0 && dc->drives[slot].data ? &dc->drives[slot] : NULL;
+}
+
+void disk_init(DiskController* dc) {
+    memset(dc, 0, sizeof(*dc));
+}
+
+static int set_geometry(DiskDrive* d, int floppy) {
+    if (floppy) {
+        for (size_t i = 0; i < sizeof(floppy_formats) / sizeof(floppy_formats[0]); i++) {
+            const FloppyFormat* f = &floppy_formats[i];
+            if (f->size != d->size) continue;
+            d->cylinders = f->cylinders;
+            d->heads = f->heads;
+            d->sectors_per_track = f->sectors_per_track;
+            d->floppy_type = f->type;
+            return 1;
+        }
+        return 0;
+    }
+    if (d->size % DISK_SECTOR_SIZE || d->size / DISK_SECTOR_SIZE > UINT32_MAX) return 0;
+    uint64_t cylinders = d->sectors / (16 * 63);
+    d->heads = 16;
+    d->sectors_per_track = 63;
+    d->cylinders = cylinders == 0 ? 1 : cylinders > 1024 ? 1024 : cylinders;
+    return 1;
+}
+
+int disk_open(DiskController* dc, uint8_t drive, const char* path, FILE* log) {
+    int slot = drive_slot(drive);
+    if (slot < 0) {
+        fprintf(log, "No BIOS drive %02Xh\n", drive);
+        return 0;
+    }
+    DiskDrive* d = &dc->drives[slot];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(log, "Cannot open disk image: %s\n", path);
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < DISK_SECTOR_SIZE) {
+        fprintf(log, "Empty or unreadable disk image: %s\n", path);
+        close(fd);
+        return 0;
+    }
+    DiskDrive opened = { 0 };
+    opened.size = st.st_size;
+    opened.sectors = opened.size / DISK_SECTOR_SIZE;
+    opened.path = path;
+    if (!set_geometry(&opened, drive < 0x80)) {
+        fprintf(log, "%s: %llu bytes is not a %s image size\n", path, (unsigned long long)opened.size,
+                drive < 0x80 ? "standard floppy" : "hard disk");
+        close(fd);
+        return 0;
+    }
+    // Private and writable: pages the guest writes are copied, the rest stay
+    // shared with the page cache and every other mapping of the file.
+    void* data = mmap(NULL, opened.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(log, "Cannot map disk image: %s\n", path);
+        return 0;
+    }
+    if (d->data) munmap(d->data, d->size);
+    opened.data = data;
+    *d = opened;
+    return 1;
+}
+
+int disk_written(const DiskController* dc) {
+    for (int i = 0; i < DISK_DRIVES; i++) {
+        if (dc->drives[i].writes) return 1;
+    }
+    return 0;
+}
+
+void disk_close(DiskController* dc) {
+    for (int i = 0; i < DISK_DRIVES; i++) {
+        if (dc->drives[i].data) munmap(dc->drives[i].data, dc->drives[i].size);
+        dc->drives[i].data = NULL;
+    }
+}
+
+// Copies count sectors at lba between the image and physical memory at addr
+// in at most two pieces, split where the buffer wraps at 1MB. Like DMA, it
+// ignores the memory map.
+static uint8_t transfer(DiskController* dc, DiskDrive* d, uint32_t lba, uint32_t count, uint32_t addr, int command) {
+    if (count == 0 || count > MAX_TRANSFER) return DISK_BAD_COMMAND;
+    if (lba >= d->sectors || count > d->sectors - lba) return DISK_NOT_FOUND;
+    if (command == DISK_CMD_VERIFY) return DISK_OK;
+    CPU8086* cpu = dc->cpu;
+    uint8_t* sector = d->data + (uint64_t)lba * DISK_SECTOR_SIZE;
+    uint32_t bytes = count * DISK_SECTOR_SIZE;
+    addr &= ADDR_MASK;
+    while (bytes) {
+        uint32_t n = bytes < MEMORY_SIZE - addr ? bytes : MEMORY_SIZE - addr;
+        if (command == DISK_CMD_WRITE) {
+            memcpy(sector, cpu->memory + addr, n);
+        } else {
+            memcpy(cpu->memory + addr, sector, n);
+            cpu_mark_dirty(cpu, addr, n);
+        }
+        sector += n;
+        bytes -= n;
+        addr = (addr + n) & ADDR_MASK;
+    }
+    if (command == DISK_CMD_WRITE) {
+        d->writes += count;
+    } else {
+        d->reads += count;
+    }
+    return DISK_OK;
+}
+
+static uint16_t reg16(const DiskController* dc, int reg) {
+    return dc->regs[reg] | (dc->regs[reg + 1] << 8);
+}
+
+static void run_command(DiskController* dc, uint8_t command) {
+    DiskDrive* d = find_drive(dc, dc->regs[DISK_REG_DRIVE]);
+    uint8_t status;
+    if (!d) {
+        status = DISK_TIMEOUT;
+    } else if (command != DISK_CMD_READ && command != DISK_CMD_WRITE && command != DISK_CMD_VERIFY) {
+        status = DISK_BAD_COMMAND;
+    } else {
+        uint32_t lba = reg16(dc, DISK_REG_LBA) | ((uint32_t)reg16(dc, DISK_REG_LBA + 2) << 16);
+        uint32_t addr = ((uint32_t)reg16(dc, DISK_REG_SEGMENT) << 4) + reg16(dc, DISK_REG_OFFSET);
+        status = transfer(dc, d, lba, reg16(dc, DISK_REG_COUNT), addr, command);
+    }
+    dc->regs[DISK_REG_ERROR] = status;
+}
+
+// Guest memory at seg:off; the mirror covers the wrap at 1MB.
+static uint8_t* guest(CPU8086* cpu, uint16_t seg, uint16_t off) {
+    return cpu->memory + ((uint32_t)seg << 4) + off;
+}
+
+static void bios_return(DiskController* dc, uint8_t status) {
+    CPU8086* cpu = dc->cpu;
+    dc->regs[DISK_REG_ERROR] = status;
+    cpu->ax = (cpu->ax & 0x00FF) | (status << 8);
+    cpu_set_flags(cpu, (cpu_get_flags(cpu) & ~0x0001) | (status != DISK_OK));
+}
+
+static int drive_count(const DiskController* dc, int hard) {
+    int count = 0;
+    for (int i = hard ? 2 : 0; i < (hard ? DISK_DRIVES : 2); i++) {
+        count += dc->drives[i].data != NULL;
+    }
+    return count;
+}
+
+// AH=02h/03h/04h: AL sectors at CH/CL/DH (cylinder, sector, head) to ES:BX.
+static void bios_chs(DiskController* dc, DiskDrive* d, int command) {
+    CPU8086* cpu = dc->cpu;
+    uint32_t cylinder = (cpu->cx >> 8) | ((cpu->cx & 0xC0) << 2);
+    uint32_t sector = cpu->cx & 0x3F;
+    uint32_t head = cpu->dx >> 8;
+    uint32_t count = cpu->ax & 0xFF;
+    uint8_t status;
+    if (sector == 0 || sector > d->sectors_per_track || head >= d->heads || cylinder >= d->cylinders) {
+        status = DISK_NOT_FOUND;
+    } else {
+        uint32_t lba = (cylinder * d->heads + head) * d->sectors_per_track + sector - 1;
+        status = transfer(dc, d, lba, count, ((uint32_t)cpu->es << 4) + cpu->bx, command);
+    }
+    cpu->ax = status == DISK_OK ? count : 0;
+    bios_return(dc, status);
+}
+
+// AH=42h/43h/44h: the disk address packet at DS:SI.
+static void bios_lba(DiskController* dc, DiskDrive* d, int command) {
+    CPU8086* cpu = dc->cpu;
+    uint8_t* packet = guest(cpu, cpu->ds, cpu->si);
+    if (packet[0] < 0x10 || packet[8 + 4] || packet[8 + 5] || packet[8 + 6] || packet[8 + 7]) {
+        bios_return(dc, DISK_BAD_COMMAND);
+        return;
+    }
+    uint32_t count = packet[2] | (packet[3] << 8);
+    uint16_t offset = packet[4] | (packet[5] << 8);
+    uint16_t segment = packet[6] | (packet[7] << 8);
+    uint32_t lba = packet[8] | (packet[9] << 8) | (packet[10] << 16) | ((uint32_t)packet[11] << 24);
+    uint8_t status = transfer(dc, d, lba, count, ((uint32_t)segment << 4) + offset, command);
+    if (status != DISK_OK) {
+        packet[2] = packet[3] = 0;
+        cpu_mark_dirty(cpu, ((uint32_t)cpu->ds << 4) + cpu->si + 2, 2);
+    }
+    bios_return(dc, status);
+}
+
+static void bios_parameters(DiskController* dc, DiskDrive* d, uint8_t drive) {
+    CPU8086* cpu = dc->cpu;
+    uint32_t last = d->cylinders - 1;
+    cpu->cx = (last & 0xFF) << 8 | (last >> 2 & 0xC0) | d->sectors_per_track;
+    cpu->dx = (d->heads - 1) << 8 | drive_count(dc, drive >= 0x80);
+    cpu->ax = 0;
+    if (drive < 0x80) {
+        cpu->bx = (cpu->bx & 0xFF00) | d->floppy_type;
+        cpu->es = 0xF000;
+        cpu->di = DISK_PARAM_TABLE - 0xF0000;
+    }
+    bios_return(dc, DISK_OK);
+}
+
+// INT 13h with the caller's registers, entered through the ROM stub.
+static void bios_service(DiskController* dc) {
+    CPU8086* cpu = dc->cpu;
+    uint8_t function = cpu->ax >> 8;
+    uint8_t drive = cpu->dx & 0xFF;
+    DiskDrive* d = find_drive(dc, drive);
+    switch (function) {
+        case 0x00:
+        case 0x0D:
+            bios_return(dc, d ? DISK_OK : DISK_TIMEOUT);
+            return;
+        case 0x01:
+            bios_return(dc, dc->regs[DISK_REG_ERROR]);
+            return;
+        case 0x15:
+            // Reports the drive type in AH rather than a status.
+            if (!d) {
+                cpu->ax &= 0x00FF;
+            } else if (drive < 0x80) {
+                cpu->ax = (cpu->ax & 0x00FF) | 0x0100;
+            } else {
+                cpu->ax = (cpu->ax & 0x00FF) | 0x0300;
+                cpu->cx = d->sectors >> 16;
+                cpu->dx = d->sectors & 0xFFFF;
+            }
+            cpu_set_flags(cpu, cpu_get_flags(cpu) & ~0x0001);
+            return;
+    }
+    if (!d) {
+        bios_return(dc, DISK_TIMEOUT);
+        return;
+    }
+    switch (function) {
+        case 0x02: bios_chs(dc, d, DISK_CMD_READ); break;
+        case 0x03: bios_chs(dc, d, DISK_CMD_WRITE); break;
+        case 0x04: bios_chs(dc, d, DISK_CMD_VERIFY); break;
+        case 0x08: bios_parameters(dc, d, drive); break;
+        case 0x41:
+            if (drive < 0x80 || cpu->bx != 0x55AA) {
+                bios_return(dc, DISK_BAD_COMMAND);
+                break;
+            }
+            cpu->bx = 0xAA55;
+            cpu->cx = 0x0001;  // fixed disk access functions
+            bios_return(dc, DISK_OK);
+            cpu->ax = (cpu->ax & 0x00FF) | 0x2100;  // EDD 1.1
+            break;
+        case 0x42: bios_lba(dc, d, DISK_CMD_READ); break;
+        case 0x43: bios_lba(dc, d, DISK_CMD_WRITE); break;
+        case 0x44: bios_lba(dc, d, DISK_CMD_VERIFY); break;
+        default: bios_return(dc, DISK_BAD_COMMAND); break;
+    }
+}
+
+static uint16_t disk_port_read(void* ctx, uint16_t port, int word) {
+    DiskController* dc = ctx;
+    (void)word;
+    int reg = port - DISK_PORT_BASE;
+    if (reg == DISK_REG_COMMAND) {
+        uint8_t status = find_drive(dc, dc->regs[DISK_REG_DRIVE]) ? DISK_STATUS_READY : 0;
+        return status | (dc->regs[DISK_REG_ERROR] ? DISK_STATUS_ERROR : 0);
+    }
+    return reg == DISK_REG_SERVICE ? 0 : dc->regs[reg];
+}
+
+static void disk_port_write(void* ctx, uint16_t port, uint16_t value, int word) {
+    DiskController* dc = ctx;
+    (void)word;
+    int reg = port - DISK_PORT_BASE;
+    if (reg == DISK_REG_COMMAND) {
+        run_command(dc, value);
+    } else if (reg == DISK_REG_SERVICE) {
+        bios_service(dc);
+    } else if (reg != DISK_REG_ERROR) {
+        dc->regs[reg] = value;
+    }
+}
+
+void disk_attach(DiskController* dc, CPU8086* cpu) {
+    dc->cpu = cpu;
+    dc->io = (IoHandler){ disk_port_read, disk_port_write, dc, IO_BYTE };
+    cpu_map_ports(cpu, DISK_PORT_BASE, DISK_REGS, &dc->io);
+
+    uint8_t* entry = cpu->memory + DISK_BIOS_ENTRY;
+    int in_use = 0;
+    for (size_t i = 0; i < sizeof(bios_stub); i++) {
+        in_use |= entry[i];
+    }
+    if (in_use) {
+        // Either a ROM's own INT 13h or our stub restored from a snapshot;
+        // in both cases the guest owns the vector, and may have hooked it.
+        if (memcmp(entry, bios_stub, sizeof(bios_stub)) != 0) {
+            fprintf(cpu->log, "ROM code at F000:E3FE, leaving INT 13h to it\n");
+        }
+        return;
+    }
+    memcpy(entry, bios_stub, sizeof(bios_stub));
+    memcpy(cpu->memory + DISK_PARAM_TABLE, param_table, sizeof(param_table));
+    cpu_mark_dirty(cpu, DISK_BIOS_ENTRY, sizeof(bios_stub));
+    cpu_mark_dirty(cpu, DISK_PARAM_TABLE, sizeof(param_table));
+    uint8_t* vector = cpu->memory + IVT_BASE + 0x13 * 4;
+    vector[0] = DISK_BIOS_ENTRY & 0xFF;
+    vector[1] = (DISK_BIOS_ENTRY >> 8) & 0xFF;
+    vector[2] = 0x00;
+    vector[3] = 0xF0;
+    cpu_mark_dirty(cpu, IVT_BASE + 0x13 * 4, 4);
+}
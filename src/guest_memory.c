@@ -0,0 +1,103 @@
+#define _GNU_SOURCE  // memfd_create
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "cpu8086.h"
+#include "guest_memory.h"
+
+// An unlinked shared-memory object to map twice.
+static int open_backing(void) {
+#ifdef __linux__
+    return memfd_create("8086-ram", 0);
+#else
+    char name[64];
+    snprintf(name, sizeof(name), "/8086-ram-%ld", (long)getpid());
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) shm_unlink(name);
+    return fd;
+#endif
+}
+
+uint8_t* guest_memory_create(FILE* log) {
+    int fd = open_backing();
+    if (fd < 0) {
+        fprintf(log, "Cannot create guest memory: %s\n", strerror(errno));
+        return NULL;
+    }
+    if (ftruncate(fd, MEMORY_SIZE) != 0) {
+        fprintf(log, "Cannot size guest memory: %s\n", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    // Reserve the whole range first so both views land next to each other.
+    uint8_t* base = mmap(NULL, MEMORY_SIZE + MEMORY_MIRROR, PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        fprintf(log, "Cannot map guest memory: %s\n", strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    if (mmap(base, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + MEMORY_SIZE, MEMORY_MIRROR, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        fprintf(log, "Cannot map guest memory: %s\n", strerror(errno));
+        munmap(base, MEMORY_SIZE + MEMORY_MIRROR);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+    return base;
+}
+
+void guest_memory_destroy(uint8_t* memory) {
+    if (memory) munmap(memory, MEMORY_SIZE + MEMORY_MIRROR);
+}
+
+int guest_memory_map_file(uint8_t* memory, uint32_t addr, int fd, uint32_t size) {
+    long host_page = sysconf(_SC_PAGESIZE);
+    if (host_page <= 0 || addr % host_page || addr < MEMORY_MIRROR || size == 0 || addr + size > MEMORY_SIZE) {
+        return 0;
+    }
+    // Pages wholly past the end of the file would fault; a partial last page
+    // reads as zeros past it.
+    uint32_t length = (size + host_page - 1) / host_page * host_page;
+    if (addr + length > MEMORY_SIZE) return 0;
+    return mmap(memory + addr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED;
+}
+
+static void set_page(MemoryMap* map, uint8_t* memory, uint32_t page, MapKind kind,
+                     const MmioHandler* handler) {
+    uint8_t* host = memory + ((page << MAP_PAGE_SHIFT) & ADDR_MASK);
+    if (map->mmio[page] && map->mmio[page]->read) map->read_handlers--;
+    map->read[page] = (kind == MAP_MMIO && handler->read) || map->watch_reads ? NULL : host;
+    map->write[page] = kind == MAP_RAM ? host : NULL;
+    map->mmio[page] = kind == MAP_MMIO ? handler : NULL;
+    if (map->mmio[page] && map->mmio[page]->read) map->read_handlers++;
+}
+
+void memory_map_init(MemoryMap* map, uint8_t* memory) {
+    memset(map, 0, sizeof(*map));
+    memory_map_set(map, memory, 0, MEMORY_SIZE, MAP_RAM, NULL);
+}
+
+void memory_map_set(MemoryMap* map, uint8_t* memory, uint32_t start, uint32_t size,
+                    MapKind kind, const MmioHandler* handler) {
+    uint32_t first = start >> MAP_PAGE_SHIFT;
+    uint32_t last = (start + size - 1) >> MAP_PAGE_SHIFT;
+    for (uint32_t page = first; page <= last; page++) {
+        set_page(map, memory, page, kind, handler);
+        if (page + (MEMORY_SIZE >> MAP_PAGE_SHIFT) < MAP_PAGES) {
+            set_page(map, memory, page + (MEMORY_SIZE >> MAP_PAGE_SHIFT), kind, handler);
+        }
+    }
+}
+
+void memory_map_watch_reads(MemoryMap* map, uint8_t* memory, int enabled) {
+    map->watch_reads = enabled;
+    for (uint32_t page = 0; page < MAP_PAGES; page++) {
+        const MmioHandler* h = map->mmio[page];
+        map->read[page] = enabled || (h && h->read) ? NULL : memory + ((page << MAP_PAGE_SHIFT) & ADDR_MASK);
+    }
+}
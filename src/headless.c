@@ -0,0 +1,507 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <getopt.h>
+#include <time.h>
+#include <signal.h>
+#include "cpu8086.h"
+#include "block_cache.h"
+#include "headless.h"
+#include "throttle.h"
+#include "snapshot.h"
+#include "batch.h"
+#include "trace.h"
+#include "profile.h"
+#include "input_script.h"
+#include "loader.h"
+#include "disk.h"
+
+#define TIME_CHECK_INTERVAL 65536
+
+static volatile sig_atomic_t profile_requested;
+
+static void request_profile(int sig) {
+    (void)sig;
+    profile_requested = 1;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define HEADLESS_MAX_ROMS 8
+
+// "PATH@ADDR" from --rom.
+static int load_rom_at(CPU8086* cpu, const char* spec) {
+    const char* at = strrchr(spec, '@');
+    char path[4096];
+    char* end;
+    unsigned long base = strtoul(at + 1, &end, 16);
+    if (end == at + 1 || *end || base == 0 || (size_t)(at - spec) >= sizeof(path)) {
+        fprintf(stderr, "Invalid ROM address: %s\n", spec);
+        return 0;
+    }
+    memcpy(path, spec, at - spec);
+    path[at - spec] = '\0';
+    return load_rom(cpu, path, base);
+}
+
+#define BUSIEST_PORTS 5
+
+// The unmapped-port totals and the ports accessed most, busiest first.
+static void print_unmapped(const IoBus* io) {
+    uint16_t top[BUSIEST_PORTS];
+    uint64_t counts[BUSIEST_PORTS];
+    int found = 0;
+    for (int port = 0; port < IO_PORTS; port++) {
+        uint64_t n = io_bus_unmapped_count(io, port);
+        if (!n) continue;
+        int i = found < BUSIEST_PORTS ? found++ : BUSIEST_PORTS;
+        while (i > 0 && counts[i - 1] < n) {
+            if (i < BUSIEST_PORTS) {
+                top[i] = top[i - 1];
+                counts[i] = counts[i - 1];
+            }
+            i--;
+        }
+        if (i < BUSIEST_PORTS) {
+            top[i] = port;
+            counts[i] = n;
+        }
+    }
+    printf("Unmapped I/O: %llu accesses to %u ports", (unsigned long long)io->unmapped_accesses, io->unmapped_ports);
+    for (int i = 0; i < found; i++) {
+        printf("%s0x%04X (%llu)", i ? ", " : "; busiest ", top[i], (unsigned long long)counts[i]);
+    }
+    printf("\n");
+}
+
+static void print_usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s --headless [options]\n"
+            "  -f, --firmware PATH         firmware image (default bin/proshivka.bin)\n"
+            "      --rom PATH@ADDR         map a ROM image read-only at hex physical ADDR (repeatable)\n"
+            "      --floppy PATH           disk image for drive A:, then B: (see README)\n"
+            "      --hdd PATH              disk image for drive C:, then D:\n"
+            "  -n, --max-instructions N    stop after N instructions\n"
+            "      --max-cycles N          stop after N CPU clocks\n"
+            "  -t, --max-seconds S         stop after S seconds of wall time\n"
+            "  -c, --clock MHZ             run at MHZ (4.77, 8, ...) instead of unthrottled (max)\n"
+            "      --no-block-cache        decode every instruction instead of caching blocks\n"
+            "      --no-jit                interpret cached blocks instead of translating hot ones\n"
+            "  -r, --restore PATH          start from a snapshot instead of the firmware; repeat to\n"
+            "                              apply its checkpoints in order\n"
+            "  -s, --snapshot PATH         save a full snapshot when the run stops\n"
+            "      --checkpoint PREFIX     save PREFIX.0 at the start, then a checkpoint of the\n"
+            "                              changed pages as PREFIX.1, PREFIX.2, ...\n"
+            "      --checkpoint-every N    instructions between checkpoints (default 10000000)\n"
+            "      --trace PATH            record every instruction to PATH (see trace-tool)\n"
+            "      --profile PATH          count opcodes, memory, port and interrupt activity and\n"
+            "                              write them to PATH (.csv or JSON) at exit and on SIGUSR1\n"
+            "      --profile-sample N      also time every Nth instruction on the host\n"
+            "  -i, --input SCRIPT          type the scancodes of an input script, see README\n"
+            "      --batch MANIFEST        run every job of MANIFEST in parallel, see README\n"
+            "  -j, --jobs N                worker threads for --batch (default: one per CPU)\n"
+            "  -o, --report PATH           JSON report of --batch (default: stdout)\n"
+            "  -h, --help                  show this help\n",
+            prog);
+}
+
+int run_headless(int argc, char** argv) {
+    const char* firmware = "bin/proshivka.bin";
+    unsigned long long max_instructions = 0;
+    unsigned long long max_cycles = 0;
+    double max_seconds = 0.0;
+    int block_cache = 1;
+    int jit = 1;
+    unsigned long clock_hz = CLOCK_UNTHROTTLED;
+    const char** restores = calloc(argc, sizeof(*restores));
+    int restore_count = 0;
+    const char* snapshot = NULL;
+    const char* checkpoint = NULL;
+    unsigned long long checkpoint_every = 10000000;
+    const char* batch = NULL;
+    int batch_workers = 0;
+    const char* report = "-";
+    const char* trace_path = NULL;
+    const char* profile_path = NULL;
+    unsigned profile_sample = 0;
+    const char* input_path = NULL;
+    const char* roms[HEADLESS_MAX_ROMS];
+    int rom_count = 0;
+    const char* disk_paths[DISK_DRIVES] = { NULL };
+    int floppies = 0, hard_disks = 0;
+    if (!restores) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    static const struct option options[] = {
+        {"headless", no_argument, NULL, 'H'},
+        {"firmware", required_argument, NULL, 'f'},
+        {"max-instructions", required_argument, NULL, 'n'},
+        {"max-cycles", required_argument, NULL, 'M'},
+        {"max-seconds", required_argument, NULL, 't'},
+        {"clock", required_argument, NULL, 'c'},
+        {"no-block-cache", no_argument, NULL, 'B'},
+        {"no-jit", no_argument, NULL, 'J'},
+        {"restore", required_argument, NULL, 'r'},
+        {"snapshot", required_argument, NULL, 's'},
+        {"checkpoint", required_argument, NULL, 'P'},
+        {"checkpoint-every", required_argument, NULL, 'E'},
+        {"batch", required_argument, NULL, 'b'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"report", required_argument, NULL, 'o'},
+        {"trace", required_argument, NULL, 'T'},
+        {"profile", required_argument, NULL, 'O'},
+        {"profile-sample", required_argument, NULL, 'S'},
+        {"input", required_argument, NULL, 'i'},
+        {"rom", required_argument, NULL, 'R'},
+        {"floppy", required_argument, NULL, 'A'},
+        {"hdd", required_argument, NULL, 'C'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "f:n:t:c:r:s:j:o:i:h", options, NULL)) != -1) {
+        switch (opt) {
+            case 'H':
+                break;
+            case 'f':
+                firmware = optarg;
+                break;
+            case 'n':
+                max_instructions = strtoull(optarg, NULL, 0);
+                break;
+            case 'M':
+                max_cycles = strtoull(optarg, NULL, 0);
+                break;
+            case 't':
+                max_seconds = strtod(optarg, NULL);
+                break;
+            case 'c':
+                if (!throttle_parse_clock(optarg, &clock_hz)) {
+                    fprintf(stderr, "Invalid clock: %s\n", optarg);
+                    free(restores);
+                    return 2;
+                }
+                break;
+            case 'B':
+                block_cache = 0;
+                break;
+            case 'J':
+                jit = 0;
+                break;
+            case 'r':
+                restores[restore_count++] = optarg;
+                break;
+            case 's':
+                snapshot = optarg;
+                break;
+            case 'P':
+                checkpoint = optarg;
+                break;
+            case 'E':
+                checkpoint_every = strtoull(optarg, NULL, 0);
+                if (checkpoint_every == 0) {
+                    fprintf(stderr, "Invalid checkpoint interval: %s\n", optarg);
+                    free(restores);
+                    return 2;
+                }
+                break;
+            case 'b':
+                batch = optarg;
+                break;
+            case 'j': {
+                char* end;
+                long workers = strtol(optarg, &end, 10);
+                if (end == optarg || *end || workers < 1 || workers > INT_MAX) {
+                    fprintf(stderr, "Invalid job count: %s\n", optarg);
+                    free(restores);
+                    return 2;
+                }
+                batch_workers = (int)workers;
+                break;
+            }
+            case 'o':
+                report = optarg;
+                break;
+            case 'T':
+                trace_path = optarg;
+                break;
+            case 'O':
+                profile_path = optarg;
+                break;
+            case 'S':
+                profile_sample = strtoul(optarg, NULL, 0);
+                break;
+            case 'i':
+                input_path = optarg;
+                break;
+            case 'R':
+                if (rom_count == HEADLESS_MAX_ROMS || !strchr(optarg, '@')) {
+                    fprintf(stderr, "Invalid ROM (PATH@ADDR, at most %d): %s\n", HEADLESS_MAX_ROMS, optarg);
+                    free(restores);
+                    return 2;
+                }
+                roms[rom_count++] = optarg;
+                break;
+            case 'A':
+            case 'C':
+                if ((opt == 'A' ? floppies : hard_disks) == 2) {
+                    fprintf(stderr, "At most two %s images\n", opt == 'A' ? "floppy" : "hard disk");
+                    free(restores);
+                    return 2;
+                }
+                if (opt == 'A') {
+                    disk_paths[floppies++] = optarg;
+                } else {
+                    disk_paths[2 + hard_disks++] = optarg;
+                }
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                free(restores);
+                return 0;
+            default:
+                print_usage(argv[0]);
+                free(restores);
+                return 2;
+        }
+    }
+
+    if (batch) {
+        free(restores);
+        return run_batch(batch, batch_workers, report);
+    }
+
+    CPU8086* cpu = malloc(sizeof(CPU8086));
+    if (!cpu) {
+        fprintf(stderr, "Cannot allocate CPU state\n");
+        free(restores);
+        return 1;
+    }
+    if (!init_cpu(cpu, stderr)) {
+        free(cpu);
+        free(restores);
+        return 1;
+    }
+    cpu_set_block_cache(cpu, block_cache);
+    if (!cpu_set_jit(cpu, jit) && block_cache) {
+        fprintf(stderr, "JIT unavailable on this host, interpreting cached blocks\n");
+    }
+    cpu_set_clock(cpu, clock_hz);
+    int loaded = 1;
+    if (restore_count == 0) {
+        loaded = load_firmware(cpu, firmware);
+    }
+    for (int i = 0; i < rom_count && loaded; i++) {
+        loaded = load_rom_at(cpu, roms[i]);
+    }
+    for (int i = 0; i < restore_count && loaded; i++) {
+        loaded = snapshot_restore(cpu, restores[i]);
+    }
+    const char* restored = restore_count ? restores[restore_count - 1] : NULL;
+    free(restores);
+    DiskController disks;
+    disk_init(&disks);
+    for (int i = 0; i < DISK_DRIVES && loaded; i++) {
+        if (disk_paths[i]) loaded = disk_open(&disks, DISK_DRIVE_NUMBER(i), disk_paths[i], stderr);
+    }
+    if (!loaded) {
+        disk_close(&disks);
+        free_cpu(cpu);
+        free(cpu);
+        return 1;
+    }
+    if (floppies || hard_disks) disk_attach(&disks, cpu);
+
+    unsigned checkpoints = 0;
+    double checkpoint_time = 0.0;
+    unsigned long long next_checkpoint = checkpoint_every;
+    char checkpoint_path[4096];
+    if (checkpoint) {
+        snprintf(checkpoint_path, sizeof(checkpoint_path), "%s.0", checkpoint);
+        if (!snapshot_save(cpu, checkpoint_path)) {
+            disk_close(&disks);
+            free_cpu(cpu);
+            free(cpu);
+            return 1;
+        }
+    }
+
+    InputScript* input = NULL;
+    if (input_path) {
+        input = input_script_load(input_path, clock_hz, stderr);
+        if (!input) {
+            disk_close(&disks);
+            free_cpu(cpu);
+            free(cpu);
+            return 1;
+        }
+        input_script_attach(input, cpu);
+    }
+
+    Trace* trace = NULL;
+    if (trace_path) {
+        trace = trace_open(trace_path, clock_hz, stderr);
+        if (!trace) {
+            input_script_free(input);
+            disk_close(&disks);
+            free_cpu(cpu);
+            free(cpu);
+            return 1;
+        }
+        cpu_set_trace(cpu, trace);
+    }
+    Profile* profile = NULL;
+    if (profile_path) {
+        profile = profile_create(profile_sample);
+        if (!profile) {
+            fprintf(stderr, "Cannot allocate profile\n");
+            if (trace) trace_close(trace);
+            input_script_free(input);
+            disk_close(&disks);
+            free_cpu(cpu);
+            free(cpu);
+            return 1;
+        }
+        cpu_set_profile(cpu, profile);
+        signal(SIGUSR1, request_profile);
+    }
+
+    unsigned long long instructions = 0;
+    double start = now_seconds();
+    double deadline = max_seconds > 0.0 ? start + max_seconds : 0.0;
+    Throttle throttle;
+    throttle_init(&throttle, clock_hz, cpu->cycles);
+    // Through the scheduler, so the run ends on the same instruction whether
+    // it is interpreted or translated.
+    if (max_cycles) cpu_set_cycle_limit(cpu, cpu->cycles + max_cycles);
+
+    while (cpu->running) {
+        unsigned long slice = clock_hz ? THROTTLE_SLICE : TIME_CHECK_INTERVAL;
+        if (max_instructions) {
+            if (instructions >= max_instructions) {
+                cpu_stop(cpu, STOP_INSTRUCTION_LIMIT);
+                break;
+            }
+            if (max_instructions - instructions < slice) {
+                slice = max_instructions - instructions;
+            }
+        }
+        if (checkpoint && next_checkpoint - instructions < slice) {
+            slice = next_checkpoint - instructions;
+        }
+        if (input) slice = input_script_slice(input, instructions, slice);
+        instructions += cpu_run(cpu, slice);
+        if (input) input_script_poll(input, instructions);
+        if (checkpoint && instructions >= next_checkpoint && cpu->running && disk_written(&disks)) {
+            fprintf(stderr, "Disk images were written, which checkpoints cannot hold; no more checkpoints\n");
+            checkpoint = NULL;
+        }
+        if (checkpoint && instructions >= next_checkpoint && cpu->running) {
+            double begin = now_seconds();
+            snprintf(checkpoint_path, sizeof(checkpoint_path), "%s.%u", checkpoint, checkpoints + 1);
+            if (!snapshot_checkpoint(cpu, checkpoint_path)) break;
+            checkpoint_time += now_seconds() - begin;
+            checkpoints++;
+            next_checkpoint = instructions + checkpoint_every;
+        }
+        if (profile_requested) {
+            profile_requested = 0;
+            if (!profile_dump(profile, profile_path, instructions, cpu->cycles)) {
+                fprintf(stderr, "Cannot write profile: %s\n", profile_path);
+            }
+        }
+        throttle_sync(&throttle, cpu->cycles);
+        if (deadline > 0.0 && now_seconds() >= deadline) {
+            cpu_stop(cpu, STOP_TIME_LIMIT);
+        }
+    }
+
+    double elapsed = now_seconds() - start;
+    double mips = elapsed > 0.0 ? instructions / elapsed / 1e6 : 0.0;
+    unsigned long long trace_records = trace ? trace->records : 0;
+    if (trace) {
+        cpu_set_trace(cpu, NULL);
+        if (!trace_close(trace)) fprintf(stderr, "Cannot write trace: %s\n", trace_path);
+    }
+    if (profile) {
+        signal(SIGUSR1, SIG_DFL);
+        cpu_set_profile(cpu, NULL);
+        if (!profile_dump(profile, profile_path, instructions, cpu->cycles)) {
+            fprintf(stderr, "Cannot write profile: %s\n", profile_path);
+        }
+        free(profile);
+    }
+
+    size_t input_left = input ? input->count - input->next : 0;
+    input_script_free(input);
+
+    if (snapshot && disk_written(&disks)) {
+        fprintf(stderr, "Disk images were written, which snapshots cannot hold; not saving %s\n", snapshot);
+        disk_close(&disks);
+        free_cpu(cpu);
+        free(cpu);
+        return 1;
+    }
+    if (snapshot && !snapshot_save(cpu, snapshot)) {
+        disk_close(&disks);
+        free_cpu(cpu);
+        free(cpu);
+        return 1;
+    }
+
+    if (restored) {
+        printf("Restored:     %s\n", restored);
+    } else {
+        printf("Firmware:     %s\n", firmware);
+    }
+    printf("Instructions: %llu\n", instructions);
+    printf("Wall time:    %.6f s\n", elapsed);
+    printf("MIPS:         %.3f\n", mips);
+    printf("Cycles:       %llu (%.3f MHz effective)\n", (unsigned long long)cpu->cycles,
+           elapsed > 0.0 ? cpu->cycles / elapsed / 1e6 : 0.0);
+    printf("Stop reason:  %s\n", stop_reason_name(cpu->stop_reason));
+    printf("Final CS:IP:  %04X:%04X\n", cpu->cs, cpu->ip);
+    if (cpu->block_cache) {
+        printf("Blocks:       %lu decoded, %lu invalidated by writes\n",
+               cpu->block_cache->built, cpu->block_cache->stale);
+    }
+    if (cpu->jit) {
+        printf("Native:       %lu blocks translated\n", cpu->block_cache->translated);
+    }
+    if (cpu->io.unmapped_ports) print_unmapped(&cpu->io);
+    for (int i = 0; i < DISK_DRIVES; i++) {
+        const DiskDrive* d = &disks.drives[i];
+        if (!d->data) continue;
+        printf("Disk %c:       %s, %llu sectors read, %llu written (not saved)\n", "ABCD"[i], d->path,
+               (unsigned long long)d->reads, (unsigned long long)d->writes);
+    }
+    if (input_path) {
+        printf("Input:        %s, %zu scancodes not delivered\n", input_path, input_left);
+    }
+    if (cpu->kb_dropped) {
+        printf("Keyboard:     %u scancodes dropped, buffer full\n", cpu->kb_dropped);
+    }
+    if (trace_path) {
+        printf("Trace:        %llu records to %s\n", trace_records, trace_path);
+    }
+    if (profile_path) {
+        printf("Profile:      %s\n", profile_path);
+    }
+    if (checkpoints) {
+        printf("Checkpoints:  %u written, %.1f us average\n", checkpoints, checkpoint_time / checkpoints * 1e6);
+    }
+
+    int status = (cpu->stop_reason == STOP_UNKNOWN_OPCODE) ? 1 : 0;
+    disk_close(&disks);
+    free_cpu(cpu);
+    free(cpu);
+    return status;
+}
@@ -0,0 +1,5 @@
+#include "headless.h"
+
+int main(int argc, char** argv) {
+    return run_headless(argc, argv);
+}
@@ -0,0 +1,181 @@
+#include <stdlib.h>
+#include <string.h>
+#include "input_script.h"
+#include "throttle.h"
+
+// The clock device timers count at for a --clock value; "max" keeps the PC's.
+static unsigned long timer_clock(unsigned long hz) {
+    return hz == CLOCK_UNTHROTTLED ? CLOCK_PC : hz;
+}
+
+static int parse_line(InputScript* s, char* line, uint64_t last[2], size_t* capacity) {
+    char* hash = strchr(line, '#');
+    if (hash) *hash = '\0';
+    char* save;
+    char* word = strtok_r(line, " \t\r\n", &save);
+    if (!word) return 1;
+    if (strcmp(word, "clock") == 0) {
+        char* hz_text = strtok_r(NULL, " \t\r\n", &save);
+        if (!hz_text || strtok_r(NULL, " \t\r\n", &save)) return 0;
+        char* end;
+        unsigned long hz = strtoul(hz_text, &end, 10);
+        if (end == hz_text || *end || hz == 0) return 0;
+        s->clock_hz = hz;
+        return 1;
+    }
+    int clock;
+    if (strcmp(word, "insn") == 0) {
+        clock = INPUT_AT_INSTRUCTION;
+    } else if (strcmp(word, "cycle") == 0) {
+        clock = INPUT_AT_CYCLE;
+    } else {
+        return 0;
+    }
+    char* when_text = strtok_r(NULL, " \t\r\n", &save);
+    if (!when_text) return 0;
+    int relative = *when_text == '+';
+    char* end;
+    uint64_t when = strtoull(when_text + relative, &end, 10);
+    if (end == when_text + relative || *end) return 0;
+    if (relative) when += last[clock];
+    if (when < last[clock]) return 0;
+    last[clock] = when;
+
+    int codes = 0;
+    while ((word = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+        unsigned long code = strtoul(word, &end, 16);
+        if (end == word || *end || code > 0xFF) return 0;
+        if (s->count == *capacity) {
+            *capacity = *capacity ? *capacity * 2 : 64;
+            InputEvent* grown = realloc(s->events, *capacity * sizeof(InputEvent));
+            if (!grown) return 0;
+            s->events = grown;
+        }
+        s->events[s->count++] = (InputEvent){ when, (uint8_t)clock, (uint8_t)code };
+        codes++;
+    }
+    return codes > 0;
+}
+
+InputScript* input_script_load(const char* path, unsigned long clock_hz, FILE* log) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        fprintf(log, "Cannot open input script: %s\n", path);
+        return NULL;
+    }
+    InputScript* s = calloc(1, sizeof(InputScript));
+    if (!s) {
+        fclose(file);
+        return NULL;
+    }
+    uint64_t last[2] = { 0, 0 };
+    size_t capacity = 0;
+    char line[1024];
+    int number = 0;
+    while (fgets(line, sizeof(line), file)) {
+        number++;
+        if (!parse_line(s, line, last, &capacity)) {
+            fprintf(log, "%s:%d: expected \"insn|cycle [+]WHEN CODE...\" with times in order, or \"clock HZ\"\n",
+                    path, number);
+            fclose(file);
+            input_script_free(s);
+            return NULL;
+        }
+    }
+    fclose(file);
+    if (s->clock_hz == timer_clock(clock_hz)) {
+        s->clock_hz = 0;  // already the run's clock
+    } else if (s->clock_hz) {
+        fprintf(log, "%s: recorded at %.3f MHz, timing devices at that clock instead of %.3f MHz\n", path,
+                s->clock_hz / 1e6, timer_clock(clock_hz) / 1e6);
+    }
+    return s;
+}
+
+void input_script_free(InputScript* s) {
+    if (!s) return;
+    free(s->events);
+    free(s);
+}
+
+static void schedule_next(InputScript* s) {
+    if (s->next < s->count && s->events[s->next].clock == INPUT_AT_CYCLE) {
+        scheduler_set(&s->cpu->events, EVENT_INPUT, s->events[s->next].when);
+    } else {
+        scheduler_cancel(&s->cpu->events, EVENT_INPUT);
+    }
+}
+
+// A run of cycle events that are due; instruction events after them wait for
+// the next input_script_poll.
+static void cycle_event(void* ctx, uint64_t when) {
+    InputScript* s = ctx;
+    (void)when;
+    while (s->next < s->count && s->events[s->next].clock == INPUT_AT_CYCLE &&
+           s->events[s->next].when <= s->cpu->cycles) {
+        keyboard_push(s->cpu, s->events[s->next++].code);
+    }
+    schedule_next(s);
+}
+
+// The CPU waits in HLT with nothing scheduled to wake it. No instruction can
+// retire until an interrupt, so the next instruction event is due now.
+static void idle_event(void* ctx) {
+    InputScript* s = ctx;
+    if (s->next >= s->count || s->events[s->next].clock != INPUT_AT_INSTRUCTION) return;
+    uint64_t when = s->events[s->next].when;
+    while (s->next < s->count && s->events[s->next].clock == INPUT_AT_INSTRUCTION &&
+           s->events[s->next].when == when) {
+        keyboard_push(s->cpu, s->events[s->next++].code);
+    }
+    schedule_next(s);
+}
+
+void input_script_attach(InputScript* s, CPU8086* cpu) {
+    s->cpu = cpu;
+    s->next = 0;
+    scheduler_register(&cpu->events, EVENT_INPUT, cycle_event, s);
+    cpu->idle_hook = idle_event;
+    cpu->idle_ctx = s;
+    // pit_set_cpu_clock ignores the clock already in use, restored or not.
+    if (s->clock_hz) cpu_set_clock(cpu, s->clock_hz);
+    input_script_poll(s, 0);
+}
+
+// Stops at the first instruction event even behind cycle events, which may
+// come due in the middle of the slice.
+unsigned long input_script_slice(const InputScript* s, unsigned long long instructions, unsigned long slice) {
+    for (size_t i = s->next; i < s->count; i++) {
+        if (s->events[i].clock != INPUT_AT_INSTRUCTION) continue;
+        uint64_t when = s->events[i].when;
+        if (when > instructions && when - instructions < slice) slice = when - instructions;
+        break;
+    }
+    return slice;
+}
+
+void input_script_poll(InputScript* s, unsigned long long instructions) {
+    while (s->next < s->count) {
+        const InputEvent* e = &s->events[s->next];
+        uint64_t now = e->clock == INPUT_AT_CYCLE ? s->cpu->cycles : instructions;
+        if (e->when > now) break;
+        keyboard_push(s->cpu, e->code);
+        s->next++;
+    }
+    schedule_next(s);
+}
+
+FILE* input_record_open(const char* path, unsigned long clock_hz) {
+    FILE* out = fopen(path, "w");
+    if (out) fprintf(out, "clock %lu\n# clock  when  scancode\n", timer_clock(clock_hz));
+    return out;
+}
+
+void input_record_key(FILE* out, unsigned long long instructions, uint8_t code) {
+    fprintf(out, "insn %llu %02X\n", instructions, code);
+}
+
+int input_record_close(FILE* out) {
+    int ok = !ferror(out);
+    return fclose(out) == 0 && ok;
+}
@@ -0,0 +1,92 @@
+#include <stdlib.h>
+#include <string.h>
+#include "io_bus.h"
+
+#define IO_COUNT_BLOCK (1 << IO_COUNT_SHIFT)
+
+void io_bus_init(IoBus* bus) {
+    memset(bus, 0, sizeof(*bus));
+    bus->count = 1;
+}
+
+void io_bus_free(IoBus* bus) {
+    for (int i = 0; i < IO_PORTS >> IO_COUNT_SHIFT; i++) {
+        free(bus->unmapped[i]);
+        bus->unmapped[i] = NULL;
+    }
+}
+
+uint64_t io_bus_unmapped_count(const IoBus* bus, uint16_t port) {
+    const uint64_t* block = bus->unmapped[port >> IO_COUNT_SHIFT];
+    return block ? block[port & (IO_COUNT_BLOCK - 1)] : 0;
+}
+
+int io_bus_map(IoBus* bus, uint16_t first, uint32_t count, const IoHandler* handler) {
+    int slot = 0;
+    if (handler) {
+        while (slot < bus->count && bus->handlers[slot] != handler) slot++;
+        if (slot == bus->count) {
+            if (bus->count == IO_MAX_HANDLERS) return 0;
+            bus->handlers[bus->count++] = handler;
+        }
+    }
+    for (uint32_t i = 0; i < count && first + i < IO_PORTS; i++) {
+        bus->slot[first + i] = slot;
+    }
+    return 1;
+}
+
+static void note_unmapped(IoBus* bus, uint16_t port, const char* access, FILE* log) {
+    uint8_t bit = 1 << (port & 7);
+    uint64_t** block = &bus->unmapped[port >> IO_COUNT_SHIFT];
+    // Without memory for the block the port only shows in the totals.
+    if (!*block) *block = calloc(IO_COUNT_BLOCK, sizeof(uint64_t));
+    if (*block) (*block)[port & (IO_COUNT_BLOCK - 1)]++;
+    bus->unmapped_accesses++;
+    if (!(bus->unmapped_logged[port >> 3] & bit)) {
+        bus->unmapped_logged[port >> 3] |= bit;
+        bus->unmapped_ports++;
+        fprintf(log, "Warning: Attempted to %s unsupported port 0x%04X (further accesses are only counted)\n",
+                access, port);
+    }
+}
+
+static uint8_t read_byte(IoBus* bus, uint16_t port, FILE* log) {
+    const IoHandler* h = bus->handlers[bus->slot[port]];
+    if (!h || !h->read) {
+        note_unmapped(bus, port, "read from", log);
+        return 0;
+    }
+    return h->read(h->ctx, port, 0);
+}
+
+static void write_byte(IoBus* bus, uint16_t port, uint8_t value, FILE* log) {
+    const IoHandler* h = bus->handlers[bus->slot[port]];
+    if (!h || !h->write) {
+        note_unmapped(bus, port, "write to", log);
+        return;
+    }
+    h->write(h->ctx, port, value, 0);
+}
+
+uint16_t io_bus_read(IoBus* bus, uint16_t port, int word, FILE* log) {
+    if (!word) return read_byte(bus, port, log);
+    const IoHandler* h = bus->handlers[bus->slot[port]];
+    if (h && h->read && (h->widths & IO_WORD)) return h->read(h->ctx, port, 1);
+    uint8_t lo = read_byte(bus, port, log);
+    return lo | (read_byte(bus, port + 1, log) << 8);
+}
+
+void io_bus_write(IoBus* bus, uint16_t port, uint16_t value, int word, FILE* log) {
+    if (!word) {
+        write_byte(bus, port, value & 0xFF, log);
+        return;
+    }
+    const IoHandler* h = bus->handlers[bus->slot[port]];
+    if (h && h->write && (h->widths & IO_WORD)) {
+        h->write(h->ctx, port, value, 1);
+        return;
+    }
+    write_byte(bus, port, value & 0xFF, log);
+    write_byte(bus, port + 1, value >> 8, log);
+}
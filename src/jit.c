@@ -0,0 +1,702 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jit.h"
+
+#if defined(__x86_64__) && !defined(CPU_NO_JIT)
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <cpuid.h>
+
+/* x86-64 translation of hot blocks.
+
+   Native code keeps AX..DI in r8..r15 (low 16 bits, upper bits ignored), the
+   CPU8086 in rbx, guest memory in rbp, the JitFrame in rdi and the loop budget
+   in rcx; rax and rdx are scratch. Guest arithmetic flags live in the host
+   EFLAGS ("live") and are parked in the frame as lahf/seto would produce them
+   whenever address arithmetic needs the host flags. Nothing is called from
+   native code: anything it cannot do inline, including stores into pages
+   holding predecoded code, ROM or MMIO and words that wrap at offset FFFF,
+   exits to the interpreter before the instruction has any effect. */
+
+struct Jit {
+    uint8_t* arena;
+    size_t used;
+};
+
+typedef struct {
+    uint64_t budget;  // remaining iterations of a looping block
+    uint16_t flags;   // AH = FLAGS low byte, AL = OF, while flags are not live
+} JitFrame;
+
+typedef unsigned (*JitFn)(CPU8086* cpu, uint8_t* memory, JitFrame* frame);
+
+#define R_AX 0
+#define R_CX 1
+#define R_DX 2
+#define G(r) (8 + (r))  // host register holding guest register r
+
+// emit_op operand kinds other than a host register
+#define MEM_GUEST -1     // [rax + rbp]: guest memory at the address in eax
+#define MEM_CPU -2       // [rbx + disp32]: a CPU8086 field
+#define MEM_FRAME -3     // [rdi + disp8]: a JitFrame field
+#define MEM_CODE_MAP -4  // [rbx + rdx + disp32]: code_map[edx]
+
+#define OFF_REG(r) (int32_t)(offsetof(CPU8086, regs) + 2 * (r))
+#define OFF_SREG(s) (int32_t)(offsetof(CPU8086, sregs) + 2 * (s))
+#define OFF_IP (int32_t)offsetof(CPU8086, ip)
+#define OFF_CODE_MAP (int32_t)offsetof(CPU8086, code_map)
+#define OFF_BUDGET (int32_t)offsetof(JitFrame, budget)
+#define OFF_FLAGS (int32_t)offsetof(JitFrame, flags)
+
+// Worst case code for one block, checked before translating it.
+#define JIT_MAX_BLOCK_CODE 8192
+#define JIT_MAX_EXITS (3 * BLOCK_MAX_INSNS + 4)
+
+enum { ALU_ADD, ALU_OR, ALU_ADC, ALU_SBB, ALU_AND, ALU_SUB, ALU_XOR, ALU_CMP };
+
+typedef struct {
+    uint8_t* patch;   // rel32 to point at the stub
+    uint16_t ip;      // guest IP to resume at
+    uint8_t k;        // instructions of the block completed
+    uint8_t taken;    // extra clocks of the conditional branch taken to get here
+    uint8_t live;     // flags live when leaving
+    uint8_t back_edge;
+} JitExit;
+
+typedef struct {
+    uint8_t* p;
+    uint8_t* head;
+    int live;
+    int nexits;
+    int check_loads;  // some pages have MMIO read handlers
+    JitExit exits[JIT_MAX_EXITS];
+    uint16_t start_ip;
+} Emitter;
+
+static void emit8(Emitter* e, uint8_t v) {
+    *e->p++ = v;
+}
+
+static void emit16(Emitter* e, uint16_t v) {
+    memcpy(e->p, &v, 2);
+    e->p += 2;
+}
+
+static void emit32(Emitter* e, uint32_t v) {
+    memcpy(e->p, &v, 4);
+    e->p += 4;
+}
+
+static void emit_bytes(Emitter* e, const char* bytes, size_t n) {
+    memcpy(e->p, bytes, n);
+    e->p += n;
+}
+
+// Emits [66] [REX] opcode ModR/M for a size-byte operation between host
+// register reg (or a /digit) and rm, a host register or a MEM_* operand.
+// Opcodes above 0xFF are 0F-prefixed.
+static void emit_op(Emitter* e, int size, unsigned opcode, int reg, int rm, int32_t disp) {
+    int rex = 0;
+    if (size == 2) emit8(e, 0x66);
+    if (size == 8) rex |= 0x08;
+    if (reg & 8) rex |= 0x04;
+    if (rm >= 0 && (rm & 8)) rex |= 0x01;
+    if (rex || (size == 1 && rm >= 4)) emit8(e, 0x40 | rex);
+    if (opcode > 0xFF) emit8(e, opcode >> 8);
+    emit8(e, opcode & 0xFF);
+    reg &= 7;
+    switch (rm) {
+        case MEM_GUEST:
+            emit8(e, 0x04 | reg << 3);
+            emit8(e, 0x28);
+            break;
+        case MEM_CPU:
+            emit8(e, 0x83 | reg << 3);
+            emit32(e, disp);
+            break;
+        case MEM_FRAME:
+            emit8(e, 0x47 | reg << 3);
+            emit8(e, disp);
+            break;
+        case MEM_CODE_MAP:
+            emit8(e, 0x84 | reg << 3);
+            emit8(e, 0x13);
+            emit32(e, disp);
+            break;
+        default:
+            emit8(e, 0xC0 | reg << 3 | (rm & 7));
+            break;
+    }
+}
+
+static void emit_imm(Emitter* e, int size, uint16_t imm) {
+    if (size == 2) {
+        emit16(e, imm);
+    } else {
+        emit8(e, imm);
+    }
+}
+
+// Jump (E9 or 0F 8x) to an exit stub emitted after the block body.
+static void emit_exit(Emitter* e, unsigned jump, uint16_t ip, int k) {
+    if (jump > 0xFF) emit8(e, jump >> 8);
+    emit8(e, jump & 0xFF);
+    JitExit* x = &e->exits[e->nexits++];
+    x->patch = e->p;
+    x->ip = ip;
+    x->k = k;
+    x->live = e->live;
+    x->taken = 0;
+    x->back_edge = 0;
+    emit32(e, 0);
+}
+
+// Branch to a guest target: a back edge when it is the block's own start.
+// taken is what the branch costs beyond its not-taken time.
+static void emit_branch(Emitter* e, unsigned jump, uint16_t target, int k, int taken) {
+    emit_exit(e, jump, target, k);
+    e->exits[e->nexits - 1].taken = taken;
+    e->exits[e->nexits - 1].back_edge = target == e->start_ip;
+}
+
+static void flags_save(Emitter* e) {
+    if (!e->live) return;
+    emit8(e, 0x9F);                      // lahf
+    emit_bytes(e, "\x0F\x90\xC0", 3);    // seto al
+    emit_op(e, 2, 0x89, R_AX, MEM_FRAME, OFF_FLAGS);
+    e->live = 0;
+}
+
+static void flags_load(Emitter* e) {
+    if (e->live) return;
+    emit_op(e, 2, 0x8B, R_AX, MEM_FRAME, OFF_FLAGS);
+    emit_bytes(e, "\x04\x7F", 2);        // add al, 0x7F: OF = (al == 1)
+    emit8(e, 0x9E);                      // sahf
+    e->live = 1;
+}
+
+// flags_load for an instruction whose guest address is already in eax.
+static void flags_load_keep_addr(Emitter* e, int mem) {
+    if (e->live || !mem) {
+        flags_load(e);
+        return;
+    }
+    emit8(e, 0x50);                      // push rax
+    flags_load(e);
+    emit8(e, 0x58);                      // pop rax
+}
+
+// The interpreter clears AF after logical operations and shifts, where the
+// host leaves it undefined. The AND also clears OF, which only logical
+// operations are known to leave 0, so shifts park the flags instead.
+static void flags_clear_af(Emitter* e) {
+    emit_bytes(e, "\x9F\x80\xE4\xEF\x9E", 5);  // lahf; and ah, ~0x10; sahf
+}
+
+static void flags_save_clear_af(Emitter* e) {
+    emit8(e, 0x9F);                      // lahf
+    emit_bytes(e, "\x0F\x90\xC0", 3);    // seto al
+    emit_bytes(e, "\x80\xE4\xEF", 3);    // and ah, ~0x10
+    emit_op(e, 2, 0x89, R_AX, MEM_FRAME, OFF_FLAGS);
+    e->live = 0;
+}
+
+static const int8_t ea_base[8] = { 3, 3, 5, 5, 6, 7, 5, 3 };
+static const int8_t ea_index[8] = { 6, 7, 6, 7, -1, -1, -1, -1 };
+
+// edx = 16-bit offset of an EA_* form.
+static void emit_ea(Emitter* e, int ea, uint16_t disp) {
+    if (ea == EA_DIRECT) {
+        emit8(e, 0xBA);                  // mov edx, imm32
+        emit32(e, disp);
+        return;
+    }
+    int base = G(ea_base[ea]) & 7;
+    if (ea_index[ea] >= 0) {
+        emit_bytes(e, "\x43\x8D\x94", 3);  // lea edx, [base + index + disp32]
+        emit8(e, (G(ea_index[ea]) & 7) << 3 | base);
+    } else {
+        emit_bytes(e, "\x41\x8D", 2);      // lea edx, [base + disp32]
+        emit8(e, 0x90 | base);
+    }
+    emit32(e, disp);
+    emit_bytes(e, "\x0F\xB7\xD2", 3);    // movzx edx, dx
+}
+
+// eax = physical address of seg:edx. Exits to the interpreter for words at
+// offset FFFF, stores to anything but plain RAM without predecoded code, and
+// loads from MMIO pages with read handlers.
+static void emit_guest_addr(Emitter* e, int seg, int size, int store, uint16_t ip, int k) {
+    if (size == 2) {                     // a word at offset FFFF wraps inside the segment
+        emit_bytes(e, "\x81\xFA\xFF\xFF\x00\x00", 6);  // cmp edx, 0xFFFF
+        emit_exit(e, 0x0F84, ip, k);     // je
+    }
+    emit_op(e, 4, 0x0FB7, R_AX, MEM_CPU, OFF_SREG(seg));  // movzx eax, word [sreg]
+    emit_bytes(e, "\xC1\xE0\x04", 3);    // shl eax, 4
+    emit_bytes(e, "\x01\xD0", 2);        // add eax, edx
+    emit8(e, 0x25);                      // and eax, ADDR_MASK
+    emit32(e, ADDR_MASK);
+    if (!store && !e->check_loads) return;
+    for (int i = 0; i < size; i++) {
+        if (i == 0) {
+            emit_bytes(e, "\x89\xC2", 2);      // mov edx, eax
+        } else {
+            emit_bytes(e, "\x8D\x50\x01", 3);  // lea edx, [rax + 1]
+            emit_bytes(e, "\x81\xE2", 2);      // and edx, ADDR_MASK
+            emit32(e, ADDR_MASK);
+        }
+        emit8(e, 0xC1);                  // shr edx, CODE_PAGE_SHIFT
+        emit8(e, 0xEA);
+        emit8(e, CODE_PAGE_SHIFT);
+        if (store) {
+            emit_op(e, 1, 0x80, 7, MEM_CODE_MAP, OFF_CODE_MAP);  // cmp byte [code_map + rdx], 0
+            emit8(e, 0);
+        } else {
+            emit_op(e, 1, 0xF6, 0, MEM_CODE_MAP, OFF_CODE_MAP);  // test byte [code_map + rdx], imm8
+            emit8(e, CODE_MAP_MMIO_READ);
+        }
+        emit_exit(e, 0x0F85, ip, k);     // jne
+    }
+}
+
+static void emit_mem_operand(Emitter* e, const DecodedInsn* d, int size, int store, uint16_t ip, int k) {
+    flags_save(e);
+    emit_ea(e, d->ea, d->disp);
+    emit_guest_addr(e, d->seg, size, store, ip, k);
+}
+
+static void alu_done(Emitter* e, int op) {
+    e->live = 1;
+    if (op == ALU_OR || op == ALU_AND || op == ALU_XOR) flags_clear_af(e);
+}
+
+// Emits native code for one instruction. Returns 0, possibly after emitting
+// some code the caller rolls back, if it is left to the interpreter.
+static int compile_insn(Emitter* e, const DecodedInsn* d, uint16_t ip, int k) {
+    uint8_t op = d->opcode;
+    int size = (op & 1) ? 2 : 1;
+    int mem = d->ea < EA_REG;
+    int rm = mem ? MEM_GUEST : G(d->rm);
+    uint16_t next_ip = ip + d->length;
+
+    if (d->prefixes & ~PREFIX_SEG) return 0;
+
+    if (op < 0x40 && (op & 7) < 6) {
+        int alu = op >> 3;
+        int cf_in = alu == ALU_ADC || alu == ALU_SBB;
+        if ((op & 7) >= 4) {             // AL/AX, imm
+            if (cf_in) flags_load(e);
+            emit_op(e, size, size == 2 ? 0x81 : 0x80, alu, G(0), 0);
+            emit_imm(e, size, d->imm);
+        } else {
+            if (size == 1 && (d->reg >= 4 || (!mem && d->rm >= 4))) return 0;
+            if (mem) emit_mem_operand(e, d, size, !(op & 2) && alu != ALU_CMP, ip, k);
+            if (cf_in) flags_load_keep_addr(e, mem);
+            emit_op(e, size, op, G(d->reg), rm, 0);
+        }
+        alu_done(e, alu);
+        return 1;
+    }
+    if (op >= 0x40 && op <= 0x4F) {      // INC/DEC r16 keep CF
+        flags_load(e);
+        emit_op(e, 2, 0xFF, op >= 0x48, G(op & 7), 0);
+        return 1;
+    }
+    if (op >= 0x50 && op <= 0x57) {      // PUSH r16
+        flags_save(e);
+        emit_bytes(e, "\x41\x8D\x54\x24\xFE", 5);  // lea edx, [r12 - 2]
+        emit_bytes(e, "\x0F\xB7\xD2", 3);
+        emit_guest_addr(e, SREG_SS, 2, 1, ip, k);
+        emit_bytes(e, "\x45\x8D\x64\x24\xFE", 5);  // lea r12d, [r12 - 2]
+        emit_op(e, 2, 0x89, G(op & 7), MEM_GUEST, 0);  // PUSH SP stores the new SP
+        return 1;
+    }
+    if (op >= 0x58 && op <= 0x5F) {      // POP r16
+        flags_save(e);
+        emit_bytes(e, "\x41\x0F\xB7\xD4", 4);      // movzx edx, r12w
+        emit_guest_addr(e, SREG_SS, 2, 0, ip, k);
+        emit_op(e, 4, 0x0FB7, R_DX, MEM_GUEST, 0);
+        emit_bytes(e, "\x45\x8D\x64\x24\x02", 5);  // lea r12d, [r12 + 2]
+        emit_op(e, 2, 0x89, R_DX, G(op & 7), 0);
+        return 1;
+    }
+    if ((op >= 0x60 && op <= 0x7F)) {    // Jcc (60-6F alias 70-7F)
+        flags_load(e);
+        emit_branch(e, 0x0F80 | (op & 0x0F), next_ip + (int8_t)d->imm, k + 1, branch_taken_cycles(op));
+        emit_exit(e, 0xE9, next_ip, k + 1);
+        return 1;
+    }
+    if (op >= 0x80 && op <= 0x83) {
+        int alu = d->reg;
+        if (size == 1 && !mem && d->rm >= 4) return 0;
+        if (mem) emit_mem_operand(e, d, size, alu != ALU_CMP, ip, k);
+        if (alu == ALU_ADC || alu == ALU_SBB) flags_load_keep_addr(e, mem);
+        emit_op(e, size, op == 0x82 ? 0x80 : op, alu, rm, 0);
+        emit_imm(e, op == 0x81 ? 2 : 1, d->imm);
+        alu_done(e, alu);
+        return 1;
+    }
+    if (op == 0x84 || op == 0x85) {      // TEST r/m, reg
+        if (size == 1 && (d->reg >= 4 || (!mem && d->rm >= 4))) return 0;
+        if (mem) emit_mem_operand(e, d, size, 0, ip, k);
+        emit_op(e, size, op, G(d->reg), rm, 0);
+        alu_done(e, ALU_AND);
+        return 1;
+    }
+    if (op == 0x86 || op == 0x87) {      // XCHG reg, reg
+        if (mem || (size == 1 && (d->reg >= 4 || d->rm >= 4))) return 0;
+        emit_op(e, size, op, G(d->reg), rm, 0);
+        return 1;
+    }
+    if (op >= 0x88 && op <= 0x8B) {      // MOV
+        if (size == 1 && (d->reg >= 4 || (!mem && d->rm >= 4))) return 0;
+        if (mem) emit_mem_operand(e, d, size, op < 0x8A, ip, k);
+        emit_op(e, size, op, G(d->reg), rm, 0);
+        return 1;
+    }
+    if (op == 0x8C && !mem) {            // MOV r16, sreg
+        emit_op(e, 4, 0x0FB7, R_DX, MEM_CPU, OFF_SREG(d->reg & 3));
+        emit_op(e, 2, 0x89, R_DX, rm, 0);
+        return 1;
+    }
+    if (op == 0x8D && mem) {             // LEA
+        emit_ea(e, d->ea, d->disp);
+        emit_op(e, 2, 0x89, R_DX, G(d->reg), 0);
+        return 1;
+    }
+    if (op == 0x8E && !mem && (d->reg & 3) != SREG_CS) {  // MOV sreg, r16
+        emit_op(e, 2, 0x89, rm, MEM_CPU, OFF_SREG(d->reg & 3));
+        return 1;
+    }
+    if (op == 0x90) return 1;
+    if (op >= 0x91 && op <= 0x97) {      // XCHG AX, r16
+        emit_op(e, 2, 0x87, G(0), G(op & 7), 0);
+        return 1;
+    }
+    if (op == 0x98) {                    // CBW
+        emit_op(e, 2, 0x0FBE, G(0), G(0), 0);
+        return 1;
+    }
+    if (op >= 0xA0 && op <= 0xA3) {      // MOV AL/AX <-> moffs
+        flags_save(e);
+        emit_ea(e, EA_DIRECT, d->imm);
+        emit_guest_addr(e, d->seg, size, op >= 0xA2, ip, k);
+        emit_op(e, size, (op >= 0xA2 ? 0x88 : 0x8A) | (op & 1), G(0), MEM_GUEST, 0);
+        return 1;
+    }
+    if (op == 0xA8 || op == 0xA9) {      // TEST AL/AX, imm
+        emit_op(e, size, op == 0xA9 ? 0xF7 : 0xF6, 0, G(0), 0);
+        emit_imm(e, size, d->imm);
+        alu_done(e, ALU_AND);
+        return 1;
+    }
+    if (op >= 0xB0 && op <= 0xB3) {      // MOV r8, imm8 (AL..BL)
+        emit8(e, 0x41);
+        emit8(e, 0xB0 | (op & 7));
+        emit8(e, d->imm);
+        return 1;
+    }
+    if (op >= 0xB8 && op <= 0xBF) {      // MOV r16, imm16
+        emit_bytes(e, "\x66\x41", 2);
+        emit8(e, 0xB8 | (op & 7));
+        emit16(e, d->imm);
+        return 1;
+    }
+    if ((op == 0xC6 || op == 0xC7) && d->reg == 0) {  // MOV r/m, imm
+        if (size == 1 && !mem && d->rm >= 4) return 0;
+        if (mem) emit_mem_operand(e, d, size, 1, ip, k);
+        emit_op(e, size, op, 0, rm, 0);
+        emit_imm(e, size, d->imm);
+        return 1;
+    }
+    if ((op == 0xD0 || op == 0xD1) && !mem) {  // rotate/shift by 1
+        int sh = d->reg == 6 ? 4 : d->reg;
+        if (size == 1 && d->rm >= 4) return 0;
+        if (sh < 4) flags_load(e);       // rotates keep SF/ZF/AF/PF
+        emit_op(e, size, op, sh, rm, 0);
+        e->live = 1;
+        if (sh >= 4) flags_save_clear_af(e);
+        return 1;
+    }
+    if (op == 0xE2 || op == 0xE3) {      // LOOP, JCXZ: CX tested through jrcxz, flags untouched
+        uint16_t target = next_ip + (int8_t)d->imm;
+        if (op == 0xE2) emit_bytes(e, "\x45\x8D\x49\xFF", 4);  // lea r9d, [r9 - 1]
+        emit_bytes(e, "\x41\x0F\xB7\xD1", 4);  // movzx edx, r9w
+        emit_bytes(e, "\x48\x87\xCA", 3);      // xchg rdx, rcx
+        emit_bytes(e, "\xE3\x08", 2);          // jrcxz +8
+        emit_bytes(e, "\x48\x87\xCA", 3);
+        if (op == 0xE2) {
+            emit_branch(e, 0xE9, target, k + 1, branch_taken_cycles(op));
+        } else {
+            emit_exit(e, 0xE9, next_ip, k + 1);
+        }
+        emit_bytes(e, "\x48\x87\xCA", 3);
+        if (op == 0xE2) {
+            emit_exit(e, 0xE9, next_ip, k + 1);
+        } else {
+            emit_branch(e, 0xE9, target, k + 1, branch_taken_cycles(op));
+        }
+        return 1;
+    }
+    if (op == 0xE9 || op == 0xEB) {      // JMP rel16 / rel8
+        uint16_t rel = op == 0xEB ? (uint16_t)(int8_t)d->imm : d->imm;
+        emit_branch(e, 0xE9, next_ip + rel, k + 1, 0);
+        return 1;
+    }
+    if (op == 0xF5 || op == 0xF8 || op == 0xF9) {  // CMC, CLC, STC
+        flags_load(e);
+        emit8(e, op);
+        return 1;
+    }
+    if ((op == 0xF6 || op == 0xF7) && !mem && d->reg <= 3) {
+        if (size == 1 && d->rm >= 4) return 0;
+        if (d->reg <= 1) {               // TEST r, imm (/1 is an alias of /0)
+            emit_op(e, size, op, 0, rm, 0);
+            emit_imm(e, size, d->imm);
+            alu_done(e, ALU_AND);
+        } else {                         // NOT leaves flags, NEG sets them
+            emit_op(e, size, op, d->reg, rm, 0);
+            if (d->reg == 3) e->live = 1;
+        }
+        return 1;
+    }
+    if ((op == 0xFE || op == 0xFF) && !mem && d->reg <= 1) {  // INC/DEC r/m
+        if (size == 1 && d->rm >= 4) return 0;
+        flags_load(e);
+        emit_op(e, size, op, d->reg, rm, 0);
+        return 1;
+    }
+    return 0;
+}
+
+static void patch_rel32(uint8_t* patch, const uint8_t* target) {
+    int32_t rel = (int32_t)(target - (patch + 4));
+    memcpy(patch, &rel, 4);
+}
+
+static const uint8_t pushes[] = { 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57 };
+static const uint8_t pops[] = { 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B, 0xC3 };
+
+static int lahf_supported(void) {
+    unsigned a, b, c, d;
+    return __get_cpuid(0x80000001, &a, &b, &c, &d) && (c & 1);
+}
+
+// The arena is never writable and executable at once: it stays read/execute
+// except for the pages jit_compile is writing into.
+Jit* jit_create(void) {
+    if (!lahf_supported()) return NULL;
+    Jit* jit = malloc(sizeof(Jit));
+    if (!jit) return NULL;
+    jit->arena = mmap(NULL, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->arena == MAP_FAILED) {
+        free(jit);
+        return NULL;
+    }
+    // Hosts that refuse executable anonymous memory refuse it here.
+    if (mprotect(jit->arena, JIT_ARENA_SIZE, PROT_READ | PROT_EXEC) != 0) {
+        munmap(jit->arena, JIT_ARENA_SIZE);
+        free(jit);
+        return NULL;
+    }
+    jit->used = 0;
+    return jit;
+}
+
+void jit_destroy(Jit* jit) {
+    if (!jit) return;
+    munmap(jit->arena, JIT_ARENA_SIZE);
+    free(jit);
+}
+
+// Throws away all translations once the arena is full.
+static void jit_reset(CPU8086* cpu) {
+    for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
+        cpu->block_cache->blocks[i].native = NULL;
+    }
+    cpu->jit->used = 0;
+}
+
+// Emits b's native code at code. Returns its size, or 0 if the block is not
+// worth running natively.
+static size_t translate(CPU8086* cpu, Block* b, uint8_t* code) {
+    Emitter e;
+    e.p = code;
+    e.nexits = 0;
+    e.check_loads = cpu->map.read_handlers != 0;
+    e.start_ip = b->ip;
+
+    emit_bytes(&e, (const char*)pushes, sizeof(pushes));
+    emit_bytes(&e, "\x48\x89\xFB\x48\x89\xF5\x48\x89\xD7", 9);  // mov rbx, rdi; mov rbp, rsi; mov rdi, rdx
+    emit_op(&e, 8, 0x8B, R_CX, MEM_FRAME, OFF_BUDGET);
+    for (int r = 0; r < 8; r++) {
+        emit_op(&e, 4, 0x0FB7, G(r), MEM_CPU, OFF_REG(r));
+    }
+    // A looping block enters its head with the flags live.
+    e.live = 0;
+    flags_load(&e);
+    e.head = e.p;
+
+    uint16_t ip = b->ip;
+    int k = 0;
+    int ended = 0;
+    while (k < b->count) {
+        const DecodedInsn* d = &b->insns[k];
+        uint8_t* mark = e.p;
+        int live = e.live;
+        int nexits = e.nexits;
+        if (!compile_insn(&e, d, ip, k)) {
+            e.p = mark;
+            e.live = live;
+            e.nexits = nexits;
+            break;
+        }
+        ip += d->length;
+        k++;
+        if (d->flags & INSN_ENDS_BLOCK) {
+            ended = 1;
+            break;
+        }
+    }
+    if (!ended) emit_exit(&e, 0xE9, ip, k);
+
+    int loops = 0;
+    for (int i = 0; i < e.nexits; i++) {
+        loops |= e.exits[i].back_edge;
+    }
+    if (k == 0 || (k < 2 && !loops)) return 0;
+
+    // Each stub returns k | clocks << 8 for the instructions it completed;
+    // passes round a looping block are counted from the budget left.
+    unsigned cycles[BLOCK_MAX_INSNS + 1];
+    cycles[0] = 0;
+    for (int i = 0; i < k; i++) {
+        cycles[i + 1] = cycles[i] + b->insns[i].cycles;
+    }
+    b->lead_cycles = cycles[k - 1];
+    uint8_t* epilogue_patches[JIT_MAX_EXITS];
+    for (int i = 0; i < e.nexits; i++) {
+        JitExit* x = &e.exits[i];
+        patch_rel32(x->patch, e.p);
+        e.live = x->live;
+        unsigned exit_cycles = cycles[x->k] + x->taken;
+        if (x->back_edge) {
+            b->loop_cycles = exit_cycles;
+            exit_cycles = 0;
+            flags_load(&e);
+            emit_bytes(&e, "\x48\x8D\x49\xFF", 4);  // lea rcx, [rcx - 1]
+            emit_bytes(&e, "\xE3\x05", 2);          // jrcxz +5: budget used up
+            emit8(&e, 0xE9);
+            patch_rel32(e.p, e.head);
+            e.p += 4;
+            x->ip = b->ip;
+            x->k = 0;
+        }
+        flags_save(&e);
+        emit_op(&e, 2, 0xC7, 0, MEM_CPU, OFF_IP);
+        emit16(&e, x->ip);
+        emit8(&e, 0xB8);                 // mov eax, k | clocks << 8
+        emit32(&e, x->k | exit_cycles << 8);
+        emit8(&e, 0xE9);
+        epilogue_patches[i] = e.p;
+        e.p += 4;
+    }
+    for (int i = 0; i < e.nexits; i++) {
+        patch_rel32(epilogue_patches[i], e.p);
+    }
+    emit_op(&e, 8, 0x89, R_CX, MEM_FRAME, OFF_BUDGET);
+    for (int r = 0; r < 8; r++) {
+        emit_op(&e, 2, 0x89, G(r), MEM_CPU, OFF_REG(r));
+    }
+    emit_bytes(&e, (const char*)pops, sizeof(pops));
+
+    b->native_count = k;
+    b->loops = loops;
+    return e.p - code;
+}
+
+void jit_compile(CPU8086* cpu, Block* b) {
+    Jit* jit = cpu->jit;
+    if (JIT_ARENA_SIZE - jit->used < JIT_MAX_BLOCK_CODE) jit_reset(cpu);
+
+    uint8_t* code = jit->arena + jit->used;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    uint8_t* first = jit->arena + (jit->used & ~(page - 1));
+    size_t span = (code + JIT_MAX_BLOCK_CODE - first + page - 1) & ~(page - 1);
+    if (first + span > jit->arena + JIT_ARENA_SIZE) span = jit->arena + JIT_ARENA_SIZE - first;
+    if (mprotect(first, span, PROT_READ | PROT_WRITE) != 0) return;
+    size_t size = translate(cpu, b, code);
+    if (mprotect(first, span, PROT_READ | PROT_EXEC) != 0 || size == 0) return;
+
+    jit->used += size;
+    jit->used = (jit->used + 15) & ~(size_t)15;
+    b->native = code;
+    cpu->block_cache->translated++;
+}
+
+unsigned long jit_run(CPU8086* cpu, Block* b, unsigned long budget, unsigned* resume) {
+    JitFrame frame;
+    *resume = 0;
+    if (cpu->cs != b->cs || cpu->ip != b->ip) return 0;
+    // The interpreter stops at the first instruction boundary at or past the
+    // next device deadline. Native code only checks its budget, so it must
+    // not cross the deadline before its last instruction: if even one pass
+    // would, the interpreter runs the block instead.
+    if (cpu->events.next <= cpu->cycles + b->lead_cycles) return 0;
+    if (b->loops) {
+        frame.budget = budget / b->count;
+        if (cpu->events.next != SCHED_NEVER) {
+            uint64_t left = cpu->events.next - cpu->cycles - b->lead_cycles - 1;
+            uint64_t passes = left / b->loop_cycles + 1;
+            if (passes < frame.budget) frame.budget = passes;
+        }
+        if (frame.budget == 0) return 0;
+    } else {
+        if (budget < b->native_count) return 0;
+        frame.budget = 0;
+    }
+    uint64_t iterations = frame.budget;
+    uint16_t flags = cpu_get_flags(cpu);
+    frame.flags = (flags & 0xFF) << 8 | ((flags >> 11) & 1);
+
+    unsigned exit = ((JitFn)b->native)(cpu, cpu->memory, &frame);
+    unsigned k = exit & 0xFF;
+    uint64_t passes = iterations - frame.budget;
+    cpu->cycles += passes * b->loop_cycles + (exit >> 8);
+
+    cpu->flags.carry = (frame.flags >> 8) & 1;
+    cpu->flags.parity = (frame.flags >> 10) & 1;
+    cpu->flags.auxiliary = (frame.flags >> 12) & 1;
+    cpu->flags.zero = (frame.flags >> 14) & 1;
+    cpu->flags.sign = (frame.flags >> 15) & 1;
+    cpu->flags.overflow = frame.flags & 1;
+    *resume = k;
+    return passes * b->count + k;
+}
+
+#else
+
+Jit* jit_create(void) {
+    return NULL;
+}
+
+void jit_destroy(Jit* jit) {
+    (void)jit;
+}
+
+void jit_compile(CPU8086* cpu, Block* b) {
+    (void)cpu;
+    (void)b;
+}
+
+unsigned long jit_run(CPU8086* cpu, Block* b, unsigned long budget, unsigned* resume) {
+    (void)cpu;
+    (void)b;
+    (void)budget;
+    *resume = 0;
+    return 0;
+}
+
+#endif
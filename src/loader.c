@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "loader.h"
+
+#define MZ_HEADER_SIZE 0x1C
+
+typedef struct {
+    int fd;
+    const uint8_t* data;  // whole file, mapped read-only
+    size_t size;
+} Image;
+
+static int image_open(CPU8086* cpu, const char* filename, Image* img) {
+    struct stat st;
+    img->data = NULL;
+    img->fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (img->fd < 0) {
+        fprintf(cpu->log, "Cannot open firmware file: %s\n", filename);
+        return 0;
+    }
+    if (fstat(img->fd, &st) != 0 || st.st_size == 0) {
+        fprintf(cpu->log, "Empty or unreadable image: %s\n", filename);
+        close(img->fd);
+        return 0;
+    }
+    img->size = st.st_size;
+    if (img->size > MEMORY_SIZE) {
+        fprintf(cpu->log, "Image too large: %zu bytes\n", img->size);
+        close(img->fd);
+        return 0;
+    }
+    void* data = mmap(NULL, img->size, PROT_READ, MAP_PRIVATE, img->fd, 0);
+    if (data == MAP_FAILED) {
+        fprintf(cpu->log, "Cannot map image: %s\n", filename);
+        close(img->fd);
+        return 0;
+    }
+    img->data = data;
+    return 1;
+}
+
+static void image_close(Image* img) {
+    munmap((void*)img->data, img->size);
+    close(img->fd);
+}
+
+static uint16_t le16(const uint8_t* p) {
+    return p[0] | (p[1] << 8);
+}
+
+static int has_suffix(const char* name, const char* suffix) {
+    size_t len = strlen(name), n = strlen(suffix);
+    return len >= n && strcasecmp(name + len - n, suffix) == 0;
+}
+
+static void copy_in(CPU8086* cpu, uint32_t addr, const uint8_t* data, size_t size) {
+    memcpy(cpu->memory + addr, data, size);
+    cpu_mark_dirty(cpu, addr, size);
+}
+
+static void set_entry(CPU8086* cpu, uint16_t cs, uint16_t ip, uint16_t ss, uint16_t sp, uint16_t ds) {
+    cpu->cs = cs;
+    cpu->ip = ip;
+    cpu->ss = ss;
+    cpu->sp = sp;
+    cpu->ds = cpu->es = ds;
+}
+
+// What DOS puts in front of a program that it looks at: INT 20h to return
+// through, the end of its memory and an empty command tail.
+static void build_psp(CPU8086* cpu, uint16_t psp) {
+    uint8_t* p = cpu->memory + psp * 16;
+    memset(p, 0, 0x100);
+    p[0] = 0xCD;
+    p[1] = 0x20;
+    p[2] = LOADER_MEMORY_TOP & 0xFF;
+    p[3] = LOADER_MEMORY_TOP >> 8;
+    p[0x81] = 0x0D;
+    cpu_mark_dirty(cpu, psp * 16, 0x100);
+}
+
+static int load_flat(CPU8086* cpu, const Image* img) {
+    if (img->size > MEMORY_SIZE - 0x0100) {
+        fprintf(cpu->log, "Firmware too large: %zu bytes\n", img->size);
+        return 0;
+    }
+    copy_in(cpu, 0x0100, img->data, img->size);
+    return 1;
+}
+
+static int load_com(CPU8086* cpu, const Image* img) {
+    uint16_t psp = LOADER_PSP_SEGMENT;
+    if (img->size > 0x10000 - 0x0100 - 2) {
+        fprintf(cpu->log, "COM program too large: %zu bytes\n", img->size);
+        return 0;
+    }
+    build_psp(cpu, psp);
+    copy_in(cpu, psp * 16 + 0x0100, img->data, img->size);
+    // A near RET from the program lands on the INT 20h at PSP:0000.
+    cpu->memory[psp * 16 + 0xFFFE] = 0;
+    cpu->memory[psp * 16 + 0xFFFF] = 0;
+    cpu_mark_dirty(cpu, psp * 16 + 0xFFFE, 2);
+    set_entry(cpu, psp, 0x0100, psp, 0xFFFE, psp);
+    return 1;
+}
+
+static int load_exe(CPU8086* cpu, const Image* img) {
+    const uint8_t* h = img->data;
+    uint16_t psp = LOADER_PSP_SEGMENT;
+    uint16_t load = psp + 0x10;
+    if (img->size < MZ_HEADER_SIZE) {
+        fprintf(cpu->log, "Truncated MZ header\n");
+        return 0;
+    }
+    uint32_t pages = le16(h + 4), last = le16(h + 2);
+    uint32_t relocs = le16(h + 6), header = le16(h + 8) * 16;
+    uint32_t min_alloc = le16(h + 0x0A) * 16;
+    uint32_t reloc_table = le16(h + 0x18);
+    uint32_t end = pages * 512 - (last ? 512 - last : 0);
+    if (end > img->size) end = img->size;  // some linkers overstate the last page
+    if (pages == 0 || header > end || reloc_table + relocs * 4 > img->size) {
+        fprintf(cpu->log, "Malformed MZ header\n");
+        return 0;
+    }
+    uint32_t module = end - header;
+    if (load * 16 + module + min_alloc > LOADER_MEMORY_TOP * 16) {
+        fprintf(cpu->log, "MZ program needs more than conventional memory: %u bytes\n", module + min_alloc);
+        return 0;
+    }
+    build_psp(cpu, psp);
+    copy_in(cpu, load * 16, h + header, module);
+    for (uint32_t i = 0; i < relocs; i++) {
+        const uint8_t* r = h + reloc_table + i * 4;
+        uint32_t addr = ((uint32_t)(uint16_t)(load + le16(r + 2)) * 16 + le16(r)) & ADDR_MASK;
+        uint16_t value = le16(cpu->memory + addr) + load;
+        cpu->memory[addr] = value & 0xFF;
+        cpu->memory[addr + 1] = value >> 8;  // the mirror takes FFFFF + 1
+    }
+    set_entry(cpu, load + le16(h + 0x16), le16(h + 0x14), load + le16(h + 0x0E), le16(h + 0x10), psp);
+    return 1;
+}
+
+int load_rom(CPU8086* cpu, const char* filename, uint32_t base) {
+    Image img;
+    if (!image_open(cpu, filename, &img)) return 0;
+    if (base == 0) base = MEMORY_SIZE - img.size;
+    if (base + img.size > MEMORY_SIZE) {
+        fprintf(cpu->log, "ROM at 0x%05X does not fit below 1MB: %zu bytes\n", base, img.size);
+        image_close(&img);
+        return 0;
+    }
+    if (!guest_memory_map_file(cpu->memory, base, img.fd, img.size)) {
+        memcpy(cpu->memory + base, img.data, img.size);
+    }
+    cpu_mark_dirty(cpu, base, img.size);
+    cpu_map_memory(cpu, base, img.size, MAP_ROM, NULL);
+    image_close(&img);
+    return 1;
+}
+
+int load_firmware(CPU8086* cpu, const char* filename) {
+    if (has_suffix(filename, ".rom")) {
+        if (!load_rom(cpu, filename, 0)) return 0;
+        cpu->cs = 0xFFFF;
+        cpu->ip = 0x0000;
+        return 1;
+    }
+    Image img;
+    if (!image_open(cpu, filename, &img)) return 0;
+    int ok;
+    if (img.size >= 2 && img.data[0] == 'M' && img.data[1] == 'Z') {
+        ok = load_exe(cpu, &img);
+    } else if (has_suffix(filename, ".com")) {
+        ok = load_com(cpu, &img);
+    } else {
+        ok = load_flat(cpu, &img);
+    }
+    image_close(&img);
+    return ok;
+}
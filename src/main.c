@@ -1,13 +1,75 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <raylib.h>
 #include "cpu8086.h"
+#include "screen.h"
+#include "core_thread.h"
+#include "headless.h"
+#include "input_script.h"
+#include "loader.h"
+
+// raylib key to PC/XT (set 1) make code; the break code adds 0x80. The
+// arrows and the keys above them are the keypad's, as on the XT keyboard.
+static const struct {
+    int key;
+    uint8_t code;
+} scancodes[] = {
+    { KEY_ESCAPE, 0x01 }, { KEY_ONE, 0x02 }, { KEY_TWO, 0x03 }, { KEY_THREE, 0x04 },
+    { KEY_FOUR, 0x05 }, { KEY_FIVE, 0x06 }, { KEY_SIX, 0x07 }, { KEY_SEVEN, 0x08 },
+    { KEY_EIGHT, 0x09 }, { KEY_NINE, 0x0A }, { KEY_ZERO, 0x0B }, { KEY_MINUS, 0x0C },
+    { KEY_EQUAL, 0x0D }, { KEY_BACKSPACE, 0x0E }, { KEY_TAB, 0x0F }, { KEY_Q, 0x10 },
+    { KEY_W, 0x11 }, { KEY_E, 0x12 }, { KEY_R, 0x13 }, { KEY_T, 0x14 }, { KEY_Y, 0x15 },
+    { KEY_U, 0x16 }, { KEY_I, 0x17 }, { KEY_O, 0x18 }, { KEY_P, 0x19 },
+    { KEY_LEFT_BRACKET, 0x1A }, { KEY_RIGHT_BRACKET, 0x1B }, { KEY_ENTER, 0x1C },
+    { KEY_LEFT_CONTROL, 0x1D }, { KEY_A, 0x1E }, { KEY_S, 0x1F }, { KEY_D, 0x20 },
+    { KEY_F, 0x21 }, { KEY_G, 0x22 }, { KEY_H, 0x23 }, { KEY_J, 0x24 }, { KEY_K, 0x25 },
+    { KEY_L, 0x26 }, { KEY_SEMICOLON, 0x27 }, { KEY_APOSTROPHE, 0x28 }, { KEY_GRAVE, 0x29 },
+    { KEY_LEFT_SHIFT, 0x2A }, { KEY_BACKSLASH, 0x2B }, { KEY_Z, 0x2C }, { KEY_X, 0x2D },
+    { KEY_C, 0x2E }, { KEY_V, 0x2F }, { KEY_B, 0x30 }, { KEY_N, 0x31 }, { KEY_M, 0x32 },
+    { KEY_COMMA, 0x33 }, { KEY_PERIOD, 0x34 }, { KEY_SLASH, 0x35 }, { KEY_RIGHT_SHIFT, 0x36 },
+    { KEY_LEFT_ALT, 0x38 }, { KEY_SPACE, 0x39 }, { KEY_CAPS_LOCK, 0x3A }, { KEY_F1, 0x3B },
+    { KEY_F2, 0x3C }, { KEY_F3, 0x3D }, { KEY_F4, 0x3E }, { KEY_F5, 0x3F }, { KEY_F6, 0x40 },
+    { KEY_F7, 0x41 }, { KEY_F8, 0x42 }, { KEY_F9, 0x43 }, { KEY_F10, 0x44 },
+    { KEY_HOME, 0x47 }, { KEY_UP, 0x48 }, { KEY_PAGE_UP, 0x49 }, { KEY_LEFT, 0x4B },
+    { KEY_RIGHT, 0x4D }, { KEY_END, 0x4F }, { KEY_DOWN, 0x50 }, { KEY_PAGE_DOWN, 0x51 },
+    { KEY_INSERT, 0x52 }, { KEY_DELETE, 0x53 },
+};
+
+// Sends the make and break codes of every key pressed or released this frame.
+static void send_keys(CoreThread* core) {
+    for (size_t i = 0; i < sizeof(scancodes) / sizeof(scancodes[0]); i++) {
+        if (IsKeyPressed(scancodes[i].key)) core_send_key(core, scancodes[i].code);
+        if (IsKeyReleased(scancodes[i].key)) core_send_key(core, scancodes[i].code | 0x80);
+    }
+}
+
+int main(int argc, char** argv) {
+    unsigned long clock_hz = CLOCK_PC;
+    const char* record_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0) {
+            return run_headless(argc, argv);
+        }
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--clock") == 0 && i + 1 < argc) {
+            if (!throttle_parse_clock(argv[++i], &clock_hz)) {
+                fprintf(stderr, "Invalid clock: %s\n", argv[i]);
+                return 2;
+            }
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        }
+    }
 
-int main(void) {
     CPU8086 cpu;
-    init_cpu(&cpu);
+    if (!init_cpu(&cpu, stderr)) {
+        return 1;
+    }
 
     if (!load_firmware(&cpu, "bin/proshivka.bin")) {
+        free_cpu(&cpu);
         return 1;
     }
 
@@ -29,9 +91,48 @@ int main(void) {
         font = GetFontDefault();
     }
 
+    Screen screen;
+    if (!screen_init(&screen, "include/terminus.ttf", char_width, char_height)) {
+        fprintf(stderr, "Cannot create the screen textures\n");
+        UnloadFont(font);
+        CloseWindow();
+        free_cpu(&cpu);
+        return 1;
+    }
+
+    // From here until core_stop the CPU belongs to the core thread; the UI
+    // only sees it through snapshots.
+    FILE* record = NULL;
+    if (record_path) {
+        record = input_record_open(record_path, clock_hz);
+        if (!record) {
+            fprintf(stderr, "Cannot create input script: %s\n", record_path);
+            screen_unload(&screen);
+            UnloadFont(font);
+            CloseWindow();
+            free_cpu(&cpu);
+            return 1;
+        }
+    }
+    CoreThread core;
+    if (!core_start(&core, &cpu, clock_hz, record)) {
+        fprintf(stderr, "Cannot start the emulation thread\n");
+        if (record) input_record_close(record);
+        screen_unload(&screen);
+        UnloadFont(font);
+        CloseWindow();
+        free_cpu(&cpu);
+        return 1;
+    }
+    CoreSnapshot snap, prev;
+    core_snapshot(&core, &snap);
+    prev = snap;
+
     
     bool auto_run = true;
-    unsigned long instruction_count = 0;
+    unsigned long long last_count = 0;
+    uint64_t last_cycles = 0;
+    float mhz = 0.0f;
     float ops_timer = 0.0f;
     float ops = 0.0f;
     const float ops_update_interval = 1.0f;
@@ -44,12 +145,8 @@ int main(void) {
     Color panel_color = (Color){20, 20, 20, 200};
     Color changed_color = (Color){255, 165, 0, 255}; 
 
-    
-    uint16_t prev_ax = cpu.ax, prev_bx = cpu.bx, prev_cx = cpu.cx, prev_dx = cpu.dx;
-    uint16_t prev_cs = cpu.cs, prev_ds = cpu.ds, prev_es = cpu.es, prev_ss = cpu.ss, prev_ip = cpu.ip;
-    uint8_t prev_carry = cpu.flags.carry, prev_zero = cpu.flags.zero, prev_sign = cpu.flags.sign;
-    uint8_t prev_overflow = cpu.flags.overflow, prev_parity = cpu.flags.parity;
-    uint8_t prev_auxiliary = cpu.flags.auxiliary, prev_interrupt = cpu.flags.interrupt;
+    // Bit positions in the FLAGS word, in panel order: C Z S O P A I
+    const int flag_bits[7] = { 0, 6, 7, 11, 2, 4, 9 };
 
 	printf("Memory size: %d bytes\n", MEMORY_SIZE);
 	printf("Screen size: %dx%d\n", SCREEN_WIDTH, SCREEN_HEIGHT);
@@ -61,34 +158,27 @@ int main(void) {
        
         if (IsKeyPressed(KEY_A)) {
             auto_run = !auto_run;
+            core_set_auto_run(&core, auto_run);
         }
 
-        int key = GetKeyPressed();
-        if (key != 0 && cpu.running) {
-            cpu.keyboard_buffer[cpu.kb_tail] = (uint8_t)key;
-            cpu.kb_tail = (cpu.kb_tail + 1) % 256;
-            cpu.kb_status |= 0x01;
-        }
+        send_keys(&core);
 
-        if (!auto_run && IsKeyPressed(KEY_SPACE) && cpu.running) {
-            execute_instruction(&cpu);
-            instruction_count++;
+        if (!auto_run && IsKeyPressed(KEY_SPACE)) {
+            core_step(&core);
         }
 
-        if (auto_run && cpu.running) {
-            for (int i = 0; i < 100000; i++) {
-                if (!cpu.running) break;
-                execute_instruction(&cpu);
-                instruction_count++;
-            }
-        }
+        core_snapshot(&core, &snap);
 
         if (ops_timer >= ops_update_interval) {
-            ops = instruction_count / ops_timer;
-            instruction_count = 0;
+            ops = (snap.instructions - last_count) / ops_timer;
+            mhz = (snap.cycles - last_cycles) / ops_timer / 1e6f;
+            last_count = snap.instructions;
+            last_cycles = snap.cycles;
             ops_timer = 0.0f;
         }
 
+        screen_update(&screen, snap.vram, snap.cga_mode, snap.cga_color);
+
         // === GUI Rendering ===
         BeginDrawing();
         ClearBackground(bg_color);
@@ -103,13 +193,13 @@ int main(void) {
         // Screen border and background
         DrawRectangle(screen_x - 6, screen_y - 6, screen_width_pixels + 12, screen_height_pixels + 12, border_color);
         DrawRectangle(screen_x - 4, screen_y - 4, screen_width_pixels + 8, screen_height_pixels + 8, panel_color);
-        draw_screen(&cpu, screen_x, screen_y, char_width, char_height, font);
+        screen_draw(&screen, screen_x, screen_y);
 
         // Status panel
         DrawRectangle(0, window_height - 40, window_width, 40, panel_color);
         char status_text[128];
-        snprintf(status_text, sizeof(status_text), "Status: %s  |  OP/S: %.0f  |  Auto-run: %s  |  Press [SPACE] to Step",
-                 cpu.running ? "RUNNING" : "HALTED", ops, auto_run ? "ON" : "OFF");
+        snprintf(status_text, sizeof(status_text), "Status: %s | OP/S: %.0f | MHz: %.2f | Auto-run: %s | [SPACE] Step",
+                 snap.running ? "RUNNING" : "HALTED", ops, mhz, auto_run ? "ON" : "OFF");
         Vector2 status_size = MeasureTextEx(font, status_text, 18, 1);
         DrawTextEx(font, status_text, 
                    (Vector2){(window_width - status_size.x) / 2, window_height - 30}, 
@@ -118,58 +208,61 @@ int main(void) {
         // Mini debug panel for registers
         char reg_text[128];
         snprintf(reg_text, sizeof(reg_text), "AX: 0x%04X  BX: 0x%04X  CX: 0x%04X  DX: 0x%04X",
-                 cpu.ax, cpu.bx, cpu.cx, cpu.dx);
+                 snap.ax, snap.bx, snap.cx, snap.dx);
         DrawTextEx(font, reg_text, 
                    (Vector2){10, window_height - 70}, 
                    16, 1, text_color);
         // Highlight changed registers
-        if (cpu.ax != prev_ax) DrawRectangle(10, window_height - 70, 60, 16, Fade(changed_color, 0.3f));
-        if (cpu.bx != prev_bx) DrawRectangle(90, window_height - 70, 60, 16, Fade(changed_color, 0.3f));
-        if (cpu.cx != prev_cx) DrawRectangle(170, window_height - 70, 60, 16, Fade(changed_color, 0.3f));
-        if (cpu.dx != prev_dx) DrawRectangle(250, window_height - 70, 60, 16, Fade(changed_color, 0.3f));
+        if (snap.ax != prev.ax) DrawRectangle(10, window_height - 70, 60, 16, Fade(changed_color, 0.3f));
+        if (snap.bx != prev.bx) DrawRectangle(90, window_height - 70, 60, 16, Fade(changed_color, 0.3f));
+        if (snap.cx != prev.cx) DrawRectangle(170, window_height - 70, 60, 16, Fade(changed_color, 0.3f));
+        if (snap.dx != prev.dx) DrawRectangle(250, window_height - 70, 60, 16, Fade(changed_color, 0.3f));
 
         // Debug panel for segment registers
         char seg_text[128];
         snprintf(seg_text, sizeof(seg_text), "CS: 0x%04X  DS: 0x%04X  ES: 0x%04X  SS: 0x%04X  IP: 0x%04X",
-                 cpu.cs, cpu.ds, cpu.es, cpu.ss, cpu.ip);
+                 snap.cs, snap.ds, snap.es, snap.ss, snap.ip);
         DrawTextEx(font, seg_text, 
                    (Vector2){10, window_height - 90}, 
                    16, 1, text_color);
         // Highlight changed segment registers
-        if (cpu.cs != prev_cs) DrawRectangle(10, window_height - 90, 60, 16, Fade(changed_color, 0.3f));
-        if (cpu.ds != prev_ds) DrawRectangle(90, window_height - 90, 60, 16, Fade(changed_color, 0.3f));
-        if (cpu.es != prev_es) DrawRectangle(170, window_height - 90, 60, 16, Fade(changed_color, 0.3f));
-        if (cpu.ss != prev_ss) DrawRectangle(250, window_height - 90, 60, 16, Fade(changed_color, 0.3f));
-        if (cpu.ip != prev_ip) DrawRectangle(330, window_height - 90, 60, 16, Fade(changed_color, 0.3f));
+        if (snap.cs != prev.cs) DrawRectangle(10, window_height - 90, 60, 16, Fade(changed_color, 0.3f));
+        if (snap.ds != prev.ds) DrawRectangle(90, window_height - 90, 60, 16, Fade(changed_color, 0.3f));
+        if (snap.es != prev.es) DrawRectangle(170, window_height - 90, 60, 16, Fade(changed_color, 0.3f));
+        if (snap.ss != prev.ss) DrawRectangle(250, window_height - 90, 60, 16, Fade(changed_color, 0.3f));
+        if (snap.ip != prev.ip) DrawRectangle(330, window_height - 90, 60, 16, Fade(changed_color, 0.3f));
 
         // Debug panel for flags
+        int flag[7];
+        for (int i = 0; i < 7; i++) {
+            flag[i] = (snap.flags >> flag_bits[i]) & 1;
+        }
         char flags_text[128];
         snprintf(flags_text, sizeof(flags_text), "Flags: C:%d Z:%d S:%d O:%d P:%d A:%d I:%d",
-                 cpu.flags.carry, cpu.flags.zero, cpu.flags.sign, cpu.flags.overflow,
-                 cpu.flags.parity, cpu.flags.auxiliary, cpu.flags.interrupt);
+                 flag[0], flag[1], flag[2], flag[3], flag[4], flag[5], flag[6]);
         DrawTextEx(font, flags_text, 
                    (Vector2){10, window_height - 110}, 
                    16, 1, text_color);
         // Highlight changed flags
-        if (cpu.flags.carry != prev_carry) DrawRectangle(60, window_height - 110, 20, 16, Fade(changed_color, 0.3f));
-        if (cpu.flags.zero != prev_zero) DrawRectangle(90, window_height - 110, 20, 16, Fade(changed_color, 0.3f));
-        if (cpu.flags.sign != prev_sign) DrawRectangle(120, window_height - 110, 20, 16, Fade(changed_color, 0.3f));
-        if (cpu.flags.overflow != prev_overflow) DrawRectangle(150, window_height - 110, 20, 16, Fade(changed_color, 0.3f));
-        if (cpu.flags.parity != prev_parity) DrawRectangle(180, window_height - 110, 20, 16, Fade(changed_color, 0.3f));
-        if (cpu.flags.auxiliary != prev_auxiliary) DrawRectangle(210, window_height - 110, 20, 16, Fade(changed_color, 0.3f));
-        if (cpu.flags.interrupt != prev_interrupt) DrawRectangle(240, window_height - 110, 20, 16, Fade(changed_color, 0.3f));
+        for (int i = 0; i < 7; i++) {
+            if (flag[i] != ((prev.flags >> flag_bits[i]) & 1)) {
+                DrawRectangle(60 + 30 * i, window_height - 110, 20, 16, Fade(changed_color, 0.3f));
+            }
+        }
 
         // Update previous values for next frame
-        prev_ax = cpu.ax; prev_bx = cpu.bx; prev_cx = cpu.cx; prev_dx = cpu.dx;
-        prev_cs = cpu.cs; prev_ds = cpu.ds; prev_es = cpu.es; prev_ss = cpu.ss; prev_ip = cpu.ip;
-        prev_carry = cpu.flags.carry; prev_zero = cpu.flags.zero; prev_sign = cpu.flags.sign;
-        prev_overflow = cpu.flags.overflow; prev_parity = cpu.flags.parity;
-        prev_auxiliary = cpu.flags.auxiliary; prev_interrupt = cpu.flags.interrupt;
+        prev = snap;
 
         EndDrawing();
     }
 
+    core_stop(&core);
+    if (record && !input_record_close(record)) {
+        fprintf(stderr, "Cannot write input script: %s\n", record_path);
+    }
+    screen_unload(&screen);
     UnloadFont(font);
     CloseWindow();
+    free_cpu(&cpu);
     return 0;
 }
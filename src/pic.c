@@ -0,0 +1,190 @@
+#include <string.h>
+#include "pic.h"
+
+// First level set in bits, in priority order starting after c->lowest.
+static int highest(const Pic8259* c, uint8_t bits) {
+    for (int i = 1; i <= 8; i++) {
+        int level = (c->lowest + i) & 7;
+        if (bits & (1 << level)) return level;
+    }
+    return -1;
+}
+
+// Level the chip would interrupt with, or -1. cascade_irr holds the requests
+// of the master's slave inputs.
+static int pending_level(const Pic8259* c, uint8_t cascade_irr) {
+    uint8_t req = (c->irr | cascade_irr) & ~c->imr;
+    if (!req) return -1;
+    for (int i = 1; i <= 8; i++) {
+        int level = (c->lowest + i) & 7;
+        uint8_t bit = 1 << level;
+        if (c->isr & bit) {
+            // In special fully nested mode a slave may interrupt again while
+            // its input is in service; in special mask mode ISR blocks nothing.
+            if (c->nested && (cascade_irr & req & bit)) return level;
+            if (!c->special_mask) return -1;
+        } else if (req & bit) {
+            return level;
+        }
+    }
+    return -1;
+}
+
+// Request line from the slave, as seen on the master's inputs.
+static uint8_t cascade_irr(const Pic* pic) {
+    if (pic->master.single || pending_level(&pic->slave, 0) < 0) return 0;
+    return pic->master.cascade & (1 << (pic->slave.cascade & 7));
+}
+
+static void update(Pic* pic) {
+    pic->intr = pending_level(&pic->master, cascade_irr(pic)) >= 0;
+}
+
+static void start_service(Pic8259* c, int level) {
+    c->irr &= ~(1 << level);
+    if (!c->auto_eoi) {
+        c->isr |= 1 << level;
+    } else if (c->rotate_on_aeoi) {
+        c->lowest = level;
+    }
+}
+
+void pic_init(Pic* pic) {
+    memset(pic, 0, sizeof(*pic));
+    pic->master.lowest = 7;
+    pic->master.vector_base = 0x08;
+    pic->master.cascade = 1 << PIC_CASCADE_IRQ;
+    pic->master.imr = 0xFD;
+    pic->slave.lowest = 7;
+    pic->slave.vector_base = 0x70;
+    pic->slave.cascade = PIC_CASCADE_IRQ;
+    pic->slave.imr = 0xFF;
+}
+
+void pic_raise(Pic* pic, int irq) {
+    Pic8259* c = irq < 8 ? &pic->master : &pic->slave;
+    c->irr |= 1 << (irq & 7);
+    update(pic);
+}
+
+uint8_t pic_acknowledge(Pic* pic) {
+    uint8_t from_slave = cascade_irr(pic);
+    int level = pending_level(&pic->master, from_slave);
+    uint8_t vector;
+    if (level < 0) {
+        vector = pic->master.vector_base | 7;  // spurious IRQ 7
+    } else if (from_slave & (1 << level)) {
+        int slave_level = pending_level(&pic->slave, 0);
+        start_service(&pic->master, level);
+        start_service(&pic->slave, slave_level);
+        vector = pic->slave.vector_base | slave_level;
+    } else {
+        start_service(&pic->master, level);
+        vector = pic->master.vector_base | level;
+    }
+    update(pic);
+    return vector;
+}
+
+static void icw1(Pic8259* c, uint8_t value) {
+    c->init_step = 2;
+    c->single = (value >> 1) & 1;
+    c->need_icw4 = value & 1;
+    c->irr = 0;
+    c->isr = 0;
+    c->imr = 0;
+    c->auto_eoi = 0;
+    c->rotate_on_aeoi = 0;
+    c->nested = 0;
+    c->special_mask = 0;
+    c->read_isr = 0;
+    c->poll = 0;
+    c->lowest = 7;
+}
+
+static void ocw2(Pic8259* c, uint8_t value) {
+    int level = value & 7;
+    int served = highest(c, c->isr);
+    switch (value >> 5) {
+        case 1:  // non-specific EOI
+            if (served >= 0) c->isr &= ~(1 << served);
+            break;
+        case 3:  // specific EOI
+            c->isr &= ~(1 << level);
+            break;
+        case 5:  // rotate on non-specific EOI
+            if (served >= 0) {
+                c->isr &= ~(1 << served);
+                c->lowest = served;
+            }
+            break;
+        case 7:  // rotate on specific EOI
+            c->isr &= ~(1 << level);
+            c->lowest = level;
+            break;
+        case 6:  // set priority
+            c->lowest = level;
+            break;
+        case 4:
+            c->rotate_on_aeoi = 1;
+            break;
+        case 0:
+            c->rotate_on_aeoi = 0;
+            break;
+    }
+}
+
+static void ocw3(Pic8259* c, uint8_t value) {
+    if (value & 0x04) c->poll = 1;
+    if (value & 0x02) c->read_isr = value & 1;
+    if (value & 0x40) c->special_mask = (value >> 5) & 1;
+}
+
+uint8_t pic_read(Pic* pic, uint16_t port) {
+    int master = !(port & 0x80);
+    Pic8259* c = master ? &pic->master : &pic->slave;
+    if (port & 1) return c->imr;
+    uint8_t from_slave = master ? cascade_irr(pic) : 0;
+    if (c->poll) {
+        c->poll = 0;
+        int level = pending_level(c, from_slave);
+        if (level < 0) return 0;
+        start_service(c, level);
+        update(pic);
+        return 0x80 | level;
+    }
+    return c->read_isr ? c->isr : c->irr | from_slave;
+}
+
+void pic_write(Pic* pic, uint16_t port, uint8_t value) {
+    Pic8259* c = (port & 0x80) ? &pic->slave : &pic->master;
+    if (!(port & 1)) {
+        if (value & 0x10) {
+            icw1(c, value);
+        } else if (value & 0x08) {
+            ocw3(c, value);
+        } else {
+            ocw2(c, value);
+        }
+    } else {
+        switch (c->init_step) {
+            case 2:
+                c->vector_base = value & 0xF8;
+                c->init_step = !c->single ? 3 : c->need_icw4 ? 4 : 0;
+                break;
+            case 3:
+                c->cascade = value;
+                c->init_step = c->need_icw4 ? 4 : 0;
+                break;
+            case 4:
+                c->auto_eoi = (value >> 1) & 1;
+                c->nested = (value >> 4) & 1;
+                c->init_step = 0;
+                break;
+            default:
+                c->imr = value;
+                break;
+        }
+    }
+    update(pic);
+}
@@ -0,0 +1,279 @@
+#include "pit.h"
+#include "throttle.h"
+
+static uint64_t to_ticks(const Pit* pit, uint64_t cycles) {
+    uint64_t e = cycles - pit->base;
+    return e / pit->num * pit->den + e % pit->num * pit->den / pit->num;
+}
+
+// First CPU clock of the given tick.
+static uint64_t to_cycles(const Pit* pit, uint64_t tick) {
+    return pit->base + tick / pit->den * pit->num + (tick % pit->den * pit->num + pit->den - 1) / pit->den;
+}
+
+static uint32_t from_bcd(uint16_t v) {
+    return (v >> 12) * 1000 + ((v >> 8) & 15) * 100 + ((v >> 4) & 15) * 10 + (v & 15);
+}
+
+static uint16_t to_bcd(uint32_t v) {
+    return (v / 1000 % 10) << 12 | (v / 100 % 10) << 8 | (v / 10 % 10) << 4 | v % 10;
+}
+
+static uint32_t period(const PitChannel* c) {
+    if (c->reload == 0) return c->bcd ? 10000 : 0x10000;
+    return c->bcd ? from_bcd(c->reload) : c->reload;
+}
+
+// Applies a count written in mode 2/3 once the period it was written in is over.
+// Ticks are compared by difference: pit_set_cpu_clock may leave past ones
+// below tick 0.
+static void settle(PitChannel* c, uint64_t t) {
+    if (c->reload_pending && (int64_t)(t - c->reload_at) >= 0) {
+        c->reload = c->next_reload;
+        c->start = c->reload_at;
+        c->reload_pending = 0;
+    }
+}
+
+static uint32_t current_count(const PitChannel* c, uint64_t t) {
+    uint32_t n = period(c);
+    if (!c->counting) return n;
+    uint64_t e = t - c->start;
+    switch (c->mode) {
+        case 2:
+            return n - e % n;
+        case 3: {  // counts down by two, once per half period
+            uint32_t p = e % n;
+            uint32_t half = (n + 1) / 2;
+            return p < half ? n - 2 * p : n - 2 * (p - half);
+        }
+        case 1:
+        case 5:
+            return n;  // gate is never triggered
+        default: {     // 0 and 4 count on through zero
+            uint32_t m = c->bcd ? 10000 : 0x10000;
+            return (n + m - e % m) % m;
+        }
+    }
+}
+
+static int output(const PitChannel* c, uint64_t t) {
+    if (!c->counting) return c->mode != 0;
+    uint32_t n = period(c);
+    uint64_t e = t - c->start;
+    switch (c->mode) {
+        case 0: return e >= n;
+        case 2: return e % n != n - 1;
+        case 3: return e % n < (n + 1) / 2;
+        case 4: return e != n;
+        default: return 1;
+    }
+}
+
+static uint16_t encode(const PitChannel* c, uint32_t count) {
+    return c->bcd ? to_bcd(count % 10000) : (uint16_t)count;
+}
+
+// Schedules the next rising edge of counter 0's output after tick t.
+static void schedule_irq(Pit* pit, uint64_t t) {
+    PitChannel* c = &pit->ch[0];
+    scheduler_cancel(pit->events, EVENT_PIT);
+    if (!c->counting) return;
+    uint32_t n = period(c);
+    switch (c->mode) {
+        case 0:
+        case 4:
+            c->edge = c->start + n;
+            break;
+        case 2:
+        case 3:
+            c->edge = c->start + ((t - c->start) / n + 1) * n;
+            break;
+        default:
+            return;
+    }
+    scheduler_set(pit->events, EVENT_PIT, to_cycles(pit, c->edge));
+}
+
+static void pit_event(void* ctx, uint64_t when) {
+    Pit* pit = ctx;
+    PitChannel* c = &pit->ch[0];
+    (void)when;
+    pit->irq0(pit->ctx);
+    if (c->mode == 2 || c->mode == 3) {
+        settle(c, c->edge);
+        c->edge += period(c);
+        scheduler_set(pit->events, EVENT_PIT, to_cycles(pit, c->edge));
+    }
+}
+
+void pit_init(Pit* pit, Scheduler* events, void (*irq0)(void* ctx), void* ctx) {
+    for (int i = 0; i < 3; i++) {
+        pit->ch[i] = (PitChannel){ 0 };
+    }
+    pit->events = events;
+    pit->irq0 = irq0;
+    pit->ctx = ctx;
+    pit->num = 0;
+    pit_set_cpu_clock(pit, CLOCK_PC, 0);
+    scheduler_register(events, EVENT_PIT, pit_event, pit);
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b) {
+    while (b) {
+        uint64_t r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+void pit_set_cpu_clock(Pit* pit, unsigned long cpu_hz, uint64_t now) {
+    uint64_t num, den;
+    if (cpu_hz == 0 || cpu_hz == CLOCK_PC) {
+        // The PC derives both from one 14.31818 MHz crystal.
+        num = 4;
+        den = 1;
+    } else {
+        uint64_t g = gcd(cpu_hz, PIT_CLOCK);
+        num = cpu_hz / g;
+        den = PIT_CLOCK / g;
+    }
+    if (num == pit->num && den == pit->den) return;
+    if (pit->num == 0) {  // from pit_init
+        pit->num = num;
+        pit->den = den;
+        pit->base = now;
+        return;
+    }
+    // Tick 0 moves to now. Channel state is kept in ticks, so shift it by the
+    // ticks already elapsed; only differences of ticks are ever used, so
+    // points before now may wrap below 0.
+    uint64_t shift = to_ticks(pit, now);
+    for (int i = 0; i < 3; i++) {
+        PitChannel* c = &pit->ch[i];
+        c->start -= shift;
+        c->reload_at -= shift;
+        c->edge -= shift;
+    }
+    pit->num = num;
+    pit->den = den;
+    pit->base = now;
+    if (pit->events->slot[EVENT_PIT] >= 0) {
+        PitChannel* c = &pit->ch[0];
+        // An edge that was already due stays due.
+        scheduler_set(pit->events, EVENT_PIT, (int64_t)c->edge < 0 ? now : to_cycles(pit, c->edge));
+    }
+}
+
+static void load_count(Pit* pit, int i, uint16_t value, uint64_t t) {
+    PitChannel* c = &pit->ch[i];
+    if (c->counting && (c->mode == 2 || c->mode == 3)) {
+        // Periodic modes pick up a new count when the current period ends.
+        settle(c, t);
+        uint32_t n = period(c);
+        c->next_reload = value;
+        c->reload_at = c->start + ((t - c->start) / n + 1) * n;
+        c->reload_pending = 1;
+        return;
+    }
+    c->reload = value;
+    c->start = t;
+    c->counting = 1;
+    c->reload_pending = 0;
+    if (i == 0) schedule_irq(pit, t);
+}
+
+static void latch_count(PitChannel* c, uint64_t t) {
+    if (c->latched) return;
+    settle(c, t);
+    c->latch = encode(c, current_count(c, t));
+    c->latched = 1;
+    c->read_msb = 0;
+}
+
+static void control(Pit* pit, uint8_t value, uint64_t t) {
+    int i = value >> 6;
+    if (i == 3) {  // 8254 read-back: bit 5 clear latches counts, bit 4 clear latches status
+        for (int j = 0; j < 3; j++) {
+            PitChannel* c = &pit->ch[j];
+            if (!(value & (2 << j))) continue;
+            if (!(value & 0x20)) latch_count(c, t);
+            if (!(value & 0x10) && !c->status_latched) {
+                settle(c, t);
+                c->status = output(c, t) << 7 | !c->counting << 6 | c->access << 4 | c->mode << 1 | c->bcd;
+                c->status_latched = 1;
+            }
+        }
+        return;
+    }
+    PitChannel* c = &pit->ch[i];
+    uint8_t access = (value >> 4) & 3;
+    if (access == 0) {
+        latch_count(c, t);
+        return;
+    }
+    c->access = access;
+    c->mode = (value >> 1) & 7;
+    if (c->mode >= 6) c->mode -= 4;
+    c->bcd = value & 1;
+    c->write_msb = 0;
+    c->read_msb = 0;
+    c->latched = 0;
+    c->status_latched = 0;
+    c->counting = 0;
+    c->reload_pending = 0;
+    if (i == 0) scheduler_cancel(pit->events, EVENT_PIT);
+}
+
+uint64_t pit_ticks(const Pit* pit, uint64_t now) {
+    return to_ticks(pit, now);
+}
+
+uint8_t pit_read(Pit* pit, uint16_t port, uint64_t now) {
+    if (port == PIT_CONTROL) return 0xFF;
+    PitChannel* c = &pit->ch[port - PIT_COUNTER0];
+    uint64_t t = to_ticks(pit, now);
+    if (c->status_latched) {
+        c->status_latched = 0;
+        return c->status;
+    }
+    uint16_t v;
+    if (c->latched) {
+        v = c->latch;
+    } else {
+        settle(c, t);
+        v = encode(c, current_count(c, t));
+    }
+    int msb = c->access == 2 || (c->access == 3 && c->read_msb);
+    if (c->access == 3) c->read_msb ^= 1;
+    if (c->latched && !(c->access == 3 && c->read_msb)) c->latched = 0;
+    return msb ? v >> 8 : v & 0xFF;
+}
+
+void pit_write(Pit* pit, uint16_t port, uint8_t value, uint64_t now) {
+    uint64_t t = to_ticks(pit, now);
+    if (port == PIT_CONTROL) {
+        control(pit, value, t);
+        return;
+    }
+    int i = port - PIT_COUNTER0;
+    PitChannel* c = &pit->ch[i];
+    switch (c->access) {
+        case 1:
+            load_count(pit, i, value, t);
+            break;
+        case 2:
+            load_count(pit, i, value << 8, t);
+            break;
+        case 3:
+            if (!c->write_msb) {
+                c->written = value;
+                c->write_msb = 1;
+            } else {
+                c->write_msb = 0;
+                load_count(pit, i, c->written | value << 8, t);
+            }
+            break;
+    }
+}
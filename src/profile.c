@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "profile.h"
+
+static const char* const region_names[PROFILE_REGIONS] = { "IVT", "RAM", "VRAM", "ROM" };
+static const char* const prefix_names[PROFILE_PREFIXES] = {
+    "ES:", "CS:", "SS:", "DS:", "REP", "REPNE", "LOCK"
+};
+static const char* const rm_names[8] = {
+    "BX+SI", "BX+DI", "BP+SI", "BP+DI", "SI", "DI", "BP", "BX"
+};
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+Profile* profile_create(unsigned sample_every) {
+    Profile* p = calloc(1, sizeof(Profile));
+    if (!p) return NULL;
+    p->sample_every = sample_every;
+    p->countdown = sample_every;
+    p->calibrate_ticks = profile_ticks();
+    p->calibrate_ns = monotonic_ns();
+    return p;
+}
+
+// Host ticks per second, measured over the life of the profile.
+static double tick_hz(const Profile* p) {
+    uint64_t ns = monotonic_ns() - p->calibrate_ns;
+    uint64_t ticks = profile_ticks() - p->calibrate_ticks;
+    return ns ? ticks * 1e9 / ns : 1e9;
+}
+
+static void modrm_name(int form, char* out, size_t size) {
+    int mod = form >> 3, rm = form & 7;
+    if (mod == 3) {
+        snprintf(out, size, "reg%d", rm);
+    } else if (mod == 0 && rm == 6) {
+        snprintf(out, size, "[disp16]");
+    } else {
+        snprintf(out, size, "[%s%s]", rm_names[rm], mod == 1 ? "+disp8" : mod == 2 ? "+disp16" : "");
+    }
+}
+
+// Average host nanoseconds per execution, from the timed samples.
+static double op_ns(const ProfileOp* op, double hz) {
+    return op->samples ? op->ticks / (double)op->samples / hz * 1e9 : 0.0;
+}
+
+static void dump_csv(const Profile* p, FILE* out, uint64_t instructions, uint64_t cycles, double hz) {
+    char name[32];
+    fprintf(out, "section,key,count,clocks,host_ns\n");
+    fprintf(out, "total,instructions,%llu,%llu,\n", (unsigned long long)instructions,
+            (unsigned long long)cycles);
+    for (int i = 0; i < 256; i++) {
+        const ProfileOp* op = &p->opcode[i];
+        if (!op->count) continue;
+        fprintf(out, "opcode,%02X,%llu,%llu,", i, (unsigned long long)op->count,
+                (unsigned long long)op->clocks);
+        if (op->samples) fprintf(out, "%.1f", op_ns(op, hz) * op->count);
+        fputc('\n', out);
+    }
+    for (int i = 0; i < PROFILE_MODRM_FORMS; i++) {
+        if (!p->modrm[i]) continue;
+        modrm_name(i, name, sizeof(name));
+        fprintf(out, "modrm,%s,%llu,,\n", name, (unsigned long long)p->modrm[i]);
+    }
+    for (int i = 0; i < PROFILE_PREFIXES; i++) {
+        if (p->prefix[i]) fprintf(out, "prefix,%s,%llu,,\n", prefix_names[i], (unsigned long long)p->prefix[i]);
+    }
+    for (int i = 0; i < PROFILE_REGIONS; i++) {
+        fprintf(out, "read,%s,%llu,,\n", region_names[i], (unsigned long long)p->reads[i]);
+        fprintf(out, "write,%s,%llu,,\n", region_names[i], (unsigned long long)p->writes[i]);
+    }
+    for (int i = 0; i < 65536; i++) {
+        if (p->port_reads[i]) fprintf(out, "in,%04X,%llu,,\n", i, (unsigned long long)p->port_reads[i]);
+        if (p->port_writes[i]) fprintf(out, "out,%04X,%llu,,\n", i, (unsigned long long)p->port_writes[i]);
+    }
+    for (int i = 0; i < 256; i++) {
+        if (p->interrupts[i]) fprintf(out, "int,%02X,%llu,,\n", i, (unsigned long long)p->interrupts[i]);
+        if (p->irq_interrupts[i]) fprintf(out, "irq,%02X,%llu,,\n", i, (unsigned long long)p->irq_interrupts[i]);
+    }
+}
+
+static void dump_json(const Profile* p, FILE* out, uint64_t instructions, uint64_t cycles, double hz) {
+    char name[32];
+    const char* sep = "";
+    fprintf(out, "{\n  \"instructions\": %llu,\n  \"clocks\": %llu,\n  \"sample_every\": %u,\n",
+            (unsigned long long)instructions, (unsigned long long)cycles, p->sample_every);
+    fprintf(out, "  \"opcodes\": [");
+    for (int i = 0; i < 256; i++) {
+        const ProfileOp* op = &p->opcode[i];
+        if (!op->count) continue;
+        fprintf(out, "%s\n    {\"opcode\": \"%02X\", \"count\": %llu, \"clocks\": %llu", sep, i,
+                (unsigned long long)op->count, (unsigned long long)op->clocks);
+        if (op->samples) {
+            fprintf(out, ", \"samples\": %llu, \"ns_each\": %.2f", (unsigned long long)op->samples, op_ns(op, hz));
+        }
+        fputc('}', out);
+        sep = ",";
+    }
+    fprintf(out, "\n  ],\n  \"modrm\": {");
+    sep = "";
+    for (int i = 0; i < PROFILE_MODRM_FORMS; i++) {
+        if (!p->modrm[i]) continue;
+        modrm_name(i, name, sizeof(name));
+        fprintf(out, "%s\n    \"%s\": %llu", sep, name, (unsigned long long)p->modrm[i]);
+        sep = ",";
+    }
+    fprintf(out, "\n  },\n  \"prefixes\": {");
+    sep = "";
+    for (int i = 0; i < PROFILE_PREFIXES; i++) {
+        fprintf(out, "%s\n    \"%s\": %llu", sep, prefix_names[i], (unsigned long long)p->prefix[i]);
+        sep = ",";
+    }
+    fprintf(out, "\n  },\n  \"memory\": {");
+    sep = "";
+    for (int i = 0; i < PROFILE_REGIONS; i++) {
+        fprintf(out, "%s\n    \"%s\": {\"reads\": %llu, \"writes\": %llu}", sep, region_names[i],
+                (unsigned long long)p->reads[i], (unsigned long long)p->writes[i]);
+        sep = ",";
+    }
+    fprintf(out, "\n  },\n  \"ports\": [");
+    sep = "";
+    for (int i = 0; i < 65536; i++) {
+        if (!p->port_reads[i] && !p->port_writes[i]) continue;
+        fprintf(out, "%s\n    {\"port\": \"%04X\", \"in\": %llu, \"out\": %llu}", sep, i,
+                (unsigned long long)p->port_reads[i], (unsigned long long)p->port_writes[i]);
+        sep = ",";
+    }
+    fprintf(out, "\n  ],\n  \"interrupts\": [");
+    sep = "";
+    for (int i = 0; i < 256; i++) {
+        if (!p->interrupts[i]) continue;
+        fprintf(out, "%s\n    {\"vector\": \"%02X\", \"count\": %llu, \"hardware\": %llu}", sep, i,
+                (unsigned long long)p->interrupts[i], (unsigned long long)p->irq_interrupts[i]);
+        sep = ",";
+    }
+    fprintf(out, "\n  ]\n}\n");
+}
+
+int profile_dump(const Profile* p, const char* path, uint64_t instructions, uint64_t cycles) {
+    FILE* out = fopen(path, "w");
+    if (!out) return 0;
+    size_t len = strlen(path);
+    double hz = tick_hz(p);
+    if (len >= 4 && strcmp(path + len - 4, ".csv") == 0) {
+        dump_csv(p, out, instructions, cycles, hz);
+    } else {
+        dump_json(p, out, instructions, cycles, hz);
+    }
+    int ok = !ferror(out);
+    return fclose(out) == 0 && ok;
+}
@@ -0,0 +1,85 @@
+#include <stddef.h>
+#include "scheduler.h"
+
+static void place(Scheduler* s, int i, int id) {
+    s->heap[i] = id;
+    s->slot[id] = i;
+}
+
+static void sift_up(Scheduler* s, int i) {
+    int id = s->heap[i];
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (s->when[s->heap[parent]] <= s->when[id]) break;
+        place(s, i, s->heap[parent]);
+        i = parent;
+    }
+    place(s, i, id);
+}
+
+static void sift_down(Scheduler* s, int i) {
+    int id = s->heap[i];
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= s->count) break;
+        if (child + 1 < s->count && s->when[s->heap[child + 1]] < s->when[s->heap[child]]) child++;
+        if (s->when[id] <= s->when[s->heap[child]]) break;
+        place(s, i, s->heap[child]);
+        i = child;
+    }
+    place(s, i, id);
+}
+
+static void update_next(Scheduler* s) {
+    s->next = s->count ? s->when[s->heap[0]] : SCHED_NEVER;
+}
+
+void scheduler_init(Scheduler* s) {
+    s->count = 0;
+    s->next = SCHED_NEVER;
+    for (int id = 0; id < EVENT_IDS; id++) {
+        s->slot[id] = -1;
+        s->handler[id] = NULL;
+        s->ctx[id] = NULL;
+    }
+}
+
+void scheduler_register(Scheduler* s, int id, EventHandler handler, void* ctx) {
+    s->handler[id] = handler;
+    s->ctx[id] = ctx;
+}
+
+void scheduler_set(Scheduler* s, int id, uint64_t when) {
+    int i = s->slot[id];
+    if (i < 0) {
+        i = s->count++;
+        s->heap[i] = id;
+        s->slot[id] = i;
+    }
+    s->when[id] = when;
+    sift_up(s, i);
+    sift_down(s, s->slot[id]);
+    update_next(s);
+}
+
+void scheduler_cancel(Scheduler* s, int id) {
+    int i = s->slot[id];
+    if (i < 0) return;
+    s->slot[id] = -1;
+    int last = s->heap[--s->count];
+    if (i < s->count) {
+        place(s, i, last);
+        sift_up(s, i);
+        sift_down(s, s->slot[last]);
+    }
+    update_next(s);
+}
+
+void scheduler_run(Scheduler* s, uint64_t now) {
+    while (s->next <= now) {
+        int id = s->heap[0];
+        uint64_t when = s->when[id];
+        scheduler_cancel(s, id);
+        s->handler[id](s->ctx[id], when);
+    }
+}
@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <string.h>
+#include "screen.h"
+
+// Unicode for each byte of code page 437, the character set of the CGA ROM.
+static const int cp437[256] = {
+    0x0000, 0x263A, 0x263B, 0x2665, 0x2666, 0x2663, 0x2660, 0x2022,
+    0x25D8, 0x25CB, 0x25D9, 0x2642, 0x2640, 0x266A, 0x266B, 0x263C,
+    0x25BA, 0x25C4, 0x2195, 0x203C, 0x00B6, 0x00A7, 0x25AC, 0x21A8,
+    0x2191, 0x2193, 0x2192, 0x2190, 0x221F, 0x2194, 0x25B2, 0x25BC,
+    0x0020, 0x0021, 0x0022, 0x0023, 0x0024, 0x0025, 0x0026, 0x0027,
+    0x0028, 0x0029, 0x002A, 0x002B, 0x002C, 0x002D, 0x002E, 0x002F,
+    0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037,
+    0x0038, 0x0039, 0x003A, 0x003B, 0x003C, 0x003D, 0x003E, 0x003F,
+    0x0040, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047,
+    0x0048, 0x0049, 0x004A, 0x004B, 0x004C, 0x004D, 0x004E, 0x004F,
+    0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057,
+    0x0058, 0x0059, 0x005A, 0x005B, 0x005C, 0x005D, 0x005E, 0x005F,
+    0x0060, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067,
+    0x0068, 0x0069, 0x006A, 0x006B, 0x006C, 0x006D, 0x006E, 0x006F,
+    0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
+    0x0078, 0x0079, 0x007A, 0x007B, 0x007C, 0x007D, 0x007E, 0x2302,
+    0x00C7, 0x00FC, 0x00E9, 0x00E2, 0x00E4, 0x00E0, 0x00E5, 0x00E7,
+    0x00EA, 0x00EB, 0x00E8, 0x00EF, 0x00EE, 0x00EC, 0x00C4, 0x00C5,
+    0x00C9, 0x00E6, 0x00C6, 0x00F4, 0x00F6, 0x00F2, 0x00FB, 0x00F9,
+    0x00FF, 0x00D6, 0x00DC, 0x00A2, 0x00A3, 0x00A5, 0x20A7, 0x0192,
+    0x00E1, 0x00ED, 0x00F3, 0x00FA, 0x00F1, 0x00D1, 0x00AA, 0x00BA,
+    0x00BF, 0x2310, 0x00AC, 0x00BD, 0x00BC, 0x00A1, 0x00AB, 0x00BB,
+    0x2591, 0x2592, 0x2593, 0x2502, 0x2524, 0x2561, 0x2562, 0x2556,
+    0x2555, 0x2563, 0x2551, 0x2557, 0x255D, 0x255C, 0x255B, 0x2510,
+    0x2514, 0x2534, 0x252C, 0x251C, 0x2500, 0x253C, 0x255E, 0x255F,
+    0x255A, 0x2554, 0x2569, 0x2566, 0x2560, 0x2550, 0x256C, 0x2567,
+    0x2568, 0x2564, 0x2565, 0x2559, 0x2558, 0x2552, 0x2553, 0x256B,
+    0x256A, 0x2518, 0x250C, 0x2588, 0x2584, 0x258C, 0x2590, 0x2580,
+    0x03B1, 0x00DF, 0x0393, 0x03C0, 0x03A3, 0x03C3, 0x00B5, 0x03C4,
+    0x03A6, 0x0398, 0x03A9, 0x03B4, 0x221E, 0x03C6, 0x03B5, 0x2229,
+    0x2261, 0x00B1, 0x2265, 0x2264, 0x2320, 0x2321, 0x00F7, 0x2248,
+    0x00B0, 0x2219, 0x00B7, 0x221A, 0x207F, 0x00B2, 0x25A0, 0x00A0,
+};
+
+// One of the 16 CGA attribute colours, from the table the graphics modes use.
+static Color cga_color(int index) {
+    uint32_t rgba = cga_rgba[index];
+    return (Color){ rgba & 0xFF, (rgba >> 8) & 0xFF, (rgba >> 16) & 0xFF, rgba >> 24 };
+}
+
+// Rasterizes all 256 glyphs once into a 16x16 grid of cells.
+static Texture2D build_atlas(const char* font_path, int char_width, int char_height) {
+    Font font = LoadFontEx(font_path, char_height, (int*)cp437 + 1, 255);
+    if (font.texture.id == 0) {
+        font = GetFontDefault();
+    }
+    Image image = GenImageColor(16 * char_width, 16 * char_height, BLANK);
+    for (int c = 1; c < 256; c++) {
+        char text[8];
+        int size = 0;
+        const char* utf8 = CodepointToUTF8(cp437[c], &size);
+        memcpy(text, utf8, size);
+        text[size] = '\0';
+        Vector2 pos = { (float)(c % 16 * char_width), (float)(c / 16 * char_height) };
+        ImageDrawTextEx(&image, font, text, pos, char_height, 0, WHITE);
+    }
+    Texture2D atlas = LoadTextureFromImage(image);
+    UnloadImage(image);
+    if (font.texture.id != GetFontDefault().texture.id) {
+        UnloadFont(font);
+    }
+    return atlas;
+}
+
+int screen_init(Screen* screen, const char* font_path, int char_width, int char_height) {
+    memset(screen, 0, sizeof(*screen));
+    screen->char_width = char_width;
+    screen->char_height = char_height;
+    screen->atlas = build_atlas(font_path, char_width, char_height);
+    screen->target = LoadRenderTexture(SCREEN_WIDTH * char_width, SCREEN_HEIGHT * char_height);
+    screen->blink_visible = 1;
+    screen->mode = CGA_MODE_RESET;
+    Image black = GenImageColor(CGA_WIDTH, CGA_HEIGHT, BLACK);
+    screen->graphics = LoadTextureFromImage(black);
+    UnloadImage(black);
+    screen->pixels = malloc(CGA_WIDTH * CGA_HEIGHT * sizeof(uint32_t));
+    return screen->atlas.id != 0 && screen->target.id != 0 && screen->graphics.id != 0 && screen->pixels;
+}
+
+void screen_unload(Screen* screen) {
+    UnloadTexture(screen->atlas);
+    UnloadRenderTexture(screen->target);
+    UnloadTexture(screen->graphics);
+    free(screen->pixels);
+}
+
+// Attribute bits: 0-3 foreground, 4-6 background, 7 blink (or background
+// intensity with CGA_MODE_BLINK off).
+static void draw_cell(const Screen* screen, int index, uint16_t cell) {
+    uint8_t ch = cell & 0xFF;
+    uint8_t attr = cell >> 8;
+    int blink = screen->mode & CGA_MODE_BLINK;
+    int x = index % SCREEN_WIDTH * screen->char_width;
+    int y = index / SCREEN_WIDTH * screen->char_height;
+    DrawRectangle(x, y, screen->char_width, screen->char_height, cga_color((attr >> 4) & (blink ? 7 : 15)));
+    if (blink && (attr & 0x80) && !screen->blink_visible) return;
+    if (ch == 0x00 || ch == 0x20 || ch == 0xFF) return;  // blank glyphs
+    Rectangle glyph = {
+        (float)(ch % 16 * screen->char_width), (float)(ch / 16 * screen->char_height),
+        (float)screen->char_width, (float)screen->char_height
+    };
+    DrawTextureRec(screen->atlas, glyph, (Vector2){ (float)x, (float)y }, cga_color(attr & 0x0F));
+}
+
+static void update_graphics(Screen* screen, const uint8_t* vram, uint8_t mode, uint8_t color) {
+    if (screen->graphics_valid && mode == screen->mode && color == screen->color &&
+        memcmp(vram, screen->graphics_shadow, CGA_VRAM_SIZE) == 0) {
+        return;
+    }
+    cga_convert(vram, mode, color, screen->pixels);
+    UpdateTexture(screen->graphics, screen->pixels);
+    memcpy(screen->graphics_shadow, vram, CGA_VRAM_SIZE);
+    screen->graphics_valid = 1;
+}
+
+void screen_update(Screen* screen, const uint8_t* vram, uint8_t mode, uint8_t color) {
+    // A blanked display shows the black frame cga_convert makes for it.
+    screen->showing_graphics = (mode & CGA_MODE_GRAPHICS) || !(mode & CGA_MODE_ENABLE);
+    if (screen->showing_graphics) {
+        update_graphics(screen, vram, mode, color);
+        screen->mode = mode;
+        screen->color = color;
+        return;
+    }
+    if ((mode ^ screen->mode) & CGA_MODE_BLINK) screen->valid = 0;
+    screen->mode = mode;
+    screen->color = color;
+
+    int blink_visible = (screen->frame++ / SCREEN_BLINK_FRAMES) % 2 == 0;
+    int blink_flipped = blink_visible != screen->blink_visible;
+    screen->blink_visible = blink_visible;
+    int drawing = 0;
+
+    for (int i = 0; i < SCREEN_CELLS; i++) {
+        uint16_t cell = vram[2 * i] | (vram[2 * i + 1] << 8);
+        if (screen->valid && cell == screen->shadow[i] && !(blink_flipped && (cell & 0x8000))) {
+            continue;
+        }
+        if (!drawing) {
+            BeginTextureMode(screen->target);
+            drawing = 1;
+        }
+        draw_cell(screen, i, cell);
+        screen->shadow[i] = cell;
+    }
+    if (drawing) EndTextureMode();
+    screen->valid = 1;
+}
+
+void screen_draw(const Screen* screen, int x, int y) {
+    if (screen->showing_graphics) {
+        Rectangle source = { 0, 0, CGA_WIDTH, CGA_HEIGHT };
+        Rectangle dest = { (float)x, (float)y, (float)screen->target.texture.width, (float)screen->target.texture.height };
+        DrawTexturePro(screen->graphics, source, dest, (Vector2){ 0, 0 }, 0.0f, WHITE);
+        return;
+    }
+    // Render textures are stored bottom-up.
+    Rectangle source = { 0, 0, (float)screen->target.texture.width, -(float)screen->target.texture.height };
+    DrawTextureRec(screen->target.texture, source, (Vector2){ (float)x, (float)y }, WHITE);
+}
@@ -0,0 +1,244 @@
+#define _GNU_SOURCE  // MAP_POPULATE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "snapshot.h"
+
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0
+#endif
+
+static void capture(CPU8086* cpu, SnapshotMachine* m) {
+    memcpy(m->regs, cpu->regs, sizeof(m->regs));
+    memcpy(m->sregs, cpu->sregs, sizeof(m->sregs));
+    m->ip = cpu->ip;
+    m->flags = cpu_get_flags(cpu);
+    m->halted = cpu->halted;
+    m->kb_head = cpu->kb_head;
+    m->kb_tail = cpu->kb_tail;
+    m->kb_status = cpu->kb_status;
+    m->cga_mode = cpu->cga_mode;
+    m->cga_color = cpu->cga_color;
+    memcpy(m->keyboard_buffer, cpu->keyboard_buffer, sizeof(m->keyboard_buffer));
+    m->cycles = cpu->cycles;
+    for (int id = 0; id < SCHED_MAX_EVENTS; id++) {
+        int scheduled = id < EVENT_COUNT && cpu->events.slot[id] >= 0;
+        m->events[id] = scheduled ? cpu->events.when[id] : SCHED_NEVER;
+    }
+    m->pic = cpu->pic;
+    memcpy(m->pit, cpu->pit.ch, sizeof(m->pit));
+    m->pit_num = cpu->pit.num;
+    m->pit_den = cpu->pit.den;
+    m->pit_base = cpu->pit.base;
+}
+
+// The device structs keep their pointers into this CPU; only their state is
+// replaced.
+static void apply(CPU8086* cpu, const SnapshotMachine* m) {
+    memcpy(cpu->regs, m->regs, sizeof(cpu->regs));
+    memcpy(cpu->sregs, m->sregs, sizeof(cpu->sregs));
+    cpu->ip = m->ip;
+    cpu->pic = m->pic;
+    cpu_set_flags(cpu, m->flags);
+    cpu->halted = m->halted;
+    cpu->kb_head = m->kb_head;
+    cpu->kb_tail = m->kb_tail;
+    cpu->kb_status = m->kb_status;
+    cpu->cga_mode = m->cga_mode;
+    cpu->cga_color = m->cga_color;
+    memcpy(cpu->keyboard_buffer, m->keyboard_buffer, sizeof(cpu->keyboard_buffer));
+    cpu->cycles = m->cycles;
+    memcpy(cpu->pit.ch, m->pit, sizeof(cpu->pit.ch));
+    cpu->pit.num = m->pit_num;
+    cpu->pit.den = m->pit_den;
+    cpu->pit.base = m->pit_base;
+    for (int id = 0; id < EVENT_COUNT; id++) {
+        if (m->events[id] == SCHED_NEVER) {
+            scheduler_cancel(&cpu->events, id);
+        } else {
+            scheduler_set(&cpu->events, id, m->events[id]);
+        }
+    }
+    cpu->running = 1;
+    cpu->stop_reason = STOP_NONE;
+    cpu->pending = (cpu->halted ? PENDING_HALT : 0) |
+                   (cpu->pic.intr && cpu->flags.interrupt ? PENDING_IRQ : 0);
+}
+
+// Marks every page clean; the next store to each one records it in cpu->dirty.
+static void start_tracking(CPU8086* cpu) {
+    memset(cpu->dirty, 0, sizeof(cpu->dirty));
+    for (int i = 0; i < CODE_PAGES; i++) {
+        cpu->code_map[i] |= CODE_MAP_CLEAN;
+    }
+}
+
+static uint64_t new_chain_id(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t id = ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec) ^ ((uint64_t)getpid() << 40);
+    return id ? id : 1;
+}
+
+static int write_all(int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 1;
+}
+
+// Writes the header and every page (all) or the dirty ones. Runs of adjacent
+// pages go out as one iovec straight from guest memory.
+static int write_snapshot(CPU8086* cpu, const char* path, uint64_t chain, uint32_t sequence, int all) {
+    union {
+        SnapshotHeader h;
+        uint8_t bytes[SNAPSHOT_DATA_OFFSET];
+    } head;
+    memset(&head, 0, sizeof(head));
+    SnapshotHeader* h = &head.h;
+    memcpy(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic));
+    h->version = SNAPSHOT_VERSION;
+    h->header_size = sizeof(SnapshotHeader);
+    h->page_size = MAP_PAGE_SIZE;
+    h->chain = chain;
+    h->sequence = sequence;
+    capture(cpu, &h->machine);
+
+    struct iovec iov[1 + RAM_PAGES];
+    int count = 0;
+    iov[count++] = (struct iovec){ head.bytes, sizeof(head.bytes) };
+    for (int page = 0; page < RAM_PAGES; page++) {
+        if (!all && !cpu->dirty[page]) continue;
+        uint8_t* data = cpu->memory + page * MAP_PAGE_SIZE;
+        struct iovec* last = &iov[count - 1];
+        if (count > 1 && (uint8_t*)last->iov_base + last->iov_len == data) {
+            last->iov_len += MAP_PAGE_SIZE;
+        } else {
+            iov[count++] = (struct iovec){ data, MAP_PAGE_SIZE };
+        }
+        h->index[h->page_count++] = page;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(cpu->log, "Cannot create snapshot %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    int ok = write_all(fd, iov, count);
+    if (!ok) fprintf(cpu->log, "Cannot write snapshot %s: %s\n", path, strerror(errno));
+    if (close(fd) != 0 && ok) {
+        fprintf(cpu->log, "Cannot write snapshot %s: %s\n", path, strerror(errno));
+        ok = 0;
+    }
+    return ok;
+}
+
+int snapshot_save(CPU8086* cpu, const char* path) {
+    uint64_t chain = new_chain_id();
+    if (!write_snapshot(cpu, path, chain, 0, 1)) return 0;
+    cpu->snapshot_chain = chain;
+    cpu->snapshot_seq = 0;
+    start_tracking(cpu);
+    return 1;
+}
+
+int snapshot_checkpoint(CPU8086* cpu, const char* path) {
+    if (!cpu->snapshot_chain) {
+        fprintf(cpu->log, "Cannot write checkpoint %s: no full snapshot to build on\n", path);
+        return 0;
+    }
+    // On failure the dirty pages stay marked for the next attempt.
+    if (!write_snapshot(cpu, path, cpu->snapshot_chain, cpu->snapshot_seq + 1, 0)) return 0;
+    cpu->snapshot_seq++;
+    start_tracking(cpu);
+    return 1;
+}
+
+static const char* check_header(const CPU8086* cpu, const SnapshotHeader* h, size_t size) {
+    if (size < SNAPSHOT_DATA_OFFSET || memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) != 0) {
+        return "not a snapshot";
+    }
+    if (h->version != SNAPSHOT_VERSION || h->header_size != sizeof(SnapshotHeader) ||
+        h->page_size != MAP_PAGE_SIZE) {
+        return "written by an incompatible version";
+    }
+    if (h->page_count > RAM_PAGES || (h->sequence == 0 && h->page_count != RAM_PAGES) ||
+        size < SNAPSHOT_DATA_OFFSET + (size_t)h->page_count * MAP_PAGE_SIZE) {
+        return "truncated";
+    }
+    for (uint32_t i = 0; i < h->page_count; i++) {
+        if (h->index[i] >= RAM_PAGES) return "corrupt page index";
+    }
+    if (h->sequence != 0) {
+        if (h->chain != cpu->snapshot_chain || h->sequence != cpu->snapshot_seq + 1) {
+            return "checkpoint does not follow the current state";
+        }
+        // Pages written since then are not in the checkpoint.
+        for (int page = 0; page < RAM_PAGES; page++) {
+            if (cpu->dirty[page]) return "guest memory changed since the previous checkpoint";
+        }
+    }
+    return NULL;
+}
+
+int snapshot_restore(CPU8086* cpu, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(cpu->log, "Cannot open snapshot %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        fprintf(cpu->log, "Cannot read snapshot %s\n", path);
+        close(fd);
+        return 0;
+    }
+    size_t size = st.st_size;
+    const uint8_t* file = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        fprintf(cpu->log, "Cannot map snapshot %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    const SnapshotHeader* h = (const SnapshotHeader*)file;
+    const char* error = check_header(cpu, h, size);
+    if (error) {
+        fprintf(cpu->log, "Cannot restore snapshot %s: %s\n", path, error);
+        munmap((void*)file, size);
+        return 0;
+    }
+    const uint8_t* data = file + SNAPSHOT_DATA_OFFSET;
+    for (uint32_t i = 0; i < h->page_count; i++, data += MAP_PAGE_SIZE) {
+        uint32_t addr = (uint32_t)h->index[i] * MAP_PAGE_SIZE;
+        if (memcmp(cpu->memory + addr, data, MAP_PAGE_SIZE) != 0) {
+            memcpy(cpu->memory + addr, data, MAP_PAGE_SIZE);
+            cpu_mark_dirty(cpu, addr, MAP_PAGE_SIZE);
+        }
+    }
+    apply(cpu, &h->machine);
+    cpu->snapshot_chain = h->chain;
+    cpu->snapshot_seq = h->sequence;
+    start_tracking(cpu);
+    munmap((void*)file, size);
+    return 1;
+}
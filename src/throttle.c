@@ -0,0 +1,45 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "throttle.h"
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int throttle_parse_clock(const char* text, unsigned long* hz) {
+    if (strcmp(text, "max") == 0) {
+        *hz = CLOCK_UNTHROTTLED;
+        return 1;
+    }
+    char* end;
+    double mhz = strtod(text, &end);
+    if (end == text || *end != '\0' || !(mhz > 0.0) || mhz > 1e6) return 0;
+    // 4.77 is what everybody calls the 4.772727 MHz PC clock.
+    *hz = (mhz > 4.765 && mhz < 4.775) ? CLOCK_PC : (unsigned long)(mhz * 1e6 + 0.5);
+    // 0 Hz would read as CLOCK_UNTHROTTLED; "max" is the only way to ask for that.
+    return *hz != CLOCK_UNTHROTTLED;
+}
+
+void throttle_init(Throttle* throttle, unsigned long hz, uint64_t cycles) {
+    throttle->hz = hz;
+    throttle->base_cycles = cycles;
+    throttle->base_ns = now_ns();
+}
+
+void throttle_sync(Throttle* throttle, uint64_t cycles) {
+    if (throttle->hz == CLOCK_UNTHROTTLED) return;
+    uint64_t now = now_ns();
+    uint64_t host = now - throttle->base_ns;
+    uint64_t guest = (uint64_t)((double)(cycles - throttle->base_cycles) * 1e9 / throttle->hz);
+    if (guest > host) {
+        uint64_t ahead = guest - host;
+        struct timespec ts = { (time_t)(ahead / 1000000000ULL), (long)(ahead % 1000000000ULL) };
+        nanosleep(&ts, NULL);
+    } else if (host - guest > THROTTLE_MAX_LAG_NS) {
+        throttle->base_cycles = cycles;
+        throttle->base_ns = now;
+    }
+}
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "trace.h"
+
+static int write_all(int fd, const void* data, size_t size) {
+    const uint8_t* p = data;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        p += n;
+        size -= n;
+    }
+    return 1;
+}
+
+static void* writer_main(void* arg) {
+    Trace* t = arg;
+    pthread_mutex_lock(&t->lock);
+    for (;;) {
+        while (t->done == t->submitted && !t->closing) {
+            pthread_cond_wait(&t->cond, &t->lock);
+        }
+        if (t->done == t->submitted) break;
+        unsigned chunk = t->done % TRACE_CHUNKS;
+        size_t count = t->counts[chunk];
+        pthread_mutex_unlock(&t->lock);
+        int ok = write_all(t->fd, t->ring + (size_t)chunk * TRACE_CHUNK_RECORDS, count * sizeof(TraceRecord));
+        pthread_mutex_lock(&t->lock);
+        if (!ok) t->error = 1;
+        t->done++;
+        pthread_cond_broadcast(&t->cond);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+Trace* trace_open(const char* path, unsigned long clock_hz, FILE* log) {
+    Trace* t = calloc(1, sizeof(Trace));
+    if (!t) {
+        fprintf(log, "Cannot create trace: %s\n", path);
+        return NULL;
+    }
+    t->ring = malloc((size_t)TRACE_CHUNKS * TRACE_CHUNK_RECORDS * sizeof(TraceRecord));
+    t->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (!t->ring || t->fd < 0) {
+        fprintf(log, "Cannot create trace: %s\n", path);
+        if (t->fd >= 0) close(t->fd);
+        free(t->ring);
+        free(t);
+        return NULL;
+    }
+    TraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(TraceRecord);
+    header.clock_hz = clock_hz;
+    if (!write_all(t->fd, &header, sizeof(header))) {
+        fprintf(log, "Cannot write trace: %s\n", path);
+        close(t->fd);
+        free(t->ring);
+        free(t);
+        return NULL;
+    }
+    t->cur = t->ring;
+    t->chunk_end = t->ring + TRACE_CHUNK_RECORDS;
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    if (pthread_create(&t->writer, NULL, writer_main, t) != 0) {
+        fprintf(log, "Cannot start trace writer: %s\n", path);
+        pthread_mutex_destroy(&t->lock);
+        pthread_cond_destroy(&t->cond);
+        close(t->fd);
+        free(t->ring);
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+// Submits the records of the chunk being filled.
+static void submit(Trace* t) {
+    t->counts[t->fill] = t->cur - (t->ring + (size_t)t->fill * TRACE_CHUNK_RECORDS);
+    t->submitted++;
+    pthread_cond_broadcast(&t->cond);
+}
+
+void trace_next_chunk(Trace* t) {
+    pthread_mutex_lock(&t->lock);
+    submit(t);
+    t->fill = (t->fill + 1) % TRACE_CHUNKS;
+    while (t->submitted - t->done >= TRACE_CHUNKS) {
+        pthread_cond_wait(&t->cond, &t->lock);
+    }
+    pthread_mutex_unlock(&t->lock);
+    t->cur = t->ring + (size_t)t->fill * TRACE_CHUNK_RECORDS;
+    t->chunk_end = t->cur + TRACE_CHUNK_RECORDS;
+}
+
+int trace_close(Trace* t) {
+    if (!t) return 1;
+    pthread_mutex_lock(&t->lock);
+    if (t->cur != t->ring + (size_t)t->fill * TRACE_CHUNK_RECORDS) submit(t);
+    t->closing = 1;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->writer, NULL);
+    int ok = !t->error && close(t->fd) == 0;
+    if (t->error) close(t->fd);
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->cond);
+    free(t->ring);
+    free(t);
+    return ok;
+}
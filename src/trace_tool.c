@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trace.h"
+
+#define DIFF_CONTEXT 3  // records printed before the first difference
+
+typedef struct {
+    const TraceHeader* header;
+    const TraceRecord* records;
+    uint64_t count;
+} TraceFile;
+
+static const char* const reg_names[12] = {
+    "AX", "CX", "DX", "BX", "SP", "BP", "SI", "DI", "ES", "CS", "SS", "DS"
+};
+
+static int open_trace(const char* path, TraceFile* trace) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open trace: %s\n", path);
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(TraceHeader)) {
+        fprintf(stderr, "Not a trace: %s\n", path);
+        close(fd);
+        return 0;
+    }
+    const uint8_t* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Cannot map trace: %s\n", path);
+        return 0;
+    }
+    trace->header = (const TraceHeader*)data;
+    if (memcmp(trace->header->magic, TRACE_MAGIC, sizeof(trace->header->magic)) != 0 ||
+        trace->header->version != TRACE_VERSION || trace->header->record_size != sizeof(TraceRecord)) {
+        fprintf(stderr, "Not a trace of this version: %s\n", path);
+        munmap((void*)data, st.st_size);
+        return 0;
+    }
+    trace->records = (const TraceRecord*)(data + sizeof(TraceHeader));
+    trace->count = (st.st_size - sizeof(TraceHeader)) / sizeof(TraceRecord);
+    return 1;
+}
+
+static uint16_t reg_value(const TraceRecord* r, int n) {
+    return n < 8 ? r->regs[n] : r->sregs[n - 8];
+}
+
+// One line per record: index, clocks, CS:IP, instruction bytes, then the
+// registers and flags that differ from prev (all of them without prev) and
+// the bytes stored.
+static void print_record(uint64_t index, const TraceRecord* r, const TraceRecord* prev) {
+    char code[32];
+    if (r->length == 0) {
+        snprintf(code, sizeof(code), "IRQ -> INT %02X", r->bytes[0]);
+    } else {
+        int n = r->length < sizeof(r->bytes) ? r->length : (int)sizeof(r->bytes);
+        int used = 0;
+        for (int i = 0; i < n; i++) {
+            used += snprintf(code + used, sizeof(code) - used, "%02X ", r->bytes[i]);
+        }
+        if (r->length > n) snprintf(code + used, sizeof(code) - used, "..");
+    }
+    printf("%10llu %12llu %04X:%04X  %-19s", (unsigned long long)index,
+           (unsigned long long)r->cycles, r->cs, r->ip, code);
+    for (int i = 0; i < 12; i++) {
+        if (!prev || reg_value(r, i) != reg_value(prev, i)) {
+            printf(" %s=%04X", reg_names[i], reg_value(r, i));
+        }
+    }
+    if (!prev || r->flags != prev->flags) printf(" FL=%04X", r->flags);
+    if (r->write_count) {
+        printf(" [%05X]=", r->write_addr & ~TRACE_WRITES_TRUNCATED);
+        for (int i = 0; i < r->write_len; i++) {
+            printf("%02X", r->write_data[i]);
+        }
+        if (r->write_addr & TRACE_WRITES_TRUNCATED) printf("... (%u bytes)", r->write_count);
+    }
+    putchar('\n');
+}
+
+static int cmd_print(const TraceFile* t, uint64_t first, uint64_t count) {
+    for (uint64_t i = first; i < t->count && i - first < count; i++) {
+        print_record(i, &t->records[i], i > first ? &t->records[i - 1] : NULL);
+    }
+    return 0;
+}
+
+// Names the first field that differs, or returns NULL if the records match.
+static const char* record_difference(const TraceRecord* a, const TraceRecord* b) {
+    if (a->cs != b->cs || a->ip != b->ip) return "CS:IP";
+    if (a->length != b->length || memcmp(a->bytes, b->bytes, sizeof(a->bytes)) != 0) return "instruction";
+    for (int i = 0; i < 12; i++) {
+        if (reg_value(a, i) != reg_value(b, i)) return reg_names[i];
+    }
+    if (a->flags != b->flags) return "flags";
+    if (a->write_count != b->write_count || a->write_addr != b->write_addr ||
+        a->write_len != b->write_len || memcmp(a->write_data, b->write_data, a->write_len) != 0) {
+        return "memory writes";
+    }
+    if (a->cycles != b->cycles) return "cycles";
+    return NULL;
+}
+
+static int cmd_diff(const TraceFile* a, const TraceFile* b, const char* name_a, const char* name_b) {
+    if (a->header->clock_hz != b->header->clock_hz) {
+        printf("Note: traces were timed against different clocks (%llu and %llu Hz)\n",
+               (unsigned long long)a->header->clock_hz, (unsigned long long)b->header->clock_hz);
+    }
+    uint64_t common = a->count < b->count ? a->count : b->count;
+    for (uint64_t i = 0; i < common; i++) {
+        const char* field = record_difference(&a->records[i], &b->records[i]);
+        if (!field) continue;
+        printf("Traces differ at record %llu (%s)\n", (unsigned long long)i, field);
+        uint64_t from = i > DIFF_CONTEXT ? i - DIFF_CONTEXT : 0;
+        for (uint64_t j = from; j < i; j++) {
+            print_record(j, &a->records[j], j > from ? &a->records[j - 1] : NULL);
+        }
+        printf("--- %s\n", name_a);
+        print_record(i, &a->records[i], i > 0 ? &a->records[i - 1] : NULL);
+        printf("+++ %s\n", name_b);
+        print_record(i, &b->records[i], i > 0 ? &b->records[i - 1] : NULL);
+        return 1;
+    }
+    if (a->count != b->count) {
+        printf("Traces match for %llu records, then %s ends\n", (unsigned long long)common,
+               a->count < b->count ? name_a : name_b);
+        return 1;
+    }
+    printf("Traces match: %llu records\n", (unsigned long long)common);
+    return 0;
+}
+
+// Applies the first count records to a blank machine and prints the state
+// they leave: registers, flags, the next CS:IP and every byte stored so far.
+static int cmd_replay(const TraceFile* t, uint64_t count) {
+    if (count > t->count) count = t->count;
+    if (count == 0) {
+        printf("Empty trace\n");
+        return 0;
+    }
+    uint8_t* memory = calloc(1, MEMORY_SIZE);
+    uint8_t* known = calloc(1, MEMORY_SIZE);
+    if (!memory || !known) {
+        fprintf(stderr, "Out of memory\n");
+        free(memory);
+        free(known);
+        return 2;
+    }
+    uint64_t interrupts = 0, truncated = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        const TraceRecord* r = &t->records[i];
+        if (r->length == 0) interrupts++;
+        if (r->write_addr & TRACE_WRITES_TRUNCATED) truncated++;
+        uint32_t addr = r->write_addr & ~TRACE_WRITES_TRUNCATED;
+        for (int j = 0; j < r->write_len; j++) {
+            memory[(addr + j) & ADDR_MASK] = r->write_data[j];
+            known[(addr + j) & ADDR_MASK] = 1;
+        }
+    }
+
+    const TraceRecord* last = &t->records[count - 1];
+    printf("After %llu records (%llu interrupts), %llu clocks:\n", (unsigned long long)count,
+           (unsigned long long)interrupts, (unsigned long long)(count < t->count ? t->records[count].cycles : last->cycles));
+    for (int i = 0; i < 12; i++) {
+        printf("%s=%04X%c", reg_names[i], reg_value(last, i), i == 7 || i == 11 ? '\n' : ' ');
+    }
+    printf("FLAGS=%04X", last->flags);
+    if (count < t->count) printf("  next %04X:%04X", t->records[count].cs, t->records[count].ip);
+    printf("\nMemory written:\n");
+    for (uint32_t line = 0; line < MEMORY_SIZE; line += 16) {
+        int any = 0;
+        for (int j = 0; j < 16; j++) any |= known[line + j];
+        if (!any) continue;
+        printf("%05X:", line);
+        for (int j = 0; j < 16; j++) {
+            if (known[line + j]) {
+                printf(" %02X", memory[line + j]);
+            } else {
+                printf(" --");
+            }
+        }
+        putchar('\n');
+    }
+    if (truncated) {
+        printf("%llu records stored more than %d bytes; only their first bytes are shown\n",
+               (unsigned long long)truncated, TRACE_WRITE_BYTES);
+    }
+    free(memory);
+    free(known);
+    return 0;
+}
+
+static void print_usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s print TRACE [FIRST [COUNT]]   pretty-print records\n"
+            "       %s diff TRACE1 TRACE2            find the first record that differs\n"
+            "       %s replay TRACE [COUNT]          state after the first COUNT records\n",
+            prog, prog, prog);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        print_usage(argv[0]);
+        return 2;
+    }
+    TraceFile a, b;
+    if (!open_trace(argv[2], &a)) return 2;
+    if (strcmp(argv[1], "print") == 0) {
+        uint64_t first = argc > 3 ? strtoull(argv[3], NULL, 0) : 0;
+        uint64_t count = argc > 4 ? strtoull(argv[4], NULL, 0) : UINT64_MAX;
+        return cmd_print(&a, first, count);
+    }
+    if (strcmp(argv[1], "diff") == 0 && argc > 3) {
+        if (!open_trace(argv[3], &b)) return 2;
+        return cmd_diff(&a, &b, argv[2], argv[3]);
+    }
+    if (strcmp(argv[1], "replay") == 0) {
+        return cmd_replay(&a, argc > 3 ? strtoull(argv[3], NULL, 0) : UINT64_MAX);
+    }
+    print_usage(argv[0]);
+    return 2;
+}